@@ -0,0 +1,550 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "vterm.h"
+#include "pseudo.h"
+#include "search.h"
+#include "scrollback.h"
+#include "termwin.h"
+#include "snapshot.h"
+#include "ya_getopt.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+/*
+    Throughput benchmark: canonical workloads run through the vterm parser
+    alone and through vterm + termwin. Results are printed as one JSON object
+    per line so runs can be compared by scripts.
+
+    ncurses draws to a pseudo terminal which a thread drains, so the numbers
+    include the cost of writing to a terminal but not of a terminal emulator
+    displaying it.
+*/
+
+// Bytes fed to vterm per frame, the size of the main loop's reads.
+#define BENCH_CHUNK 8192
+
+typedef struct bench_buf
+{
+    char *data;
+    size_t len;
+    size_t size;
+} bench_buf;
+
+typedef struct bench_opts
+{
+    size_t bytes;         // Bytes generated per workload.
+    const char *workload; // NULL runs them all.
+    int rows;
+    int cols;
+    int parse_only;
+    const char *restore_file; // Snapshot each run starts from.
+} bench_opts;
+
+typedef void ( *bench_gen_func )( bench_buf *buf, int rows, int cols, size_t bytes );
+
+static const VTermScreenCallbacks g_screen_cbs =
+    {
+      termwin_damage_callback,      // damage
+      NULL,                         // moverect
+      termwin_movecursor_callback,  // movecursor
+      termwin_settermprop_callback, // settermprop
+      termwin_bell_callback,        // bell
+      NULL,                         // resize
+      termwin_sb_pushline_callback, // sb_pushline
+      termwin_sb_popline_callback   // sb_popline
+    };
+
+static uint32_t g_rand_state = 0x12345678;
+
+// xorshift32: same workload bytes on every run.
+static uint32_t bench_rand( uint32_t n )
+{
+    g_rand_state ^= g_rand_state << 13;
+    g_rand_state ^= g_rand_state >> 17;
+    g_rand_state ^= g_rand_state << 5;
+    return g_rand_state % n;
+}
+
+static void bench_put( bench_buf *buf, const void *data, size_t len )
+{
+    if ( buf->len + len > buf->size )
+    {
+        buf->size = MAX( buf->len + len, buf->size * 2 );
+        buf->data = ( char * )realloc( buf->data, buf->size );
+        if ( !buf->data )
+            FATAL_ERROR( realloc );
+    }
+
+    memcpy( buf->data + buf->len, data, len );
+    buf->len += len;
+}
+
+static void bench_printf( bench_buf *buf, const char *fmt, ... ) ATTRIBUTE_PRINTF( 2, 3 );
+static void bench_printf( bench_buf *buf, const char *fmt, ... )
+{
+    int len;
+    va_list ap;
+    char str[ 256 ];
+
+    va_start( ap, fmt );
+    len = vsnprintf( str, sizeof( str ), fmt, ap );
+    va_end( ap );
+
+    bench_put( buf, str, MIN( ( size_t )len, sizeof( str ) - 1 ) );
+}
+
+static void bench_put_char( bench_buf *buf, uint32_t c )
+{
+    uint8_t utf8[ 4 ];
+
+    bench_put( buf, utf8, utf8_encode( utf8, c ) );
+}
+
+// Lines of printable ASCII.
+static void gen_ascii( bench_buf *buf, int rows, int cols, size_t bytes )
+{
+    while ( buf->len < bytes )
+    {
+        int i;
+        int len = bench_rand( cols + 1 );
+
+        for ( i = 0; i < len; i++ )
+            bench_put_char( buf, ' ' + bench_rand( 95 ) );
+        bench_put( buf, "\r\n", 2 );
+    }
+}
+
+// Short words with 16, 256 and truecolor SGR changes, bold and underline.
+static void gen_sgr( bench_buf *buf, int rows, int cols, size_t bytes )
+{
+    while ( buf->len < bytes )
+    {
+        int col = 0;
+
+        while ( col < cols - 8 )
+        {
+            int i;
+            int len = 1 + bench_rand( 7 );
+
+            switch ( bench_rand( 4 ) )
+            {
+            case 0:
+                bench_printf( buf, "\033[%u;%um", 30 + bench_rand( 8 ), 40 + bench_rand( 8 ) );
+                break;
+            case 1:
+                bench_printf( buf, "\033[38;5;%u;48;5;%um", bench_rand( 256 ), bench_rand( 256 ) );
+                break;
+            case 2:
+                bench_printf( buf, "\033[1;4;38;2;%u;%u;%um", bench_rand( 256 ), bench_rand( 256 ), bench_rand( 256 ) );
+                break;
+            default:
+                bench_put( buf, "\033[0m", 4 );
+                break;
+            }
+
+            for ( i = 0; i < len; i++ )
+                bench_put_char( buf, 'a' + bench_rand( 26 ) );
+            bench_put_char( buf, ' ' );
+            col += len + 1;
+        }
+        bench_put( buf, "\033[0m\r\n", 6 );
+    }
+}
+
+// Lines written at the bottom of changing scroll regions, some scrolled
+// back down with reverse index.
+static void gen_scroll( bench_buf *buf, int rows, int cols, size_t bytes )
+{
+    while ( buf->len < bytes )
+    {
+        int i;
+        int top = 1 + bench_rand( rows / 2 );
+        int bottom = top + 1 + bench_rand( rows - top );
+
+        bench_printf( buf, "\033[%d;%dr", top, bottom );
+
+        for ( i = 0; i < 32; i++ )
+        {
+            int len = bench_rand( cols );
+
+            if ( bench_rand( 4 ) )
+            {
+                bench_printf( buf, "\033[%d;1H\n", bottom );
+            }
+            else
+            {
+                bench_printf( buf, "\033[%d;1H\033M", top );
+            }
+
+            while ( len-- > 0 )
+                bench_put_char( buf, '!' + bench_rand( 94 ) );
+        }
+    }
+    bench_put( buf, "\033[r", 3 );
+}
+
+// Single characters at random positions.
+static void gen_cursor( bench_buf *buf, int rows, int cols, size_t bytes )
+{
+    while ( buf->len < bytes )
+    {
+        bench_printf( buf, "\033[%u;%uH", 1 + bench_rand( rows ), 1 + bench_rand( cols ) );
+        bench_put_char( buf, '!' + bench_rand( 94 ) );
+    }
+}
+
+// Double width CJK, and Latin letters with up to three combining marks.
+static void gen_cjk( bench_buf *buf, int rows, int cols, size_t bytes )
+{
+    while ( buf->len < bytes )
+    {
+        int col = 0;
+
+        while ( col < cols - 1 )
+        {
+            if ( bench_rand( 2 ) )
+            {
+                bench_put_char( buf, 0x4e00 + bench_rand( 0x5000 ) );
+                col += 2;
+            }
+            else
+            {
+                int marks = bench_rand( 4 );
+
+                bench_put_char( buf, 'a' + bench_rand( 26 ) );
+                while ( marks-- )
+                    bench_put_char( buf, 0x300 + bench_rand( 0x70 ) );
+                col++;
+            }
+        }
+        bench_put( buf, "\r\n", 2 );
+    }
+}
+
+// Full screen redraws like top or an editor: every row addressed, colored
+// header and status lines, the rest mostly unchanged between frames.
+static void gen_tui( bench_buf *buf, int rows, int cols, size_t bytes )
+{
+    int frame = 0;
+
+    bench_put( buf, "\033[?1049h", 8 );
+
+    while ( buf->len < bytes )
+    {
+        int row;
+
+        bench_printf( buf, "\033[H\033[1;37;44m frame %-*d\033[0m", cols - 7, frame );
+
+        for ( row = 2; row < rows; row++ )
+        {
+            int col;
+
+            bench_printf( buf, "\033[%d;1H\033[%um%5d ", row, 31 + ( row % 7 ), ( row * 7919 + frame ) % 100000 );
+            bench_put( buf, "\033[0m", 4 );
+            for ( col = 6; col < cols; col++ )
+                bench_put_char( buf, ( ( col + row + frame / 8 ) % 13 ) ? '.' : '#' );
+        }
+
+        bench_printf( buf, "\033[%d;1H\033[7m %-*s\033[0m", rows, cols - 1, "status" );
+        frame++;
+    }
+
+    bench_put( buf, "\033[?1049l", 8 );
+}
+
+static const struct
+{
+    const char *name;
+    bench_gen_func gen;
+} g_workloads[] =
+    {
+      { "ascii", gen_ascii },
+      { "sgr", gen_sgr },
+      { "scroll", gen_scroll },
+      { "cursor", gen_cursor },
+      { "cjk", gen_cjk },
+      { "tui", gen_tui },
+    };
+
+static void *bench_drain( void *arg )
+{
+    char buf[ 65536 ];
+    int fd = *( int * )arg;
+
+    // Ends when the slave side is closed.
+    while ( read( fd, buf, sizeof( buf ) ) > 0 || errno == EINTR )
+        ;
+    return NULL;
+}
+
+static void bench_run( FILE *out, const char *name, const bench_buf *buf, VTerm *vt, termwin *twin, const snapshot *snap )
+{
+    size_t off;
+    uint64_t start;
+    uint64_t *frame_ns;
+    size_t frames = 0;
+    termwin_stats before = { 0, 0 };
+    termwin_stats after = { 0, 0 };
+    VTermScreen *vts = vterm_obtain_screen( vt );
+
+    frame_ns = ( uint64_t * )malloc( ( buf->len / BENCH_CHUNK + 1 ) * sizeof( frame_ns[ 0 ] ) );
+    if ( !frame_ns )
+        FATAL_ERROR( malloc );
+
+    vterm_screen_reset( vts, 1 );
+    // Start from a real screen instead of a blank one.
+    if ( snap )
+        snapshot_restore( snap, vt, twin );
+    if ( twin )
+    {
+        termwin_refresh( twin );
+        termwin_get_stats( twin, &before );
+    }
+
+    start = get_time_ns();
+
+    for ( off = 0; off < buf->len; off += BENCH_CHUNK )
+    {
+        uint64_t t0 = get_time_ns();
+
+        vterm_input_write( vt, buf->data + off, MIN( BENCH_CHUNK, buf->len - off ) );
+        if ( twin )
+            termwin_refresh( twin );
+
+        frame_ns[ frames++ ] = get_time_ns() - t0;
+    }
+
+    double secs = ( get_time_ns() - start ) / 1e9;
+
+    if ( twin )
+        termwin_get_stats( twin, &after );
+
+    fprintf( out, "{\"workload\": \"%s\", \"mode\": \"%s\", \"bytes\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.2f, "
+                  "\"frames\": %" PRIu64 ", \"cells\": %" PRIu64 ", \"frame_p50_us\": %.1f, \"frame_p99_us\": %.1f}\n",
+             name, twin ? "render" : "parse", buf->len, secs, secs > 0 ? buf->len / ( 1024.0 * 1024.0 ) / secs : 0.0,
+             after.frames - before.frames, after.cells - before.cells,
+             percentile_u64( frame_ns, frames, 50 ) / 1e3, percentile_u64( frame_ns, frames, 99 ) / 1e3 );
+    fflush( out );
+
+    free( frame_ns );
+}
+
+static void bench_usage( const char *argv0 )
+{
+    size_t i;
+
+    printf( "%s [options]\n\n", argv0 );
+    printf( "  -s --size MB               Bytes generated per workload (default 16).\n" );
+    printf( "  -w --workload NAME         Only run NAME:" );
+    for ( i = 0; i < sizeof( g_workloads ) / sizeof( g_workloads[ 0 ] ); i++ )
+        printf( " %s", g_workloads[ i ].name );
+    printf( "\n" );
+    printf( "     --rows ROWS             Terminal rows (default 50).\n" );
+    printf( "     --cols COLS             Terminal columns (default 160).\n" );
+    printf( "  -p --parse_only            Skip the termwin runs.\n" );
+    printf( "     --restore FILE          Start each run from snapshot FILE.\n" );
+    printf( "  -h --help                  Show this help.\n" );
+    exit( 1 );
+}
+
+static void bench_parse_args( bench_opts *opts, int argc, char **argv )
+{
+    static const struct option long_options[] =
+        {
+          { "help", ya_no_argument, 0, 'h' },
+          { "size", ya_required_argument, 0, 's' },
+          { "workload", ya_required_argument, 0, 'w' },
+          { "rows", ya_required_argument, 0, 'r' },
+          { "cols", ya_required_argument, 0, 'c' },
+          { "parse_only", ya_no_argument, 0, 'p' },
+          { "restore", ya_required_argument, 0, 'R' },
+          { 0, 0, 0, 0 }
+        };
+
+    opts->bytes = 16 * 1024 * 1024;
+    opts->workload = NULL;
+    opts->rows = 50;
+    opts->cols = 160;
+    opts->parse_only = 0;
+    opts->restore_file = NULL;
+
+    for ( ;; )
+    {
+        int c = ya_getopt_long( argc, argv, "s:w:ph?", long_options, NULL );
+        if ( c == -1 )
+            break;
+
+        switch ( c )
+        {
+        case 's':
+            opts->bytes = strtoul( ya_optarg, NULL, 10 ) * 1024 * 1024;
+            break;
+        case 'w':
+            opts->workload = ya_optarg;
+            break;
+        case 'r':
+            opts->rows = atoi( ya_optarg );
+            break;
+        case 'c':
+            opts->cols = atoi( ya_optarg );
+            break;
+        case 'p':
+            opts->parse_only = 1;
+            break;
+        case 'R':
+            opts->restore_file = ya_optarg;
+            break;
+        default:
+            bench_usage( argv[ 0 ] );
+        }
+    }
+
+    // termwin leaves a 5 cell margin around the window.
+    if ( !opts->bytes || opts->rows < 12 || opts->cols < 20 )
+        bench_usage( argv[ 0 ] );
+}
+
+int main( int argc, char *argv[] )
+{
+    size_t i;
+    FILE *out;
+    bench_opts opts;
+    VTerm *vt;
+    termwin *twin = NULL;
+    scrollback *sb = NULL;
+    pthread_t drain_thread;
+    int master = -1, slave = -1;
+    int rows, cols;
+    snapshot *snap = NULL;
+
+    bench_parse_args( &opts, argc, argv );
+
+    clog_init_path( 0, "/dev/null" );
+
+    if ( opts.restore_file )
+    {
+        snap = snapshot_load( opts.restore_file );
+        if ( !snap )
+        {
+            fprintf( stderr, "Unable to load snapshot %s\n", opts.restore_file );
+            return 1;
+        }
+    }
+
+    // Results go to the real stdout, ncurses gets the pty.
+    out = fdopen( dup( STDOUT_FILENO ), "w" );
+    if ( !out )
+        FATAL_ERROR( fdopen );
+
+    rows = opts.rows - 10;
+    cols = opts.cols - 10;
+
+    if ( !opts.parse_only )
+    {
+        char slavename[ 128 ];
+        const struct winsize size = { opts.rows, opts.cols, 0, 0 };
+
+        if ( pty_open( &master, &slave, slavename, sizeof( slavename ), NULL, &size ) )
+            FATAL_ERROR( pty_open );
+        if ( pthread_create( &drain_thread, NULL, bench_drain, &master ) )
+            FATAL_ERROR( pthread_create );
+
+        fflush( stdout );
+        if ( dup2( slave, STDOUT_FILENO ) < 0 || dup2( slave, STDIN_FILENO ) < 0 )
+            FATAL_ERROR( dup2 );
+
+        twin = termwin_init( getenv( "TERM" ) ? NULL : "xterm-256color" );
+        if ( !twin )
+            FATAL_ERROR( termwin_init );
+        termwin_getsize( twin, &rows, &cols );
+    }
+
+    for ( i = 0; i < sizeof( g_workloads ) / sizeof( g_workloads[ 0 ] ); i++ )
+    {
+        bench_buf buf = { NULL, 0, 0 };
+
+        if ( opts.workload && strcmp( opts.workload, g_workloads[ i ].name ) )
+            continue;
+
+        g_workloads[ i ].gen( &buf, rows, cols, opts.bytes );
+
+        // Parser on its own.
+        vt = vterm_new( rows, cols );
+        vterm_set_utf8( vt, 1 );
+        vterm_screen_reset( vterm_obtain_screen( vt ), 1 );
+        bench_run( out, g_workloads[ i ].name, &buf, vt, NULL, snap );
+        vterm_free( vt );
+
+        // Parser and renderer, with scrollback like cvterm's defaults.
+        if ( twin )
+        {
+            vt = vterm_new( rows, cols );
+            vterm_set_utf8( vt, 1 );
+            termwin_setvterm( twin, vt );
+
+            sb = scrollback_create( 10000, 0 );
+            scrollback_set_width( sb, cols );
+            termwin_setscrollback( twin, sb );
+
+            vterm_screen_enable_altscreen( vterm_obtain_screen( vt ), 1 );
+            vterm_screen_set_callbacks( vterm_obtain_screen( vt ), &g_screen_cbs, twin );
+            bench_run( out, g_workloads[ i ].name, &buf, vt, twin, snap );
+
+            termwin_setscrollback( twin, NULL );
+            scrollback_free( sb );
+            vterm_free( vt );
+        }
+
+        free( buf.data );
+    }
+
+    if ( twin )
+    {
+        termwin_free( twin );
+
+        // Closing the slave ends the drain thread.
+        close( STDOUT_FILENO );
+        close( STDIN_FILENO );
+        close( slave );
+        pthread_join( drain_thread, NULL );
+        close( master );
+    }
+
+    snapshot_free( snap );
+    fclose( out );
+    clog_free( 0 );
+    return 0;
+}
@@ -0,0 +1,319 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/select.h>
+
+#include "vterm.h"
+#include "scrollback.h"
+#include "termwin.h"
+#include "record.h"
+#include "session.h"
+#include "snapshot.h"
+#include "ipc.h"
+#include "server.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+// Same command prefix as cvterm: Ctrl+].
+#define CLIENT_PREFIX_KEY 0x1d
+
+static const VTermScreenCallbacks g_client_cbs =
+    {
+      termwin_damage_callback,      // damage
+      NULL,                         // moverect
+      termwin_movecursor_callback,  // movecursor
+      termwin_settermprop_callback, // settermprop
+      termwin_bell_callback,        // bell
+      NULL,                         // resize
+      NULL,                         // sb_pushline
+      NULL                          // sb_popline
+    };
+
+typedef struct client
+{
+    ipc_conn *conn;
+    termwin *twin;
+    VTerm *vt; // Screen as the server last sent it.
+    int prefix; // Got the command prefix key.
+    int done;
+    char exit_msg[ 128 ];
+} client;
+
+static struct sigaction g_client_winch_old;
+static volatile sig_atomic_t g_client_winch = 0;
+
+static void client_winch_handler( int signo )
+{
+    if ( g_client_winch_old.sa_handler )
+        ( *g_client_winch_old.sa_handler )( signo );
+
+    g_client_winch = 1;
+}
+
+static void client_send_size( client *cl, int type )
+{
+    int y, x, rows, cols;
+    uint16_t size[ 2 ];
+
+    termwin_get_area( cl->twin, &y, &x, &rows, &cols );
+    termwin_set_geometry( cl->twin, y, x, rows, cols );
+
+    termwin_getsize( cl->twin, &rows, &cols );
+    vterm_set_size( cl->vt, rows, cols );
+
+    size[ 0 ] = ( uint16_t )rows;
+    size[ 1 ] = ( uint16_t )cols;
+    ipc_send( cl->conn, type, size, sizeof( size ) );
+}
+
+// Returns 1 if ch was a client command.
+static int client_key( client *cl, int ch )
+{
+    int32_t delta;
+
+    if ( !cl->prefix )
+    {
+        if ( ch != CLIENT_PREFIX_KEY )
+            return 0;
+
+        cl->prefix = 1;
+        return 1;
+    }
+
+    cl->prefix = 0;
+    switch ( ch )
+    {
+    case 'd':
+        snprintf( cl->exit_msg, sizeof( cl->exit_msg ), "detached" );
+        cl->done = 1;
+        return 1;
+    case 'c':
+        ipc_send( cl->conn, IPC_NEW, NULL, 0 );
+        return 1;
+    case 'n':
+    case 'p':
+        delta = ( ch == 'n' ) ? 1 : -1;
+        ipc_send( cl->conn, IPC_SELECT, &delta, sizeof( delta ) );
+        return 1;
+    case CLIENT_PREFIX_KEY:
+        return 0;
+    }
+    return 1;
+}
+
+// Keys go to the server as typed; the program's pty does the rest.
+static void client_input( client *cl )
+{
+    char buf[ 1024 ];
+    size_t len = 0;
+
+    while ( !cl->done )
+    {
+        int ch = termwin_getch( cl->twin );
+        if ( ch == -1 )
+            break;
+
+        if ( client_key( cl, ch ) )
+            continue;
+
+        buf[ len++ ] = ( char )ch;
+        if ( len == sizeof( buf ) )
+        {
+            ipc_send( cl->conn, IPC_INPUT, buf, len );
+            len = 0;
+        }
+    }
+
+    if ( len )
+        ipc_send( cl->conn, IPC_INPUT, buf, len );
+}
+
+static void client_handle_msg( client *cl, const ipc_msg *msg )
+{
+    char text[ 128 ];
+    snapshot *snap;
+
+    switch ( msg->type )
+    {
+    case IPC_SNAPSHOT:
+        snap = snapshot_decode( msg->data, msg->len );
+        if ( !snap )
+        {
+            clog_error( CLOG( 0 ), "Server sent a bad snapshot" );
+            break;
+        }
+        // Start from a clean screen: the snapshot may leave the altscreen.
+        vterm_screen_reset( vterm_obtain_screen( cl->vt ), 1 );
+        snapshot_restore( snap, cl->vt, cl->twin );
+        snapshot_free( snap );
+        break;
+
+    case IPC_DIFF:
+        vterm_input_write( cl->vt, ( const char * )msg->data, msg->len );
+        break;
+
+    case IPC_STATUS:
+        snprintf( text, sizeof( text ), "%.*s", ( int )msg->len, ( const char * )msg->data );
+        termwin_set_status( cl->twin, text );
+        break;
+
+    case IPC_EXIT:
+        snprintf( cl->exit_msg, sizeof( cl->exit_msg ), "%.*s", ( int )msg->len, ( const char * )msg->data );
+        cl->done = 1;
+        break;
+
+    default:
+        clog_warn_limit( CLOG( 0 ), "Unknown server message %d", msg->type );
+        break;
+    }
+}
+
+static void client_read( client *cl )
+{
+    int ret = 0;
+    ipc_msg msg;
+
+    if ( ipc_fill( cl->conn ) )
+    {
+        // Whatever arrived before the close still counts.
+        while ( !cl->done && ipc_next( cl->conn, &msg ) > 0 )
+            client_handle_msg( cl, &msg );
+        if ( !cl->done )
+            snprintf( cl->exit_msg, sizeof( cl->exit_msg ), "server went away" );
+        cl->done = 1;
+        return;
+    }
+
+    while ( !cl->done && ( ret = ipc_next( cl->conn, &msg ) ) > 0 )
+        client_handle_msg( cl, &msg );
+
+    if ( ret < 0 )
+    {
+        snprintf( cl->exit_msg, sizeof( cl->exit_msg ), "bad message from server" );
+        cl->done = 1;
+    }
+}
+
+static void client_loop( client *cl )
+{
+    sigset_t select_mask;
+    struct sigaction winch_sigaction;
+    int fd = ipc_conn_get_fd( cl->conn );
+
+    // cvterm blocks SIGWINCH; only take it while waiting in pselect.
+    sigprocmask( SIG_BLOCK, NULL, &select_mask );
+    sigdelset( &select_mask, SIGWINCH );
+
+    winch_sigaction.sa_handler = client_winch_handler;
+    sigemptyset( &winch_sigaction.sa_mask );
+    winch_sigaction.sa_flags = 0;
+    if ( sigaction( SIGWINCH, &winch_sigaction, &g_client_winch_old ) )
+        FATAL_ERROR( sigaction );
+
+    while ( !cl->done )
+    {
+        int ret;
+        fd_set fds;
+        fd_set wfds;
+        struct timespec timeout = { 0, 20000000 };
+
+        FD_ZERO( &fds );
+        FD_ZERO( &wfds );
+        FD_SET( STDIN_FILENO, &fds );
+        FD_SET( fd, &fds );
+        if ( ipc_pending( cl->conn ) )
+            FD_SET( fd, &wfds );
+
+        ret = pselect( fd + 1, &fds, &wfds, NULL, &timeout, &select_mask );
+        if ( ret == -1 && errno != EINTR )
+            FATAL_ERROR( pselect );
+
+        if ( g_client_winch )
+        {
+            g_client_winch = 0;
+            client_send_size( cl, IPC_RESIZE );
+        }
+
+        if ( ret > 0 )
+        {
+            if ( FD_ISSET( fd, &fds ) )
+                client_read( cl );
+            if ( FD_ISSET( STDIN_FILENO, &fds ) )
+                client_input( cl );
+        }
+
+        if ( ipc_flush( cl->conn ) && !cl->done )
+        {
+            snprintf( cl->exit_msg, sizeof( cl->exit_msg ), "server went away" );
+            cl->done = 1;
+        }
+
+        termwin_refresh( cl->twin );
+    }
+
+    sigaction( SIGWINCH, &g_client_winch_old, NULL );
+}
+
+int client_run( const char *path, const char *nc_term )
+{
+    client cl;
+    int rows, cols;
+    int fd = ipc_connect( path );
+
+    if ( fd < 0 )
+        return -1;
+
+    memset( &cl, 0, sizeof( cl ) );
+    cl.conn = ipc_conn_create( fd );
+
+    cl.twin = termwin_init( nc_term );
+    if ( !cl.twin )
+        FATAL_ERROR( termwin_init );
+    termwin_getsize( cl.twin, &rows, &cols );
+
+    cl.vt = vterm_new( rows, cols );
+    vterm_set_utf8( cl.vt, 1 );
+    termwin_setvterm( cl.twin, cl.vt );
+    vterm_screen_enable_altscreen( vterm_obtain_screen( cl.vt ), 1 );
+    vterm_screen_reset( vterm_obtain_screen( cl.vt ), 1 );
+    vterm_screen_set_callbacks( vterm_obtain_screen( cl.vt ), &g_client_cbs, cl.twin );
+
+    client_send_size( &cl, IPC_HELLO );
+    client_loop( &cl );
+
+    termwin_free( cl.twin );
+    vterm_free( cl.vt );
+    ipc_conn_free( cl.conn );
+
+    clog_info( CLOG( 0 ), "Client done: %s", cl.exit_msg );
+    printf( "[%s]\n", cl.exit_msg );
+    return 0;
+}
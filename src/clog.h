@@ -6,6 +6,9 @@
  * - Four log levels (debug, info, warn, error).
  * - Custom formats.
  * - Fast.
+ * - Optional asynchronous writing from a background thread.
+ * - Optional binary logging, formatted later by a decoder.
+ * - Rate limits for noisy call sites.
  *
  * Dependencies:
  * - Should conform to C89, C++98 (but requires vsnprintf, unfortunately).
@@ -67,11 +70,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 
 /* Number of loggers that can be defined. */
 #define CLOG_MAX_LOGGERS 16
@@ -83,6 +88,30 @@
  * they will not appear in the log. */
 #define CLOG_DATETIME_LENGTH 256
 
+/* Messages up to this long are stored in async ring records; longer ones are
+ * allocated. */
+#define CLOG_ASYNC_MSG_LENGTH 240
+
+/* Call sites a binary logger can tell apart, and the most arguments a binary
+ * message keeps.  Formats with more fall back to text. */
+#define CLOG_BINARY_SITES 1024
+#define CLOG_BINARY_MAX_ARGS 12
+
+/* Log calls below this level compile to nothing.  Set it with -D, e.g.
+ * -DCLOG_COMPILE_LEVEL=CLOG_INFO; by default every level is kept. */
+#ifndef CLOG_COMPILE_LEVEL
+#define CLOG_COMPILE_LEVEL CLOG_DEBUG
+#endif
+
+/* Rate limited call sites may log CLOG_LIMIT_BURST messages at once, then
+ * CLOG_LIMIT_RATE a second. */
+#ifndef CLOG_LIMIT_RATE
+#define CLOG_LIMIT_RATE 10
+#endif
+#ifndef CLOG_LIMIT_BURST
+#define CLOG_LIMIT_BURST 20
+#endif
+
 /* Default format strings. */
 #define CLOG_DEFAULT_FORMAT "%d %t %f(%n): %l: %m\n"
 #define CLOG_DEFAULT_DATE_FORMAT "%Y-%m-%d"
@@ -140,6 +169,64 @@ int clog_init_fd( int id, int fd );
  */
 void clog_free( int id );
 
+/**
+ * Create a logger writing binary records to the given file path, in append
+ * mode.  Instead of formatting, a log call stores the call site, a timestamp
+ * and the raw arguments: numbers as-is and a copy of each string.  Each call
+ * site and its format string are written once.  The log formats are not
+ * used; cvterm_logdecode turns the file into text.
+ *
+ * Messages whose formats can't be deferred (%n, %m, wide strings, too many
+ * arguments) are formatted and stored as text.  Strings are cut to fit in
+ * CLOG_ASYNC_MSG_LENGTH bytes with the rest of the record.
+ *
+ * Records carry the process id, so several processes can share the file.  A
+ * process forked after this call writes as its parent, so only one of the
+ * two should go on logging.
+ *
+ * @param id
+ * A constant integer between 0 and 15 that uniquely identifies this logger.
+ *
+ * @param path
+ * Path to the file where records will be written.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_init_binary( int id, const char *const path );
+
+/**
+ * Switch a logger to asynchronous mode: log calls format the message and
+ * queue it in a lock-free ring, and a background thread adds the log format
+ * and writes records in batches.  Messages logged while the ring is full
+ * are dropped and counted; the writer logs how many were lost.
+ *
+ * clog_free, clog_flush and changing a format wait for queued records to be
+ * written.  Don't fork with an async logger: the child has no writer.
+ *
+ * @param id
+ * The id of the logger.
+ *
+ * @param records
+ * Ring size in records, rounded up to a power of two.  Zero goes back to
+ * writing on the caller's thread.
+ *
+ * @return
+ * Zero on success, non-zero on failure.
+ */
+int clog_set_async( int id, size_t records );
+
+/**
+ * Wait until everything logged so far has been written.  Call before exiting
+ * on a fatal error.  Does nothing for synchronous loggers.
+ */
+void clog_flush( int id );
+
+/**
+ * Messages an async logger has dropped because its ring was full.
+ */
+unsigned long clog_get_dropped( int id );
+
 #define CLOG( id ) __FILE__, __LINE__, __FUNCTION__, id
 
 /**
@@ -163,12 +250,30 @@ void clog_free( int id );
  *
  * @param ...
  * Any additional format arguments.
+ *
+ * These are wrapped in macros of the same name: calls below
+ * CLOG_COMPILE_LEVEL are compiled out, and the logger's level is checked
+ * before the format arguments are evaluated.
  */
 void clog_debug( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... );
 void clog_info( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... );
 void clog_warn( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... );
 void clog_error( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... );
 
+/**
+ * Rate limited log calls, for paths that can fail over and over: each call
+ * site has a token bucket allowing CLOG_LIMIT_BURST messages, refilled at
+ * CLOG_LIMIT_RATE a second.  Messages over the limit aren't formatted.  The
+ * next message let through is preceded by "suppressed N messages" from the
+ * same site, and clog_free logs counts still pending.
+ *
+ *     clog_warn_limit(CLOG(MY_LOGGER_ID), "read failed: %d", errno);
+ */
+#define clog_debug_limit( ... ) _clog_call_limit( clog_debug, CLOG_DEBUG, __VA_ARGS__ )
+#define clog_info_limit( ... ) _clog_call_limit( clog_info, CLOG_INFO, __VA_ARGS__ )
+#define clog_warn_limit( ... ) _clog_call_limit( clog_warn, CLOG_WARN, __VA_ARGS__ )
+#define clog_error_limit( ... ) _clog_call_limit( clog_error, CLOG_ERROR, __VA_ARGS__ )
+
 /**
  * Set the minimum level of messages that should be written to the log.
  * Messages below this level will not be written.  By default, loggers are
@@ -236,6 +341,26 @@ int clog_set_fmt( int id, const char *fmt );
  * No need to read below this point.
  */
 
+/* One step of a compiled log format. */
+enum _clog_op_type
+{
+    CLOG_OP_TEXT, /* len bytes of fmt at offset. */
+    CLOG_OP_DATE,
+    CLOG_OP_TIME,
+    CLOG_OP_FILE,
+    CLOG_OP_FUNC,
+    CLOG_OP_LINE,
+    CLOG_OP_LEVEL,
+    CLOG_OP_MESSAGE
+};
+
+struct _clog_op
+{
+    unsigned char type;
+    unsigned short offset;
+    unsigned short len;
+};
+
 /**
  * The C logger structure.
  */
@@ -257,20 +382,185 @@ struct clog
     /* Time format */
     char time_fmt[ CLOG_FORMAT_LENGTH ];
 
+    /* fmt compiled by _clog_compile_fmt. */
+    struct _clog_op ops[ CLOG_FORMAT_LENGTH ];
+    int op_count;
+
+    /* Changes with the date and time formats, for the per-thread cache. */
+    unsigned int time_gen;
+
     /* Tracks whether the fd needs to be closed eventually. */
     int opened;
+
+    /* Set in async mode. */
+    struct _clog_async *async;
+
+    /* Set for binary loggers. */
+    struct _clog_binary *binary;
+};
+
+/*
+ * Binary log file: a series of records, each starting with a kind byte.
+ * Integers are in the writer's byte order.
+ *
+ *   'H' "clogbin" u8 version, u32 run    Starts each run of the program.
+ *   'S' u32 run, u32 site, u32 line,     A call site.  Sites may follow
+ *       u8 text, u16+file, u16+func,     their first messages.
+ *       u16+fmt
+ *   'M' u32 run, u8 level, u32 site,     A message.  ns is CLOCK_REALTIME.
+ *       u64 ns, u16 len, args
+ *   'D' u32 run, u64 count               Messages dropped, ring full.
+ *
+ * run is the writer's process id.  Site ids are per run: runs sharing a file
+ * interleave their records, and other loggers may add text lines between
+ * them.
+ *
+ * Arguments are stored in order by type: CLOG_ARG_INT takes 4 bytes,
+ * CLOG_ARG_LDOUBLE sizeof( long double ), CLOG_ARG_STR u16 length and the
+ * bytes, and the rest 8.  Text sites have one CLOG_ARG_STR, the message.
+ */
+#define CLOG_BINARY_MAGIC "clogbin"
+#define CLOG_BINARY_VERSION 2
+#define CLOG_BINARY_HEADER 13
+#define CLOG_BINARY_MSG_HEADER 20
+
+enum _clog_arg_type
+{
+    CLOG_ARG_NONE, /* %% */
+    CLOG_ARG_INT,
+    CLOG_ARG_LONG,
+    CLOG_ARG_LLONG,
+    CLOG_ARG_DOUBLE,
+    CLOG_ARG_LDOUBLE,
+    CLOG_ARG_PTR,
+    CLOG_ARG_STR,
+    CLOG_ARG_BAD /* Can't be deferred. */
+};
+
+struct _clog_site
+{
+    const char *fmt; /* Set last: a site is ready once fmt is. */
+    const char *sfile;
+    int sline;
+    unsigned int id;
+    int text;
+    int arg_count;
+    unsigned int args_size; /* Bytes of args, counting strings as empty. */
+    unsigned char args[ CLOG_BINARY_MAX_ARGS ];
+};
+
+/* Call sites, hashed by format and line.  Looked up without the lock;
+ * added under it. */
+struct _clog_binary
+{
+    pthread_mutex_t lock;
+    uint32_t run;
+    unsigned int site_count;
+    unsigned long dropped;
+    struct _clog_site sites[ CLOG_BINARY_SITES ];
+};
+
+/* Token bucket of a rate limited call site.  Sites that have suppressed
+ * messages are listed so clog_free can report them. */
+struct _clog_limit
+{
+    int lock;
+    int listed;
+    uint64_t last_ms;
+    unsigned int tokens; /* In thousandths. */
+    unsigned long suppressed;
+    const char *sfile;
+    int sline;
+    const char *sfunc;
+    int id;
+    enum clog_level level;
+    struct _clog_limit *next;
+};
+
+/* A queued message.  seq is the slot's turn: see _clog_async_claim. */
+struct _clog_record
+{
+    size_t seq;
+    enum clog_level level;
+    const char *sfile;
+    int sline;
+    const char *sfunc;
+    time_t time;
+    char *long_msg; /* Allocated if msg was too small. */
+    size_t len;     /* Bytes of msg for binary loggers. */
+    char msg[ CLOG_ASYNC_MSG_LENGTH ];
+};
+
+/* Bounded MPSC ring (Vyukov's queue with one consumer).  Producers claim a
+ * slot with a CAS on head and publish it by bumping its seq; the writer
+ * thread owns tail. */
+struct _clog_async
+{
+    struct _clog_record *ring;
+    size_t mask;
+    size_t head;    /* Next slot to claim. */
+    size_t tail;    /* Next slot to write, writer thread only. */
+    size_t written; /* Records written out, for clog_flush. */
+    unsigned long dropped;
+    int stop;
+    pthread_t thread;
 };
 
 void _clog_err( const char *fmt, ... );
+int _clog_limit_take( struct _clog_limit *limit, const char *sfile, int sline, const char *sfunc,
+                      int id, enum clog_level level );
+const char *_clog_scan_spec( const char *spec, unsigned char *type, int *stars );
 
 #ifdef CLOG_MAIN
 struct clog *_clog_loggers[ CLOG_MAX_LOGGERS ] = { 0 };
 #else
 extern struct clog *_clog_loggers[ CLOG_MAX_LOGGERS ];
+extern const char *const CLOG_LEVEL_NAMES[];
 #endif
 
+/* Missing loggers pass so the call reports the error. */
+static inline int _clog_enabled( int id, enum clog_level level )
+{
+    struct clog *logger = _clog_loggers[ id ];
+
+    return !logger || level >= logger->level;
+}
+
+#define _clog_call( _func, _level, _sfile, _sline, _sfunc, _id, ... )               \
+    do                                                                            \
+    {                                                                             \
+        if ( ( _level ) >= CLOG_COMPILE_LEVEL && _clog_enabled( _id, _level ) ) \
+            ( _func )( _sfile, _sline, _sfunc, _id, __VA_ARGS__ );                \
+    } while ( 0 )
+
+#define _clog_call_limit( _func, _level, _sfile, _sline, _sfunc, _id, ... )                   \
+    do                                                                                      \
+    {                                                                                       \
+        static struct _clog_limit _clog_site_limit;                                         \
+        if ( ( _level ) >= CLOG_COMPILE_LEVEL && _clog_enabled( _id, _level ) &&           \
+             _clog_limit_take( &_clog_site_limit, _sfile, _sline, _sfunc, _id, _level ) ) \
+            ( _func )( _sfile, _sline, _sfunc, _id, __VA_ARGS__ );                          \
+    } while ( 0 )
+
+#define clog_debug( ... ) _clog_call( clog_debug, CLOG_DEBUG, __VA_ARGS__ )
+#define clog_info( ... ) _clog_call( clog_info, CLOG_INFO, __VA_ARGS__ )
+#define clog_warn( ... ) _clog_call( clog_warn, CLOG_WARN, __VA_ARGS__ )
+#define clog_error( ... ) _clog_call( clog_error, CLOG_ERROR, __VA_ARGS__ )
+
 #ifdef CLOG_MAIN
 
+/* Source of struct clog time_gen values. */
+static unsigned int _clog_time_gen;
+
+/* Rate limited sites that have suppressed messages. */
+static struct _clog_limit *_clog_limits;
+
+static void _clog_limit_report( int id );
+
+static void _clog_compile_fmt( struct clog *logger );
+static void _clog_binary_log( struct clog *logger, const char *sfile, int sline, const char *sfunc,
+                              enum clog_level level, const char *fmt, va_list ap );
+
 const char *const CLOG_LEVEL_NAMES[] = {
     "DEBUG",
     "INFO",
@@ -280,7 +570,7 @@ const char *const CLOG_LEVEL_NAMES[] = {
 
 int clog_init_path( int id, const char *const path )
 {
-    int fd = open( path, O_CREAT | O_WRONLY, 0666 );
+    int fd = open( path, O_CREAT | O_WRONLY | O_APPEND, 0666 );
     if ( fd == -1 )
     {
         _clog_err( "Unable to open %s: %s\n", path, strerror( errno ) );
@@ -315,22 +605,60 @@ int clog_init_fd( int id, int fd )
     logger->level = CLOG_DEBUG;
     logger->fd = fd;
     logger->opened = 0;
+    logger->async = NULL;
+    logger->binary = NULL;
     strcpy( logger->fmt, CLOG_DEFAULT_FORMAT );
     strcpy( logger->date_fmt, CLOG_DEFAULT_DATE_FORMAT );
     strcpy( logger->time_fmt, CLOG_DEFAULT_TIME_FORMAT );
+    _clog_compile_fmt( logger );
+    logger->time_gen = __atomic_add_fetch( &_clog_time_gen, 1, __ATOMIC_RELAXED );
 
     _clog_loggers[ id ] = logger;
     return 0;
 }
 
+int clog_init_binary( int id, const char *const path )
+{
+    struct _clog_binary *binary;
+    char header[ CLOG_BINARY_HEADER ] = { 'H' };
+
+    if ( clog_init_path( id, path ) )
+        return 1;
+
+    binary = ( struct _clog_binary * )calloc( 1, sizeof( *binary ) );
+    if ( !binary )
+    {
+        _clog_err( "Failed to allocate binary logger: %s\n", strerror( errno ) );
+        clog_free( id );
+        return 1;
+    }
+    pthread_mutex_init( &binary->lock, NULL );
+    binary->run = ( uint32_t )getpid();
+    _clog_loggers[ id ]->binary = binary;
+
+    memcpy( header + 1, CLOG_BINARY_MAGIC, 7 );
+    header[ 8 ] = CLOG_BINARY_VERSION;
+    memcpy( header + 9, &binary->run, 4 );
+    if ( write( _clog_loggers[ id ]->fd, header, sizeof( header ) ) == -1 )
+        _clog_err( "Unable to write to log file: %s\n", strerror( errno ) );
+    return 0;
+}
+
 void clog_free( int id )
 {
     if ( _clog_loggers[ id ] )
     {
+        _clog_limit_report( id );
+        clog_set_async( id, 0 );
         if ( _clog_loggers[ id ]->opened )
         {
             close( _clog_loggers[ id ]->fd );
         }
+        if ( _clog_loggers[ id ]->binary )
+        {
+            pthread_mutex_destroy( &_clog_loggers[ id ]->binary->lock );
+            free( _clog_loggers[ id ]->binary );
+        }
         free( _clog_loggers[ id ] );
         _clog_loggers[ id ] = 0;
     }
@@ -363,7 +691,10 @@ int clog_set_time_fmt( int id, const char *fmt )
         _clog_err( "clog_set_time_fmt: Format specifier too long.\n" );
         return 1;
     }
+    /* Queued records keep the format they were logged with. */
+    clog_flush( id );
     strcpy( logger->time_fmt, fmt );
+    logger->time_gen = __atomic_add_fetch( &_clog_time_gen, 1, __ATOMIC_RELAXED );
     return 0;
 }
 
@@ -380,7 +711,10 @@ int clog_set_date_fmt( int id, const char *fmt )
         _clog_err( "clog_set_date_fmt: Format specifier too long.\n" );
         return 1;
     }
+    /* Queued records keep the format they were logged with. */
+    clog_flush( id );
     strcpy( logger->date_fmt, fmt );
+    logger->time_gen = __atomic_add_fetch( &_clog_time_gen, 1, __ATOMIC_RELAXED );
     return 0;
 }
 
@@ -397,62 +731,158 @@ int clog_set_fmt( int id, const char *fmt )
         _clog_err( "clog_set_fmt: Format specifier too long.\n" );
         return 1;
     }
+    /* Queued records keep the format they were logged with. */
+    clog_flush( id );
     strcpy( logger->fmt, fmt );
+    _clog_compile_fmt( logger );
     return 0;
 }
 
 /* Internal functions */
 
-size_t
-_clog_append_str( char **dst, char *orig_buf, const char *src, size_t cur_size )
+/* Output buffer: starts in the caller's buffer and moves to the heap if it
+ * outgrows it. */
+struct _clog_buf
+{
+    char *data;
+    size_t len;
+    size_t size;
+    char *orig;
+};
+
+static void _clog_buf_init( struct _clog_buf *b, char *orig, size_t size )
+{
+    b->data = orig;
+    b->len = 0;
+    b->size = size;
+    b->orig = orig;
+}
+
+static void _clog_buf_free( struct _clog_buf *b )
+{
+    if ( b->data != b->orig )
+        free( b->data );
+    b->data = b->orig;
+    b->len = 0;
+}
+
+/* Make room for len more bytes.  Returns zero if out of memory. */
+static int _clog_buf_grow( struct _clog_buf *b, size_t len )
 {
-    size_t new_size = cur_size;
+    size_t size = b->size;
+    char *data;
 
-    while ( strlen( *dst ) + strlen( src ) >= new_size )
+    while ( b->len + len > size )
+        size *= 2;
+
+    if ( b->data == b->orig )
     {
-        new_size *= 2;
+        data = ( char * )malloc( size );
+        if ( data )
+            memcpy( data, b->data, b->len );
     }
-    if ( new_size != cur_size )
+    else
     {
-        if ( *dst == orig_buf )
-        {
-            *dst = ( char * )malloc( new_size );
-            strcpy( *dst, orig_buf );
-        }
-        else
-        {
-            *dst = ( char * )realloc( *dst, new_size );
-        }
+        data = ( char * )realloc( b->data, size );
     }
+    if ( !data )
+        return 0;
 
-    strcat( *dst, src );
-    return new_size;
+    b->data = data;
+    b->size = size;
+    return 1;
 }
 
-size_t
-_clog_append_int( char **dst, char *orig_buf, long int d, size_t cur_size )
+static inline void _clog_buf_put( struct _clog_buf *b, const char *src, size_t len )
 {
-    char buf[ 40 ]; /* Enough for 128-bit decimal */
-    if ( snprintf( buf, 40, "%ld", d ) >= 40 )
+    if ( b->len + len > b->size && !_clog_buf_grow( b, len ) )
+        return;
+
+    memcpy( b->data + b->len, src, len );
+    b->len += len;
+}
+
+static void _clog_buf_put_int( struct _clog_buf *b, long int d )
+{
+    char buf[ 24 ];
+    char *p = buf + sizeof( buf );
+    unsigned long int u = d < 0 ? -( unsigned long int )d : ( unsigned long int )d;
+
+    do
     {
-        return cur_size;
-    }
-    return _clog_append_str( dst, orig_buf, buf, cur_size );
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while ( u );
+    if ( d < 0 )
+        *--p = '-';
+
+    _clog_buf_put( b, p, buf + sizeof( buf ) - p );
 }
 
-size_t
-_clog_append_time( char **dst, char *orig_buf, struct tm *lt,
-                   const char *fmt, size_t cur_size )
+/* Turn logger->fmt into ops, merging runs of literal text.  Unknown
+ * substitutions produce nothing, as does a trailing '%'. */
+static void _clog_compile_fmt( struct clog *logger )
 {
-    char buf[ CLOG_DATETIME_LENGTH ];
-    size_t result = strftime( buf, CLOG_DATETIME_LENGTH, fmt, lt );
+    const char *fmt = logger->fmt;
+    int count = 0;
+    size_t i;
 
-    if ( result > 0 )
+    for ( i = 0; fmt[ i ]; i++ )
     {
-        return _clog_append_str( dst, orig_buf, buf, cur_size );
+        unsigned char type = CLOG_OP_TEXT;
+        size_t offset = i;
+
+        if ( fmt[ i ] == '%' )
+        {
+            if ( !fmt[ ++i ] )
+                break;
+
+            switch ( fmt[ i ] )
+            {
+            case '%':
+                offset = i;
+                break;
+            case 'd':
+                type = CLOG_OP_DATE;
+                break;
+            case 't':
+                type = CLOG_OP_TIME;
+                break;
+            case 'f':
+                type = CLOG_OP_FILE;
+                break;
+            case 'F':
+                type = CLOG_OP_FUNC;
+                break;
+            case 'n':
+                type = CLOG_OP_LINE;
+                break;
+            case 'l':
+                type = CLOG_OP_LEVEL;
+                break;
+            case 'm':
+                type = CLOG_OP_MESSAGE;
+                break;
+            default:
+                continue;
+            }
+        }
+
+        if ( type == CLOG_OP_TEXT && count &&
+             logger->ops[ count - 1 ].type == CLOG_OP_TEXT &&
+             logger->ops[ count - 1 ].offset + logger->ops[ count - 1 ].len == offset )
+        {
+            logger->ops[ count - 1 ].len++;
+            continue;
+        }
+
+        logger->ops[ count ].type = type;
+        logger->ops[ count ].offset = ( unsigned short )offset;
+        logger->ops[ count ].len = 1;
+        count++;
     }
 
-    return cur_size;
+    logger->op_count = count;
 }
 
 const char *
@@ -473,77 +903,682 @@ _clog_basename( const char *path )
     return path;
 }
 
-char *
-_clog_format( const struct clog *logger, char buf[], size_t buf_size,
+/* The date and time strings for one second.  Per thread, since synchronous
+ * loggers format on the caller's thread. */
+struct _clog_time_cache
+{
+    const struct clog *logger;
+    unsigned int gen;
+    time_t t;
+    size_t date_len;
+    size_t time_len;
+    char date[ CLOG_DATETIME_LENGTH ];
+    char time[ CLOG_DATETIME_LENGTH ];
+};
+
+static __thread struct _clog_time_cache _clog_time_cache;
+
+static struct _clog_time_cache *_clog_get_time( const struct clog *logger, time_t t )
+{
+    struct _clog_time_cache *cache = &_clog_time_cache;
+
+    if ( cache->logger != logger || cache->gen != logger->time_gen || cache->t != t )
+    {
+        struct tm tm;
+        struct tm *lt = localtime_r( &t, &tm );
+
+        /* A failed strftime leaves the field out, as it always has. */
+        cache->date_len = lt ? strftime( cache->date, CLOG_DATETIME_LENGTH, logger->date_fmt, lt ) : 0;
+        cache->time_len = lt ? strftime( cache->time, CLOG_DATETIME_LENGTH, logger->time_fmt, lt ) : 0;
+        cache->logger = logger;
+        cache->gen = logger->time_gen;
+        cache->t = t;
+    }
+    return cache;
+}
+
+/* Run the logger's compiled format, appending the line to out. */
+void
+_clog_format( const struct clog *logger, struct _clog_buf *out,
               const char *sfile, int sline, const char *sfunc, const char *level,
-              const char *message )
+              const char *message, size_t message_len, time_t t )
 {
-    size_t cur_size = buf_size;
-    char *result = buf;
-    enum
+    int i;
+    struct _clog_time_cache *cache = NULL;
+
+    for ( i = 0; i < logger->op_count; i++ )
     {
-        NORMAL,
-        SUBST
-    } state = NORMAL;
-    size_t fmtlen = strlen( logger->fmt );
-    size_t i;
-    time_t t = time( NULL );
-    struct tm *lt = localtime( &t );
+        const struct _clog_op *op = &logger->ops[ i ];
+
+        switch ( op->type )
+        {
+        case CLOG_OP_TEXT:
+            _clog_buf_put( out, logger->fmt + op->offset, op->len );
+            break;
+        case CLOG_OP_DATE:
+            if ( !cache )
+                cache = _clog_get_time( logger, t );
+            _clog_buf_put( out, cache->date, cache->date_len );
+            break;
+        case CLOG_OP_TIME:
+            if ( !cache )
+                cache = _clog_get_time( logger, t );
+            _clog_buf_put( out, cache->time, cache->time_len );
+            break;
+        case CLOG_OP_FILE:
+            sfile = _clog_basename( sfile );
+            _clog_buf_put( out, sfile, strlen( sfile ) );
+            break;
+        case CLOG_OP_FUNC:
+            _clog_buf_put( out, sfunc, strlen( sfunc ) );
+            break;
+        case CLOG_OP_LINE:
+            _clog_buf_put_int( out, sline );
+            break;
+        case CLOG_OP_LEVEL:
+            _clog_buf_put( out, level, strlen( level ) );
+            break;
+        case CLOG_OP_MESSAGE:
+            _clog_buf_put( out, message, message_len );
+            break;
+        }
+    }
+}
+
+/* Claim the next ring slot, or count a dropped message and return NULL if
+ * the ring is full.  The record goes to the writer once _clog_async_publish
+ * bumps its seq. */
+static struct _clog_record *_clog_async_claim( struct _clog_async *async )
+{
+    size_t pos = __atomic_load_n( &async->head, __ATOMIC_RELAXED );
 
-    sfile = _clog_basename( sfile );
-    result[ 0 ] = 0;
-    for ( i = 0; i < fmtlen; ++i )
+    for ( ;; )
     {
-        if ( state == NORMAL )
+        struct _clog_record *rec = &async->ring[ pos & async->mask ];
+        size_t seq = __atomic_load_n( &rec->seq, __ATOMIC_ACQUIRE );
+
+        /* The slot is free for pos: try to claim it. */
+        if ( seq == pos )
         {
-            if ( logger->fmt[ i ] == '%' )
+            if ( __atomic_compare_exchange_n( &async->head, &pos, pos + 1, 1,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+                return rec;
+        }
+        /* Still holding a record from the last lap: full. */
+        else if ( ( long )( seq - pos ) < 0 )
+        {
+            __atomic_fetch_add( &async->dropped, 1, __ATOMIC_RELAXED );
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n( &async->head, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+static void _clog_async_publish( struct _clog_record *rec )
+{
+    __atomic_store_n( &rec->seq, rec->seq + 1, __ATOMIC_RELEASE );
+}
+
+/* Queue a message, or count it as dropped if the ring is full. */
+void _clog_async_push( struct clog *logger, const char *sfile, int sline, const char *sfunc,
+                       enum clog_level level, const char *fmt, va_list ap )
+{
+    struct _clog_record *rec = _clog_async_claim( logger->async );
+    va_list ap2;
+    int len;
+
+    if ( !rec )
+        return;
+
+    rec->level = level;
+    rec->sfile = sfile;
+    rec->sline = sline;
+    rec->sfunc = sfunc;
+    rec->time = time( NULL );
+    rec->long_msg = NULL;
+
+    va_copy( ap2, ap );
+    len = vsnprintf( rec->msg, sizeof( rec->msg ), fmt, ap );
+    if ( len >= ( int )sizeof( rec->msg ) )
+    {
+        rec->long_msg = ( char * )malloc( len + 1 );
+        if ( rec->long_msg )
+            vsnprintf( rec->long_msg, len + 1, fmt, ap2 );
+    }
+    va_end( ap2 );
+
+    _clog_async_publish( rec );
+}
+
+/* Write out the writer's batch. */
+static void _clog_async_write( struct clog *logger, struct _clog_buf *batch )
+{
+    if ( batch->len && write( logger->fd, batch->data, batch->len ) == -1 )
+        _clog_err( "Unable to write to log file: %s\n", strerror( errno ) );
+    _clog_buf_free( batch );
+}
+
+static void *_clog_async_thread( void *arg )
+{
+    struct clog *logger = ( struct clog * )arg;
+    struct _clog_async *async = logger->async;
+    unsigned long dropped_reported = 0;
+    char batch_buf[ 65536 ];
+    struct _clog_buf batch;
+
+    _clog_buf_init( &batch, batch_buf, sizeof( batch_buf ) );
+
+    for ( ;; )
+    {
+        size_t count = 0;
+        unsigned long dropped;
+        int stop = __atomic_load_n( &async->stop, __ATOMIC_ACQUIRE );
+
+        for ( ;; )
+        {
+            const char *message;
+            struct _clog_record *rec = &async->ring[ async->tail & async->mask ];
+
+            if ( __atomic_load_n( &rec->seq, __ATOMIC_ACQUIRE ) != async->tail + 1 )
+                break;
+
+            /* Leave room so most lines go straight into the batch. */
+            if ( batch.len > sizeof( batch_buf ) - 1024 )
+                _clog_async_write( logger, &batch );
+
+            if ( logger->binary )
             {
-                state = SUBST;
+                _clog_buf_put( &batch, rec->msg, rec->len );
             }
             else
             {
-                char str[ 2 ] = { 0 };
-                str[ 0 ] = logger->fmt[ i ];
-                cur_size = _clog_append_str( &result, buf, str, cur_size );
+                message = rec->long_msg ? rec->long_msg : rec->msg;
+                _clog_format( logger, &batch, rec->sfile, rec->sline, rec->sfunc,
+                              CLOG_LEVEL_NAMES[ rec->level ], message, strlen( message ), rec->time );
+                free( rec->long_msg );
             }
+
+            /* Hand the slot back to producers for the next lap. */
+            __atomic_store_n( &rec->seq, async->tail + async->mask + 1, __ATOMIC_RELEASE );
+            async->tail++;
+            count++;
+        }
+
+        dropped = __atomic_load_n( &async->dropped, __ATOMIC_RELAXED );
+        if ( dropped != dropped_reported && logger->binary )
+        {
+            char rec[ 13 ] = { 'D' };
+            uint64_t lost = dropped - dropped_reported;
+
+            memcpy( rec + 1, &logger->binary->run, 4 );
+            memcpy( rec + 5, &lost, sizeof( lost ) );
+            _clog_buf_put( &batch, rec, sizeof( rec ) );
+            dropped_reported = dropped;
+        }
+        else if ( dropped != dropped_reported )
+        {
+            char text[ 96 ];
+            int len = snprintf( text, sizeof( text ), "clog: dropped %lu messages, log ring full\n",
+                                dropped - dropped_reported );
+
+            _clog_buf_put( &batch, text, len );
+            dropped_reported = dropped;
+        }
+
+        _clog_async_write( logger, &batch );
+        __atomic_store_n( &async->written, async->tail, __ATOMIC_RELEASE );
+
+        if ( !count )
+        {
+            struct timespec ts = { 0, 1000000 };
+
+            /* Stopping only once everything before the stop is out. */
+            if ( stop )
+                break;
+            nanosleep( &ts, NULL );
+        }
+    }
+
+    return NULL;
+}
+
+int clog_set_async( int id, size_t records )
+{
+    struct clog *logger = _clog_loggers[ id ];
+    struct _clog_async *async;
+    size_t i, size = 1;
+
+    if ( logger == NULL )
+    {
+        _clog_err( "clog_set_async: No such logger: %d\n", id );
+        return 1;
+    }
+
+    if ( logger->async )
+    {
+        async = logger->async;
+
+        __atomic_store_n( &async->stop, 1, __ATOMIC_RELEASE );
+        pthread_join( async->thread, NULL );
+        logger->async = NULL;
+
+        free( async->ring );
+        free( async );
+    }
+
+    if ( !records )
+        return 0;
+
+    while ( size < records )
+        size *= 2;
+
+    async = ( struct _clog_async * )calloc( 1, sizeof( *async ) );
+    if ( async )
+        async->ring = ( struct _clog_record * )calloc( size, sizeof( struct _clog_record ) );
+    if ( !async || !async->ring )
+    {
+        _clog_err( "Failed to allocate log ring: %s\n", strerror( errno ) );
+        free( async );
+        return 1;
+    }
+
+    async->mask = size - 1;
+    for ( i = 0; i < size; i++ )
+        async->ring[ i ].seq = i;
+
+    logger->async = async;
+    if ( pthread_create( &async->thread, NULL, _clog_async_thread, logger ) )
+    {
+        _clog_err( "Failed to start log writer\n" );
+        logger->async = NULL;
+        free( async->ring );
+        free( async );
+        return 1;
+    }
+    return 0;
+}
+
+void clog_flush( int id )
+{
+    struct clog *logger = _clog_loggers[ id ];
+    struct _clog_async *async = logger ? logger->async : NULL;
+
+    if ( async )
+    {
+        size_t head = __atomic_load_n( &async->head, __ATOMIC_ACQUIRE );
+
+        while ( ( long )( __atomic_load_n( &async->written, __ATOMIC_ACQUIRE ) - head ) < 0 )
+        {
+            struct timespec ts = { 0, 100000 };
+
+            nanosleep( &ts, NULL );
+        }
+    }
+}
+
+unsigned long clog_get_dropped( int id )
+{
+    struct clog *logger = _clog_loggers[ id ];
+
+    unsigned long dropped = 0;
+
+    if ( logger && logger->async )
+        dropped += __atomic_load_n( &logger->async->dropped, __ATOMIC_RELAXED );
+    if ( logger && logger->binary )
+        dropped += __atomic_load_n( &logger->binary->dropped, __ATOMIC_RELAXED );
+    return dropped;
+}
+
+/* Parse the printf conversion after a '%'.  Sets the argument type, and
+ * stars to the number of '*' width and precision ints before it.  Returns
+ * the end of the conversion. */
+const char *
+_clog_scan_spec( const char *spec, unsigned char *type, int *stars )
+{
+    int size = 0; /* 'h', 'l', 'L' or 'q' (long long) */
+
+    *stars = 0;
+    while ( *spec && strchr( "-+ #0'", *spec ) )
+        spec++;
+    for ( ;; )
+    {
+        if ( *spec == '*' )
+        {
+            ( *stars )++;
+            spec++;
         }
+        while ( *spec >= '0' && *spec <= '9' )
+            spec++;
+        if ( *spec != '.' )
+            break;
+        spec++;
+    }
+
+    for ( ;; spec++ )
+    {
+        if ( *spec == 'h' )
+            size = 'h';
+        else if ( *spec == 'l' )
+            size = size == 'l' ? 'q' : 'l';
+        else if ( *spec == 'L' || *spec == 'q' )
+            size = *spec;
+        else if ( *spec == 'z' || *spec == 't' || *spec == 'j' )
+            size = 'l';
         else
+            break;
+    }
+
+    switch ( *spec )
+    {
+    case '%':
+        *type = CLOG_ARG_NONE;
+        break;
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        *type = size == 'q' || size == 'L' ? CLOG_ARG_LLONG : size == 'l' ? CLOG_ARG_LONG : CLOG_ARG_INT;
+        break;
+    case 'c':
+        *type = size ? CLOG_ARG_BAD : CLOG_ARG_INT;
+        break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        *type = size == 'L' ? CLOG_ARG_LDOUBLE : CLOG_ARG_DOUBLE;
+        break;
+    case 'p':
+        *type = CLOG_ARG_PTR;
+        break;
+    case 's':
+        *type = size ? CLOG_ARG_BAD : CLOG_ARG_STR;
+        break;
+    default:
+        *type = CLOG_ARG_BAD;
+        return *spec ? spec + 1 : spec;
+    }
+    return spec + 1;
+}
+
+/* Fill in the argument types of a site's format.  Sites that can't be
+ * deferred become text. */
+static void _clog_site_parse( struct _clog_site *site, const char *fmt )
+{
+    int i;
+
+    site->arg_count = 0;
+    site->args_size = 0;
+    site->text = 0;
+
+    while ( ( fmt = strchr( fmt, '%' ) ) )
+    {
+        unsigned char type;
+        int stars;
+
+        fmt = _clog_scan_spec( fmt + 1, &type, &stars );
+        if ( type == CLOG_ARG_BAD || site->arg_count + stars + 1 > CLOG_BINARY_MAX_ARGS )
+        {
+            site->text = 1;
+            site->arg_count = 0;
+            return;
+        }
+        while ( stars-- )
+            site->args[ site->arg_count++ ] = CLOG_ARG_INT;
+        if ( type != CLOG_ARG_NONE )
+            site->args[ site->arg_count++ ] = type;
+    }
+
+    for ( i = 0; i < site->arg_count; i++ )
+    {
+        unsigned char type = site->args[ i ];
+
+        site->args_size += type == CLOG_ARG_STR ? 2 : type == CLOG_ARG_INT ? 4 : type == CLOG_ARG_LDOUBLE ? sizeof( long double ) : 8;
+    }
+}
+
+static size_t _clog_put_str( char *dst, const char *str, size_t len )
+{
+    uint16_t len16 = ( uint16_t )len;
+
+    memcpy( dst, &len16, sizeof( len16 ) );
+    memcpy( dst + sizeof( len16 ), str, len );
+    return sizeof( len16 ) + len;
+}
+
+static void _clog_buf_put_str( struct _clog_buf *b, const char *str )
+{
+    uint16_t len = ( uint16_t )strnlen( str, 65535 );
+
+    _clog_buf_put( b, ( const char * )&len, sizeof( len ) );
+    _clog_buf_put( b, str, len );
+}
+
+/* Find or add the site for a call.  Returns NULL if the table is full. */
+static struct _clog_site *_clog_binary_site( struct clog *logger, const char *sfile, int sline,
+                                             const char *sfunc, const char *fmt )
+{
+    struct _clog_binary *binary = logger->binary;
+    unsigned int hash = ( unsigned int )( ( uintptr_t )fmt >> 3 ) ^ ( ( unsigned int )sline * 2654435761u );
+    unsigned int i;
+    struct _clog_site *site = NULL;
+
+    for ( i = 0; i < CLOG_BINARY_SITES; i++ )
+    {
+        const char *site_fmt;
+
+        site = &binary->sites[ ( hash + i ) & ( CLOG_BINARY_SITES - 1 ) ];
+        site_fmt = __atomic_load_n( &site->fmt, __ATOMIC_ACQUIRE );
+        if ( !site_fmt )
+            break;
+        if ( site_fmt == fmt && site->sline == sline && site->sfile == sfile )
+            return site;
+    }
+
+    pthread_mutex_lock( &binary->lock );
+
+    /* Another thread may have added it, or taken the free slot. */
+    for ( ; i < CLOG_BINARY_SITES; i++ )
+    {
+        site = &binary->sites[ ( hash + i ) & ( CLOG_BINARY_SITES - 1 ) ];
+        if ( !site->fmt )
+            break;
+        if ( site->fmt == fmt && site->sline == sline && site->sfile == sfile )
+        {
+            pthread_mutex_unlock( &binary->lock );
+            return site;
+        }
+    }
+
+    if ( i < CLOG_BINARY_SITES && binary->site_count < CLOG_BINARY_SITES - 1 )
+    {
+        char buf[ 1024 ];
+        char head[ 14 ] = { 'S' };
+        uint32_t value;
+        struct _clog_buf rec;
+
+        site->sfile = sfile;
+        site->sline = sline;
+        site->id = ++binary->site_count;
+        _clog_site_parse( site, fmt );
+
+        /* Sites go straight to the file; the decoder reads them first. */
+        memcpy( head + 1, &binary->run, 4 );
+        value = site->id;
+        memcpy( head + 5, &value, 4 );
+        value = ( uint32_t )sline;
+        memcpy( head + 9, &value, 4 );
+        head[ 13 ] = ( char )site->text;
+
+        _clog_buf_init( &rec, buf, sizeof( buf ) );
+        _clog_buf_put( &rec, head, sizeof( head ) );
+        _clog_buf_put_str( &rec, sfile );
+        _clog_buf_put_str( &rec, sfunc );
+        _clog_buf_put_str( &rec, fmt );
+        if ( write( logger->fd, rec.data, rec.len ) == -1 )
+            _clog_err( "Unable to write to log file: %s\n", strerror( errno ) );
+        _clog_buf_free( &rec );
+
+        __atomic_store_n( &site->fmt, fmt, __ATOMIC_RELEASE );
+    }
+    else
+    {
+        site = NULL;
+    }
+
+    pthread_mutex_unlock( &binary->lock );
+    return site;
+}
+
+/* Encode a message record into dst, which holds CLOG_ASYNC_MSG_LENGTH bytes.
+ * Returns its length. */
+static size_t _clog_binary_encode( char *dst, uint32_t run, const struct _clog_site *site,
+                                   enum clog_level level, const char *fmt, va_list ap )
+{
+    const size_t size = CLOG_ASYNC_MSG_LENGTH;
+    size_t len = CLOG_BINARY_MSG_HEADER;
+    size_t rest = site->args_size; /* Room the arguments after this one need. */
+    uint32_t id = site->id;
+    uint16_t args_len;
+    struct timespec ts;
+    uint64_t ns;
+    int i;
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+    ns = ( uint64_t )ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    dst[ 0 ] = 'M';
+    memcpy( dst + 1, &run, 4 );
+    dst[ 5 ] = ( char )level;
+    memcpy( dst + 6, &id, 4 );
+    memcpy( dst + 10, &ns, 8 );
+
+    if ( site->text )
+    {
+        int result = vsnprintf( dst + len + 2, size - len - 2, fmt, ap );
+        uint16_t text_len = ( uint16_t )( result < 0 ? 0 : ( size_t )result < size - len - 3 ? ( size_t )result : size - len - 3 );
+
+        memcpy( dst + len, &text_len, 2 );
+        len += 2 + text_len;
+    }
+    else
+    {
+        for ( i = 0; i < site->arg_count; i++ )
         {
-            switch ( logger->fmt[ i ] )
+            switch ( site->args[ i ] )
             {
-            case '%':
-                cur_size = _clog_append_str( &result, buf, "%", cur_size );
-                break;
-            case 't':
-                cur_size = _clog_append_time( &result, buf, lt,
-                                              logger->time_fmt, cur_size );
+            case CLOG_ARG_INT:
+            {
+                int v = va_arg( ap, int );
+
+                memcpy( dst + len, &v, 4 );
+                len += 4;
+                rest -= 4;
                 break;
-            case 'd':
-                cur_size = _clog_append_time( &result, buf, lt,
-                                              logger->date_fmt, cur_size );
+            }
+            case CLOG_ARG_LONG:
+            {
+                int64_t v = va_arg( ap, long );
+
+                memcpy( dst + len, &v, 8 );
+                len += 8;
+                rest -= 8;
                 break;
-            case 'l':
-                cur_size = _clog_append_str( &result, buf, level, cur_size );
+            }
+            case CLOG_ARG_LLONG:
+            {
+                int64_t v = va_arg( ap, long long );
+
+                memcpy( dst + len, &v, 8 );
+                len += 8;
+                rest -= 8;
                 break;
-            case 'n':
-                cur_size = _clog_append_int( &result, buf, sline, cur_size );
+            }
+            case CLOG_ARG_DOUBLE:
+            {
+                double v = va_arg( ap, double );
+
+                memcpy( dst + len, &v, 8 );
+                len += 8;
+                rest -= 8;
                 break;
-            case 'f':
-                cur_size = _clog_append_str( &result, buf, sfile, cur_size );
+            }
+            case CLOG_ARG_LDOUBLE:
+            {
+                long double v = va_arg( ap, long double );
+
+                memcpy( dst + len, &v, sizeof( v ) );
+                len += sizeof( v );
+                rest -= sizeof( v );
                 break;
-            case 'F':
-                cur_size = _clog_append_str( &result, buf, sfunc, cur_size );
+            }
+            case CLOG_ARG_PTR:
+            {
+                uint64_t v = ( uintptr_t )va_arg( ap, void * );
+
+                memcpy( dst + len, &v, 8 );
+                len += 8;
+                rest -= 8;
                 break;
-            case 'm':
-                cur_size = _clog_append_str( &result, buf, message,
-                                             cur_size );
+            }
+            case CLOG_ARG_STR:
+            {
+                const char *str = va_arg( ap, const char * );
+
+                if ( !str )
+                    str = "(null)";
+                rest -= 2;
+                len += _clog_put_str( dst + len, str, strnlen( str, size - len - 2 - rest ) );
                 break;
             }
-            state = NORMAL;
+            }
+        }
+    }
+
+    args_len = ( uint16_t )( len - CLOG_BINARY_MSG_HEADER );
+    memcpy( dst + 18, &args_len, 2 );
+    return len;
+}
+
+static void _clog_binary_log( struct clog *logger, const char *sfile, int sline, const char *sfunc,
+                              enum clog_level level, const char *fmt, va_list ap )
+{
+    struct _clog_site *site = _clog_binary_site( logger, sfile, sline, sfunc, fmt );
+
+    if ( !site )
+    {
+        __atomic_fetch_add( logger->async ? &logger->async->dropped : &logger->binary->dropped,
+                            1, __ATOMIC_RELAXED );
+        return;
+    }
+
+    if ( logger->async )
+    {
+        struct _clog_record *rec = _clog_async_claim( logger->async );
+
+        if ( rec )
+        {
+            rec->len = _clog_binary_encode( rec->msg, logger->binary->run, site, level, fmt, ap );
+            _clog_async_publish( rec );
         }
     }
+    else
+    {
+        char rec[ CLOG_ASYNC_MSG_LENGTH ];
+        size_t len = _clog_binary_encode( rec, logger->binary->run, site, level, fmt, ap );
 
-    return result;
+        if ( write( logger->fd, rec, len ) == -1 )
+            _clog_err( "Unable to write to log file: %s\n", strerror( errno ) );
+    }
 }
 
 void _clog_log( const char *sfile, int sline, const char *sfunc, enum clog_level level,
@@ -555,8 +1590,8 @@ void _clog_log( const char *sfile, int sline, const char *sfunc, enum clog_level
     char buf[ 4096 ];
     size_t buf_size = 4096;
     char *dynbuf = buf;
-    char *message;
     int result;
+    va_list ap2;
     struct clog *logger = _clog_loggers[ id ];
 
     if ( !logger )
@@ -570,45 +1605,51 @@ void _clog_log( const char *sfile, int sline, const char *sfunc, enum clog_level
         return;
     }
 
+    if ( logger->binary )
+    {
+        _clog_binary_log( logger, sfile, sline, sfunc, level, fmt, ap );
+        return;
+    }
+
+    if ( logger->async )
+    {
+        _clog_async_push( logger, sfile, sline, sfunc, level, fmt, ap );
+        return;
+    }
+
     /* Format the message text with the argument list. */
+    va_copy( ap2, ap );
     result = vsnprintf( dynbuf, buf_size, fmt, ap );
     if ( ( size_t )result >= buf_size )
     {
         buf_size = result + 1;
         dynbuf = ( char * )malloc( buf_size );
-        result = vsnprintf( dynbuf, buf_size, fmt, ap );
+        result = vsnprintf( dynbuf, buf_size, fmt, ap2 );
         if ( ( size_t )result >= buf_size )
         {
             /* Formatting failed -- too large */
             _clog_err( "Formatting failed (1).\n" );
             free( dynbuf );
+            va_end( ap2 );
             return;
         }
     }
+    va_end( ap2 );
 
     /* Format according to log format and write to log */
     {
         char message_buf[ 4096 ];
-        message = _clog_format( logger, message_buf, 4096, sfile, sline, sfunc,
-                                CLOG_LEVEL_NAMES[ level ], dynbuf );
-        if ( !message )
-        {
-            _clog_err( "Formatting failed (2).\n" );
-            if ( dynbuf != buf )
-            {
-                free( dynbuf );
-            }
-            return;
-        }
-        result = write( logger->fd, message, strlen( message ) );
+        struct _clog_buf out;
+
+        _clog_buf_init( &out, message_buf, sizeof( message_buf ) );
+        _clog_format( logger, &out, sfile, sline, sfunc, CLOG_LEVEL_NAMES[ level ],
+                      dynbuf, result, time( NULL ) );
+        result = write( logger->fd, out.data, out.len );
         if ( result == -1 )
         {
             _clog_err( "Unable to write to log file: %s\n", strerror( errno ) );
         }
-        if ( message != message_buf )
-        {
-            free( message );
-        }
+        _clog_buf_free( &out );
         if ( dynbuf != buf )
         {
             free( dynbuf );
@@ -616,28 +1657,115 @@ void _clog_log( const char *sfile, int sline, const char *sfunc, enum clog_level
     }
 }
 
-void clog_debug( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
+static void _clog_log_args( const char *sfile, int sline, const char *sfunc, enum clog_level level,
+                            int id, const char *fmt, ... )
+{
+    va_list ap;
+    va_start( ap, fmt );
+    _clog_log( sfile, sline, sfunc, level, id, fmt, ap );
+    va_end( ap );
+}
+
+int _clog_limit_take( struct _clog_limit *limit, const char *sfile, int sline, const char *sfunc,
+                      int id, enum clog_level level )
+{
+    struct timespec ts;
+    uint64_t now_ms;
+    unsigned long suppressed = 0;
+    int ret = 0;
+
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+    now_ms = ( uint64_t )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    while ( __atomic_test_and_set( &limit->lock, __ATOMIC_ACQUIRE ) )
+        ;
+
+    if ( !limit->last_ms )
+    {
+        limit->tokens = CLOG_LIMIT_BURST * 1000;
+        limit->sfile = sfile;
+        limit->sline = sline;
+        limit->sfunc = sfunc;
+        limit->id = id;
+        limit->level = level;
+    }
+    else
+    {
+        uint64_t tokens = limit->tokens + ( now_ms - limit->last_ms ) * CLOG_LIMIT_RATE;
+
+        limit->tokens = tokens < CLOG_LIMIT_BURST * 1000 ? ( unsigned int )tokens : CLOG_LIMIT_BURST * 1000;
+    }
+    limit->last_ms = now_ms;
+
+    if ( limit->tokens >= 1000 )
+    {
+        limit->tokens -= 1000;
+        suppressed = limit->suppressed;
+        limit->suppressed = 0;
+        ret = 1;
+    }
+    else if ( !limit->suppressed++ && !limit->listed )
+    {
+        limit->listed = 1;
+        limit->next = __atomic_load_n( &_clog_limits, __ATOMIC_RELAXED );
+        while ( !__atomic_compare_exchange_n( &_clog_limits, &limit->next, limit, 1,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+            ;
+    }
+
+    __atomic_clear( &limit->lock, __ATOMIC_RELEASE );
+
+    if ( suppressed )
+        _clog_log_args( sfile, sline, sfunc, level, id, "suppressed %lu messages", suppressed );
+    return ret;
+}
+
+/* Log counts still held by rate limited sites of a logger. */
+static void _clog_limit_report( int id )
+{
+    struct _clog_limit *limit;
+
+    for ( limit = __atomic_load_n( &_clog_limits, __ATOMIC_ACQUIRE ); limit; limit = limit->next )
+    {
+        unsigned long suppressed;
+
+        if ( limit->id != id )
+            continue;
+
+        while ( __atomic_test_and_set( &limit->lock, __ATOMIC_ACQUIRE ) )
+            ;
+        suppressed = limit->suppressed;
+        limit->suppressed = 0;
+        __atomic_clear( &limit->lock, __ATOMIC_RELEASE );
+
+        if ( suppressed )
+            _clog_log_args( limit->sfile, limit->sline, limit->sfunc, limit->level, id,
+                            "suppressed %lu messages", suppressed );
+    }
+}
+
+void ( clog_debug )( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
 {
     va_list ap;
     va_start( ap, fmt );
     _clog_log( sfile, sline, sfunc, CLOG_DEBUG, id, fmt, ap );
 }
 
-void clog_info( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
+void ( clog_info )( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
 {
     va_list ap;
     va_start( ap, fmt );
     _clog_log( sfile, sline, sfunc, CLOG_INFO, id, fmt, ap );
 }
 
-void clog_warn( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
+void ( clog_warn )( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
 {
     va_list ap;
     va_start( ap, fmt );
     _clog_log( sfile, sline, sfunc, CLOG_WARN, id, fmt, ap );
 }
 
-void clog_error( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
+void ( clog_error )( const char *sfile, int sline, const char *sfunc, int id, const char *fmt, ... )
 {
     va_list ap;
     va_start( ap, fmt );
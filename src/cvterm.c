@@ -26,13 +26,27 @@
  *
  **************************************************************************/
 #define _GNU_SOURCE
+#include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <limits.h>
 #include <locale.h>
 #include <signal.h>
+#include <sys/wait.h>
 
 #include "vterm.h"
 #include "pseudo.h"
+#include "ptypool.h"
+#include "search.h"
+#include "scrollback.h"
 #include "termwin.h"
+#include "record.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "session.h"
+#include "server.h"
+#include "ipc.h"
 #include "ya_getopt.h"
 #include "clog.h"
 #include "cvterm_utils.h"
@@ -45,8 +59,8 @@ static const VTermScreenCallbacks g_screen_cbs =
       termwin_settermprop_callback, // settermprop
       termwin_bell_callback,        // bell
       NULL,                         // resize
-      NULL,                         // sb_pushline
-      NULL                          // sb_popline
+      termwin_sb_pushline_callback, // sb_pushline
+      termwin_sb_popline_callback   // sb_popline
     };
 
 typedef struct cvterm_opts
@@ -54,17 +68,138 @@ typedef struct cvterm_opts
     const char *env_term;
     const char *nc_term;
     const char *logfile;
+    int binlog;
     int wait_for_debugger;
+    size_t scrollback_lines;
+    size_t scrollback_mb;
+    const char *scrollback_dir;
+    int mouse;
+    const char *record_file;
+    const char *to_asciicast;
+    const char *replay_file;
+    int replay_realtime;
+    double replay_seek;
+    const char *snapshot_file;
+    const char *restore_file;
+    int server;
+    int attach;
+    const char *socket_path;
+    int parse_threads;
 
     int argc;
     const char **argv;
     const char *argv_buf[ 2 ];
 } cvterm_opts;
 
+// RAM kept for the newest scrollback when spilling history to disk.
+#define SCROLLBACK_SPILL_RAM_BYTES ( 4 * 1024 * 1024 )
+
+// Ptys kept open and ready for new sessions.
+#define PTY_POOL_SPARES 4
+
+// Log ring records; a full ring drops messages instead of stalling the UI.
+#define CLOG_ASYNC_RECORDS 4096
+
+// Ctrl+] starts a cvterm command key instead of going to the child.
+#define CMD_PREFIX_KEY 0x1d
+#define KEY_ESCAPE 0x1b
+
+#define KEY_SEQ_MAX 16
+
+// Sessions one cvterm can run.
+#define SESSION_MAX 32
+// Panes the screen can be tiled into.
+#define PANE_MAX 9
+
+// Keys from escape sequences we look at, above the Unicode range.
+enum
+{
+    VKEY_PAGEUP = 0x110000,
+    VKEY_PAGEDOWN,
+    VKEY_SHIFT_PAGEUP,
+    VKEY_SHIFT_PAGEDOWN,
+    VKEY_UP,
+    VKEY_DOWN,
+    VKEY_HOME,
+    VKEY_END,
+    VKEY_WHEELUP,
+    VKEY_WHEELDOWN,
+    VKEY_MOUSE // Other mouse reports.
+};
+
+typedef struct key_seq
+{
+    const char *seq;
+    int key;
+} key_seq;
+
+static const key_seq g_key_seqs[] =
+    {
+      { "\033[5~", VKEY_PAGEUP },
+      { "\033[6~", VKEY_PAGEDOWN },
+      { "\033[5;2~", VKEY_SHIFT_PAGEUP },
+      { "\033[6;2~", VKEY_SHIFT_PAGEDOWN },
+      { "\033[A", VKEY_UP },
+      { "\033OA", VKEY_UP },
+      { "\033[B", VKEY_DOWN },
+      { "\033OB", VKEY_DOWN },
+      { "\033[H", VKEY_HOME },
+      { "\033OH", VKEY_HOME },
+      { "\033[1~", VKEY_HOME },
+      { "\033[F", VKEY_END },
+      { "\033OF", VKEY_END },
+      { "\033[4~", VKEY_END },
+    };
+
+typedef enum input_mode
+{
+    INPUT_CHILD,  // Keys go to the child.
+    INPUT_PREFIX, // Got CMD_PREFIX_KEY, waiting for the command.
+    INPUT_PROMPT, // Typing a search pattern.
+    INPUT_SEARCH, // Search active: n / N move between matches.
+    INPUT_SCROLL  // Looking through scrollback.
+} input_mode;
+
+typedef struct input_state
+{
+    input_mode mode;
+    int mouse; // Always report mouse wheel, not just while scrolled back.
+
+    // Search
+    int flags;
+    char pattern[ 256 ];
+    size_t pattern_len;
+    search *s;
+    uint64_t line; // Scrollback line of the current match.
+
+    const char *snapshot_file;
+} input_state;
+
+typedef struct pane
+{
+    termwin *twin;
+    session *sess; // NULL while its session is being replaced.
+} pane;
+
+static pane g_panes[ PANE_MAX ];
+static int g_pane_count = 0;
+static int g_pane = 0; // Pane with focus.
+
+static termwin *g_twin = NULL; // Focused pane's termwin.
+static record *g_rec = NULL;
+static session *g_rec_sess = NULL; // Session being recorded.
+
+static session_config g_session_cfg;
+static session_pool *g_pool = NULL; // Parses sessions not in panes.
+static session *g_sessions[ SESSION_MAX ];
+static int g_session_count = 0;
+
+// Session in the focused pane, and its vterm and scrollback.
+static session *g_sess = NULL;
 static VTerm *g_vterm = NULL;
-static termwin *g_twin = NULL;
-static int g_master_pty;
+static scrollback *g_sb = NULL;
 static struct sigaction g_winch_sigaction_old;
+static input_state g_input;
 
 static void sigwinch( int how )
 {
@@ -80,81 +215,795 @@ static void sigwinch( int how )
         FATAL_ERROR( sigprocmask );
 }
 
-static void sigwinch_handler( int signo )
+// Size sess's session to its pane.
+static void pane_fit( pane *p )
 {
     int rows, cols;
+    int vt_rows, vt_cols;
+
+    termwin_getsize( p->twin, &rows, &cols );
+    vterm_get_size( session_get_vterm( p->sess ), &vt_rows, &vt_cols );
+    if ( rows != vt_rows || cols != vt_cols )
+        session_resize( p->sess, rows, cols );
+}
+
+// Tile the panes in a grid over the window area. A short last row of the
+// grid shares its width between fewer panes.
+static void pane_layout()
+{
+    int i;
+    int y, x, rows, cols;
+    int grid_cols = 1;
+    int grid_rows;
+
+    termwin_get_area( g_twin, &y, &x, &rows, &cols );
+
+    while ( grid_cols * grid_cols < g_pane_count )
+        grid_cols++;
+    grid_rows = ( g_pane_count + grid_cols - 1 ) / grid_cols;
 
+    for ( i = 0; i < g_pane_count; i++ )
+    {
+        int row = i / grid_cols;
+        int col = i % grid_cols;
+        int n = ( row == grid_rows - 1 ) ? g_pane_count - row * grid_cols : grid_cols;
+        int py = y + rows * row / grid_rows;
+        int px = x + cols * col / n;
+
+        termwin_set_geometry( g_panes[ i ].twin, py, px,
+                              y + rows * ( row + 1 ) / grid_rows - py,
+                              x + cols * ( col + 1 ) / n - px );
+        if ( g_panes[ i ].sess )
+            pane_fit( &g_panes[ i ] );
+    }
+}
+
+static void sigwinch_handler( int signo )
+{
     if ( g_winch_sigaction_old.sa_handler )
         ( *g_winch_sigaction_old.sa_handler )( signo );
 
     vterm_screen_flush_damage( vterm_obtain_screen( g_vterm ) );
 
-    termwin_resize( g_twin );
+    // Sessions in panes get their new sizes, others when they're shown.
+    pane_layout();
+}
+
+// Turn terminal mouse button reporting on / off.
+static void mouse_report( int on )
+{
+    static int s_on = 0;
+
+    if ( on != s_on )
+    {
+        const char *seq = on ? "\033[?1000h" : "\033[?1000l";
+
+        s_on = on;
+        if ( write( STDOUT_FILENO, seq, strlen( seq ) ) < 0 )
+            clog_warn_limit( CLOG( 0 ), "mouse_report write failed: %d", errno );
+    }
+}
+
+static void scroll_start()
+{
+    g_input.mode = INPUT_SCROLL;
+    mouse_report( 1 );
+}
+
+static void scroll_stop()
+{
+    termwin_scroll_end( g_twin );
+    termwin_set_status( g_twin, NULL );
+    g_input.mode = INPUT_CHILD;
+    mouse_report( g_input.mouse );
+}
+
+// Handle scrollback viewing keys. Returns 0 if key isn't one.
+static int scroll_key( int key )
+{
+    int rows, cols;
+    uint64_t first, end, line;
+
+    if ( !g_sb )
+        return 0;
+
     termwin_getsize( g_twin, &rows, &cols );
 
-    // Set pty size.
-    const struct winsize size = { rows, cols, 0, 0 };
-    if ( ioctl( g_master_pty, TIOCSWINSZ, &size ) != 0 )
-        FATAL_ERROR( ioctl( TIOCSWINSZ ) );
+    switch ( key )
+    {
+    case VKEY_PAGEUP:
+    case VKEY_SHIFT_PAGEUP:
+    case 'b':
+        termwin_scroll( g_twin, -MAX( 1, rows - 1 ) );
+        break;
+    case VKEY_PAGEDOWN:
+    case VKEY_SHIFT_PAGEDOWN:
+    case ' ':
+        termwin_scroll( g_twin, MAX( 1, rows - 1 ) );
+        break;
+    case VKEY_UP:
+    case 'k':
+        termwin_scroll( g_twin, -1 );
+        break;
+    case VKEY_DOWN:
+    case 'j':
+        termwin_scroll( g_twin, 1 );
+        break;
+    case 'u':
+        termwin_scroll( g_twin, -MAX( 1, rows / 2 ) );
+        break;
+    case 'd':
+        termwin_scroll( g_twin, MAX( 1, rows / 2 ) );
+        break;
+    case VKEY_WHEELUP:
+        termwin_scroll( g_twin, -3 );
+        break;
+    case VKEY_WHEELDOWN:
+        termwin_scroll( g_twin, 3 );
+        break;
+    case VKEY_HOME:
+    case 'g':
+        scrollback_get_range( g_sb, &first, &end );
+        termwin_scroll_to( g_twin, first, 0 );
+        break;
+    case VKEY_END:
+    case 'G':
+        termwin_scroll_end( g_twin );
+        break;
+    default:
+        return 0;
+    }
+
+    if ( g_input.mode == INPUT_SCROLL )
+    {
+        if ( termwin_get_scroll( g_twin, &line ) )
+        {
+            char status[ 128 ];
+
+            scrollback_get_range( g_sb, &first, &end );
+            snprintf( status, sizeof( status ), "scrollback: %" PRIu64 " lines up   (q: back to live)", end - line );
+            termwin_set_status( g_twin, status );
+        }
+        else
+        {
+            scroll_stop();
+        }
+    }
+    return 1;
+}
+
+static void search_set_status( const char *msg )
+{
+    char status[ 512 ];
+
+    snprintf( status, sizeof( status ), "%c%s%s%s",
+              ( g_input.flags & SEARCH_REGEX ) ? '?' : '/', g_input.pattern,
+              msg ? "   " : "", msg ? msg : "" );
+    termwin_set_status( g_twin, status );
+}
+
+static void search_stop()
+{
+    termwin_scroll_end( g_twin );
+    termwin_set_highlight( g_twin, NULL );
+    termwin_set_status( g_twin, NULL );
 
-    // Tell vterm our new size.
-    vterm_set_size( g_vterm, rows, cols );
+    search_free( g_input.s );
+    g_input.s = NULL;
+    g_input.mode = INPUT_CHILD;
 }
 
-static void handle_input( VTerm *vt, int master )
+static void search_next( int backward )
+{
+    int rows, cols;
+    char msg[ 128 ];
+    uint64_t first, end;
+    uint64_t line = g_input.line;
+
+    if ( !g_sb )
+    {
+        search_set_status( "(no scrollback)" );
+        return;
+    }
+
+    if ( !scrollback_search( g_sb, g_input.s, &line, backward ) )
+    {
+        search_set_status( backward ? "no older matches" : "no newer matches" );
+        return;
+    }
+
+    g_input.line = line;
+    scrollback_get_range( g_sb, &first, &end );
+    snprintf( msg, sizeof( msg ), "history line %" PRIu64 " (%" PRIu64 " up)", line, end - line );
+    search_set_status( msg );
+
+    // Show it in the middle of the window.
+    termwin_getsize( g_twin, &rows, &cols );
+    termwin_scroll_to( g_twin, line, rows / 2 );
+}
+
+static void search_run()
+{
+    size_t i;
+    int flags = g_input.flags;
+
+    // Lower case patterns ignore case.
+    for ( i = 0; i < g_input.pattern_len && g_input.pattern[ i ] == tolower( ( unsigned char )g_input.pattern[ i ] ); i++ )
+        ;
+    if ( i == g_input.pattern_len )
+        flags |= SEARCH_ICASE;
+
+    g_input.s = search_create( g_input.pattern, flags );
+    if ( !g_input.s )
+    {
+        g_input.mode = INPUT_CHILD;
+        if ( g_input.pattern_len )
+            search_set_status( "invalid pattern" );
+        else
+            termwin_set_status( g_twin, NULL );
+        return;
+    }
+
+    g_input.mode = INPUT_SEARCH;
+    termwin_set_highlight( g_twin, g_input.s );
+
+    // Start from the newest history line.
+    if ( g_sb )
+    {
+        uint64_t first;
+
+        scrollback_get_range( g_sb, &first, &g_input.line );
+    }
+    search_next( 1 );
+}
+
+static void snapshot_save_screen()
+{
+    char status[ PATH_MAX + 64 ];
+    char dir[ PATH_MAX ];
+    char *slash;
+    snapshot *snap = snapshot_capture( g_vterm, g_twin );
+
+    snprintf( dir, sizeof( dir ), "%s", g_input.snapshot_file );
+    slash = strrchr( dir, '/' );
+    if ( slash && slash != dir )
+    {
+        *slash = 0;
+        mkdir_p( dir, 0700 );
+    }
+
+    if ( !snapshot_save( snap, g_input.snapshot_file ) )
+        snprintf( status, sizeof( status ), "snapshot saved to %s", g_input.snapshot_file );
+    else
+        snprintf( status, sizeof( status ), "unable to save snapshot to %s", g_input.snapshot_file );
+    termwin_set_status( g_twin, status );
+
+    snapshot_free( snap );
+}
+
+// Send keys vterm has encoded to the attached session.
+static void input_flush()
 {
     size_t buflen;
     char buf[ 8192 ];
 
-    while ( vterm_output_get_buffer_remaining( vt ) > 0 )
+    if ( !g_sess )
+        return;
+
+    while ( ( buflen = vterm_output_get_buffer_current( g_vterm ) ) > 0 )
     {
-        int ch = termwin_getch( g_twin );
-        if ( ch == -1 )
-            break;
+        buflen = MIN( buflen, sizeof( buf ) );
+        buflen = vterm_output_read( g_vterm, buf, buflen );
 
-        vterm_keyboard_unichar( vt, ( uint32_t )ch, VTERM_MOD_NONE );
+        session_write( g_sess, buf, buflen );
     }
+}
 
-    while ( ( buflen = vterm_output_get_buffer_current( vt ) ) > 0 )
+// Pane showing sess, or -1.
+static int pane_find( session *sess )
+{
+    int i;
+
+    for ( i = 0; i < g_pane_count; i++ )
     {
-        buflen = MIN( buflen, sizeof( buf ) );
-        buflen = vterm_output_read( vt, buf, buflen );
+        if ( g_panes[ i ].sess == sess )
+            return i;
+    }
+    return -1;
+}
 
-        ssize_t bytes_write = TEMP_FAILURE_RETRY( write( master, buf, buflen ) );
-        if ( bytes_write != ( ssize_t )buflen )
-            FATAL_ERROR( write );
+static void pane_focus( int index )
+{
+    if ( g_twin && index == g_pane )
+        return;
+
+    if ( g_twin )
+    {
+        input_flush();
+        search_stop();
+        termwin_set_focus( g_twin, 0 );
     }
+
+    g_pane = index;
+    g_twin = g_panes[ index ].twin;
+    termwin_set_focus( g_twin, 1 );
+
+    g_sess = g_panes[ index ].sess;
+    g_vterm = g_sess ? session_get_vterm( g_sess ) : NULL;
+    g_sb = g_sess ? session_get_scrollback( g_sess ) : NULL;
+
+    g_input.mode = INPUT_CHILD;
+    mouse_report( g_input.mouse );
 }
 
-static int handle_output( VTerm *vt, int master )
+// Show sess, which isn't in a pane, in pane index.
+static void pane_show( int index, session *sess )
 {
-    char buf[ 8192 ];
+    pane *p = &g_panes[ index ];
 
-    for ( ;; )
+    p->sess = sess;
+    pane_fit( p );
+    session_attach( sess, p->twin );
+
+    if ( index == g_pane )
     {
-        ssize_t bytes_read = TEMP_FAILURE_RETRY( read( master, buf, sizeof( buf ) ) );
+        g_sess = sess;
+        g_vterm = session_get_vterm( sess );
+        g_sb = session_get_scrollback( sess );
+    }
+}
 
-        // Check if master pty was closed.
-        if ( !bytes_read )
-            return -1;
+static void pane_remove( int index )
+{
+    termwin_free( g_panes[ index ].twin );
+    if ( index == g_pane )
+        g_twin = NULL;
 
-        if ( bytes_read < 0 )
+    g_pane_count--;
+    memmove( &g_panes[ index ], &g_panes[ index + 1 ], ( g_pane_count - index ) * sizeof( g_panes[ 0 ] ) );
+
+    if ( g_twin )
+    {
+        if ( g_pane > index )
+            g_pane--;
+    }
+    else
+    {
+        pane_focus( MIN( index, g_pane_count - 1 ) );
+    }
+
+    pane_layout();
+}
+
+// Show the focused pane's session in brackets and * for sessions out of
+// view with new output.
+static void session_show_list()
+{
+    int i;
+    size_t len;
+    char status[ 256 ];
+
+    len = snprintf( status, sizeof( status ), "sessions:" );
+    for ( i = 0; i < g_session_count && len < sizeof( status ); i++ )
+    {
+        if ( g_sessions[ i ] == g_sess )
+            len += snprintf( status + len, sizeof( status ) - len, " [%d]", i + 1 );
+        else
+            len += snprintf( status + len, sizeof( status ) - len, " %d%s", i + 1,
+                             session_take_activity( g_sessions[ i ] ) ? "*" : "" );
+    }
+    termwin_set_status( g_twin, status );
+}
+
+// Show a session in the focused pane, or focus the pane it's already in.
+static void session_switch( int index )
+{
+    session *sess = g_sessions[ index ];
+    int p = pane_find( sess );
+
+    if ( p >= 0 )
+    {
+        pane_focus( p );
+    }
+    else
+    {
+        if ( g_sess )
         {
-            // EAGAIN: no data available.
-            // EIO: last slave fd closed.
-            if ( errno == EAGAIN )
-                return 0;
-            else if ( errno == EIO )
-                return -1;
+            input_flush();
+            search_stop();
+            session_detach( g_sess );
+        }
+
+        pane_show( g_pane, sess );
+
+        g_input.mode = INPUT_CHILD;
+        mouse_report( g_input.mouse );
+    }
+
+    session_show_list();
+}
+
+// Start a session running the command cvterm was started with and switch to it.
+static int session_open()
+{
+    int rows, cols;
+    session *sess;
+
+    if ( g_session_count == SESSION_MAX )
+    {
+        termwin_set_status( g_twin, "too many sessions" );
+        return -1;
+    }
+
+    termwin_getsize( g_twin, &rows, &cols );
+    sess = session_create( &g_session_cfg, rows, cols );
+    if ( !sess )
+    {
+        termwin_set_status( g_twin, "unable to start session" );
+        return -1;
+    }
+
+    g_sessions[ g_session_count++ ] = sess;
+    session_switch( g_session_count - 1 );
+    return 0;
+}
+
+// Session's child has exited.
+static void session_close( int index )
+{
+    int i;
+    session *sess = g_sessions[ index ];
+    int p = pane_find( sess );
+
+    if ( p >= 0 )
+    {
+        if ( p == g_pane )
+        {
+            search_stop();
+            g_sess = NULL;
+            g_vterm = NULL;
+            g_sb = NULL;
+        }
+        session_detach( sess );
+        g_panes[ p ].sess = NULL;
+    }
+    if ( sess == g_rec_sess )
+        g_rec_sess = NULL;
+
+    session_free( sess );
+
+    g_session_count--;
+    memmove( &g_sessions[ index ], &g_sessions[ index + 1 ], ( g_session_count - index ) * sizeof( g_sessions[ 0 ] ) );
+
+    // Reap children which were still exiting when their session closed.
+    while ( waitpid( -1, NULL, WNOHANG ) > 0 )
+        ;
+
+    if ( p < 0 || !g_session_count )
+        return;
+
+    // Fill the pane with a session that's out of view, or drop it.
+    for ( i = 0; i < g_session_count; i++ )
+    {
+        if ( pane_find( g_sessions[ i ] ) < 0 )
+        {
+            pane_show( p, g_sessions[ i ] );
+            return;
+        }
+    }
+    pane_remove( p );
+}
+
+// Split the screen with a new pane running a new session.
+static void pane_open()
+{
+    termwin *twin;
+
+    if ( g_pane_count == PANE_MAX )
+    {
+        termwin_set_status( g_twin, "too many panes" );
+        return;
+    }
+
+    twin = termwin_init( NULL );
+    if ( !twin )
+        FATAL_ERROR( termwin_init );
+    termwin_set_focus( twin, 0 );
+
+    g_panes[ g_pane_count ].twin = twin;
+    g_panes[ g_pane_count ].sess = NULL;
+    g_pane_count++;
+
+    pane_layout();
+    pane_focus( g_pane_count - 1 );
+
+    if ( session_open() )
+        pane_remove( g_pane_count - 1 );
+}
+
+// Close the focused pane. Its session keeps running out of view.
+static void pane_close()
+{
+    if ( g_pane_count == 1 )
+    {
+        termwin_set_status( g_twin, "only one pane" );
+        return;
+    }
+
+    input_flush();
+    search_stop();
+    session_detach( g_sess );
+    pane_remove( g_pane );
+}
+
+// Index of the attached session.
+static int session_current()
+{
+    int i;
+
+    for ( i = 0; i < g_session_count && g_sessions[ i ] != g_sess; i++ )
+        ;
+    return i;
+}
+
+// Handle cvterm command keys. Returns 0 if ch should go to the child.
+static int handle_key( int ch )
+{
+    switch ( g_input.mode )
+    {
+    case INPUT_CHILD:
+        // Clear any leftover message from the last search.
+        termwin_set_status( g_twin, NULL );
+
+        if ( ch == CMD_PREFIX_KEY )
+        {
+            g_input.mode = INPUT_PREFIX;
+            return 1;
+        }
+        if ( ch == VKEY_SHIFT_PAGEUP || ch == VKEY_WHEELUP )
+        {
+            scroll_start();
+            scroll_key( ch );
+            return 1;
+        }
+        // Only get mouse reports when we asked for them.
+        return ( ch == VKEY_MOUSE || ch == VKEY_WHEELDOWN );
+
+    case INPUT_PREFIX:
+        g_input.mode = INPUT_CHILD;
+        if ( ch == 's' )
+        {
+            snapshot_save_screen();
+            return 1;
+        }
+        if ( ch == 'c' )
+        {
+            session_open();
+            return 1;
+        }
+        if ( ch == 'n' || ch == 'p' )
+        {
+            int delta = ( ch == 'n' ) ? 1 : g_session_count - 1;
+
+            session_switch( ( session_current() + delta ) % g_session_count );
+            return 1;
+        }
+        if ( ch >= '1' && ch <= '9' )
+        {
+            if ( ch - '1' < g_session_count )
+                session_switch( ch - '1' );
             else
-                FATAL_ERROR( read );
+                session_show_list();
+            return 1;
+        }
+        if ( ch == 'w' )
+        {
+            session_show_list();
+            return 1;
+        }
+        if ( ch == '|' )
+        {
+            pane_open();
+            return 1;
+        }
+        if ( ch == 'o' )
+        {
+            pane_focus( ( g_pane + 1 ) % g_pane_count );
+            return 1;
+        }
+        if ( ch == 'x' )
+        {
+            pane_close();
+            return 1;
+        }
+        if ( ch == '/' || ch == '?' )
+        {
+            search_stop();
+            g_input.mode = INPUT_PROMPT;
+            g_input.flags = ( ch == '?' ) ? SEARCH_REGEX : 0;
+            g_input.pattern_len = 0;
+            g_input.pattern[ 0 ] = 0;
+            search_set_status( NULL );
+            return 1;
+        }
+        if ( ch == '[' || ch == VKEY_PAGEUP || ch == VKEY_SHIFT_PAGEUP )
+        {
+            scroll_start();
+            scroll_key( ( ch == '[' ) ? VKEY_UP : ch );
+            return 1;
+        }
+
+        scroll_stop();
+
+        // Prefix key twice sends it through.
+        return ( ch != CMD_PREFIX_KEY );
+
+    case INPUT_PROMPT:
+        if ( ch == '\r' || ch == '\n' )
+        {
+            search_run();
+        }
+        else if ( ch == KEY_ESCAPE )
+        {
+            search_stop();
+        }
+        else if ( ch == 0x7f || ch == '\b' )
+        {
+            // Drop the last UTF-8 char.
+            while ( g_input.pattern_len && ( g_input.pattern[ g_input.pattern_len - 1 ] & 0xc0 ) == 0x80 )
+                g_input.pattern_len--;
+            if ( g_input.pattern_len )
+                g_input.pattern_len--;
+            g_input.pattern[ g_input.pattern_len ] = 0;
+            search_set_status( NULL );
         }
+        else if ( ch >= 0x20 && ch <= 0xff && g_input.pattern_len + 1 < sizeof( g_input.pattern ) )
+        {
+            g_input.pattern[ g_input.pattern_len++ ] = ( char )ch;
+            g_input.pattern[ g_input.pattern_len ] = 0;
+            search_set_status( NULL );
+        }
+        return 1;
 
-        vterm_input_write( vt, buf, bytes_read );
+    case INPUT_SEARCH:
+        if ( ch == 'n' )
+            search_next( 1 );
+        else if ( ch == 'N' )
+            search_next( 0 );
+        else if ( ch == KEY_ESCAPE || ch == 'q' )
+            search_stop();
+        else if ( ch == CMD_PREFIX_KEY )
+        {
+            search_stop();
+            g_input.mode = INPUT_PREFIX;
+        }
+        else if ( !scroll_key( ch ) && ch != VKEY_MOUSE )
+        {
+            search_stop();
+            return 0;
+        }
+        return 1;
+
+    case INPUT_SCROLL:
+        if ( ch == KEY_ESCAPE || ch == 'q' )
+            scroll_stop();
+        else if ( ch == CMD_PREFIX_KEY )
+            g_input.mode = INPUT_PREFIX;
+        else if ( !scroll_key( ch ) && ch != VKEY_MOUSE )
+        {
+            // Typing goes back to the live screen.
+            scroll_stop();
+            return 0;
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+// Read the rest of an escape sequence after ESC. Returns its length.
+static int read_key_seq( char *seq, int size )
+{
+    int len = 1;
+
+    seq[ 0 ] = KEY_ESCAPE;
+    while ( len < size )
+    {
+        int ch = termwin_getch( g_twin );
+        if ( ch == -1 )
+            break;
+
+        seq[ len++ ] = ( char )ch;
+
+        if ( len == 2 && ch != '[' && ch != 'O' )
+            break; // Alt+key
+        if ( len == 3 && seq[ 1 ] == 'O' )
+            break; // SS3
+        if ( len >= 3 && seq[ 1 ] == '[' )
+        {
+            // X10 mouse reports have three bytes after ESC [ M.
+            if ( seq[ 2 ] == 'M' ? ( len == 6 ) : ( ch >= 0x40 && ch <= 0x7e ) )
+                break;
+        }
     }
+    return len;
 }
 
-static void main_loop( VTerm *vt, int master )
+// Returns VKEY_* for an escape sequence, or 0.
+static int key_seq_lookup( const char *seq, int len )
+{
+    size_t i;
+
+    if ( len == 6 && !memcmp( seq, "\033[M", 3 ) )
+    {
+        int button = ( unsigned char )seq[ 3 ] - 32;
+
+        if ( button & 64 )
+            return ( button & 1 ) ? VKEY_WHEELDOWN : VKEY_WHEELUP;
+        return VKEY_MOUSE;
+    }
+
+    for ( i = 0; i < sizeof( g_key_seqs ) / sizeof( g_key_seqs[ 0 ] ); i++ )
+    {
+        if ( strlen( g_key_seqs[ i ].seq ) == ( size_t )len && !memcmp( g_key_seqs[ i ].seq, seq, len ) )
+            return g_key_seqs[ i ].key;
+    }
+    return 0;
+}
+
+static void handle_input()
+{
+    // Keys can switch sessions, so g_vterm is looked up each time around.
+    while ( vterm_output_get_buffer_remaining( g_vterm ) > 0 )
+    {
+        int i;
+        int key;
+        int len = 1;
+        char seq[ KEY_SEQ_MAX ];
+        int ch = termwin_getch( g_twin );
+        if ( ch == -1 )
+            break;
+
+        key = ch;
+        seq[ 0 ] = ( char )ch;
+        if ( ch == KEY_ESCAPE )
+        {
+            len = read_key_seq( seq, sizeof( seq ) );
+            if ( len > 1 )
+                key = key_seq_lookup( seq, len );
+        }
+
+        if ( key && handle_key( key ) )
+            continue;
+
+        // Sequences we don't know only go to the child outside command modes.
+        if ( !key && g_input.mode != INPUT_CHILD )
+            continue;
+
+        for ( i = 0; i < len; i++ )
+            vterm_keyboard_unichar( g_vterm, ( unsigned char )seq[ i ], VTERM_MOD_NONE );
+    }
+
+    input_flush();
+}
+
+// Add a keyframe so replays can seek to here.
+static void record_screen()
+{
+    size_t len;
+    uint8_t *data;
+    // Modes and colors come from termwin, which only knows sessions in panes.
+    int p = pane_find( g_rec_sess );
+    snapshot *snap = snapshot_capture( session_get_vterm( g_rec_sess ), ( p >= 0 ) ? g_panes[ p ].twin : NULL );
+
+    data = snapshot_encode( snap, &len );
+    record_keyframe( g_rec, data, len );
+
+    free( data );
+    snapshot_free( snap );
+}
+
+static void main_loop()
 {
     struct sigaction winch_sigaction;
 
@@ -166,19 +1015,34 @@ static void main_loop( VTerm *vt, int master )
     if ( sigaction( SIGWINCH, &winch_sigaction, &g_winch_sigaction_old ) )
         FATAL_ERROR( sigaction );
 
-    for ( ;; )
+    while ( g_session_count )
     {
+        int i;
         int ret;
         fd_set fds;
+        int maxfd = STDIN_FILENO;
+        termwin *twins[ PANE_MAX ];
         // Update every 20ms.
         struct timeval timeout = { 0, 20000 };
 
         FD_ZERO( &fds );
         FD_SET( STDIN_FILENO, &fds );
-        FD_SET( master, &fds );
+        FD_SET( session_pool_get_fd( g_pool ), &fds );
+        maxfd = MAX( maxfd, session_pool_get_fd( g_pool ) );
+        for ( i = 0; i < g_session_count; i++ )
+        {
+            int fd = session_get_fd( g_sessions[ i ] );
+
+            // Workers have these until they say they're done.
+            if ( session_busy( g_sessions[ i ] ) )
+                continue;
+
+            FD_SET( fd, &fds );
+            maxfd = MAX( maxfd, fd );
+        }
 
         sigwinch( SIG_UNBLOCK );
-        ret = select( master + 1, &fds, NULL, NULL, &timeout );
+        ret = select( maxfd + 1, &fds, NULL, NULL, &timeout );
         sigwinch( SIG_BLOCK );
 
         if ( ret == -1 )
@@ -189,18 +1053,37 @@ static void main_loop( VTerm *vt, int master )
             FATAL_ERROR( select );
         }
 
-        if ( FD_ISSET( master, &fds ) )
+        if ( FD_ISSET( session_pool_get_fd( g_pool ), &fds ) )
+            session_pool_reap( g_pool );
+
+        // Detached sessions keep parsing on the pool so they're current when
+        // switched to; sessions in panes are read here and drawn.
+        // Backwards so closing one doesn't move those still to check.
+        for ( i = g_session_count - 1; i >= 0; i-- )
         {
-            if ( handle_output( vt, master ) )
-                return;
+            session *sess = g_sessions[ i ];
+
+            if ( session_exited( sess ) )
+                session_close( i );
+            else if ( !session_busy( sess ) && FD_ISSET( session_get_fd( sess ), &fds ) &&
+                      session_pool_submit( g_pool, sess ) && session_read( sess ) )
+                session_close( i );
         }
+        if ( !g_session_count )
+            return;
 
         if ( FD_ISSET( STDIN_FILENO, &fds ) )
         {
-            handle_input( vt, master );
+            handle_input();
         }
 
-        termwin_refresh( g_twin );
+        if ( g_rec && g_rec_sess && record_keyframe_due( g_rec ) )
+            record_screen();
+
+        // One terminal update for every pane which changed.
+        for ( i = 0; i < g_pane_count; i++ )
+            twins[ i ] = g_panes[ i ].twin;
+        termwin_refresh_all( twins, g_pane_count );
     }
 }
 
@@ -209,13 +1092,28 @@ static void cvterm_shutdown()
     if ( _clog_loggers[ 0 ] )
         clog_debug( CLOG( 0 ), "atexit function called." );
 
-    if ( g_vterm )
-    {
-        vterm_free( g_vterm );
-        g_vterm = NULL;
-    }
+    while ( g_session_count )
+        session_free( g_sessions[ --g_session_count ] );
+    session_pool_free( g_pool );
+    g_pool = NULL;
+    pty_pool_free( g_session_cfg.ptys );
+    g_session_cfg.ptys = NULL;
+    g_sess = NULL;
+    g_vterm = NULL;
+    g_sb = NULL;
+    g_rec_sess = NULL;
 
-    termwin_free( g_twin );
+    search_free( g_input.s );
+    g_input.s = NULL;
+
+    // Flushes the rest of the recording.
+    record_free( g_rec );
+    g_rec = NULL;
+
+    mouse_report( 0 );
+
+    while ( g_pane_count )
+        termwin_free( g_panes[ --g_pane_count ].twin );
     g_twin = NULL;
 
     clog_free( 0 );
@@ -228,8 +1126,17 @@ static void opts_print( cvterm_opts *opts )
     printf( "Options:\n" );
     printf( "  TERM: %s\n", opts->env_term );
     printf( "  NCTERM: %s\n", opts->nc_term );
-    printf( "  logfile: %s\n", opts->logfile );
+    printf( "  logfile: %s%s\n", opts->logfile, opts->binlog ? " (binary)" : "" );
     printf( "  wait_for_debugger: %d\n", opts->wait_for_debugger );
+    printf( "  scrollback: %zu lines, %zu MB\n", opts->scrollback_lines, opts->scrollback_mb );
+    printf( "  scrollback_dir: %s\n", opts->scrollback_dir );
+    printf( "  mouse: %d\n", opts->mouse );
+    printf( "  record: %s\n", opts->record_file );
+    printf( "  replay: %s%s, from %.1fs\n", opts->replay_file, opts->replay_realtime ? " (realtime)" : "", opts->replay_seek );
+    printf( "  snapshot: %s\n", opts->snapshot_file );
+    printf( "  restore: %s\n", opts->restore_file );
+    printf( "  parse threads: %d\n", opts->parse_threads );
+    printf( "  socket: %s%s\n", opts->socket_path, opts->server ? " (server)" : opts->attach ? " (attach)" : "" );
 
     printf( "  cmd: " );
     for ( i = 0; i < opts->argc; i++ )
@@ -243,11 +1150,65 @@ static void opts_usage( cvterm_opts *opts, int argc, char *argv[] )
 
     printf( "  -w --wait_for_debugger     Wait for debugger to attach.\n" );
     printf( "  -l --logfile FILE          Set logfile name.\n" );
+    printf( "     --binlog                Write the log as binary records for cvterm_logdecode.\n" );
+    printf( "  -s --scrollback LINES      Lines of scrollback to keep (0: none, or unlimited).\n" );
+    printf( "     --scrollback_mb MB      Limit scrollback size (0: no limit).\n" );
+    printf( "     --scrollback_spill      Spill old scrollback to ~/.cache/cvterm.\n" );
+    printf( "     --scrollback_dir DIR    Spill old scrollback to DIR.\n" );
+    printf( "  -m --mouse                 Scroll back with the mouse wheel.\n" );
+    printf( "  -r --record FILE           Record the session to FILE.\n" );
+    printf( "     --to_asciicast FILE     Write recording FILE to stdout as asciicast v2.\n" );
+    printf( "     --replay FILE           Draw recording FILE as fast as possible and print timings.\n" );
+    printf( "     --replay_realtime       Replay with the recording's original timing.\n" );
+    printf( "     --replay_seek SECONDS   Start the replay SECONDS into the recording.\n" );
+    printf( "     --snapshot FILE         Where Ctrl+] s saves the screen (~/.cache/cvterm/snapshot).\n" );
+    printf( "     --restore FILE          Start with the screen from snapshot FILE.\n" );
+    printf( "     --parse_threads N       Threads parsing sessions not on screen (0: one per core).\n" );
+    printf( "     --server                Run CMD in the background for --attach to show.\n" );
+    printf( "     --attach                Show the sessions of a --server. Ctrl+] d detaches.\n" );
+    printf( "     --socket PATH           Server socket (~/.cache/cvterm/server.sock).\n" );
     printf( "  -h --help                  Show this help.\n" );
 
+    printf( "\nKeys:\n" );
+    printf( "  Ctrl+] /                   Search scrollback (lower case ignores case).\n" );
+    printf( "  Ctrl+] ?                   Search scrollback with an extended regex.\n" );
+    printf( "  n N                        While searching: older / newer match. Esc ends.\n" );
+    printf( "  Shift+PgUp, Ctrl+] [       Scroll back. PgUp/PgDn, k/j, u/d, g/G move, q ends.\n" );
+    printf( "  Ctrl+] s                   Save a snapshot of the screen.\n" );
+    printf( "  Ctrl+] c                   Start another session.\n" );
+    printf( "  Ctrl+] n p 1-9             Next / previous / numbered session.\n" );
+    printf( "  Ctrl+] w                   List sessions (* has new output).\n" );
+    printf( "  Ctrl+] |                   Split off a pane with a new session.\n" );
+    printf( "  Ctrl+] o                   Focus the next pane.\n" );
+    printf( "  Ctrl+] x                   Close the pane, leaving its session running.\n" );
+    printf( "  Ctrl+] Ctrl+]              Send Ctrl+] to the program.\n" );
+
     exit( 1 );
 }
 
+static size_t opts_parse_lines( const char *arg )
+{
+    if ( !strcmp( arg, "unlimited" ) )
+        return SIZE_MAX;
+
+    return strtoul( arg, NULL, 10 );
+}
+
+// $XDG_CACHE_HOME/cvterm or ~/.cache/cvterm.
+static const char *opts_cache_dir()
+{
+    static char s_dir[ PATH_MAX ];
+    const char *env_cache = getenv( "XDG_CACHE_HOME" );
+    const char *env_home = getenv( "HOME" );
+
+    if ( env_cache && env_cache[ 0 ] )
+        snprintf( s_dir, sizeof( s_dir ), "%s/cvterm", env_cache );
+    else
+        snprintf( s_dir, sizeof( s_dir ), "%s/.cache/cvterm", env_home ? env_home : "/tmp" );
+
+    return s_dir;
+}
+
 static int opts_parse_args( cvterm_opts *opts, int argc, char **argv )
 {
     static const struct option long_options[] =
@@ -255,6 +1216,23 @@ static int opts_parse_args( cvterm_opts *opts, int argc, char **argv )
           { "help", ya_no_argument, 0, 0 },
           { "wait_for_debugger", ya_no_argument, 0, 0 },
           { "logfile", ya_required_argument, 0, 0 },
+          { "binlog", ya_no_argument, 0, 0 },
+          { "scrollback", ya_required_argument, 0, 0 },
+          { "scrollback_mb", ya_required_argument, 0, 0 },
+          { "scrollback_spill", ya_no_argument, 0, 0 },
+          { "scrollback_dir", ya_required_argument, 0, 0 },
+          { "mouse", ya_no_argument, 0, 0 },
+          { "record", ya_required_argument, 0, 0 },
+          { "to_asciicast", ya_required_argument, 0, 0 },
+          { "replay", ya_required_argument, 0, 0 },
+          { "replay_realtime", ya_no_argument, 0, 0 },
+          { "replay_seek", ya_required_argument, 0, 0 },
+          { "snapshot", ya_required_argument, 0, 0 },
+          { "restore", ya_required_argument, 0, 0 },
+          { "parse_threads", ya_required_argument, 0, 0 },
+          { "server", ya_no_argument, 0, 0 },
+          { "attach", ya_no_argument, 0, 0 },
+          { "socket", ya_required_argument, 0, 0 },
           { 0, 0, 0, 0 }
         };
     const char *env_shell = getenv( "SHELL" );
@@ -264,7 +1242,23 @@ static int opts_parse_args( cvterm_opts *opts, int argc, char **argv )
     opts->env_term = env_term;
     opts->nc_term = env_ncterm ? env_ncterm : env_term;
     opts->logfile = "cvterm.log";
+    opts->binlog = 0;
     opts->wait_for_debugger = 0;
+    opts->scrollback_lines = 10000;
+    opts->scrollback_mb = 0;
+    opts->scrollback_dir = NULL;
+    opts->mouse = 0;
+    opts->record_file = NULL;
+    opts->to_asciicast = NULL;
+    opts->replay_file = NULL;
+    opts->replay_realtime = 0;
+    opts->replay_seek = 0;
+    opts->snapshot_file = NULL;
+    opts->restore_file = NULL;
+    opts->server = 0;
+    opts->attach = 0;
+    opts->socket_path = NULL;
+    opts->parse_threads = 0;
 
     opts->argv_buf[ 0 ] = env_shell ? env_shell : "/bin/sh";
     opts->argv_buf[ 1 ] = NULL;
@@ -274,7 +1268,7 @@ static int opts_parse_args( cvterm_opts *opts, int argc, char **argv )
     for ( ;; )
     {
         int option_index = 0;
-        int c = ya_getopt_long( argc, argv, "l:wh?", long_options, &option_index );
+        int c = ya_getopt_long( argc, argv, "l:s:r:mwh?", long_options, &option_index );
         if ( c == -1 )
             break;
 
@@ -287,6 +1281,40 @@ static int opts_parse_args( cvterm_opts *opts, int argc, char **argv )
                 opts->wait_for_debugger = 1;
             else if ( !strcmp( long_options[ option_index ].name, "logfile" ) )
                 opts->logfile = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "binlog" ) )
+                opts->binlog = 1;
+            else if ( !strcmp( long_options[ option_index ].name, "scrollback" ) )
+                opts->scrollback_lines = opts_parse_lines( ya_optarg );
+            else if ( !strcmp( long_options[ option_index ].name, "scrollback_mb" ) )
+                opts->scrollback_mb = strtoul( ya_optarg, NULL, 10 );
+            else if ( !strcmp( long_options[ option_index ].name, "scrollback_spill" ) )
+                opts->scrollback_dir = opts_cache_dir();
+            else if ( !strcmp( long_options[ option_index ].name, "scrollback_dir" ) )
+                opts->scrollback_dir = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "mouse" ) )
+                opts->mouse = 1;
+            else if ( !strcmp( long_options[ option_index ].name, "record" ) )
+                opts->record_file = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "to_asciicast" ) )
+                opts->to_asciicast = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "replay" ) )
+                opts->replay_file = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "replay_realtime" ) )
+                opts->replay_realtime = 1;
+            else if ( !strcmp( long_options[ option_index ].name, "replay_seek" ) )
+                opts->replay_seek = MAX( 0.0, strtod( ya_optarg, NULL ) );
+            else if ( !strcmp( long_options[ option_index ].name, "snapshot" ) )
+                opts->snapshot_file = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "restore" ) )
+                opts->restore_file = ya_optarg;
+            else if ( !strcmp( long_options[ option_index ].name, "parse_threads" ) )
+                opts->parse_threads = atoi( ya_optarg );
+            else if ( !strcmp( long_options[ option_index ].name, "server" ) )
+                opts->server = 1;
+            else if ( !strcmp( long_options[ option_index ].name, "attach" ) )
+                opts->attach = 1;
+            else if ( !strcmp( long_options[ option_index ].name, "socket" ) )
+                opts->socket_path = ya_optarg;
             else
             {
                 fprintf( stderr, "ERROR: Unhandled option '--%s'.\n",
@@ -299,10 +1327,22 @@ static int opts_parse_args( cvterm_opts *opts, int argc, char **argv )
             opts->logfile = ya_optarg;
             break;
 
+        case 's':
+            opts->scrollback_lines = opts_parse_lines( ya_optarg );
+            break;
+
         case 'w':
             opts->wait_for_debugger = 1;
             break;
 
+        case 'm':
+            opts->mouse = 1;
+            break;
+
+        case 'r':
+            opts->record_file = ya_optarg;
+            break;
+
         case 'h':
         case '?':
             return -1;
@@ -322,6 +1362,22 @@ static int opts_parse_args( cvterm_opts *opts, int argc, char **argv )
     if ( !opts->logfile || !opts->logfile[ 0 ] )
         opts->logfile = "/dev/null";
 
+    if ( !opts->snapshot_file )
+    {
+        static char s_snapshot_file[ PATH_MAX ];
+
+        snprintf( s_snapshot_file, sizeof( s_snapshot_file ), "%s/snapshot", opts_cache_dir() );
+        opts->snapshot_file = s_snapshot_file;
+    }
+
+    if ( !opts->socket_path )
+    {
+        static char s_socket_path[ PATH_MAX ];
+
+        snprintf( s_socket_path, sizeof( s_socket_path ), "%s/server.sock", opts_cache_dir() );
+        opts->socket_path = s_socket_path;
+    }
+
     return 0;
 }
 
@@ -335,13 +1391,22 @@ static int opts_init( cvterm_opts *opts, int argc, char *argv[] )
         opts_usage( opts, argc, argv );
         return 1;
     }
-    opts_print( opts );
+    // Conversions write to stdout.
+    if ( !opts->to_asciicast )
+        opts_print( opts );
 
     // Initialize logging.
-    clog_init_path( 0, opts->logfile );
-    clog_set_fmt( 0, "%m" );
-    clog_info( CLOG( 0 ), "\n" );
-    clog_set_fmt( 0, "%d %d: %m\n" );
+    if ( opts->binlog )
+    {
+        clog_init_binary( 0, opts->logfile );
+    }
+    else
+    {
+        clog_init_path( 0, opts->logfile );
+        clog_set_fmt( 0, "%m" );
+        clog_info( CLOG( 0 ), "\n" );
+        clog_set_fmt( 0, "%d %d: %m\n" );
+    }
     clog_info( CLOG( 0 ), "Starting %s...", argv[ 0 ] );
     clog_set_fmt( 0, "%f(%F:%n): %l: %m\n" );
 
@@ -351,6 +1416,107 @@ static int opts_init( cvterm_opts *opts, int argc, char *argv[] )
     return 0;
 }
 
+// Draw a recording instead of running a program.
+static int replay_main( cvterm_opts *opts, int rows, int cols )
+{
+    int ret;
+    replay_stats stats;
+    VTerm *vt = vterm_new( rows, cols );
+    VTermScreen *vtscreen = vterm_obtain_screen( vt );
+
+    vterm_set_utf8( vt, 1 );
+    termwin_setvterm( g_twin, vt );
+
+    if ( opts->scrollback_lines )
+    {
+        size_t max_lines = ( opts->scrollback_lines == SIZE_MAX ) ? 0 : opts->scrollback_lines;
+
+        g_sb = scrollback_create( max_lines, opts->scrollback_mb * 1024 * 1024 );
+        scrollback_set_width( g_sb, cols );
+        termwin_setscrollback( g_twin, g_sb );
+    }
+
+    vterm_screen_enable_altscreen( vtscreen, 1 );
+    vterm_screen_reset( vtscreen, 1 );
+    vterm_screen_set_callbacks( vtscreen, &g_screen_cbs, g_twin );
+
+    ret = replay_run( opts->replay_file, vt, g_twin, g_sb, opts->replay_realtime,
+                      ( uint64_t )( opts->replay_seek * 1000000 ), &stats );
+
+    // Results go to the normal terminal.
+    termwin_free( g_twin );
+    g_twin = NULL;
+
+    vterm_free( vt );
+    scrollback_free( g_sb );
+    g_sb = NULL;
+
+    if ( !ret )
+        replay_print_stats( &stats );
+    else if ( ret == -2 )
+        fprintf( stderr, "%s ends before %.1fs\n", opts->replay_file, opts->replay_seek );
+    else
+        fprintf( stderr, "Unable to replay %s\n", opts->replay_file );
+    return ret ? 1 : 0;
+}
+
+// Start a server in the background and return.
+static int server_main( cvterm_opts *opts )
+{
+    int fd;
+    pid_t pid;
+    struct termios child_termios;
+    int have_termios = !tcgetattr( STDIN_FILENO, &child_termios );
+
+    mkdir_p( opts_cache_dir(), 0700 );
+    fd = ipc_listen( opts->socket_path );
+    if ( fd < 0 )
+    {
+        if ( errno == EADDRINUSE )
+            fprintf( stderr, "A server is already running on %s\n", opts->socket_path );
+        else
+            fprintf( stderr, "Unable to listen on %s\n", opts->socket_path );
+        return 1;
+    }
+
+    pid = fork();
+    if ( pid < 0 )
+        FATAL_ERROR( fork );
+    if ( pid > 0 )
+    {
+        printf( "Server %d listening on %s\n", pid, opts->socket_path );
+        close( fd );
+        return 0;
+    }
+
+    // Leave the terminal we were started from.
+    if ( setsid() < 0 )
+        FATAL_ERROR( setsid );
+    freopen( "/dev/null", "r", stdin );
+    freopen( "/dev/null", "w", stdout );
+    freopen( "/dev/null", "w", stderr );
+
+    // The writer thread doesn't survive fork, so start it in the server.
+    clog_set_async( 0, CLOG_ASYNC_RECORDS );
+
+    g_session_cfg.argv = opts->argv;
+    g_session_cfg.env_term = opts->env_term;
+    g_session_cfg.termios = have_termios ? &child_termios : NULL;
+    g_session_cfg.scrollback_lines = opts->scrollback_lines;
+    g_session_cfg.scrollback_bytes = opts->scrollback_mb * 1024 * 1024;
+    g_session_cfg.scrollback_dir = opts->scrollback_dir;
+    g_session_cfg.scrollback_spill_ram = SCROLLBACK_SPILL_RAM_BYTES;
+    g_session_cfg.ptys = pty_pool_create( PTY_POOL_SPARES, g_session_cfg.termios );
+
+    if ( server_run( fd, &g_session_cfg, opts->parse_threads ) )
+        clog_error( CLOG( 0 ), "Unable to start %s", opts->argv[ 0 ] );
+    unlink( opts->socket_path );
+    pty_pool_free( g_session_cfg.ptys );
+
+    clog_free( 0 );
+    return 0;
+}
+
 int main( int argc, char *argv[] )
 {
     cvterm_opts opts;
@@ -362,6 +1528,31 @@ int main( int argc, char *argv[] )
     if ( opts_init( &opts, argc, argv ) )
         return 1;
 
+    if ( opts.to_asciicast )
+    {
+        int ret = record_to_asciicast( opts.to_asciicast, stdout );
+
+        clog_free( 0 );
+        return ret ? 1 : 0;
+    }
+
+    if ( opts.server )
+        return server_main( &opts );
+
+    // Write the log from a background thread so the input and draw loop
+    // never waits on the log file.
+    clog_set_async( 0, CLOG_ASYNC_RECORDS );
+
+    if ( opts.attach )
+    {
+        int ret = client_run( opts.socket_path, opts.nc_term );
+
+        if ( ret )
+            fprintf( stderr, "No server on %s\n", opts.socket_path );
+        clog_free( 0 );
+        return ret ? 1 : 0;
+    }
+
     // Call cvterm_shutdown on exit.
     atexit( cvterm_shutdown );
 
@@ -377,50 +1568,64 @@ int main( int argc, char *argv[] )
         FATAL_ERROR( termwin_init );
     termwin_getsize( g_twin, &rows, &cols );
 
-    // Create our vterm object.
-    g_vterm = vterm_new( rows, cols );
-    vterm_set_utf8( g_vterm, 1 );
+    g_input.mouse = opts.mouse;
+    mouse_report( opts.mouse );
 
-    termwin_setvterm( g_twin, g_vterm );
+    if ( opts.replay_file )
+        return replay_main( &opts, rows, cols );
 
-    // Initialize vterm screen.
-    VTermScreen *vtscreen = vterm_obtain_screen( g_vterm );
-    vterm_screen_enable_altscreen( vtscreen, 1 );
-    vterm_screen_reset( vtscreen, 1 );
-    vterm_screen_set_callbacks( vtscreen, &g_screen_cbs, g_twin );
+    g_panes[ 0 ].twin = g_twin;
+    g_panes[ 0 ].sess = NULL;
+    g_pane_count = 1;
 
-    {
-        char slavename[ 128 ];
-        const struct winsize size = { rows, cols, 0, 0 };
+    g_session_cfg.argv = opts.argv;
+    g_session_cfg.env_term = opts.env_term;
+    g_session_cfg.termios = &child_termios;
+    g_session_cfg.scrollback_lines = opts.scrollback_lines;
+    g_session_cfg.scrollback_bytes = opts.scrollback_mb * 1024 * 1024;
+    g_session_cfg.scrollback_dir = opts.scrollback_dir;
+    g_session_cfg.scrollback_spill_ram = SCROLLBACK_SPILL_RAM_BYTES;
+    g_session_cfg.ptys = pty_pool_create( PTY_POOL_SPARES, &child_termios );
 
-        pid_t child = pty_fork( &g_master_pty, slavename, sizeof( slavename ), &child_termios, &size );
-        clog_info( CLOG( 0 ), "pty_fork child:%d slavename:%s", child, slavename );
+    g_pool = session_pool_create( opts.parse_threads );
 
-        if ( child == 0 )
-        {
-            if ( opts.env_term )
-            {
-                if ( setenv( "TERM", opts.env_term, 1 ) )
-                    FATAL_ERROR( setenv );
-            }
-            else
-            {
-                if ( unsetenv( "TERM" ) )
-                    FATAL_ERROR( unsetenv );
-            }
+    if ( session_open() )
+        FATAL_ERROR( session_open );
+    termwin_set_status( g_twin, NULL );
 
-            sigwinch( SIG_UNBLOCK );
+    g_input.snapshot_file = opts.snapshot_file;
+    if ( opts.restore_file )
+    {
+        snapshot *snap = snapshot_load( opts.restore_file );
 
-            execvp( opts.argv[ 0 ], ( char *const * )opts.argv );
-            FATAL_ERROR( execvp );
+        if ( snap )
+        {
+            snapshot_restore( snap, g_vterm, g_twin );
+            snapshot_free( snap );
+        }
+        else
+        {
+            termwin_set_status( g_twin, "unable to restore snapshot" );
         }
     }
 
-    // Make g_master_py non-blocking.
-    if ( fcntl( g_master_pty, F_SETFL, fcntl( g_master_pty, F_GETFL ) | O_NONBLOCK ) < 0 )
-        FATAL_ERROR( fcntl );
+    // Record the first session. The writer thread starts after its fork.
+    if ( opts.record_file )
+    {
+        g_rec = record_create( opts.record_file, rows, cols );
+        if ( g_rec )
+        {
+            g_rec_sess = g_sess;
+            session_set_record( g_rec_sess, g_rec );
+        }
+        else
+        {
+            clog_error( CLOG( 0 ), "Unable to record to %s", opts.record_file );
+            termwin_set_status( g_twin, "unable to record" );
+        }
+    }
 
-    main_loop( g_vterm, g_master_pty );
+    main_loop();
 
     cvterm_shutdown();
     return 0;
@@ -28,7 +28,10 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 
 #define CLOG_MAIN
 #include "clog.h"
@@ -136,3 +139,86 @@ uint32_t get_ticks()
 
     return ( t.tv_sec - s_t0.tv_sec ) * 1000 + ( t.tv_usec - s_t0.tv_usec ) / 1000;
 }
+
+uint64_t get_time_ns()
+{
+    struct timespec ts;
+
+    if ( clock_gettime( CLOCK_MONOTONIC, &ts ) )
+        FATAL_ERROR( clock_gettime );
+
+    return ( uint64_t )ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64( const void *a, const void *b )
+{
+    uint64_t x = *( const uint64_t * )a;
+    uint64_t y = *( const uint64_t * )b;
+
+    return ( x > y ) - ( x < y );
+}
+
+uint64_t percentile_u64( uint64_t *vals, size_t count, int pct )
+{
+    if ( !count )
+        return 0;
+
+    qsort( vals, count, sizeof( vals[ 0 ] ), cmp_u64 );
+    return vals[ MIN( count - 1, count * pct / 100 ) ];
+}
+
+// Create directory path and any missing parents. Returns 0 on success.
+int mkdir_p( const char *path, unsigned int mode )
+{
+    char *slash;
+    char buf[ PATH_MAX ];
+
+    if ( snprintf( buf, sizeof( buf ), "%s", path ) >= ( int )sizeof( buf ) )
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    for ( slash = strchr( buf + 1, '/' ); slash; slash = strchr( slash + 1, '/' ) )
+    {
+        *slash = 0;
+        if ( mkdir( buf, mode ) && errno != EEXIST )
+            return -1;
+        *slash = '/';
+    }
+
+    if ( mkdir( buf, mode ) && errno != EEXIST )
+        return -1;
+
+    return 0;
+}
+
+// Encode c as UTF-8 into dst, which needs room for 4 bytes. Returns length.
+size_t utf8_encode( uint8_t *dst, uint32_t c )
+{
+    if ( c < 0x80 )
+    {
+        dst[ 0 ] = c;
+        return 1;
+    }
+    else if ( c < 0x800 )
+    {
+        dst[ 0 ] = 0xc0 | ( c >> 6 );
+        dst[ 1 ] = 0x80 | ( c & 0x3f );
+        return 2;
+    }
+    else if ( c < 0x10000 )
+    {
+        dst[ 0 ] = 0xe0 | ( c >> 12 );
+        dst[ 1 ] = 0x80 | ( ( c >> 6 ) & 0x3f );
+        dst[ 2 ] = 0x80 | ( c & 0x3f );
+        return 3;
+    }
+
+    c = MIN( c, 0x10ffff );
+    dst[ 0 ] = 0xf0 | ( c >> 18 );
+    dst[ 1 ] = 0x80 | ( ( c >> 12 ) & 0x3f );
+    dst[ 2 ] = 0x80 | ( ( c >> 6 ) & 0x3f );
+    dst[ 3 ] = 0x80 | ( c & 0x3f );
+    return 4;
+}
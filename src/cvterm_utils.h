@@ -49,11 +49,26 @@ __inline__ void __debugbreak()
     do                                                           \
     {                                                            \
         clog_error( CLOG( 0 ), "%s failed: %d", #_func, errno ); \
+        clog_flush( 0 );                                         \
         if ( is_debugger_attached() )                            \
             __debugbreak();                                      \
         exit( -1 );                                              \
     } while ( 0 )
 
+#define NCURSES_CHECK( _ret, _func, ... )                            \
+    do                                                               \
+    {                                                                \
+        _ret = _func( __VA_ARGS__ );                                 \
+        if ( _ret == ERR )                                           \
+        {                                                            \
+            clog_error( CLOG( 0 ), "%s failed: %d", #_func, errno ); \
+            clog_flush( 0 );                                         \
+            if ( is_debugger_attached() )                            \
+                __debugbreak();                                      \
+            exit( -1 );                                              \
+        }                                                            \
+    } while ( 0 )
+
 int is_debugger_attached();
 void wait_for_debugger();
 
@@ -62,4 +77,16 @@ uint32_t sqrt_uint32( uint32_t a_nInput );
 // Get number of milliseconds since app started up
 uint32_t get_ticks();
 
+// Monotonic clock in nanoseconds.
+uint64_t get_time_ns();
+
+// Sort vals and return the pct'th percentile. 0 if count is 0.
+uint64_t percentile_u64( uint64_t *vals, size_t count, int pct );
+
+// Create directory path and any missing parents. Returns 0 on success.
+int mkdir_p( const char *path, unsigned int mode );
+
+// Encode c as UTF-8 into dst, which needs room for 4 bytes. Returns length.
+size_t utf8_encode( uint8_t *dst, uint32_t c );
+
 #endif // _CVTERM_UTILS_H_
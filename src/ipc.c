@@ -0,0 +1,278 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "ipc.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define IPC_HEADER_SIZE 5
+// Anything longer means the stream is out of sync.
+#define IPC_MSG_MAX ( 64 * 1024 * 1024 )
+
+typedef struct ipc_buf
+{
+    uint8_t *data;
+    size_t pos; // Bytes already consumed.
+    size_t len;
+    size_t size;
+} ipc_buf;
+
+struct ipc_conn
+{
+    int fd;
+    ipc_buf in;
+    ipc_buf out;
+};
+
+// Make room for len more bytes, first dropping what's been consumed.
+static void ipc_buf_reserve( ipc_buf *buf, size_t len )
+{
+    if ( buf->pos )
+    {
+        memmove( buf->data, buf->data + buf->pos, buf->len - buf->pos );
+        buf->len -= buf->pos;
+        buf->pos = 0;
+    }
+
+    if ( buf->len + len > buf->size )
+    {
+        buf->size = MAX( buf->len + len, MAX( 4096, buf->size * 2 ) );
+        buf->data = ( uint8_t * )realloc( buf->data, buf->size );
+        if ( !buf->data )
+            FATAL_ERROR( realloc );
+    }
+}
+
+static int ipc_addr( const char *path, struct sockaddr_un *addr )
+{
+    memset( addr, 0, sizeof( *addr ) );
+    addr->sun_family = AF_UNIX;
+
+    if ( strlen( path ) >= sizeof( addr->sun_path ) )
+    {
+        clog_error( CLOG( 0 ), "Socket path too long: %s", path );
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy( addr->sun_path, path );
+    return 0;
+}
+
+int ipc_connect( const char *path )
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    if ( ipc_addr( path, &addr ) )
+        return -1;
+
+    fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( fd < 0 )
+        FATAL_ERROR( socket );
+
+    if ( TEMP_FAILURE_RETRY( connect( fd, ( struct sockaddr * )&addr, sizeof( addr ) ) ) )
+    {
+        int err = errno;
+
+        close( fd );
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+int ipc_listen( const char *path )
+{
+    int fd;
+    mode_t mask;
+    struct sockaddr_un addr;
+
+    if ( ipc_addr( path, &addr ) )
+        return -1;
+
+    // Something answering means a live server.
+    fd = ipc_connect( path );
+    if ( fd >= 0 )
+    {
+        close( fd );
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink( path );
+
+    fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( fd < 0 )
+        FATAL_ERROR( socket );
+
+    // Only we get to type into our sessions.
+    mask = umask( 077 );
+    if ( bind( fd, ( struct sockaddr * )&addr, sizeof( addr ) ) || listen( fd, 4 ) )
+    {
+        int err = errno;
+
+        umask( mask );
+        clog_error( CLOG( 0 ), "Unable to listen on %s: %d", path, err );
+        close( fd );
+        errno = err;
+        return -1;
+    }
+    umask( mask );
+
+    clog_info( CLOG( 0 ), "Listening on %s", path );
+    return fd;
+}
+
+int ipc_accept( int listen_fd )
+{
+    return TEMP_FAILURE_RETRY( accept4( listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) );
+}
+
+ipc_conn *ipc_conn_create( int fd )
+{
+    ipc_conn *conn = ( ipc_conn * )calloc( 1, sizeof( *conn ) );
+
+    if ( !conn )
+        FATAL_ERROR( calloc );
+
+    if ( fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK ) < 0 )
+        FATAL_ERROR( fcntl );
+
+    conn->fd = fd;
+    return conn;
+}
+
+void ipc_conn_free( ipc_conn *conn )
+{
+    if ( conn )
+    {
+        close( conn->fd );
+        free( conn->in.data );
+        free( conn->out.data );
+        free( conn );
+    }
+}
+
+int ipc_conn_get_fd( ipc_conn *conn )
+{
+    return conn->fd;
+}
+
+void ipc_send( ipc_conn *conn, int type, const void *data, size_t len )
+{
+    uint8_t *p;
+    uint32_t len32 = ( uint32_t )len;
+
+    ipc_buf_reserve( &conn->out, IPC_HEADER_SIZE + len );
+
+    p = conn->out.data + conn->out.len;
+    p[ 0 ] = ( uint8_t )type;
+    memcpy( p + 1, &len32, sizeof( len32 ) );
+    if ( len )
+        memcpy( p + IPC_HEADER_SIZE, data, len );
+    conn->out.len += IPC_HEADER_SIZE + len;
+}
+
+int ipc_flush( ipc_conn *conn )
+{
+    ipc_buf *buf = &conn->out;
+
+    while ( buf->pos < buf->len )
+    {
+        // No SIGPIPE if the other side has gone.
+        ssize_t ret = TEMP_FAILURE_RETRY( send( conn->fd, buf->data + buf->pos, buf->len - buf->pos, MSG_NOSIGNAL ) );
+
+        if ( ret < 0 )
+            return ( errno == EAGAIN ) ? 0 : -1;
+
+        buf->pos += ret;
+    }
+
+    buf->pos = 0;
+    buf->len = 0;
+    return 0;
+}
+
+size_t ipc_pending( ipc_conn *conn )
+{
+    return conn->out.len - conn->out.pos;
+}
+
+int ipc_fill( ipc_conn *conn )
+{
+    ipc_buf *buf = &conn->in;
+
+    for ( ;; )
+    {
+        ssize_t ret;
+
+        ipc_buf_reserve( buf, 16384 );
+
+        ret = TEMP_FAILURE_RETRY( read( conn->fd, buf->data + buf->len, buf->size - buf->len ) );
+        if ( !ret )
+            return -1;
+        if ( ret < 0 )
+            return ( errno == EAGAIN ) ? 0 : -1;
+
+        buf->len += ret;
+    }
+}
+
+int ipc_next( ipc_conn *conn, ipc_msg *msg )
+{
+    uint32_t len;
+    ipc_buf *buf = &conn->in;
+    const uint8_t *p = buf->data + buf->pos;
+
+    if ( buf->len - buf->pos < IPC_HEADER_SIZE )
+        return 0;
+
+    memcpy( &len, p + 1, sizeof( len ) );
+    if ( len > IPC_MSG_MAX )
+    {
+        clog_error( CLOG( 0 ), "Message of %u bytes, dropping connection", len );
+        return -1;
+    }
+    if ( buf->len - buf->pos < IPC_HEADER_SIZE + len )
+        return 0;
+
+    msg->type = p[ 0 ];
+    msg->data = p + IPC_HEADER_SIZE;
+    msg->len = len;
+
+    buf->pos += IPC_HEADER_SIZE + len;
+    return 1;
+}
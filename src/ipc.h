@@ -0,0 +1,85 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _IPC_H_
+#define _IPC_H_
+
+// Messages between a cvterm server and an attached client over a Unix socket.
+// Each is a type byte and a 32-bit length followed by the payload. Sockets are
+// non-blocking: sends are queued and written by ipc_flush.
+typedef struct ipc_conn ipc_conn;
+
+enum ipc_type
+{
+    // Client to server.
+    IPC_HELLO = 1, // uint16_t rows, cols. Attach and get a snapshot.
+    IPC_RESIZE,    // uint16_t rows, cols.
+    IPC_INPUT,     // Bytes for the program.
+    IPC_NEW,       // Start another session and show it.
+    IPC_SELECT,    // int32_t count of sessions to move forward.
+
+    // Server to client.
+    IPC_SNAPSHOT, // snapshot_encode of the whole screen.
+    IPC_DIFF,     // snapshot_diff escapes since the last update.
+    IPC_STATUS,   // Text for the status line.
+    IPC_EXIT,     // Text saying why the client is being let go.
+};
+
+typedef struct ipc_msg
+{
+    int type;
+    const uint8_t *data;
+    size_t len;
+} ipc_msg;
+
+// Listen on path. Returns -1 with errno EADDRINUSE if a server is already
+// there; a stale socket left by one which died is replaced.
+int ipc_listen( const char *path );
+// Returns a connected fd, -1 if there's no server.
+int ipc_connect( const char *path );
+// Returns -1 if no connection was waiting.
+int ipc_accept( int listen_fd );
+
+// Takes ownership of fd.
+ipc_conn *ipc_conn_create( int fd );
+void ipc_conn_free( ipc_conn *conn );
+int ipc_conn_get_fd( ipc_conn *conn );
+
+// Queue a message.
+void ipc_send( ipc_conn *conn, int type, const void *data, size_t len );
+// Write as much of the queue as the socket takes. Returns -1 on error.
+int ipc_flush( ipc_conn *conn );
+// Bytes queued and not yet written.
+size_t ipc_pending( ipc_conn *conn );
+
+// Read what has arrived. Returns -1 when the other side has gone.
+int ipc_fill( ipc_conn *conn );
+// Returns 1 and the next whole message read, 0 if there isn't one yet, and
+// -1 if the stream is corrupt. msg is valid until the next ipc_fill.
+int ipc_next( ipc_conn *conn, ipc_msg *msg );
+
+#endif // _IPC_H_
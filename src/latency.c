@@ -0,0 +1,407 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "pseudo.h"
+#include "ya_getopt.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+/*
+    Keystroke to paint latency. cvterm runs on a pty with cat as its child.
+    Each key is written to cvterm's stdin, so it goes through handle_input to
+    the child, is echoed by the child's tty, parsed by vterm and drawn by
+    termwin_refresh. Latency is the time until the key's glyph shows up in
+    what cvterm writes to its terminal.
+*/
+
+#define LATENCY_BUCKETS 24
+#define LATENCY_TIMEOUT_NS ( 1000 * 1000000ULL )
+#define LATENCY_SETTLE_NS ( 300 * 1000000ULL )
+#define LATENCY_MAX_ARGS 64
+
+// Skip escape sequences in cvterm's output so only drawn text is matched.
+enum
+{
+    SCAN_TEXT,
+    SCAN_ESC,
+    SCAN_CSI,
+    SCAN_STRING,     // OSC / DCS, up to BEL or ST.
+    SCAN_STRING_ESC,
+    SCAN_CHARSET,
+};
+
+typedef struct latency_opts
+{
+    const char *cvterm;
+    int keys;
+    int interval_ms;
+    int rows;
+    int cols;
+    int variant_count;
+    const char *variants[ LATENCY_MAX_ARGS ];
+} latency_opts;
+
+typedef struct latency_run
+{
+    int master;
+    int scan;
+    uint64_t *samples;
+    int count;
+    int lost;
+} latency_run;
+
+// Read what's ready and return 1 if key was drawn.
+static int latency_scan( latency_run *run, int key )
+{
+    int found = 0;
+
+    for ( ;; )
+    {
+        ssize_t i;
+        unsigned char buf[ 4096 ];
+        ssize_t len = read( run->master, buf, sizeof( buf ) );
+
+        if ( len <= 0 )
+            return found;
+
+        for ( i = 0; i < len; i++ )
+        {
+            unsigned char c = buf[ i ];
+
+            switch ( run->scan )
+            {
+            case SCAN_TEXT:
+                if ( c == 0x1b )
+                    run->scan = SCAN_ESC;
+                else if ( c == key )
+                    found = 1;
+                break;
+            case SCAN_ESC:
+                if ( c == '[' )
+                    run->scan = SCAN_CSI;
+                else if ( c == ']' || c == 'P' )
+                    run->scan = SCAN_STRING;
+                else if ( c == '(' || c == ')' || c == '*' || c == '+' )
+                    run->scan = SCAN_CHARSET;
+                else
+                    run->scan = SCAN_TEXT;
+                break;
+            case SCAN_CSI:
+                if ( c >= 0x40 && c <= 0x7e )
+                    run->scan = SCAN_TEXT;
+                break;
+            case SCAN_STRING:
+                if ( c == 0x07 )
+                    run->scan = SCAN_TEXT;
+                else if ( c == 0x1b )
+                    run->scan = SCAN_STRING_ESC;
+                break;
+            case SCAN_STRING_ESC:
+                run->scan = ( c == '\\' ) ? SCAN_TEXT : SCAN_STRING;
+                break;
+            case SCAN_CHARSET:
+                run->scan = SCAN_TEXT;
+                break;
+            }
+        }
+    }
+}
+
+// Wait up to timeout ns for key to be drawn. key 0 waits for output to stop.
+static int latency_wait( latency_run *run, int key, uint64_t timeout )
+{
+    uint64_t end = get_time_ns() + timeout;
+
+    for ( ;; )
+    {
+        int ret;
+        struct pollfd pfd = { run->master, POLLIN, 0 };
+        uint64_t now = get_time_ns();
+
+        if ( now >= end )
+            return 0;
+
+        ret = poll( &pfd, 1, ( int )( ( end - now ) / 1000000 ) + 1 );
+        if ( ret < 0 && errno != EINTR )
+            FATAL_ERROR( poll );
+        if ( ret <= 0 )
+        {
+            if ( !key )
+                return 1;
+            continue;
+        }
+        if ( pfd.revents & ( POLLHUP | POLLERR ) && !( pfd.revents & POLLIN ) )
+            return 0;
+
+        if ( latency_scan( run, key ) && key )
+            return 1;
+
+        // Quiet for a while after the last output.
+        if ( !key )
+            end = get_time_ns() + timeout;
+    }
+}
+
+static void latency_write( int fd, const char *buf, size_t len )
+{
+    if ( TEMP_FAILURE_RETRY( write( fd, buf, len ) ) != ( ssize_t )len )
+        FATAL_ERROR( write );
+}
+
+static pid_t latency_spawn( latency_opts *opts, const char *variant, int *master )
+{
+    int argc = 0;
+    char *args = NULL;
+    char slavename[ 128 ];
+    const char *argv[ LATENCY_MAX_ARGS + 8 ];
+    const struct winsize size = { opts->rows, opts->cols, 0, 0 };
+    pid_t pid;
+
+    argv[ argc++ ] = opts->cvterm;
+    argv[ argc++ ] = "--logfile";
+    argv[ argc++ ] = "/dev/null";
+
+    // Variant is extra cvterm options separated by spaces.
+    if ( variant && variant[ 0 ] )
+    {
+        char *tok, *save;
+
+        args = strdup( variant );
+        for ( tok = strtok_r( args, " ", &save ); tok && argc < LATENCY_MAX_ARGS; tok = strtok_r( NULL, " ", &save ) )
+            argv[ argc++ ] = tok;
+    }
+
+    argv[ argc++ ] = "--";
+    argv[ argc++ ] = "cat";
+    argv[ argc ] = NULL;
+
+    pid = pty_fork( master, slavename, sizeof( slavename ), NULL, &size );
+    if ( pid < 0 )
+        FATAL_ERROR( pty_fork );
+
+    if ( pid == 0 )
+    {
+        if ( !getenv( "TERM" ) )
+            setenv( "TERM", "xterm-256color", 1 );
+
+        execv( opts->cvterm, ( char *const * )argv );
+        _exit( 127 );
+    }
+
+    free( args );
+
+    if ( fcntl( *master, F_SETFL, fcntl( *master, F_GETFL ) | O_NONBLOCK ) < 0 )
+        FATAL_ERROR( fcntl );
+
+    return pid;
+}
+
+static void latency_report( const char *variant, latency_run *run )
+{
+    int i;
+    int buckets[ LATENCY_BUCKETS ] = { 0 };
+    int min_bucket = LATENCY_BUCKETS;
+    int max_bucket = 0;
+    int peak = 1;
+
+    // Power of two buckets of microseconds.
+    for ( i = 0; i < run->count; i++ )
+    {
+        int b = 0;
+        uint64_t us = run->samples[ i ] / 1000;
+
+        while ( us > 1 && b < LATENCY_BUCKETS - 1 )
+        {
+            us >>= 1;
+            b++;
+        }
+        buckets[ b ]++;
+        min_bucket = MIN( min_bucket, b );
+        max_bucket = MAX( max_bucket, b );
+        peak = MAX( peak, buckets[ b ] );
+    }
+
+    printf( "variant \"%s\": %d keys, %d lost\n", variant, run->count, run->lost );
+    printf( "  p50 %.1f us  p90 %.1f us  p99 %.1f us  max %.1f us\n",
+            percentile_u64( run->samples, run->count, 50 ) / 1e3,
+            percentile_u64( run->samples, run->count, 90 ) / 1e3,
+            percentile_u64( run->samples, run->count, 99 ) / 1e3,
+            percentile_u64( run->samples, run->count, 100 ) / 1e3 );
+
+    for ( i = min_bucket; i <= max_bucket; i++ )
+    {
+        int bar = buckets[ i ] * 50 / peak;
+
+        printf( "  %8u - %8u us %6d ", i ? 1u << i : 0u, 2u << i, buckets[ i ] );
+        while ( bar-- > 0 )
+            putchar( '#' );
+        putchar( '\n' );
+    }
+    fflush( stdout );
+}
+
+static void latency_measure( latency_opts *opts, const char *variant )
+{
+    int i;
+    int status;
+    latency_run run;
+    pid_t pid;
+
+    memset( &run, 0, sizeof( run ) );
+    run.samples = ( uint64_t * )malloc( opts->keys * sizeof( run.samples[ 0 ] ) );
+    if ( !run.samples )
+        FATAL_ERROR( malloc );
+
+    pid = latency_spawn( opts, variant, &run.master );
+
+    // Let cvterm draw its first screen.
+    latency_wait( &run, 0, LATENCY_SETTLE_NS );
+
+    for ( i = 0; i < opts->keys; i++ )
+    {
+        uint64_t t0;
+        char key = 'A' + ( i % 26 );
+        struct timespec ts = { 0, opts->interval_ms * 1000000L };
+
+        // New line every alphabet so a key's glyph is only drawn once.
+        if ( i && !( i % 26 ) )
+        {
+            latency_write( run.master, "\r", 1 );
+            latency_wait( &run, 0, 50 * 1000000ULL );
+        }
+
+        t0 = get_time_ns();
+        latency_write( run.master, &key, 1 );
+
+        if ( latency_wait( &run, key, LATENCY_TIMEOUT_NS ) )
+            run.samples[ run.count++ ] = get_time_ns() - t0;
+        else
+            run.lost++;
+
+        nanosleep( &ts, NULL );
+    }
+
+    // EOF to cat ends cvterm.
+    latency_write( run.master, "\r\004", 2 );
+    latency_wait( &run, 0, LATENCY_SETTLE_NS );
+    if ( waitpid( pid, &status, WNOHANG ) == 0 )
+    {
+        kill( pid, SIGTERM );
+        waitpid( pid, &status, 0 );
+    }
+    close( run.master );
+
+    latency_report( variant, &run );
+    free( run.samples );
+}
+
+static void latency_usage( const char *argv0 )
+{
+    printf( "%s [options] CVTERM\n\n", argv0 );
+    printf( "  -n --keys N                Keystrokes per variant (default 500).\n" );
+    printf( "  -i --interval MS           Pause between keys (default 10).\n" );
+    printf( "  -v --variant \"OPTIONS\"     Also run with these cvterm options. Repeatable.\n" );
+    printf( "     --rows ROWS             Terminal rows (default 50).\n" );
+    printf( "     --cols COLS             Terminal columns (default 160).\n" );
+    printf( "  -h --help                  Show this help.\n" );
+    exit( 1 );
+}
+
+int main( int argc, char *argv[] )
+{
+    int i;
+    latency_opts opts;
+    static const struct option long_options[] =
+        {
+          { "help", ya_no_argument, 0, 'h' },
+          { "keys", ya_required_argument, 0, 'n' },
+          { "interval", ya_required_argument, 0, 'i' },
+          { "variant", ya_required_argument, 0, 'v' },
+          { "rows", ya_required_argument, 0, 'r' },
+          { "cols", ya_required_argument, 0, 'c' },
+          { 0, 0, 0, 0 }
+        };
+
+    memset( &opts, 0, sizeof( opts ) );
+    opts.keys = 500;
+    opts.interval_ms = 10;
+    opts.rows = 50;
+    opts.cols = 160;
+
+    // The default build of cvterm always runs.
+    opts.variants[ opts.variant_count++ ] = "";
+
+    for ( ;; )
+    {
+        int c = ya_getopt_long( argc, argv, "n:i:v:h?", long_options, NULL );
+        if ( c == -1 )
+            break;
+
+        switch ( c )
+        {
+        case 'n':
+            opts.keys = atoi( ya_optarg );
+            break;
+        case 'i':
+            opts.interval_ms = atoi( ya_optarg );
+            break;
+        case 'v':
+            if ( opts.variant_count < LATENCY_MAX_ARGS )
+                opts.variants[ opts.variant_count++ ] = ya_optarg;
+            break;
+        case 'r':
+            opts.rows = atoi( ya_optarg );
+            break;
+        case 'c':
+            opts.cols = atoi( ya_optarg );
+            break;
+        default:
+            latency_usage( argv[ 0 ] );
+        }
+    }
+
+    if ( ya_optind >= argc || opts.keys <= 0 || opts.interval_ms < 0 )
+        latency_usage( argv[ 0 ] );
+    opts.cvterm = argv[ ya_optind ];
+
+    clog_init_path( 0, "/dev/null" );
+
+    for ( i = 0; i < opts.variant_count; i++ )
+        latency_measure( &opts, opts.variants[ i ] );
+
+    clog_free( 0 );
+    return 0;
+}
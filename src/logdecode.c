@@ -0,0 +1,577 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "clog.h"
+
+/*
+    Turns binary logs written by clog_init_binary (cvterm --binlog) into text:
+
+        2026-10-19 10:15:42.123456 termwin.c(termwin_getch:285): DEBUG: ...
+
+    Each run of the program starts with a header record, and every record
+    after it is tagged with the run's id, so runs sharing a file can
+    interleave. Anything else, such as text lines from a logger sharing the
+    file, is copied through. Call sites can be written after their first
+    messages, so the file is read twice: once for the sites, then for the
+    messages.
+*/
+
+typedef struct logdecode_site
+{
+    char *file;
+    char *func;
+    char *fmt;
+    uint32_t line;
+    int text;
+} logdecode_site;
+
+typedef struct logdecode_run
+{
+    uint32_t id;
+    logdecode_site *sites;
+    size_t site_count;
+} logdecode_run;
+
+typedef struct logdecode
+{
+    const uint8_t *data;
+    size_t size;
+    logdecode_run *runs;
+    size_t run_count;
+    const char *name;
+    FILE *out;
+} logdecode;
+
+static int read_file( FILE *file, uint8_t **data, size_t *size )
+{
+    size_t cap = 1024 * 1024;
+    uint8_t *buf = ( uint8_t * )malloc( cap );
+    size_t len = 0;
+    size_t ret;
+
+    while ( buf && ( ret = fread( buf + len, 1, cap - len, file ) ) > 0 )
+    {
+        len += ret;
+        if ( len == cap )
+        {
+            uint8_t *grown = ( uint8_t * )realloc( buf, cap * 2 );
+
+            if ( !grown )
+                break;
+            buf = grown;
+            cap *= 2;
+        }
+    }
+    if ( !buf || ferror( file ) )
+    {
+        free( buf );
+        return -1;
+    }
+
+    *data = buf;
+    *size = len;
+    return 0;
+}
+
+static char *copy_str( const uint8_t *src, size_t len )
+{
+    char *str = ( char * )malloc( len + 1 );
+
+    if ( str )
+    {
+        memcpy( str, src, len );
+        str[ len ] = 0;
+    }
+    return str;
+}
+
+// Read a u16 length and string at pos. Returns the bytes used, or 0.
+static size_t read_str( const uint8_t *data, size_t pos, size_t end, const uint8_t **str, size_t *len )
+{
+    uint16_t len16;
+
+    if ( pos + 2 > end )
+        return 0;
+    memcpy( &len16, data + pos, 2 );
+    if ( pos + 2 + len16 > end )
+        return 0;
+
+    *str = data + pos + 2;
+    *len = len16;
+    return 2 + len16;
+}
+
+// Returns the length of the record at pos, or 0 if it's cut off or unknown.
+static size_t record_size( const logdecode *ld, size_t pos )
+{
+    const uint8_t *data = ld->data;
+    size_t end = ld->size;
+
+    switch ( data[ pos ] )
+    {
+    case 'H':
+        if ( pos + CLOG_BINARY_HEADER > end || memcmp( data + pos + 1, CLOG_BINARY_MAGIC, 7 ) )
+            return 0;
+        return CLOG_BINARY_HEADER;
+    case 'D':
+        return pos + 13 <= end ? 13 : 0;
+    case 'M':
+    {
+        uint16_t len;
+
+        if ( pos + CLOG_BINARY_MSG_HEADER > end )
+            return 0;
+        memcpy( &len, data + pos + 18, 2 );
+        return pos + CLOG_BINARY_MSG_HEADER + len <= end ? CLOG_BINARY_MSG_HEADER + len : 0;
+    }
+    case 'S':
+    {
+        size_t len = 14;
+        int i;
+
+        for ( i = 0; i < 3; i++ )
+        {
+            const uint8_t *str;
+            size_t str_len;
+            size_t used = read_str( data, pos + len, end, &str, &str_len );
+
+            if ( !used )
+                return 0;
+            len += used;
+        }
+        return pos + len <= end ? len : 0;
+    }
+    }
+    return 0;
+}
+
+static void free_runs( logdecode *ld )
+{
+    size_t i;
+    size_t j;
+
+    for ( i = 0; i < ld->run_count; i++ )
+    {
+        logdecode_run *run = &ld->runs[ i ];
+
+        for ( j = 0; j < run->site_count; j++ )
+        {
+            free( run->sites[ j ].file );
+            free( run->sites[ j ].func );
+            free( run->sites[ j ].fmt );
+        }
+        free( run->sites );
+    }
+    free( ld->runs );
+    ld->runs = NULL;
+    ld->run_count = 0;
+}
+
+static int add_run( logdecode *ld, uint32_t id )
+{
+    logdecode_run *runs = ( logdecode_run * )realloc( ld->runs, ( ld->run_count + 1 ) * sizeof( *runs ) );
+
+    if ( !runs )
+        return -1;
+
+    ld->runs = runs;
+    runs[ ld->run_count ].id = id;
+    runs[ ld->run_count ].sites = NULL;
+    runs[ ld->run_count ].site_count = 0;
+    ld->run_count++;
+    return 0;
+}
+
+// The run a record tagged id belongs to: the latest of the first started
+// runs with that id, as a process id can come round again.
+static logdecode_run *find_run( logdecode *ld, size_t started, uint32_t id )
+{
+    size_t i;
+
+    for ( i = started; i > 0; i-- )
+    {
+        if ( ld->runs[ i - 1 ].id == id )
+            return &ld->runs[ i - 1 ];
+    }
+    return NULL;
+}
+
+static void add_site( logdecode *ld, logdecode_run *run, size_t pos )
+{
+    const uint8_t *data = ld->data;
+    uint32_t id;
+    size_t len = 14;
+    const uint8_t *str[ 3 ];
+    size_t str_len[ 3 ];
+    logdecode_site *site;
+    int i;
+
+    memcpy( &id, data + pos + 5, 4 );
+    for ( i = 0; i < 3; i++ )
+        len += read_str( data, pos + len, ld->size, &str[ i ], &str_len[ i ] );
+
+    if ( id >= run->site_count )
+    {
+        size_t count = id + 64;
+        logdecode_site *sites = ( logdecode_site * )realloc( run->sites, count * sizeof( *sites ) );
+
+        if ( !sites )
+            return;
+        memset( sites + run->site_count, 0, ( count - run->site_count ) * sizeof( *sites ) );
+        run->sites = sites;
+        run->site_count = count;
+    }
+
+    site = &run->sites[ id ];
+    free( site->file );
+    free( site->func );
+    free( site->fmt );
+    memcpy( &site->line, data + pos + 9, 4 );
+    site->text = data[ pos + 13 ];
+    site->file = copy_str( str[ 0 ], str_len[ 0 ] );
+    site->func = copy_str( str[ 1 ], str_len[ 1 ] );
+    site->fmt = copy_str( str[ 2 ], str_len[ 2 ] );
+}
+
+static size_t arg_size( unsigned char type )
+{
+    switch ( type )
+    {
+    case CLOG_ARG_INT:
+        return 4;
+    case CLOG_ARG_LDOUBLE:
+        return sizeof( long double );
+    case CLOG_ARG_NONE:
+    case CLOG_ARG_STR:
+    case CLOG_ARG_BAD:
+        return 0;
+    }
+    return 8;
+}
+
+#define PRINT_SPEC( _value )                                                        \
+    ( stars == 0 ? fprintf( out, spec, _value )                                     \
+                 : stars == 1 ? fprintf( out, spec, star[ 0 ], _value )             \
+                              : fprintf( out, spec, star[ 0 ], star[ 1 ], _value ) )
+
+// Format the message's arguments with the site's format.
+static void print_message( FILE *out, const char *fmt, const uint8_t *args, size_t len )
+{
+    const uint8_t *end = args + len;
+
+    while ( *fmt )
+    {
+        char spec[ 64 ];
+        const char *next;
+        unsigned char type;
+        int stars;
+        int star[ 2 ] = { 0, 0 };
+        int i;
+
+        if ( *fmt != '%' )
+        {
+            fputc( *fmt++, out );
+            continue;
+        }
+
+        next = _clog_scan_spec( fmt + 1, &type, &stars );
+        if ( type == CLOG_ARG_NONE )
+        {
+            fputc( '%', out );
+            fmt = next;
+            continue;
+        }
+        if ( type == CLOG_ARG_BAD || stars > 2 || ( size_t )( next - fmt ) >= sizeof( spec ) )
+            break;
+
+        snprintf( spec, sizeof( spec ), "%.*s", ( int )( next - fmt ), fmt );
+        fmt = next;
+
+        for ( i = 0; i < stars; i++ )
+        {
+            if ( args + 4 > end )
+                goto truncated;
+            memcpy( &star[ i ], args, 4 );
+            args += 4;
+        }
+
+        if ( type == CLOG_ARG_STR )
+        {
+            uint16_t str_len;
+            char str[ CLOG_ASYNC_MSG_LENGTH ];
+
+            if ( args + 2 > end )
+                goto truncated;
+            memcpy( &str_len, args, 2 );
+            if ( args + 2 + str_len > end || str_len >= sizeof( str ) )
+                goto truncated;
+            memcpy( str, args + 2, str_len );
+            str[ str_len ] = 0;
+            args += 2 + str_len;
+            PRINT_SPEC( str );
+            continue;
+        }
+
+        if ( args + arg_size( type ) > end )
+            goto truncated;
+
+        switch ( type )
+        {
+        case CLOG_ARG_INT:
+        {
+            int v;
+
+            memcpy( &v, args, sizeof( v ) );
+            PRINT_SPEC( v );
+            break;
+        }
+        case CLOG_ARG_LONG:
+        {
+            int64_t v;
+
+            memcpy( &v, args, sizeof( v ) );
+            PRINT_SPEC( ( long )v );
+            break;
+        }
+        case CLOG_ARG_LLONG:
+        {
+            int64_t v;
+
+            memcpy( &v, args, sizeof( v ) );
+            PRINT_SPEC( ( long long )v );
+            break;
+        }
+        case CLOG_ARG_DOUBLE:
+        {
+            double v;
+
+            memcpy( &v, args, sizeof( v ) );
+            PRINT_SPEC( v );
+            break;
+        }
+        case CLOG_ARG_LDOUBLE:
+        {
+            long double v;
+
+            memcpy( &v, args, sizeof( v ) );
+            PRINT_SPEC( v );
+            break;
+        }
+        case CLOG_ARG_PTR:
+        {
+            uint64_t v;
+
+            memcpy( &v, args, sizeof( v ) );
+            PRINT_SPEC( ( void * )( uintptr_t )v );
+            break;
+        }
+        }
+        args += arg_size( type );
+    }
+    return;
+
+truncated:
+    fputs( "<truncated>", out );
+}
+
+static void print_record( logdecode *ld, const logdecode_run *run, size_t pos )
+{
+    const uint8_t *data = ld->data + pos;
+    FILE *out = ld->out;
+    uint8_t level = data[ 5 ];
+    uint32_t id;
+    uint64_t ns;
+    uint16_t len;
+    time_t t;
+    struct tm tm;
+    char date[ 64 ];
+    const logdecode_site *site;
+    const char *file;
+
+    memcpy( &id, data + 6, 4 );
+    memcpy( &ns, data + 10, 8 );
+    memcpy( &len, data + 18, 2 );
+
+    t = ( time_t )( ns / 1000000000 );
+    strftime( date, sizeof( date ), "%Y-%m-%d %H:%M:%S", localtime_r( &t, &tm ) );
+    fprintf( out, "%s.%06u ", date, ( unsigned int )( ns % 1000000000 / 1000 ) );
+
+    site = id < run->site_count && run->sites[ id ].fmt ? &run->sites[ id ] : NULL;
+    if ( !site )
+    {
+        fprintf( out, "<unknown site %u>\n", id );
+        return;
+    }
+
+    file = strrchr( site->file, '/' );
+    fprintf( out, "%s(%s:%u): %s: ", file ? file + 1 : site->file, site->func, site->line,
+             level <= CLOG_ERROR ? CLOG_LEVEL_NAMES[ level ] : "?" );
+    if ( site->text )
+        print_message( out, "%s", data + CLOG_BINARY_MSG_HEADER, len );
+    else
+        print_message( out, site->fmt, data + CLOG_BINARY_MSG_HEADER, len );
+    fputc( '\n', out );
+}
+
+// Go through the file: add the runs and their sites, or with print set,
+// print the messages. Returns where it stopped.
+static size_t decode_pass( logdecode *ld, int print )
+{
+    size_t pos = 0;
+    size_t started = 0;
+
+    while ( pos < ld->size )
+    {
+        const uint8_t *data = ld->data + pos;
+        size_t len = record_size( ld, pos );
+        logdecode_run *run = NULL;
+        uint32_t id;
+
+        if ( len && data[ 0 ] == 'H' )
+        {
+            if ( data[ 8 ] != CLOG_BINARY_VERSION )
+            {
+                if ( print )
+                    fprintf( stderr, "%s: unknown version %u\n", ld->name, data[ 8 ] );
+                return pos;
+            }
+            memcpy( &id, data + 9, 4 );
+            if ( started == ld->run_count && ( print || add_run( ld, id ) ) )
+                return pos;
+            started++;
+            pos += len;
+            continue;
+        }
+
+        if ( len )
+        {
+            memcpy( &id, data + 1, 4 );
+            run = find_run( ld, started, id );
+        }
+        if ( !run )
+        {
+            // Not from a run we know: a line from a text logger sharing the file.
+            const uint8_t *eol = ( const uint8_t * )memchr( data, '\n', ld->size - pos );
+
+            if ( !eol )
+                return pos;
+            if ( print )
+                fwrite( data, 1, eol + 1 - data, ld->out );
+            pos += eol + 1 - data;
+            continue;
+        }
+
+        if ( !print && data[ 0 ] == 'S' )
+        {
+            add_site( ld, run, pos );
+        }
+        else if ( print && data[ 0 ] == 'M' )
+        {
+            print_record( ld, run, pos );
+        }
+        else if ( print && data[ 0 ] == 'D' )
+        {
+            uint64_t count;
+
+            memcpy( &count, data + 5, 8 );
+            fprintf( ld->out, "clog: dropped %" PRIu64 " messages, log ring full\n", count );
+        }
+        pos += len;
+    }
+    return pos;
+}
+
+static int decode( const char *name, FILE *file )
+{
+    logdecode ld;
+    uint8_t *data;
+    size_t pos;
+
+    if ( read_file( file, &data, &ld.size ) )
+    {
+        fprintf( stderr, "Unable to read %s\n", name );
+        return -1;
+    }
+    ld.data = data;
+    ld.runs = NULL;
+    ld.run_count = 0;
+    ld.name = name;
+    ld.out = stdout;
+
+    if ( !memmem( data, ld.size, "H" CLOG_BINARY_MAGIC, 8 ) )
+    {
+        fprintf( stderr, "%s is not a binary log\n", name );
+        free( data );
+        return -1;
+    }
+
+    decode_pass( &ld, 0 );
+    pos = decode_pass( &ld, 1 );
+    if ( pos < ld.size )
+        fprintf( stderr, "%s: stopped at bad record, offset %zu\n", name, pos );
+
+    free_runs( &ld );
+    free( data );
+    return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+    int i;
+    int ret = 0;
+
+    if ( argc > 1 && ( !strcmp( argv[ 1 ], "-h" ) || !strcmp( argv[ 1 ], "--help" ) ) )
+    {
+        printf( "%s [FILE...]\n\nPrint binary logs from cvterm --binlog as text.\n", argv[ 0 ] );
+        return 0;
+    }
+
+    if ( argc < 2 )
+        return decode( "stdin", stdin ) ? 1 : 0;
+
+    for ( i = 1; i < argc; i++ )
+    {
+        FILE *file = fopen( argv[ i ], "rb" );
+
+        if ( !file )
+        {
+            fprintf( stderr, "Unable to open %s\n", argv[ i ] );
+            ret = 1;
+            continue;
+        }
+        if ( decode( argv[ i ], file ) )
+            ret = 1;
+        fclose( file );
+    }
+    return ret;
+}
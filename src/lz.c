@@ -0,0 +1,231 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+    Stream of sequences, each:
+
+        token               high nibble: literal count, low: match length - 4
+        [ 255... n ]        literal count extension if high nibble is 15
+        literals
+        offset              2 bytes little endian, back from current output
+        [ 255... n ]        match length extension if low nibble is 15
+
+    The last sequence is literals only and ends at the end of src.
+*/
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 0xffff
+
+#define LZ_NIBBLE( _x ) ( ( _x ) < 15 ? ( _x ) : 15 )
+
+static uint32_t lz_read32( const uint8_t *p )
+{
+    uint32_t v;
+
+    memcpy( &v, p, sizeof( v ) );
+    return v;
+}
+
+static uint32_t lz_hash( uint32_t v )
+{
+    return ( v * 2654435761u ) >> ( 32 - LZ_HASH_BITS );
+}
+
+// Write a length extension. Returns NULL if it doesn't fit.
+static uint8_t *lz_put_length( uint8_t *op, uint8_t *oend, size_t len )
+{
+    for ( ; len >= 255; len -= 255 )
+    {
+        if ( op >= oend )
+            return NULL;
+        *op++ = 255;
+    }
+
+    if ( op >= oend )
+        return NULL;
+    *op++ = ( uint8_t )len;
+    return op;
+}
+
+static uint8_t *lz_put_sequence( uint8_t *op, uint8_t *oend,
+                                 const uint8_t *lit, size_t nlit, size_t offset, size_t match )
+{
+    uint8_t *token = op++;
+
+    if ( op > oend )
+        return NULL;
+
+    *token = ( uint8_t )( LZ_NIBBLE( nlit ) << 4 );
+    if ( nlit >= 15 && !( op = lz_put_length( op, oend, nlit - 15 ) ) )
+        return NULL;
+
+    if ( ( size_t )( oend - op ) < nlit )
+        return NULL;
+    memcpy( op, lit, nlit );
+    op += nlit;
+
+    if ( match )
+    {
+        match -= LZ_MIN_MATCH;
+        *token |= LZ_NIBBLE( match );
+
+        if ( oend - op < 2 )
+            return NULL;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+
+        if ( match >= 15 && !( op = lz_put_length( op, oend, match - 15 ) ) )
+            return NULL;
+    }
+
+    return op;
+}
+
+size_t lz_compress( const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size )
+{
+    uint32_t table[ 1 << LZ_HASH_BITS ];
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *iend = src + src_size;
+    const uint8_t *mlimit = ( src_size > LZ_MIN_MATCH ) ? iend - LZ_MIN_MATCH : src;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_size;
+
+    memset( table, 0xff, sizeof( table ) );
+
+    while ( ip < mlimit )
+    {
+        uint32_t v = lz_read32( ip );
+        uint32_t h = lz_hash( v );
+        uint32_t pos = ( uint32_t )( ip - src );
+        uint32_t cand = table[ h ];
+
+        table[ h ] = pos;
+
+        if ( cand != 0xffffffff && pos - cand <= LZ_MAX_OFFSET && lz_read32( src + cand ) == v )
+        {
+            const uint8_t *ref = src + cand + LZ_MIN_MATCH;
+            const uint8_t *mp = ip + LZ_MIN_MATCH;
+
+            while ( mp < iend && *mp == *ref )
+                mp++, ref++;
+
+            op = lz_put_sequence( op, oend, anchor, ip - anchor, pos - cand, mp - ip );
+            if ( !op )
+                return 0;
+
+            ip = anchor = mp;
+            continue;
+        }
+
+        ip++;
+    }
+
+    op = lz_put_sequence( op, oend, anchor, iend - anchor, 0, 0 );
+    return op ? ( size_t )( op - dst ) : 0;
+}
+
+// Read a length extension. Returns 0 on truncated input.
+static int lz_get_length( const uint8_t **pip, const uint8_t *iend, size_t *len )
+{
+    const uint8_t *ip = *pip;
+    uint8_t b;
+
+    do
+    {
+        if ( ip >= iend )
+            return 0;
+        b = *ip++;
+        *len += b;
+    } while ( b == 255 );
+
+    *pip = ip;
+    return 1;
+}
+
+size_t lz_decompress( const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size )
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + src_size;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_size;
+
+    while ( ip < iend )
+    {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        size_t match = token & 15;
+        size_t offset;
+
+        if ( nlit == 15 && !lz_get_length( &ip, iend, &nlit ) )
+            return 0;
+        if ( ( size_t )( iend - ip ) < nlit || ( size_t )( oend - op ) < nlit )
+            return 0;
+
+        memcpy( op, ip, nlit );
+        ip += nlit;
+        op += nlit;
+
+        // Last sequence has no match.
+        if ( ip == iend )
+            break;
+
+        if ( iend - ip < 2 )
+            return 0;
+        offset = ip[ 0 ] | ( ip[ 1 ] << 8 );
+        ip += 2;
+
+        if ( match == 15 && !lz_get_length( &ip, iend, &match ) )
+            return 0;
+        match += LZ_MIN_MATCH;
+
+        if ( !offset || offset > ( size_t )( op - dst ) || ( size_t )( oend - op ) < match )
+            return 0;
+
+        if ( offset >= match )
+        {
+            memcpy( op, op - offset, match );
+            op += match;
+        }
+        else
+        {
+            // Overlapping copy repeats the last offset bytes.
+            const uint8_t *ref = op - offset;
+
+            while ( match-- )
+                *op++ = *ref++;
+        }
+    }
+
+    return op - dst;
+}
@@ -70,6 +70,8 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <signal.h>
+#include <spawn.h>
 
 #include "pseudo.h"
 
@@ -134,12 +136,23 @@ static size_t strlcpy_local(char *dst, const char *src, size_t size)
     return s - src - 1;
 }
 
+/* groupname2gid: Returns the gid of the tty group, or -1. The group file
+ * is only read the first time; the answer doesn't change while we run.
+ */
 static int groupname2gid(const char *groupname)
 {
-    FILE *group = fopen("/etc/group", "r");
+    static int cached = 0;
+    static int cached_gid = -1;
+    FILE *group;
     char line[BUFSIZ], *gid;
     int ret = -1;
 
+    if (cached)
+        return cached_gid;
+
+    if (!(group = fopen("/etc/group", "r")))
+        return -1;
+
     while (fgets(line, BUFSIZ, group)) {
         if (!strncmp(line, "tty:", 4)) {
             if ((gid = strchr(line + 4, ':')))
@@ -151,15 +164,29 @@ static int groupname2gid(const char *groupname)
 
     fclose(group);
 
+    cached_gid = ret;
+    cached = 1;
     return ret;
 }
 
+/* uid2gid: Returns the primary gid of uid, or -1. Like groupname2gid,
+ * the passwd file is read once for the last uid asked about.
+ */
 static int uid2gid(uid_t uid)
 {
-    FILE *passwd = fopen("/etc/passwd", "r");
+    static int cached = 0;
+    static uid_t cached_uid;
+    static int cached_gid = -1;
+    FILE *passwd;
     char line[BUFSIZ], *ptr;
     int ret = -1;
 
+    if (cached && cached_uid == uid)
+        return cached_gid;
+
+    if (!(passwd = fopen("/etc/passwd", "r")))
+        return -1;
+
     while (fgets(line, BUFSIZ, passwd)) {
         if ((ptr = strchr(line, ':')) && (ptr = strchr(ptr + 1, ':')) &&
                 atoi(ptr + 1) == (int) uid && (ptr = strchr(ptr + 1, ':'))) {
@@ -170,6 +197,9 @@ static int uid2gid(uid_t uid)
 
     fclose(passwd);
 
+    cached_uid = uid;
+    cached_gid = ret;
+    cached = 1;
     return ret;
 }
 
@@ -185,7 +215,8 @@ static int uid2gid(uid_t uid)
  * If slave_termios is not null, it is passed to tcsetattr with the 
  * command TCSANOW to set the terminal attributes of the slave device. 
  * If slave_winsize is not null, it is passed to ioctl with the command 
- * TIOCSWINSZ to set the window size of the slave device. On success, 
+ * TIOCSWINSZ to set the window size of the slave device. Through
+ * /dev/ptmx, both descriptors are close-on-exec. On success, 
  * returns 0. On error, returns -1 with errno set appropriately.
  */
 int pty_open(int *masterfd, int *slavefd, char *slavename, size_t slavenamesize,
@@ -284,7 +315,10 @@ int pty_open(int *masterfd, int *slavefd, char *slavename, size_t slavenamesize,
 
     /* Open the master descriptor */
 
-    if ((*masterfd = open("/dev/ptmx", O_RDWR | O_NOCTTY)) == -1)
+    /* Close-on-exec so ptys opened while another thread forks don't leak
+     * into that child. pty_fork's dup2s of the slave don't inherit it. */
+
+    if ((*masterfd = open("/dev/ptmx", O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1)
         return -1;
 
     /* Set slave ownership and permissions to real uid of process */
@@ -324,7 +358,7 @@ int pty_open(int *masterfd, int *slavefd, char *slavename, size_t slavenamesize,
 
     /* Open the slave descriptor */
 
-    if ((*slavefd = open(slavename, O_RDWR | O_NOCTTY)) == -1) {
+    if ((*slavefd = open(slavename, O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1) {
         close(*masterfd);
         return -1;
     }
@@ -681,7 +715,6 @@ pid_t pty_fork(int *masterfd, char *slavename, size_t slavenamesize,
         const struct winsize * slave_winsize)
 {
     int slavefd = 0;
-    pid_t pid = 0;
 
     /*
      ** Note: we don't use forkpty() because it closes the master in the
@@ -694,6 +727,17 @@ pid_t pty_fork(int *masterfd, char *slavename, size_t slavenamesize,
                     slave_winsize) == -1)
         return -1;
 
+    return pty_fork_open(masterfd, slavefd, slavename);
+}
+
+/* pty_fork_open: Like pty_fork, for a pseudo terminal already opened by
+ * pty_open. Both descriptors are closed on error and in the parent the
+ * slave is closed on success.
+ */
+pid_t pty_fork_open(int *masterfd, int slavefd, const char *slavename)
+{
+    pid_t pid = 0;
+
     switch (pid = fork()) {
         case -1:
             pty_release(slavename);
@@ -707,7 +751,11 @@ pid_t pty_fork(int *masterfd, char *slavename, size_t slavenamesize,
             if (pty_make_controlling_tty(&slavefd, slavename) == -1)
                 _exit(EXIT_FAILURE);
 
-            /* Redirect stdin, stdout and stderr from the pseudo tty */
+            /* Redirect stdin, stdout and stderr from the pseudo tty. dup2
+             * clears close-on-exec, but a slave already there keeps it. */
+
+            if (slavefd <= STDERR_FILENO && fcntl(slavefd, F_SETFD, 0) == -1)
+                _exit(EXIT_FAILURE);
 
             if (slavefd != STDIN_FILENO && dup2(slavefd, STDIN_FILENO) == -1)
                 _exit(EXIT_FAILURE);
@@ -741,3 +789,94 @@ pid_t pty_fork(int *masterfd, char *slavename, size_t slavenamesize,
         }
     }
 }
+
+/* pty_spawn: Runs file (searched for in PATH) with argv and envp on a pseudo
+ * terminal opened by pty_open, as its controlling terminal and on standard
+ * input, output and error. The child starts with no signals blocked and
+ * every signal at its default action. On error both descriptors are closed
+ * and the slave is released, like pty_fork_open; on success the slave is
+ * closed in the parent. Returns the pid of the child or -1 with errno set
+ * appropriately.
+ *
+ * Where posix_spawn can start a new session (POSIX_SPAWN_SETSID is defined
+ * at build time), it does all the work: glibc runs the child on the parent's
+ * memory with clone(CLONE_VM|CLONE_VFORK) until the exec, so no page tables
+ * get copied however big the parent is. Opening the slave as the new
+ * session leader's first terminal makes it the controlling tty. A
+ * posix_spawnp failure is returned as is, not retried with fork. Builds
+ * without POSIX_SPAWN_SETSID fork with pty_fork_open and execvp.
+ */
+pid_t pty_spawn(int *masterfd, int slavefd, const char *slavename,
+        const char *file, char *const argv[], char *const envp[])
+{
+    sigset_t mask, defaults;
+    pid_t pid;
+#ifdef POSIX_SPAWN_SETSID
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    int err;
+#endif /* POSIX_SPAWN_SETSID */
+
+    sigemptyset(&mask);
+    sigfillset(&defaults);
+
+#ifdef POSIX_SPAWN_SETSID
+    if ((err = posix_spawn_file_actions_init(&actions))) {
+        pty_release(slavename);
+        close(slavefd);
+        close(*masterfd);
+        return set_errno(err);
+    }
+
+    if ((err = posix_spawnattr_init(&attr))) {
+        posix_spawn_file_actions_destroy(&actions);
+        pty_release(slavename);
+        close(slavefd);
+        close(*masterfd);
+        return set_errno(err);
+    }
+
+    /* Our own descriptors are close-on-exec (see pty_open) */
+
+    if (!(err = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+                    slavename, O_RDWR, 0)) &&
+            !(err = posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO,
+                    STDOUT_FILENO)) &&
+            !(err = posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO,
+                    STDERR_FILENO)) &&
+            !(err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID |
+                    POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF)) &&
+            !(err = posix_spawnattr_setsigmask(&attr, &mask)) &&
+            !(err = posix_spawnattr_setsigdefault(&attr, &defaults)))
+        err = posix_spawnp(&pid, file, &actions, &attr, argv, envp);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err) {
+        pty_release(slavename);
+        close(slavefd);
+        close(*masterfd);
+        return set_errno(err);
+    }
+
+    close(slavefd);
+    return pid;
+#else /* POSIX_SPAWN_SETSID */
+    if ((pid = pty_fork_open(masterfd, slavefd, slavename)) == 0) {
+        int signo;
+
+        for (signo = 1; signo < NSIG; signo++)
+            if (sigismember(&defaults, signo) == 1)
+                signal(signo, SIG_DFL);
+
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        environ = (char **)envp;
+        execvp(file, argv);
+        _exit(127);
+    }
+
+    return pid;
+#endif /* POSIX_SPAWN_SETSID */
+}
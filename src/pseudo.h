@@ -55,5 +55,8 @@ int pty_change_window_size(int masterfd, int row, int col, int xpixel,
 pid_t pty_fork(int *masterfd, char *slavename, size_t slavenamesize,
         const struct termios *slave_termios,
         const struct winsize *slave_winsize);
+pid_t pty_fork_open(int *masterfd, int slavefd, const char *slavename);
+pid_t pty_spawn(int *masterfd, int slavefd, const char *slavename,
+        const char *file, char *const argv[], char *const envp[]);
 
 #endif
@@ -0,0 +1,189 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pseudo.h"
+#include "ptypool.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define PTY_POOL_MAX 16
+
+// Wait after a failed open, doubling up to the max while it keeps failing.
+#define PTY_POOL_RETRY_MS 100
+#define PTY_POOL_RETRY_MAX_MS 5000
+
+struct pty_pool
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // Signalled when a pty is taken or we're stopping.
+    int stop;
+
+    int want;
+    int count;
+    pty_pair pairs[ PTY_POOL_MAX ];
+
+    int have_termios;
+    struct termios termios;
+};
+
+static int pty_pool_open( pty_pool *pool, pty_pair *pair )
+{
+    return pty_open( &pair->master, &pair->slave, pair->slavename, sizeof( pair->slavename ),
+                     pool->have_termios ? &pool->termios : NULL, NULL );
+}
+
+// Sleep ms with the lock held, or until we're stopping.
+static void pty_pool_backoff( pty_pool *pool, int ms )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += ( ms % 1000 ) * 1000000L;
+    if ( ts.tv_nsec >= 1000000000L )
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    while ( !pool->stop && pthread_cond_timedwait( &pool->cond, &pool->lock, &ts ) != ETIMEDOUT )
+        ;
+}
+
+static void *pty_pool_thread( void *arg )
+{
+    pty_pool *pool = ( pty_pool * )arg;
+    int retry_ms = PTY_POOL_RETRY_MS;
+
+    pthread_mutex_lock( &pool->lock );
+    while ( !pool->stop )
+    {
+        pty_pair pair;
+
+        if ( pool->count >= pool->want )
+        {
+            pthread_cond_wait( &pool->cond, &pool->lock );
+            continue;
+        }
+
+        // Open outside the lock so takers don't wait on it.
+        pthread_mutex_unlock( &pool->lock );
+        if ( pty_pool_open( pool, &pair ) )
+        {
+            // Likely out of descriptors or ptys for now, so try again later.
+            // Meanwhile sessions open their own.
+            clog_error_limit( CLOG( 0 ), "pty_open failed: %d, retrying in %d ms", errno, retry_ms );
+            pthread_mutex_lock( &pool->lock );
+            pty_pool_backoff( pool, retry_ms );
+            retry_ms = MIN( retry_ms * 2, PTY_POOL_RETRY_MAX_MS );
+            continue;
+        }
+        retry_ms = PTY_POOL_RETRY_MS;
+        pthread_mutex_lock( &pool->lock );
+
+        pool->pairs[ pool->count++ ] = pair;
+    }
+    pthread_mutex_unlock( &pool->lock );
+
+    return NULL;
+}
+
+pty_pool *pty_pool_create( int count, const struct termios *termios )
+{
+    pty_pool *pool = ( pty_pool * )calloc( 1, sizeof( *pool ) );
+
+    if ( !pool )
+        FATAL_ERROR( calloc );
+
+    pool->want = MIN( count, PTY_POOL_MAX );
+    if ( termios )
+    {
+        pool->termios = *termios;
+        pool->have_termios = 1;
+    }
+
+    pthread_mutex_init( &pool->lock, NULL );
+    pthread_cond_init( &pool->cond, NULL );
+
+    if ( pthread_create( &pool->thread, NULL, pty_pool_thread, pool ) )
+        FATAL_ERROR( pthread_create );
+
+    return pool;
+}
+
+void pty_pool_free( pty_pool *pool )
+{
+    if ( pool )
+    {
+        pthread_mutex_lock( &pool->lock );
+        pool->stop = 1;
+        pthread_cond_signal( &pool->cond );
+        pthread_mutex_unlock( &pool->lock );
+
+        pthread_join( pool->thread, NULL );
+
+        while ( pool->count )
+        {
+            pty_pair *pair = &pool->pairs[ --pool->count ];
+
+            close( pair->slave );
+            close( pair->master );
+        }
+
+        pthread_mutex_destroy( &pool->lock );
+        pthread_cond_destroy( &pool->cond );
+        free( pool );
+    }
+}
+
+int pty_pool_take( pty_pool *pool, pty_pair *pair )
+{
+    int found = 0;
+
+    pthread_mutex_lock( &pool->lock );
+    if ( pool->count )
+    {
+        *pair = pool->pairs[ --pool->count ];
+        found = 1;
+        pthread_cond_signal( &pool->cond );
+    }
+    pthread_mutex_unlock( &pool->lock );
+
+    if ( !found )
+    {
+        clog_debug( CLOG( 0 ), "pty pool empty, opening one now" );
+        return pty_pool_open( pool, pair );
+    }
+    return 0;
+}
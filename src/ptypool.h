@@ -0,0 +1,52 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _PTYPOOL_H_
+#define _PTYPOOL_H_
+
+// Pseudo terminals opened ahead of time by a background thread, so starting
+// a session only has to fork and exec. Spare ptys are close-on-exec so other
+// sessions' children don't hold them open.
+typedef struct pty_pool pty_pool;
+
+typedef struct pty_pair
+{
+    int master;
+    int slave;
+    char slavename[ SLAVE_SIZE ];
+} pty_pair;
+
+// Keep count ptys ready, with termios (may be NULL) set on them.
+pty_pool *pty_pool_create( int count, const struct termios *termios );
+// Closes the spares.
+void pty_pool_free( pty_pool *pool );
+
+// Take a ready pty, opening one now if there are none left. Returns -1 on
+// failure.
+int pty_pool_take( pty_pool *pool, pty_pair *pair );
+
+#endif // _PTYPOOL_H_
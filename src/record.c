@@ -0,0 +1,764 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "record.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+/*
+    File layout, little endian:
+
+        char magic[ 8 ]     "CVTREC\0\1"
+        uint16_t rows
+        uint16_t cols
+        uint32_t reserved
+        int64_t start_us    wall clock time recording started
+
+    followed by events, only ever appended:
+
+        uint8_t type        record_type
+        varint delta_us     time since the previous event
+        varint len
+        uint8_t data[ len ] RECORD_RESIZE: varint rows, cols
+                            RECORD_DROPPED: varint count
+                            RECORD_KEYFRAME: snapshot_encode data
+
+    A recording closed cleanly ends with an index of its keyframes:
+
+        struct { uint64_t time_us, offset; } keyframes[ count ]
+        uint64_t count
+        char magic[ 8 ]     "CVTIDX\0\1"
+
+    Recordings without one (the process died) get indexed by scanning.
+
+    The main thread encodes events into a single producer / single consumer
+    ring and a writer thread drains it to the file. When the ring is full
+    events are dropped and counted rather than waiting on the disk.
+*/
+
+#define RECORD_MAGIC "CVTREC\0\1"
+#define RECORD_HEADER_SIZE 24
+#define RECORD_RING_SIZE ( 8 * 1024 * 1024 )
+#define RECORD_WRITER_SLEEP_US 5000
+
+#define RECORD_INDEX_MAGIC "CVTIDX\0\1"
+#define RECORD_INDEX_FOOTER_SIZE 16
+
+// A keyframe is due after this long or this much output, whichever's first.
+#define RECORD_KEYFRAME_INTERVAL_US ( 30 * 1000000 )
+#define RECORD_KEYFRAME_BYTES ( 8 * 1024 * 1024 )
+
+typedef struct record_keyframe_entry
+{
+    uint64_t time_us;
+    uint64_t offset; // File offset of the RECORD_KEYFRAME event.
+} record_keyframe_entry;
+
+struct record
+{
+    int fd;
+    pthread_t thread;
+    int stop;
+
+    // Ring of encoded events. head is only written by the main thread and
+    // tail only by the writer thread.
+    uint8_t *ring;
+    size_t ring_size;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t last_head; // Where the last event queued starts.
+
+    uint64_t start_us;
+    uint64_t last_us;
+    uint64_t dropped; // Not yet reported with a RECORD_DROPPED event.
+
+    uint64_t keyframe_us;    // When the last keyframe was queued.
+    uint64_t keyframe_bytes; // Output since then.
+    record_keyframe_entry *keyframes;
+    size_t keyframe_count;
+    size_t keyframe_size;
+
+    uint64_t events;
+    uint64_t dropped_total;
+    int write_errno; // Set by the writer thread.
+};
+
+struct record_reader
+{
+    uint8_t *map;
+    size_t size; // End of the events.
+    size_t map_size;
+    size_t offset;
+    uint64_t time_us;
+
+    record_keyframe_entry *keyframes;
+    size_t keyframe_count;
+    int indexed;
+
+    int rows;
+    int cols;
+    int64_t start_us;
+};
+
+static uint64_t record_now_us()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t record_put_varint( uint8_t *p, uint64_t v )
+{
+    size_t n = 0;
+
+    while ( v >= 0x80 )
+    {
+        p[ n++ ] = ( uint8_t )( v | 0x80 );
+        v >>= 7;
+    }
+    p[ n++ ] = ( uint8_t )v;
+    return n;
+}
+
+static void record_ring_copy( record *rec, uint64_t pos, const void *data, size_t len )
+{
+    size_t off = pos & ( rec->ring_size - 1 );
+    size_t n = MIN( len, rec->ring_size - off );
+
+    memcpy( rec->ring + off, data, n );
+    memcpy( rec->ring, ( const uint8_t * )data + n, len - n );
+}
+
+// Queue an event if it fits in the ring. Returns 0 if it doesn't.
+static int record_queue( record *rec, int type, const void *data, size_t len )
+{
+    size_t hlen;
+    uint8_t hdr[ 1 + 10 + 10 ];
+    uint64_t now = record_now_us();
+    uint64_t head = rec->head;
+    uint64_t tail = __atomic_load_n( &rec->tail, __ATOMIC_ACQUIRE );
+
+    hdr[ 0 ] = ( uint8_t )type;
+    hlen = 1 + record_put_varint( hdr + 1, now - rec->last_us );
+    hlen += record_put_varint( hdr + hlen, len );
+
+    if ( hlen + len > rec->ring_size - ( head - tail ) )
+        return 0;
+
+    rec->last_head = head;
+    record_ring_copy( rec, head, hdr, hlen );
+    record_ring_copy( rec, head + hlen, data, len );
+    __atomic_store_n( &rec->head, head + hlen + len, __ATOMIC_RELEASE );
+
+    rec->last_us = now;
+    rec->events++;
+    return 1;
+}
+
+static void record_event_put( record *rec, int type, const void *data, size_t len )
+{
+    if ( rec->dropped )
+    {
+        uint8_t buf[ 10 ];
+        size_t n = record_put_varint( buf, rec->dropped );
+
+        if ( !record_queue( rec, RECORD_DROPPED, buf, n ) )
+        {
+            rec->dropped++;
+            rec->dropped_total++;
+            return;
+        }
+        rec->dropped = 0;
+    }
+
+    if ( !record_queue( rec, type, data, len ) )
+    {
+        rec->dropped++;
+        rec->dropped_total++;
+    }
+}
+
+static void *record_writer( void *arg )
+{
+    record *rec = ( record * )arg;
+
+    for ( ;; )
+    {
+        ssize_t ret;
+        size_t off, n;
+        int stop = __atomic_load_n( &rec->stop, __ATOMIC_ACQUIRE );
+        uint64_t head = __atomic_load_n( &rec->head, __ATOMIC_ACQUIRE );
+        uint64_t tail = rec->tail;
+
+        if ( head == tail )
+        {
+            struct timespec ts = { 0, RECORD_WRITER_SLEEP_US * 1000 };
+
+            if ( stop )
+                break;
+
+            nanosleep( &ts, NULL );
+            continue;
+        }
+
+        off = tail & ( rec->ring_size - 1 );
+        n = MIN( head - tail, rec->ring_size - off );
+
+        ret = write( rec->fd, rec->ring + off, n );
+        if ( ret < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            // Keep draining so the main thread isn't stuck dropping events.
+            rec->write_errno = errno;
+            ret = n;
+        }
+
+        __atomic_store_n( &rec->tail, tail + ret, __ATOMIC_RELEASE );
+    }
+
+    return NULL;
+}
+
+record *record_create( const char *path, int rows, int cols )
+{
+    record *rec;
+    struct timeval tv;
+    uint8_t hdr[ RECORD_HEADER_SIZE ];
+    uint16_t size[ 2 ] = { ( uint16_t )rows, ( uint16_t )cols };
+    int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+
+    if ( fd < 0 )
+    {
+        clog_error( CLOG( 0 ), "Unable to open %s: %d", path, errno );
+        return NULL;
+    }
+
+    gettimeofday( &tv, NULL );
+    int64_t start_us = ( int64_t )tv.tv_sec * 1000000 + tv.tv_usec;
+
+    memset( hdr, 0, sizeof( hdr ) );
+    memcpy( hdr, RECORD_MAGIC, 8 );
+    memcpy( hdr + 8, size, sizeof( size ) );
+    memcpy( hdr + 16, &start_us, sizeof( start_us ) );
+
+    if ( TEMP_FAILURE_RETRY( write( fd, hdr, sizeof( hdr ) ) ) != sizeof( hdr ) )
+    {
+        clog_error( CLOG( 0 ), "Unable to write %s: %d", path, errno );
+        close( fd );
+        return NULL;
+    }
+
+    rec = ( record * )calloc( 1, sizeof( *rec ) );
+    if ( !rec )
+        FATAL_ERROR( calloc );
+
+    rec->fd = fd;
+    rec->ring_size = RECORD_RING_SIZE;
+    rec->ring = ( uint8_t * )malloc( rec->ring_size );
+    if ( !rec->ring )
+        FATAL_ERROR( malloc );
+    rec->start_us = record_now_us();
+    rec->last_us = rec->start_us;
+    rec->keyframe_us = rec->start_us;
+
+    if ( pthread_create( &rec->thread, NULL, record_writer, rec ) )
+        FATAL_ERROR( pthread_create );
+
+    clog_info( CLOG( 0 ), "Recording to %s", path );
+    return rec;
+}
+
+// Append the keyframe index. Only called once the writer thread is done.
+static void record_write_index( record *rec )
+{
+    uint8_t footer[ RECORD_INDEX_FOOTER_SIZE ];
+    uint64_t count = rec->keyframe_count;
+    size_t len = count * sizeof( rec->keyframes[ 0 ] );
+
+    memcpy( footer, &count, sizeof( count ) );
+    memcpy( footer + 8, RECORD_INDEX_MAGIC, 8 );
+
+    if ( ( len && TEMP_FAILURE_RETRY( write( rec->fd, rec->keyframes, len ) ) != ( ssize_t )len ) ||
+         TEMP_FAILURE_RETRY( write( rec->fd, footer, sizeof( footer ) ) ) != sizeof( footer ) )
+        clog_error( CLOG( 0 ), "Unable to write recording index: %d", errno );
+}
+
+void record_free( record *rec )
+{
+    if ( rec )
+    {
+        __atomic_store_n( &rec->stop, 1, __ATOMIC_RELEASE );
+        pthread_join( rec->thread, NULL );
+
+        if ( rec->write_errno )
+            clog_error( CLOG( 0 ), "Recording write failed: %d", rec->write_errno );
+        else
+            record_write_index( rec );
+
+        clog_info( CLOG( 0 ), "Recorded %" PRIu64 " events, %" PRIu64 " bytes, %" PRIu64 " dropped",
+                   rec->events, rec->head, rec->dropped_total );
+
+        close( rec->fd );
+        free( rec->keyframes );
+        free( rec->ring );
+        free( rec );
+    }
+}
+
+void record_output( record *rec, const void *buf, size_t len )
+{
+    record_event_put( rec, RECORD_OUTPUT, buf, len );
+    rec->keyframe_bytes += len;
+}
+
+void record_input( record *rec, const void *buf, size_t len )
+{
+    record_event_put( rec, RECORD_INPUT, buf, len );
+}
+
+void record_resize( record *rec, int rows, int cols )
+{
+    uint8_t buf[ 20 ];
+    size_t n = record_put_varint( buf, rows );
+
+    n += record_put_varint( buf + n, cols );
+    record_event_put( rec, RECORD_RESIZE, buf, n );
+}
+
+int record_keyframe_due( record *rec )
+{
+    if ( !rec->keyframe_bytes )
+        return 0;
+
+    return ( rec->keyframe_bytes >= RECORD_KEYFRAME_BYTES ) ||
+           ( record_now_us() - rec->keyframe_us >= RECORD_KEYFRAME_INTERVAL_US );
+}
+
+void record_keyframe( record *rec, const void *buf, size_t len )
+{
+    uint64_t events = rec->events;
+
+    rec->keyframe_us = record_now_us();
+    rec->keyframe_bytes = 0;
+
+    record_event_put( rec, RECORD_KEYFRAME, buf, len );
+    if ( rec->events == events || rec->dropped )
+        return;
+
+    if ( rec->keyframe_count == rec->keyframe_size )
+    {
+        rec->keyframe_size = MAX( 64, rec->keyframe_size * 2 );
+        rec->keyframes = ( record_keyframe_entry * )realloc( rec->keyframes, rec->keyframe_size * sizeof( rec->keyframes[ 0 ] ) );
+        if ( !rec->keyframes )
+            FATAL_ERROR( realloc );
+    }
+    rec->keyframes[ rec->keyframe_count ].time_us = rec->last_us - rec->start_us;
+    // Everything queued lands in the file in order after the header.
+    rec->keyframes[ rec->keyframe_count ].offset = RECORD_HEADER_SIZE + rec->last_head;
+    rec->keyframe_count++;
+}
+
+// Load the keyframe index if the recording was closed cleanly.
+static void record_read_index( record_reader *reader )
+{
+    uint64_t count;
+    size_t len;
+    const uint8_t *footer = reader->map + reader->size - RECORD_INDEX_FOOTER_SIZE;
+
+    if ( reader->size < RECORD_HEADER_SIZE + RECORD_INDEX_FOOTER_SIZE ||
+         memcmp( footer + 8, RECORD_INDEX_MAGIC, 8 ) )
+        return;
+
+    memcpy( &count, footer, sizeof( count ) );
+    if ( count > ( reader->size - RECORD_HEADER_SIZE - RECORD_INDEX_FOOTER_SIZE ) / sizeof( record_keyframe_entry ) )
+        return;
+
+    len = count * sizeof( record_keyframe_entry );
+    if ( count )
+    {
+        reader->keyframes = ( record_keyframe_entry * )malloc( len );
+        if ( !reader->keyframes )
+            FATAL_ERROR( malloc );
+        memcpy( reader->keyframes, footer - len, len );
+    }
+
+    reader->keyframe_count = count;
+    reader->size -= len + RECORD_INDEX_FOOTER_SIZE;
+    reader->indexed = 1;
+}
+
+record_reader *record_open( const char *path )
+{
+    void *map;
+    struct stat st;
+    uint16_t size[ 2 ];
+    record_reader *reader;
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+
+    if ( fd < 0 )
+    {
+        clog_error( CLOG( 0 ), "Unable to open %s: %d", path, errno );
+        return NULL;
+    }
+
+    if ( fstat( fd, &st ) || st.st_size < RECORD_HEADER_SIZE )
+    {
+        clog_error( CLOG( 0 ), "%s is not a recording", path );
+        close( fd );
+        return NULL;
+    }
+
+    map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( map == MAP_FAILED )
+    {
+        clog_error( CLOG( 0 ), "mmap %s failed: %d", path, errno );
+        return NULL;
+    }
+
+    if ( memcmp( map, RECORD_MAGIC, 8 ) )
+    {
+        clog_error( CLOG( 0 ), "%s is not a recording", path );
+        munmap( map, st.st_size );
+        return NULL;
+    }
+
+    reader = ( record_reader * )calloc( 1, sizeof( *reader ) );
+    if ( !reader )
+        FATAL_ERROR( calloc );
+
+    reader->map = ( uint8_t * )map;
+    reader->size = st.st_size;
+    reader->map_size = st.st_size;
+    reader->offset = RECORD_HEADER_SIZE;
+    record_read_index( reader );
+
+    memcpy( size, reader->map + 8, sizeof( size ) );
+    memcpy( &reader->start_us, reader->map + 16, sizeof( reader->start_us ) );
+    reader->rows = size[ 0 ];
+    reader->cols = size[ 1 ];
+
+    madvise( map, st.st_size, MADV_SEQUENTIAL );
+    return reader;
+}
+
+void record_close( record_reader *reader )
+{
+    if ( reader )
+    {
+        munmap( reader->map, reader->map_size );
+        free( reader->keyframes );
+        free( reader );
+    }
+}
+
+void record_get_info( record_reader *reader, int *rows, int *cols, int64_t *start_us )
+{
+    *rows = reader->rows;
+    *cols = reader->cols;
+    *start_us = reader->start_us;
+}
+
+// Read a varint at *pos. Returns 0 if it runs past end.
+static int record_get_varint( const uint8_t *p, size_t end, size_t *pos, uint64_t *v )
+{
+    int shift = 0;
+
+    *v = 0;
+    while ( *pos < end && shift < 64 )
+    {
+        uint8_t b = p[ ( *pos )++ ];
+
+        *v |= ( uint64_t )( b & 0x7f ) << shift;
+        if ( !( b & 0x80 ) )
+            return 1;
+        shift += 7;
+    }
+    return 0;
+}
+
+int record_next( record_reader *reader, record_event *event )
+{
+    uint64_t delta, len;
+    size_t pos = reader->offset;
+
+    if ( pos >= reader->size )
+        return 0;
+
+    memset( event, 0, sizeof( *event ) );
+    event->type = reader->map[ pos++ ];
+
+    // A partly written last event just ends the recording.
+    if ( !record_get_varint( reader->map, reader->size, &pos, &delta ) ||
+         !record_get_varint( reader->map, reader->size, &pos, &len ) ||
+         len > reader->size - pos )
+        return 0;
+
+    reader->time_us += delta;
+    event->time_us = reader->time_us;
+    event->data = reader->map + pos;
+    event->len = len;
+
+    switch ( event->type )
+    {
+    case RECORD_OUTPUT:
+    case RECORD_INPUT:
+    case RECORD_KEYFRAME:
+        break;
+
+    case RECORD_RESIZE:
+    {
+        uint64_t rows, cols;
+        size_t p = pos;
+
+        if ( !record_get_varint( reader->map, pos + len, &p, &rows ) ||
+             !record_get_varint( reader->map, pos + len, &p, &cols ) )
+            return -1;
+        event->rows = ( int )rows;
+        event->cols = ( int )cols;
+        break;
+    }
+
+    case RECORD_DROPPED:
+    {
+        size_t p = pos;
+
+        if ( !record_get_varint( reader->map, pos + len, &p, &event->dropped ) )
+            return -1;
+        break;
+    }
+
+    default:
+        return -1;
+    }
+
+    reader->offset = pos + len;
+    return 1;
+}
+
+// Find the keyframes of a recording without an index.
+static void record_scan_keyframes( record_reader *reader )
+{
+    size_t size = 0;
+    record_event event;
+
+    reader->offset = RECORD_HEADER_SIZE;
+    reader->time_us = 0;
+
+    for ( ;; )
+    {
+        size_t offset = reader->offset;
+
+        if ( record_next( reader, &event ) <= 0 )
+            break;
+        if ( event.type != RECORD_KEYFRAME )
+            continue;
+
+        if ( reader->keyframe_count == size )
+        {
+            size = MAX( 64, size * 2 );
+            reader->keyframes = ( record_keyframe_entry * )realloc( reader->keyframes, size * sizeof( reader->keyframes[ 0 ] ) );
+            if ( !reader->keyframes )
+                FATAL_ERROR( realloc );
+        }
+        reader->keyframes[ reader->keyframe_count ].time_us = event.time_us;
+        reader->keyframes[ reader->keyframe_count ].offset = offset;
+        reader->keyframe_count++;
+    }
+
+    reader->indexed = 1;
+}
+
+int record_seek( record_reader *reader, uint64_t time_us, record_event *event )
+{
+    size_t lo = 0;
+    size_t hi;
+
+    if ( !reader->indexed )
+        record_scan_keyframes( reader );
+
+    // Last keyframe at or before time_us.
+    hi = reader->keyframe_count;
+    while ( lo < hi )
+    {
+        size_t mid = lo + ( hi - lo ) / 2;
+
+        if ( reader->keyframes[ mid ].time_us <= time_us )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if ( lo && reader->keyframes[ lo - 1 ].offset < reader->size )
+    {
+        const record_keyframe_entry *entry = &reader->keyframes[ lo - 1 ];
+
+        reader->offset = entry->offset;
+        if ( record_next( reader, event ) > 0 && event->type == RECORD_KEYFRAME )
+        {
+            reader->time_us = entry->time_us;
+            event->time_us = entry->time_us;
+            return 1;
+        }
+        clog_warn( CLOG( 0 ), "Recording index entry %zu is bad", lo - 1 );
+    }
+
+    reader->offset = RECORD_HEADER_SIZE;
+    reader->time_us = 0;
+    return 0;
+}
+
+// Write data as a JSON string. Returns bytes of a trailing incomplete UTF-8
+// char which weren't written.
+static size_t record_json_string( FILE *out, const uint8_t *data, size_t len )
+{
+    size_t i = 0;
+
+    fputc( '"', out );
+    while ( i < len )
+    {
+        size_t n, k;
+        uint8_t c = data[ i ];
+
+        if ( c < 0x80 )
+        {
+            if ( c == '"' || c == '\\' )
+                fprintf( out, "\\%c", c );
+            else if ( c < 0x20 || c == 0x7f )
+                fprintf( out, "\\u%04x", c );
+            else
+                fputc( c, out );
+            i++;
+            continue;
+        }
+
+        n = ( c >= 0xf0 && c < 0xf8 ) ? 4 : ( c >= 0xe0 ) ? 3 : ( c >= 0xc2 && c < 0xe0 ) ? 2 : 0;
+        if ( c >= 0xf8 )
+            n = 0;
+
+        for ( k = 1; n && k < n && i + k < len; k++ )
+        {
+            if ( ( data[ i + k ] & 0xc0 ) != 0x80 )
+                n = 0;
+        }
+
+        if ( n && i + n > len )
+        {
+            // Rest of the char is in the next event.
+            break;
+        }
+
+        if ( !n )
+        {
+            fputs( "\\ufffd", out );
+            i++;
+            continue;
+        }
+
+        fwrite( data + i, 1, n, out );
+        i += n;
+    }
+    fputc( '"', out );
+
+    return len - i;
+}
+
+int record_to_asciicast( const char *path, FILE *out )
+{
+    int ret;
+    int rows, cols;
+    int64_t start_us;
+    record_event event;
+    uint8_t *carry[ 2 ] = { NULL, NULL };
+    size_t carry_len[ 2 ] = { 0, 0 };
+    size_t carry_size[ 2 ] = { 0, 0 };
+    record_reader *reader = record_open( path );
+
+    if ( !reader )
+        return -1;
+
+    record_get_info( reader, &rows, &cols, &start_us );
+    fprintf( out, "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %" PRId64 "}\n",
+             cols, rows, start_us / 1000000 );
+
+    while ( ( ret = record_next( reader, &event ) ) > 0 )
+    {
+        double t = event.time_us / 1000000.0;
+
+        if ( event.type == RECORD_OUTPUT || event.type == RECORD_INPUT )
+        {
+            // Keep UTF-8 chars split across events together.
+            int i = ( event.type == RECORD_INPUT );
+            size_t len = carry_len[ i ] + event.len;
+
+            if ( len > carry_size[ i ] )
+            {
+                carry_size[ i ] = MAX( len, carry_size[ i ] * 2 );
+                carry[ i ] = ( uint8_t * )realloc( carry[ i ], carry_size[ i ] );
+                if ( !carry[ i ] )
+                    FATAL_ERROR( realloc );
+            }
+            memcpy( carry[ i ] + carry_len[ i ], event.data, event.len );
+
+            fprintf( out, "[%.6f, \"%c\", ", t, i ? 'i' : 'o' );
+            carry_len[ i ] = record_json_string( out, carry[ i ], len );
+            fputs( "]\n", out );
+
+            memmove( carry[ i ], carry[ i ] + len - carry_len[ i ], carry_len[ i ] );
+        }
+        else if ( event.type == RECORD_RESIZE )
+        {
+            fprintf( out, "[%.6f, \"r\", \"%dx%d\"]\n", t, event.cols, event.rows );
+        }
+        else if ( event.type == RECORD_DROPPED )
+        {
+            fprintf( out, "[%.6f, \"m\", \"dropped %" PRIu64 " events\"]\n", t, event.dropped );
+        }
+    }
+
+    free( carry[ 0 ] );
+    free( carry[ 1 ] );
+    record_close( reader );
+
+    if ( ret < 0 )
+        clog_error( CLOG( 0 ), "%s is corrupt", path );
+    return ret;
+}
@@ -0,0 +1,88 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+// Session recordings: the child's output, keys sent to it and resizes,
+// with timestamps. Written by a background thread so the main loop never
+// waits on the disk.
+typedef struct record record;
+typedef struct record_reader record_reader;
+
+enum record_type
+{
+    RECORD_OUTPUT = 1, // Bytes read from the child.
+    RECORD_INPUT,      // Bytes written to the child.
+    RECORD_RESIZE,     // New rows / cols.
+    RECORD_DROPPED,    // Events lost because the writer fell behind.
+    RECORD_KEYFRAME,   // snapshot_encode of the screen.
+};
+
+typedef struct record_event
+{
+    int type;
+    uint64_t time_us; // Since the start of the recording.
+    const uint8_t *data;
+    size_t len;
+    int rows; // RECORD_RESIZE
+    int cols;
+    uint64_t dropped; // RECORD_DROPPED
+} record_event;
+
+// Start recording to path. Returns NULL on failure.
+record *record_create( const char *path, int rows, int cols );
+// Flush everything queued and close the file.
+void record_free( record *rec );
+
+void record_output( record *rec, const void *buf, size_t len );
+void record_input( record *rec, const void *buf, size_t len );
+void record_resize( record *rec, int rows, int cols );
+
+// Returns 1 when it's time for a keyframe: a snapshot of the screen which
+// lets replays seek without parsing everything before it.
+int record_keyframe_due( record *rec );
+void record_keyframe( record *rec, const void *buf, size_t len );
+
+// Read a recording. Returns NULL on failure.
+record_reader *record_open( const char *path );
+void record_close( record_reader *reader );
+
+// Size of the terminal and wall clock time (us) when recording started.
+void record_get_info( record_reader *reader, int *rows, int *cols, int64_t *start_us );
+// Get the next event. Returns 1, 0 at the end, or -1 if the file is corrupt.
+// event->data points into the reader and is valid until record_close.
+int record_next( record_reader *reader, record_event *event );
+// Move to the last keyframe at or before time_us and return it in event, so
+// record_next continues after it. Returns 0 and goes back to the start if
+// there isn't one.
+int record_seek( record_reader *reader, uint64_t time_us, record_event *event );
+
+// Write a recording out as asciicast v2. Returns 0 on success.
+int record_to_asciicast( const char *path, FILE *out );
+
+#endif // _RECORD_H_
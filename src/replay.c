@@ -0,0 +1,224 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/select.h>
+
+#include "vterm.h"
+#include "scrollback.h"
+#include "termwin.h"
+#include "record.h"
+#include "snapshot.h"
+#include "replay.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+// Wait until time ns. Returns 0 if a key asked to stop.
+static int replay_wait( termwin *twin, uint64_t time )
+{
+    for ( ;; )
+    {
+        int ch;
+        fd_set fds;
+        struct timeval tv;
+        uint64_t now = get_time_ns();
+
+        if ( now >= time )
+            return 1;
+
+        tv.tv_sec = ( time - now ) / 1000000000;
+        tv.tv_usec = ( ( time - now ) % 1000000000 ) / 1000;
+
+        FD_ZERO( &fds );
+        FD_SET( STDIN_FILENO, &fds );
+        if ( select( STDIN_FILENO + 1, &fds, NULL, NULL, &tv ) <= 0 )
+            continue;
+
+        while ( ( ch = termwin_getch( twin ) ) != -1 )
+        {
+            if ( ch == 'q' || ch == 0x03 )
+                return 0;
+        }
+    }
+}
+
+// Start from the screen in a keyframe event.
+static void replay_keyframe( VTerm *vt, termwin *twin, scrollback *sb, const record_event *event )
+{
+    int rows, cols;
+    snapshot *snap = snapshot_decode( event->data, event->len );
+
+    if ( !snap )
+    {
+        clog_warn( CLOG( 0 ), "Bad keyframe at %" PRIu64 " us", event->time_us );
+        return;
+    }
+
+    snapshot_get_size( snap, &rows, &cols );
+    vterm_set_size( vt, rows, cols );
+    if ( sb )
+        scrollback_set_width( sb, cols );
+
+    snapshot_restore( snap, vt, twin );
+    snapshot_free( snap );
+}
+
+int replay_run( const char *path, VTerm *vt, termwin *twin, scrollback *sb, int realtime, uint64_t seek_us,
+                replay_stats *stats )
+{
+    int ret;
+    int rows, cols;
+    int reached = !seek_us;
+    int64_t start_us;
+    uint64_t start;
+    termwin_stats tstats;
+    record_event event;
+    uint64_t *frame_ns = NULL;
+    size_t frame_size = 0;
+    record_reader *reader = record_open( path );
+
+    memset( stats, 0, sizeof( *stats ) );
+    if ( !reader )
+        return -1;
+
+    // Parse at the recorded size so the screen matches the original session.
+    record_get_info( reader, &rows, &cols, &start_us );
+    vterm_set_size( vt, rows, cols );
+    if ( sb )
+        scrollback_set_width( sb, cols );
+
+    start = get_time_ns();
+
+    if ( seek_us && record_seek( reader, seek_us, &event ) )
+        replay_keyframe( vt, twin, sb, &event );
+
+    while ( ( ret = record_next( reader, &event ) ) > 0 )
+    {
+        uint64_t t0, t1;
+        int catchup = ( event.time_us < seek_us );
+
+        if ( !catchup && !reached )
+        {
+            reached = 1;
+            stats->seek_ns = get_time_ns() - start;
+            start += stats->seek_ns;
+        }
+
+        if ( realtime && !catchup && !replay_wait( twin, start + ( event.time_us - seek_us ) * 1000 ) )
+            break;
+
+        if ( event.type == RECORD_RESIZE )
+        {
+            vterm_set_size( vt, event.rows, event.cols );
+            if ( sb )
+                scrollback_set_width( sb, event.cols );
+            continue;
+        }
+        else if ( event.type != RECORD_OUTPUT )
+        {
+            // There's no child to send input to.
+            continue;
+        }
+
+        // Parse without drawing until we get to seek_us.
+        if ( catchup )
+        {
+            vterm_input_write( vt, ( const char * )event.data, event.len );
+            continue;
+        }
+
+        t0 = get_time_ns();
+        vterm_input_write( vt, ( const char * )event.data, event.len );
+        t1 = get_time_ns();
+
+        // One frame per read from the child, like the main loop.
+        termwin_refresh( twin );
+
+        if ( stats->events >= frame_size )
+        {
+            frame_size = MAX( 4096, frame_size * 2 );
+            frame_ns = ( uint64_t * )realloc( frame_ns, frame_size * sizeof( frame_ns[ 0 ] ) );
+            if ( !frame_ns )
+                FATAL_ERROR( realloc );
+        }
+        frame_ns[ stats->events ] = get_time_ns() - t1;
+
+        stats->parse_ns += t1 - t0;
+        stats->render_ns += frame_ns[ stats->events ];
+        stats->bytes += event.len;
+        stats->events++;
+    }
+
+    stats->wall_ns = get_time_ns() - start;
+
+    termwin_get_stats( twin, &tstats );
+    stats->frames = tstats.frames;
+    stats->cells = tstats.cells;
+
+    stats->frame_p50_ns = percentile_u64( frame_ns, stats->events, 50 );
+    stats->frame_p99_ns = percentile_u64( frame_ns, stats->events, 99 );
+    stats->frame_max_ns = percentile_u64( frame_ns, stats->events, 100 );
+
+    clog_info( CLOG( 0 ), "replay %s: %" PRIu64 " bytes, %" PRIu64 " frames, %" PRIu64 " cells",
+               path, stats->bytes, stats->frames, stats->cells );
+
+    free( frame_ns );
+    record_close( reader );
+
+    if ( ret < 0 )
+    {
+        clog_error( CLOG( 0 ), "%s is corrupt", path );
+        return -1;
+    }
+    if ( !reached )
+    {
+        clog_warn( CLOG( 0 ), "%s ends before %" PRIu64 " us", path, seek_us );
+        return -2;
+    }
+    return 0;
+}
+
+void replay_print_stats( const replay_stats *stats )
+{
+    double busy = ( stats->parse_ns + stats->render_ns ) / 1e9;
+    double mb = stats->bytes / ( 1024.0 * 1024.0 );
+
+    printf( "bytes:      %" PRIu64 " (%.2f MB in %" PRIu64 " reads)\n", stats->bytes, mb, stats->events );
+    printf( "parse:      %.3f s, %.2f MB/s\n", stats->parse_ns / 1e9, stats->parse_ns ? mb / ( stats->parse_ns / 1e9 ) : 0.0 );
+    printf( "parse+draw: %.3f s, %.2f MB/s\n", busy, busy > 0 ? mb / busy : 0.0 );
+    printf( "wall:       %.3f s\n", stats->wall_ns / 1e9 );
+    if ( stats->seek_ns )
+        printf( "seek:       %.3f s\n", stats->seek_ns / 1e9 );
+    printf( "frames:     %" PRIu64 "\n", stats->frames );
+    printf( "cells:      %" PRIu64 "\n", stats->cells );
+    printf( "frame time: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+            stats->frame_p50_ns / 1e3, stats->frame_p99_ns / 1e3, stats->frame_max_ns / 1e3 );
+}
@@ -0,0 +1,58 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+// Feed a recording through vterm and termwin without a child process.
+
+typedef struct replay_stats
+{
+    uint64_t bytes;       // Output bytes parsed.
+    uint64_t events;      // Output events.
+    uint64_t frames;      // Refreshes that updated the terminal.
+    uint64_t cells;       // Cells drawn.
+    uint64_t parse_ns;    // Time in vterm_input_write.
+    uint64_t render_ns;   // Time in termwin_refresh.
+    uint64_t wall_ns;     // Whole replay, including waits in realtime mode.
+    uint64_t seek_ns;     // Loading a keyframe and parsing up to the seek time.
+    uint64_t frame_p50_ns;
+    uint64_t frame_p99_ns;
+    uint64_t frame_max_ns;
+} replay_stats;
+
+// Replay path with its original timing if realtime is set, otherwise as
+// fast as possible. Starts seek_us into the recording from the keyframe
+// before it. q or Ctrl+C stops it. Returns 0 on success, -2 if the recording
+// ends before seek_us, or -1 if it can't be read.
+int replay_run( const char *path, VTerm *vt, termwin *twin, scrollback *sb, int realtime, uint64_t seek_us,
+                replay_stats *stats );
+
+// Print stats to stdout.
+void replay_print_stats( const replay_stats *stats );
+
+#endif // _REPLAY_H_
@@ -0,0 +1,1505 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "vterm.h"
+#include "search.h"
+#include "scrollback.h"
+#include "lz.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+/*
+    Lines are encoded into records which are appended to 64KB arena blocks:
+
+        sb_line_hdr
+        sb_run[ nruns ]     style runs covering the stored cells
+        char text[ textlen ] UTF-8, one char per cell plus markers below
+
+    Trailing blank cells which share the style of the last cell are trimmed.
+    The last run's style is used to fill cells past the end of the record.
+    Lines with one run in the default (zero) style store no runs at all.
+
+    Each line has an 8 byte ref (block id, offset) in an index made of fixed
+    size pages, so finding any line is O(1). Push appends to the newest block,
+    pop removes from it, and history limits drop lines / blocks from the front.
+
+    With scrollback_set_spill, sealed blocks and full index pages older than
+    the newest few are written to an unlinked file in a cache directory and
+    read back through MAP_SHARED mappings of 64MB file segments. The kernel
+    page cache decides what stays resident; evicted history is hole punched
+    out of the file.
+
+    When a block fills up and gets sealed, it's compressed with the LZ codec
+    in lz.c. Style runs are already run length encoded per line, and the LZ
+    pass catches the runs and text prefixes that repeat from line to line.
+    Lines in compressed blocks are read through a small LRU cache of
+    decompressed blocks.
+
+    Soft wrapped lines are flagged with SB_LINE_WRAPPED, and a run of
+    wrapped lines plus the line ending it form one logical line. Reading
+    history through scrollback_pos wraps logical lines to the current width
+    as they're needed, with a cache of the wrapping, so a resize costs
+    nothing up front no matter how much history there is.
+
+    Every block also has a 32K bit set of the trigrams in its lines' text,
+    which lives right after the (compressed) block data and gets spilled
+    along with it.
+    Searches skip blocks missing any trigram the query requires, so only a
+    few blocks (and their pages on disk) get looked at for rare strings.
+*/
+
+#define SB_BLOCK_SIZE ( 64 * 1024 )
+#define SB_INDEX_SHIFT 12
+#define SB_INDEX_PAGE_LINES ( 1 << SB_INDEX_SHIFT )
+#define SB_INDEX_PAGE_SIZE ( SB_INDEX_PAGE_LINES * sizeof( sb_line_ref ) )
+#define SB_MAX_TEXTLEN 0xffff
+
+#define SB_SPILL_SEGMENT_SIZE ( 64 * 1024 * 1024 )
+#define SB_SPILL_ALIGN 4096
+#define SB_SPILL_RAM_PAGES 2
+
+// libvterm never stores C0 controls in cells, so these can't collide with text.
+#define SB_TEXT_WIDE 0x1e      // Next char is double width and owns the following cell.
+#define SB_TEXT_COMBINING 0x1f // Next char combines with the previous cell.
+
+#define SB_ALIGN( _x ) ( ( ( _x ) + 1 ) & ~( size_t )1 )
+
+#define SB_TRIGRAM_BITS ( 32 * 1024 )
+#define SB_TRIGRAM_BYTES ( SB_TRIGRAM_BITS / 8 )
+#define SB_TRIGRAM_OFFSET( _x ) ( ( ( _x ) + 7 ) & ~( size_t )7 )
+
+#define SB_CACHE_BLOCKS 4
+
+#define SB_LINE_WRAPPED 0x1 // hdr.flags: line continues on the next one.
+#define SB_LINE_SPLIT 0x2   // hdr.flags: starts a logical line despite the wrap.
+#define SB_WRAP_CACHE_LINES 256
+#define SB_WRAP_MAX_LINES 1024 // Longest logical line we'll join up.
+
+typedef struct sb_line_hdr
+{
+    uint16_t cols;    // Width of the screen when the line was pushed.
+    uint16_t ncells;  // Cells stored after trimming trailing blanks.
+    uint16_t nruns;   // Style runs following the header.
+    uint16_t textlen; // Bytes of text following the runs.
+    uint16_t flags;
+} sb_line_hdr;
+
+typedef struct sb_run
+{
+    uint16_t ncells;
+    uint16_t attrs;
+    VTermColor fg;
+    VTermColor bg;
+} sb_run;
+
+typedef struct sb_line_ref
+{
+    uint32_t block;
+    uint32_t offset;
+} sb_line_ref;
+
+typedef struct sb_block
+{
+    uint8_t *data;
+    uint32_t size;
+    uint32_t used;
+    uint32_t raw_size;    // Size of data before compression.
+    uint32_t comp_size;   // Compressed size of data, 0 if not compressed.
+    uint32_t nlines;      // Lines in this block still stored.
+    int sealed;           // Full: nothing more gets appended.
+    int64_t spill_offset; // Offset in spill file, -1 while in RAM.
+    uint64_t first_line;  // Line number of the first record.
+    uint8_t *trigrams;    // SB_TRIGRAM_BITS bit set, stored after data.
+} sb_block;
+
+typedef struct sb_cache_entry
+{
+    const sb_block *block;
+    uint8_t *data;
+    size_t size;
+    uint64_t tick; // Last use.
+} sb_cache_entry;
+
+// A logical line and where it breaks into rows at the current width.
+typedef struct sb_wrap
+{
+    uint64_t line;   // First stored line.
+    uint32_t nlines; // Stored lines joined up.
+    int width;
+    uint64_t gen;    // scrollback wrap_gen when wrapped.
+
+    VTermScreenCell *cells;
+    size_t ncells;
+    size_t cells_size;
+    VTermScreenCell fill; // Blank in the style of the end of line.
+
+    size_t *rows; // Cell each row starts at, plus one past the end.
+    int nrows;
+    size_t rows_size;
+} sb_wrap;
+
+typedef struct sb_page
+{
+    sb_line_ref *refs;
+    int64_t spill_offset;
+} sb_page;
+
+typedef struct sb_segment
+{
+    uint8_t *map;
+    size_t live; // Spilled blocks and pages still stored in this segment.
+} sb_segment;
+
+// Power of two ring of pointers.
+typedef struct sb_ptrq
+{
+    void **items;
+    size_t head;
+    size_t count;
+    size_t cap;
+} sb_ptrq;
+
+struct scrollback
+{
+    size_t max_lines;
+    size_t max_bytes;
+
+    uint64_t first_line;  // Oldest stored line.
+    uint64_t end_line;    // One past newest stored line.
+    uint64_t first_block; // Id of blocks[ 0 ].
+    uint64_t first_page;  // Page number of pages[ 0 ].
+
+    sb_ptrq blocks; // sb_block *
+    sb_ptrq pages;  // sb_page *
+    size_t bytes;         // RAM used by blocks and index pages.
+    size_t spilled_bytes; // Bytes stored in the spill file.
+
+    // Blocks before spill_block and pages before spill_page are on disk.
+    int spill_fd;
+    int spill_enabled;
+    size_t spill_ram_blocks;
+    uint64_t spill_block;
+    uint64_t spill_page;
+    uint64_t spill_end;
+    sb_segment *segments;
+    size_t nsegments;
+
+    // Decompressed blocks.
+    sb_cache_entry cache[ SB_CACHE_BLOCKS ];
+    uint64_t cache_tick;
+
+    // Width history is wrapped to and cache of wrapped logical lines.
+    int width;
+    uint64_t wrap_gen;
+    uint64_t tail_line; // First line of the newest logical line.
+    int tail_open;      // Newest line is wrapped.
+    sb_wrap *wraps;
+
+    size_t raw_bytes;  // Compressed blocks' original size.
+    size_t comp_bytes; // Compressed blocks' size.
+    uint64_t decodes;
+    uint64_t decode_ns;
+
+    uint8_t *scratch;
+    size_t scratch_size;
+    uint8_t *comp;
+    size_t comp_size;
+    sb_run *runs;
+    size_t runs_size;
+    char *text;
+    size_t text_size;
+};
+
+static void sb_ptrq_push_back( sb_ptrq *q, void *item )
+{
+    if ( q->count == q->cap )
+    {
+        size_t i;
+        size_t cap = q->cap ? q->cap * 2 : 16;
+        void **items = ( void ** )malloc( cap * sizeof( void * ) );
+
+        if ( !items )
+            FATAL_ERROR( malloc );
+
+        for ( i = 0; i < q->count; i++ )
+            items[ i ] = q->items[ ( q->head + i ) & ( q->cap - 1 ) ];
+
+        free( q->items );
+        q->items = items;
+        q->head = 0;
+        q->cap = cap;
+    }
+
+    q->items[ ( q->head + q->count++ ) & ( q->cap - 1 ) ] = item;
+}
+
+static void *sb_ptrq_get( const sb_ptrq *q, size_t i )
+{
+    return q->items[ ( q->head + i ) & ( q->cap - 1 ) ];
+}
+
+static void *sb_ptrq_pop_front( sb_ptrq *q )
+{
+    void *item = q->items[ q->head ];
+
+    q->head = ( q->head + 1 ) & ( q->cap - 1 );
+    q->count--;
+    return item;
+}
+
+static void *sb_ptrq_pop_back( sb_ptrq *q )
+{
+    return q->items[ ( q->head + --q->count ) & ( q->cap - 1 ) ];
+}
+
+static void *sb_grow( void *buf, size_t *size, size_t needed )
+{
+    if ( needed > *size )
+    {
+        *size = MAX( needed, *size * 2 );
+
+        buf = realloc( buf, *size );
+        if ( !buf )
+            FATAL_ERROR( realloc );
+    }
+    return buf;
+}
+
+static const uint8_t *sb_utf8_decode( const uint8_t *src, const uint8_t *end, uint32_t *c )
+{
+    int len;
+    uint32_t ch = *src++;
+
+    if ( ch < 0x80 )
+        len = 0;
+    else if ( ch < 0xe0 )
+        len = 1, ch &= 0x1f;
+    else if ( ch < 0xf0 )
+        len = 2, ch &= 0x0f;
+    else
+        len = 3, ch &= 0x07;
+
+    while ( len-- && src < end )
+        ch = ( ch << 6 ) | ( *src++ & 0x3f );
+
+    *c = ch;
+    return src;
+}
+
+static uint16_t sb_pack_attrs( const VTermScreenCell *cell )
+{
+    return cell->attrs.bold |
+           ( cell->attrs.underline << 1 ) |
+           ( cell->attrs.italic << 3 ) |
+           ( cell->attrs.blink << 4 ) |
+           ( cell->attrs.reverse << 5 ) |
+           ( cell->attrs.strike << 6 ) |
+           ( cell->attrs.font << 7 ) |
+           ( cell->attrs.dwl << 11 ) |
+           ( cell->attrs.dhl << 12 );
+}
+
+static void sb_unpack_run( const sb_run *run, VTermScreenCell *cell )
+{
+    cell->attrs.bold = run->attrs & 1;
+    cell->attrs.underline = ( run->attrs >> 1 ) & 3;
+    cell->attrs.italic = ( run->attrs >> 3 ) & 1;
+    cell->attrs.blink = ( run->attrs >> 4 ) & 1;
+    cell->attrs.reverse = ( run->attrs >> 5 ) & 1;
+    cell->attrs.strike = ( run->attrs >> 6 ) & 1;
+    cell->attrs.font = ( run->attrs >> 7 ) & 15;
+    cell->attrs.dwl = ( run->attrs >> 11 ) & 1;
+    cell->attrs.dhl = ( run->attrs >> 12 ) & 3;
+    cell->fg = run->fg;
+    cell->bg = run->bg;
+}
+
+static void sb_cell_run( const VTermScreenCell *cell, sb_run *run )
+{
+    run->ncells = 0;
+    run->attrs = sb_pack_attrs( cell );
+    run->fg = cell->fg;
+    run->bg = cell->bg;
+}
+
+static int sb_run_equal( const sb_run *a, const sb_run *b )
+{
+    return ( a->attrs == b->attrs ) &&
+           !memcmp( &a->fg, &b->fg, sizeof( a->fg ) ) &&
+           !memcmp( &a->bg, &b->bg, sizeof( a->bg ) );
+}
+
+static int sb_run_is_default( const sb_run *run )
+{
+    static const sb_run s_default_run;
+
+    return sb_run_equal( run, &s_default_run );
+}
+
+static int sb_cell_is_blank( const VTermScreenCell *cell )
+{
+    return ( cell->chars[ 0 ] == 0 ) ||
+           ( cell->chars[ 0 ] == ' ' && cell->chars[ 1 ] == 0 );
+}
+
+// Encode cells into sb->scratch. Returns size of the record.
+static size_t sb_encode_line( scrollback *sb, int cols, const VTermScreenCell *cells, int flags )
+{
+    int col;
+    int ncells = cols;
+    size_t textlen = 0;
+    size_t nruns = 0;
+    sb_run eol_run = { 0 };
+    sb_line_hdr hdr;
+    uint8_t *text;
+
+    cols = MIN( cols, 0xffff );
+
+    if ( cols > 0 )
+    {
+        sb_run run;
+
+        // Trim trailing blanks in the same style as the last cell.
+        sb_cell_run( &cells[ cols - 1 ], &eol_run );
+
+        for ( ncells = cols; ncells > 0; ncells-- )
+        {
+            sb_cell_run( &cells[ ncells - 1 ], &run );
+            if ( !sb_cell_is_blank( &cells[ ncells - 1 ] ) || !sb_run_equal( &run, &eol_run ) )
+                break;
+        }
+    }
+
+    // Worst case: every cell has its own run and full set of combining chars.
+    sb->runs = ( sb_run * )sb_grow( sb->runs, &sb->runs_size, ( ncells + 1 ) * sizeof( sb_run ) );
+    sb->scratch = ( uint8_t * )sb_grow( sb->scratch, &sb->scratch_size,
+                                        sizeof( hdr ) + ( ncells + 1 ) * sizeof( sb_run ) +
+                                            ncells * ( 1 + VTERM_MAX_CHARS_PER_CELL * 5 ) );
+    text = sb->scratch + sizeof( hdr ) + ( ncells + 1 ) * sizeof( sb_run );
+
+    for ( col = 0; col < ncells; col++ )
+    {
+        int i;
+        sb_run run;
+        const VTermScreenCell *cell = &cells[ col ];
+
+        if ( textlen + 1 + VTERM_MAX_CHARS_PER_CELL * 5 > SB_MAX_TEXTLEN )
+        {
+            ncells = col;
+            break;
+        }
+
+        sb_cell_run( cell, &run );
+        if ( nruns && sb_run_equal( &sb->runs[ nruns - 1 ], &run ) )
+            sb->runs[ nruns - 1 ].ncells++;
+        else
+        {
+            run.ncells = 1;
+            sb->runs[ nruns++ ] = run;
+        }
+
+        if ( cell->chars[ 0 ] == ( uint32_t )-1 )
+        {
+            // Continuation of a wide char we already wrote.
+            if ( col && cells[ col - 1 ].width == 2 )
+                continue;
+
+            text[ textlen++ ] = ' ';
+            continue;
+        }
+
+        if ( cell->width == 2 && col + 1 < ncells )
+            text[ textlen++ ] = SB_TEXT_WIDE;
+
+        textlen += utf8_encode( text + textlen, cell->chars[ 0 ] ? cell->chars[ 0 ] : ' ' );
+
+        for ( i = 1; i < VTERM_MAX_CHARS_PER_CELL && cell->chars[ i ]; i++ )
+        {
+            text[ textlen++ ] = SB_TEXT_COMBINING;
+            textlen += utf8_encode( text + textlen, cell->chars[ i ] );
+        }
+    }
+
+    if ( !nruns || !sb_run_equal( &sb->runs[ nruns - 1 ], &eol_run ) )
+        sb->runs[ nruns++ ] = eol_run;
+
+    if ( nruns == 1 && sb_run_is_default( &sb->runs[ 0 ] ) )
+        nruns = 0;
+
+    hdr.cols = cols;
+    hdr.ncells = ncells;
+    hdr.nruns = nruns;
+    hdr.textlen = textlen;
+    hdr.flags = flags;
+
+    memcpy( sb->scratch, &hdr, sizeof( hdr ) );
+    memcpy( sb->scratch + sizeof( hdr ), sb->runs, nruns * sizeof( sb_run ) );
+    memmove( sb->scratch + sizeof( hdr ) + nruns * sizeof( sb_run ), text, textlen );
+
+    return sizeof( hdr ) + nruns * sizeof( sb_run ) + textlen;
+}
+
+static void sb_decode_line( const uint8_t *rec, int cols, VTermScreenCell *cells )
+{
+    int col = 0;
+    size_t run = 0;
+    size_t run_left;
+    sb_line_hdr hdr;
+    VTermScreenCell blank;
+    const sb_run *runs = ( const sb_run * )( rec + sizeof( hdr ) );
+    const uint8_t *text;
+    const uint8_t *text_end;
+
+    memcpy( &hdr, rec, sizeof( hdr ) );
+    text = rec + sizeof( hdr ) + hdr.nruns * sizeof( sb_run );
+    text_end = text + hdr.textlen;
+
+    memset( &blank, 0, sizeof( blank ) );
+    blank.width = 1;
+    if ( hdr.nruns )
+        sb_unpack_run( &runs[ 0 ], &blank );
+    run_left = hdr.nruns ? runs[ 0 ].ncells : ( size_t )-1;
+
+    while ( text < text_end && col < cols )
+    {
+        int i;
+        int wide = 0;
+        uint32_t ch;
+        VTermScreenCell *cell = &cells[ col ];
+
+        // Move to the run for this cell.
+        while ( !run_left && run + 1 < hdr.nruns )
+        {
+            run_left = runs[ ++run ].ncells;
+            sb_unpack_run( &runs[ run ], &blank );
+        }
+
+        if ( *text == SB_TEXT_WIDE )
+        {
+            wide = 1;
+            text++;
+        }
+
+        *cell = blank;
+        text = sb_utf8_decode( text, text_end, &ch );
+        cell->chars[ 0 ] = ch;
+
+        for ( i = 1; i < VTERM_MAX_CHARS_PER_CELL && text < text_end && *text == SB_TEXT_COMBINING; i++ )
+        {
+            text = sb_utf8_decode( text + 1, text_end, &ch );
+            cell->chars[ i ] = ch;
+        }
+
+        run_left--;
+        col++;
+
+        if ( wide && col < cols )
+        {
+            cell->width = 2;
+
+            cells[ col ] = blank;
+            cells[ col ].chars[ 0 ] = ( uint32_t )-1;
+            run_left--;
+            col++;
+        }
+    }
+
+    // Fill the rest with blanks in the last run's style.
+    if ( hdr.nruns )
+        sb_unpack_run( &runs[ hdr.nruns - 1 ], &blank );
+
+    for ( ; col < cols; col++ )
+        cells[ col ] = blank;
+}
+
+// Get the text of a record without markers into sb->text. Returns length.
+static size_t sb_line_text( scrollback *sb, const uint8_t *rec )
+{
+    size_t i;
+    size_t len = 0;
+    sb_line_hdr hdr;
+    const uint8_t *text;
+
+    memcpy( &hdr, rec, sizeof( hdr ) );
+    text = rec + sizeof( hdr ) + hdr.nruns * sizeof( sb_run );
+
+    sb->text = ( char * )sb_grow( sb->text, &sb->text_size, hdr.textlen + 1 );
+
+    for ( i = 0; i < hdr.textlen; i++ )
+    {
+        if ( text[ i ] != SB_TEXT_WIDE && text[ i ] != SB_TEXT_COMBINING )
+            sb->text[ len++ ] = text[ i ];
+    }
+    return len;
+}
+
+static void sb_index_line( scrollback *sb, sb_block *block, const uint8_t *rec )
+{
+    size_t i;
+    size_t len = sb_line_text( sb, rec );
+
+    for ( i = 0; i + 3 <= len; i++ )
+    {
+        uint32_t bit = search_trigram( ( const uint8_t * )sb->text + i ) & ( SB_TRIGRAM_BITS - 1 );
+
+        block->trigrams[ bit >> 3 ] |= 1 << ( bit & 7 );
+    }
+}
+
+static int sb_block_may_match( const sb_block *block, const uint32_t *trigrams, size_t ntrigrams )
+{
+    size_t i;
+
+    for ( i = 0; i < ntrigrams; i++ )
+    {
+        uint32_t bit = trigrams[ i ] & ( SB_TRIGRAM_BITS - 1 );
+
+        if ( !( block->trigrams[ bit >> 3 ] & ( 1 << ( bit & 7 ) ) ) )
+            return 0;
+    }
+    return 1;
+}
+
+// Bytes of data actually stored for the block.
+static size_t sb_block_stored( const sb_block *block )
+{
+    return block->comp_size ? block->comp_size : block->used;
+}
+
+// Get the uncompressed records for a block.
+static const uint8_t *sb_block_data( scrollback *sb, const sb_block *block )
+{
+    int i;
+    struct timespec t0, t1;
+    sb_cache_entry *entry = &sb->cache[ 0 ];
+
+    if ( !block->comp_size )
+        return block->data;
+
+    sb->cache_tick++;
+
+    for ( i = 0; i < SB_CACHE_BLOCKS; i++ )
+    {
+        if ( sb->cache[ i ].block == block )
+        {
+            sb->cache[ i ].tick = sb->cache_tick;
+            return sb->cache[ i ].data;
+        }
+        if ( sb->cache[ i ].tick < entry->tick )
+            entry = &sb->cache[ i ];
+    }
+
+    entry->data = ( uint8_t * )sb_grow( entry->data, &entry->size, block->raw_size );
+
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+    if ( lz_decompress( block->data, block->comp_size, entry->data, block->raw_size ) != block->raw_size )
+        FATAL_ERROR( lz_decompress );
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+
+    sb->decodes++;
+    sb->decode_ns += ( t1.tv_sec - t0.tv_sec ) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+
+    entry->block = block;
+    entry->tick = sb->cache_tick;
+    return entry->data;
+}
+
+// Compress a block which is done being appended to.
+static void sb_block_seal( scrollback *sb, sb_block *block )
+{
+    size_t size;
+    uint8_t *data;
+
+    block->sealed = 1;
+
+    // Keep it as is unless we save at least 1/8th.
+    sb->comp = ( uint8_t * )sb_grow( sb->comp, &sb->comp_size, block->used );
+    size = lz_compress( block->data, block->used, sb->comp, block->used - block->used / 8 );
+    if ( !size )
+        return;
+
+    // New allocation with the compressed data and trigrams.
+    data = ( uint8_t * )malloc( SB_TRIGRAM_OFFSET( size ) + SB_TRIGRAM_BYTES );
+    if ( !data )
+        FATAL_ERROR( malloc );
+
+    memcpy( data, sb->comp, size );
+    memcpy( data + SB_TRIGRAM_OFFSET( size ), block->trigrams, SB_TRIGRAM_BYTES );
+
+    sb->bytes -= SB_TRIGRAM_OFFSET( block->size ) + SB_TRIGRAM_BYTES;
+    sb->bytes += SB_TRIGRAM_OFFSET( size ) + SB_TRIGRAM_BYTES;
+    free( block->data );
+
+    block->data = data;
+    block->trigrams = data + SB_TRIGRAM_OFFSET( size );
+    block->size = size;
+    block->raw_size = block->used;
+    block->comp_size = size;
+
+    sb->raw_bytes += block->raw_size;
+    sb->comp_bytes += block->comp_size;
+}
+
+static sb_line_ref *sb_line_ref_get( scrollback *sb, uint64_t line )
+{
+    sb_page *page = ( sb_page * )sb_ptrq_get( &sb->pages, ( line >> SB_INDEX_SHIFT ) - sb->first_page );
+
+    return &page->refs[ line & ( SB_INDEX_PAGE_LINES - 1 ) ];
+}
+
+static sb_block *sb_block_get( scrollback *sb, uint32_t id )
+{
+    return ( sb_block * )sb_ptrq_get( &sb->blocks, ( uint32_t )( id - ( uint32_t )sb->first_block ) );
+}
+
+// Write data to the spill file. Returns where it can be read in the file
+// mapping or NULL on failure.
+static uint8_t *sb_spill_write( scrollback *sb, const void *data, size_t size, int64_t *offset )
+{
+    uint64_t off = sb->spill_end;
+    size_t seg = off / SB_SPILL_SEGMENT_SIZE;
+
+    if ( size > SB_SPILL_SEGMENT_SIZE )
+        return NULL;
+
+    // Objects never straddle segments.
+    if ( ( off + size - 1 ) / SB_SPILL_SEGMENT_SIZE != seg )
+    {
+        seg++;
+        off = ( uint64_t )seg * SB_SPILL_SEGMENT_SIZE;
+    }
+
+    if ( seg >= sb->nsegments )
+    {
+        void *map;
+
+        sb->segments = ( sb_segment * )realloc( sb->segments, ( seg + 1 ) * sizeof( sb_segment ) );
+        if ( !sb->segments )
+            FATAL_ERROR( realloc );
+
+        if ( ftruncate( sb->spill_fd, ( off_t )( seg + 1 ) * SB_SPILL_SEGMENT_SIZE ) )
+        {
+            clog_error( CLOG( 0 ), "ftruncate spill file failed: %d", errno );
+            return NULL;
+        }
+
+        map = mmap( NULL, SB_SPILL_SEGMENT_SIZE, PROT_READ, MAP_SHARED, sb->spill_fd,
+                    ( off_t )seg * SB_SPILL_SEGMENT_SIZE );
+        if ( map == MAP_FAILED )
+        {
+            clog_error( CLOG( 0 ), "mmap spill file failed: %d", errno );
+            return NULL;
+        }
+
+        sb->segments[ seg ].map = ( uint8_t * )map;
+        sb->segments[ seg ].live = 0;
+        sb->nsegments = seg + 1;
+    }
+
+    if ( TEMP_FAILURE_RETRY( pwrite( sb->spill_fd, data, size, ( off_t )off ) ) != ( ssize_t )size )
+    {
+        clog_error( CLOG( 0 ), "pwrite spill file failed: %d", errno );
+        return NULL;
+    }
+
+    sb->segments[ seg ].live++;
+    sb->spill_end = ( off + size + SB_SPILL_ALIGN - 1 ) & ~( uint64_t )( SB_SPILL_ALIGN - 1 );
+    sb->spilled_bytes += size;
+
+    *offset = off;
+    return sb->segments[ seg ].map + ( off - ( uint64_t )seg * SB_SPILL_SEGMENT_SIZE );
+}
+
+static void sb_spill_release( scrollback *sb, int64_t offset, size_t size )
+{
+    size_t seg = offset / SB_SPILL_SEGMENT_SIZE;
+
+    sb->spilled_bytes -= size;
+
+    // Give the disk space back. Not every filesystem can, which is fine.
+    fallocate( sb->spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+               ( size + SB_SPILL_ALIGN - 1 ) & ~( size_t )( SB_SPILL_ALIGN - 1 ) );
+
+    if ( !--sb->segments[ seg ].live && seg + 1 < sb->nsegments )
+    {
+        munmap( sb->segments[ seg ].map, SB_SPILL_SEGMENT_SIZE );
+        sb->segments[ seg ].map = NULL;
+    }
+}
+
+static sb_block *sb_block_new( scrollback *sb, size_t size )
+{
+    sb_block *block = ( sb_block * )malloc( sizeof( *block ) );
+
+    if ( !block )
+        FATAL_ERROR( malloc );
+
+    block->data = ( uint8_t * )malloc( SB_TRIGRAM_OFFSET( size ) + SB_TRIGRAM_BYTES );
+    if ( !block->data )
+        FATAL_ERROR( malloc );
+
+    block->size = size;
+    block->used = 0;
+    block->raw_size = 0;
+    block->comp_size = 0;
+    block->nlines = 0;
+    block->sealed = 0;
+    block->spill_offset = -1;
+    block->first_line = sb->end_line;
+    block->trigrams = block->data + SB_TRIGRAM_OFFSET( size );
+    memset( block->trigrams, 0, SB_TRIGRAM_BYTES );
+
+    sb_ptrq_push_back( &sb->blocks, block );
+    sb->bytes += SB_TRIGRAM_OFFSET( size ) + SB_TRIGRAM_BYTES;
+    return block;
+}
+
+static void sb_block_free( scrollback *sb, sb_block *block )
+{
+    int i;
+
+    for ( i = 0; i < SB_CACHE_BLOCKS; i++ )
+    {
+        if ( sb->cache[ i ].block == block )
+        {
+            sb->cache[ i ].block = NULL;
+            sb->cache[ i ].tick = 0;
+        }
+    }
+
+    if ( block->comp_size )
+    {
+        sb->raw_bytes -= block->raw_size;
+        sb->comp_bytes -= block->comp_size;
+    }
+
+    if ( block->spill_offset >= 0 )
+    {
+        sb_spill_release( sb, block->spill_offset, block->size );
+    }
+    else
+    {
+        sb->bytes -= SB_TRIGRAM_OFFSET( block->size ) + SB_TRIGRAM_BYTES;
+        free( block->data );
+    }
+    free( block );
+}
+
+static void sb_page_new( scrollback *sb )
+{
+    sb_page *page = ( sb_page * )malloc( sizeof( *page ) );
+
+    if ( !page )
+        FATAL_ERROR( malloc );
+
+    page->refs = ( sb_line_ref * )malloc( SB_INDEX_PAGE_SIZE );
+    if ( !page->refs )
+        FATAL_ERROR( malloc );
+
+    page->spill_offset = -1;
+
+    sb_ptrq_push_back( &sb->pages, page );
+    sb->bytes += SB_INDEX_PAGE_SIZE;
+}
+
+static void sb_page_free( scrollback *sb, sb_page *page )
+{
+    if ( page->spill_offset >= 0 )
+    {
+        sb_spill_release( sb, page->spill_offset, SB_INDEX_PAGE_SIZE );
+    }
+    else
+    {
+        sb->bytes -= SB_INDEX_PAGE_SIZE;
+        free( page->refs );
+    }
+    free( page );
+}
+
+// Bring a spilled index page back into RAM so it can be written again.
+static void sb_page_unspill( scrollback *sb, sb_page *page )
+{
+    sb_line_ref *refs = ( sb_line_ref * )malloc( SB_INDEX_PAGE_SIZE );
+
+    if ( !refs )
+        FATAL_ERROR( malloc );
+
+    memcpy( refs, page->refs, SB_INDEX_PAGE_SIZE );
+    sb_spill_release( sb, page->spill_offset, SB_INDEX_PAGE_SIZE );
+
+    page->refs = refs;
+    page->spill_offset = -1;
+    sb->bytes += SB_INDEX_PAGE_SIZE;
+}
+
+// Move sealed blocks and full index pages past the RAM window to disk.
+static void sb_spill( scrollback *sb )
+{
+    uint64_t end_block = sb->first_block + sb->blocks.count;
+    uint64_t end_page = sb->first_page + sb->pages.count;
+
+    if ( !sb->spill_enabled )
+        return;
+
+    sb->spill_block = MAX( sb->spill_block, sb->first_block );
+    while ( sb->spill_block + sb->spill_ram_blocks < end_block )
+    {
+        int64_t offset;
+        uint8_t *data;
+        sb_block *block = sb_block_get( sb, ( uint32_t )sb->spill_block );
+        size_t len = SB_TRIGRAM_OFFSET( sb_block_stored( block ) );
+
+        // Pack the trigrams right after the used part of the block.
+        memmove( block->data + len, block->trigrams, SB_TRIGRAM_BYTES );
+        block->trigrams = block->data + len;
+
+        data = sb_spill_write( sb, block->data, len + SB_TRIGRAM_BYTES, &offset );
+        if ( !data )
+        {
+            clog_error( CLOG( 0 ), "Disabling scrollback spill." );
+            sb->spill_enabled = 0;
+            return;
+        }
+
+        sb->bytes -= SB_TRIGRAM_OFFSET( block->size ) + SB_TRIGRAM_BYTES;
+        free( block->data );
+
+        // Spilled size covers the trigrams so releasing punches them out too.
+        block->data = data;
+        block->trigrams = data + len;
+        block->size = len + SB_TRIGRAM_BYTES;
+        block->spill_offset = offset;
+        sb->spill_block++;
+    }
+
+    sb->spill_page = MAX( sb->spill_page, sb->first_page );
+    while ( sb->spill_page + SB_SPILL_RAM_PAGES < end_page )
+    {
+        int64_t offset;
+        sb_page *page = ( sb_page * )sb_ptrq_get( &sb->pages, sb->spill_page - sb->first_page );
+        uint8_t *data = sb_spill_write( sb, page->refs, SB_INDEX_PAGE_SIZE, &offset );
+
+        if ( !data )
+        {
+            clog_error( CLOG( 0 ), "Disabling scrollback spill." );
+            sb->spill_enabled = 0;
+            return;
+        }
+
+        sb->bytes -= SB_INDEX_PAGE_SIZE;
+        free( page->refs );
+
+        page->refs = ( sb_line_ref * )data;
+        page->spill_offset = offset;
+        sb->spill_page++;
+    }
+}
+
+// Drop index pages which only hold lines before first_line.
+static void sb_trim_pages( scrollback *sb )
+{
+    while ( sb->first_page < ( sb->first_line >> SB_INDEX_SHIFT ) )
+    {
+        if ( sb->pages.count )
+            sb_page_free( sb, ( sb_page * )sb_ptrq_pop_front( &sb->pages ) );
+        sb->first_page++;
+    }
+}
+
+static void sb_evict( scrollback *sb )
+{
+    for ( ;; )
+    {
+        uint64_t count = sb->end_line - sb->first_line;
+        sb_block *block;
+        uint64_t n;
+
+        if ( !count )
+            break;
+
+        block = ( sb_block * )sb_ptrq_get( &sb->blocks, 0 );
+
+        if ( sb->max_bytes && sb->bytes + sb->spilled_bytes > sb->max_bytes )
+        {
+            // Over the byte limit: drop the oldest block in one go.
+            n = block->nlines;
+        }
+        else if ( sb->max_lines && count > sb->max_lines )
+        {
+            n = MIN( block->nlines, count - sb->max_lines );
+        }
+        else
+        {
+            break;
+        }
+
+        sb->first_line += n;
+        block->nlines -= n;
+
+        if ( !block->nlines )
+        {
+            sb_block_free( sb, ( sb_block * )sb_ptrq_pop_front( &sb->blocks ) );
+            sb->first_block++;
+        }
+
+        sb_trim_pages( sb );
+    }
+}
+
+static const uint8_t *sb_line_get( scrollback *sb, uint64_t line )
+{
+    sb_line_ref *ref = sb_line_ref_get( sb, line );
+
+    return sb_block_data( sb, sb_block_get( sb, ref->block ) ) + ref->offset;
+}
+
+static int sb_line_flags( scrollback *sb, uint64_t line )
+{
+    sb_line_hdr hdr;
+
+    memcpy( &hdr, sb_line_get( sb, line ), sizeof( hdr ) );
+    return hdr.flags;
+}
+
+// First stored line of the logical line holding line.
+static uint64_t sb_logical_start( scrollback *sb, uint64_t line )
+{
+    int flags;
+    uint64_t start = line;
+
+    if ( line >= sb->tail_line && line < sb->end_line )
+        return MAX( sb->tail_line, sb->first_line );
+
+    for ( flags = sb_line_flags( sb, start ); start > sb->first_line && !( flags & SB_LINE_SPLIT ); start-- )
+    {
+        flags = sb_line_flags( sb, start - 1 );
+        if ( !( flags & SB_LINE_WRAPPED ) )
+            break;
+    }
+    return start;
+}
+
+// Join up the logical line starting at line and break it into rows.
+static sb_wrap *sb_wrap_get( scrollback *sb, uint64_t line )
+{
+    size_t n;
+    uint32_t i;
+    sb_wrap *wrap;
+
+    if ( !sb->wraps )
+    {
+        sb->wraps = ( sb_wrap * )calloc( SB_WRAP_CACHE_LINES, sizeof( sb_wrap ) );
+        if ( !sb->wraps )
+            FATAL_ERROR( calloc );
+    }
+
+    wrap = &sb->wraps[ line & ( SB_WRAP_CACHE_LINES - 1 ) ];
+    if ( wrap->nlines && wrap->line == line && wrap->gen == sb->wrap_gen )
+        return wrap;
+
+    wrap->line = line;
+    wrap->width = sb->width;
+    wrap->gen = sb->wrap_gen;
+    wrap->ncells = 0;
+
+    for ( i = 0; line + i < sb->end_line; )
+    {
+        sb_line_hdr hdr;
+        const uint8_t *rec = sb_line_get( sb, line + i );
+
+        memcpy( &hdr, rec, sizeof( hdr ) );
+        if ( i && ( hdr.flags & SB_LINE_SPLIT ) )
+            break;
+        i++;
+
+        if ( hdr.flags & SB_LINE_WRAPPED )
+        {
+            // Wrapped lines are full width.
+            n = hdr.cols;
+        }
+        else
+        {
+            // Decode one past the text to get the fill style.
+            n = hdr.ncells + 1;
+        }
+
+        wrap->cells = ( VTermScreenCell * )sb_grow( wrap->cells, &wrap->cells_size,
+                                                    ( wrap->ncells + n ) * sizeof( VTermScreenCell ) );
+        sb_decode_line( rec, n, wrap->cells + wrap->ncells );
+        wrap->ncells += n;
+
+        if ( !( hdr.flags & SB_LINE_WRAPPED ) )
+        {
+            wrap->fill = wrap->cells[ --wrap->ncells ];
+            break;
+        }
+        wrap->fill = wrap->cells[ wrap->ncells - 1 ];
+        wrap->fill.chars[ 0 ] = 0;
+        wrap->fill.width = 1;
+    }
+    wrap->nlines = i;
+
+    // Break into rows, never splitting a wide char.
+    wrap->nrows = 0;
+    for ( n = 0;; )
+    {
+        size_t end = MIN( n + sb->width, wrap->ncells );
+
+        if ( end < wrap->ncells && end > n + 1 && wrap->cells[ end ].chars[ 0 ] == ( uint32_t )-1 )
+            end--;
+
+        wrap->rows = ( size_t * )sb_grow( wrap->rows, &wrap->rows_size, ( wrap->nrows + 2 ) * sizeof( size_t ) );
+        wrap->rows[ wrap->nrows++ ] = n;
+
+        n = end;
+        if ( n >= wrap->ncells )
+            break;
+    }
+    wrap->rows[ wrap->nrows ] = wrap->ncells;
+
+    return wrap;
+}
+
+scrollback *scrollback_create( size_t max_lines, size_t max_bytes )
+{
+    scrollback *sb = ( scrollback * )calloc( 1, sizeof( *sb ) );
+
+    if ( !sb )
+        FATAL_ERROR( calloc );
+
+    sb->max_lines = max_lines;
+    sb->max_bytes = max_bytes;
+    sb->width = 80;
+    sb->spill_fd = -1;
+    return sb;
+}
+
+int scrollback_set_spill( scrollback *sb, const char *dir, size_t ram_bytes )
+{
+    char path[ PATH_MAX ];
+
+    if ( sb->spill_fd >= 0 )
+        return 0;
+
+    if ( mkdir_p( dir, 0700 ) )
+    {
+        clog_error( CLOG( 0 ), "Unable to create %s: %d", dir, errno );
+        return -1;
+    }
+
+    if ( snprintf( path, sizeof( path ), "%s/scrollback-XXXXXX", dir ) >= ( int )sizeof( path ) )
+        return -1;
+
+    sb->spill_fd = mkostemp( path, O_CLOEXEC );
+    if ( sb->spill_fd < 0 )
+    {
+        clog_error( CLOG( 0 ), "Unable to create spill file %s: %d", path, errno );
+        return -1;
+    }
+
+    // Nobody else needs to see it, and this way it goes away with us.
+    unlink( path );
+
+    sb->spill_enabled = 1;
+    sb->spill_ram_blocks = MAX( 1, ram_bytes / SB_BLOCK_SIZE );
+    sb->spill_block = sb->first_block;
+    sb->spill_page = sb->first_page;
+
+    clog_info( CLOG( 0 ), "scrollback spilling to %s, keeping %zu blocks in RAM", path, sb->spill_ram_blocks );
+    return 0;
+}
+
+void scrollback_free( scrollback *sb )
+{
+    if ( sb )
+    {
+        size_t i;
+
+        // Spilled data goes away with the mappings below.
+        while ( sb->blocks.count )
+        {
+            sb_block *block = ( sb_block * )sb_ptrq_pop_back( &sb->blocks );
+
+            if ( block->spill_offset < 0 )
+                free( block->data );
+            free( block );
+        }
+        while ( sb->pages.count )
+        {
+            sb_page *page = ( sb_page * )sb_ptrq_pop_back( &sb->pages );
+
+            if ( page->spill_offset < 0 )
+                free( page->refs );
+            free( page );
+        }
+
+        for ( i = 0; i < sb->nsegments; i++ )
+        {
+            if ( sb->segments[ i ].map )
+                munmap( sb->segments[ i ].map, SB_SPILL_SEGMENT_SIZE );
+        }
+        if ( sb->spill_fd >= 0 )
+            close( sb->spill_fd );
+
+        for ( i = 0; i < SB_CACHE_BLOCKS; i++ )
+            free( sb->cache[ i ].data );
+        for ( i = 0; sb->wraps && i < SB_WRAP_CACHE_LINES; i++ )
+        {
+            free( sb->wraps[ i ].cells );
+            free( sb->wraps[ i ].rows );
+        }
+        free( sb->wraps );
+
+        free( sb->segments );
+        free( sb->blocks.items );
+        free( sb->pages.items );
+        free( sb->scratch );
+        free( sb->comp );
+        free( sb->runs );
+        free( sb->text );
+        free( sb );
+    }
+}
+
+int scrollback_row_flags( int cols, const VTermScreenCell *cells )
+{
+    uint32_t ch = cols > 0 ? cells[ cols - 1 ].chars[ 0 ] : 0;
+
+    return ( ch && ch != ' ' ) ? SCROLLBACK_WRAPPED : 0;
+}
+
+void scrollback_push( scrollback *sb, int cols, const VTermScreenCell *cells, int flags )
+{
+    sb_line_ref *ref;
+    sb_block *block = NULL;
+    uint64_t line = sb->end_line;
+    uint64_t pageno = line >> SB_INDEX_SHIFT;
+    int hdr_flags = ( flags & SCROLLBACK_WRAPPED ) ? SB_LINE_WRAPPED : 0;
+    size_t size;
+
+    if ( line == sb->first_line || !sb->tail_open )
+    {
+        sb->tail_line = line;
+    }
+    else if ( line - sb->tail_line >= SB_WRAP_MAX_LINES )
+    {
+        // Cap how much gets joined into one logical line.
+        hdr_flags |= SB_LINE_SPLIT;
+        sb->tail_line = line;
+    }
+    else if ( sb->wraps )
+    {
+        // Extending the newest logical line changes its wrapping.
+        sb->wraps[ MAX( sb->tail_line, sb->first_line ) & ( SB_WRAP_CACHE_LINES - 1 ) ].nlines = 0;
+    }
+    sb->tail_open = !!( flags & SCROLLBACK_WRAPPED );
+
+    size = sb_encode_line( sb, cols, cells, hdr_flags );
+
+    if ( sb->blocks.count )
+    {
+        block = ( sb_block * )sb_ptrq_get( &sb->blocks, sb->blocks.count - 1 );
+
+        if ( !block->sealed && block->used + size > block->size )
+            sb_block_seal( sb, block );
+        if ( block->sealed )
+            block = NULL;
+    }
+
+    if ( !block )
+        block = sb_block_new( sb, MAX( SB_BLOCK_SIZE, size ) );
+
+    if ( pageno == sb->first_page + sb->pages.count )
+    {
+        sb_page_new( sb );
+    }
+    else if ( pageno < sb->spill_page )
+    {
+        // Popped back into a spilled page.
+        sb_page_unspill( sb, ( sb_page * )sb_ptrq_get( &sb->pages, pageno - sb->first_page ) );
+        sb->spill_page = pageno;
+    }
+
+    ref = sb_line_ref_get( sb, line );
+    ref->block = ( uint32_t )( sb->first_block + sb->blocks.count - 1 );
+    ref->offset = block->used;
+
+    memcpy( block->data + block->used, sb->scratch, size );
+    sb_index_line( sb, block, block->data + block->used );
+    block->used += SB_ALIGN( size );
+    block->nlines++;
+
+    sb->end_line++;
+
+    sb_evict( sb );
+    sb_spill( sb );
+}
+
+int scrollback_pop( scrollback *sb, int cols, VTermScreenCell *cells )
+{
+    uint64_t line;
+    sb_block *block;
+    sb_line_ref *ref;
+
+    if ( sb->first_line == sb->end_line )
+        return 0;
+
+    line = --sb->end_line;
+    ref = sb_line_ref_get( sb, line );
+    block = sb_block_get( sb, ref->block );
+
+    sb_decode_line( sb_block_data( sb, block ) + ref->offset, cols, cells );
+
+    // Newest line is always at the end of the newest block.
+    block->used = ref->offset;
+    if ( !--block->nlines )
+    {
+        sb_block_free( sb, ( sb_block * )sb_ptrq_pop_back( &sb->blocks ) );
+        sb->spill_block = MIN( sb->spill_block, sb->first_block + sb->blocks.count );
+    }
+
+    if ( !( line & ( SB_INDEX_PAGE_LINES - 1 ) ) && sb->pages.count &&
+         ( line >> SB_INDEX_SHIFT ) == sb->first_page + sb->pages.count - 1 )
+    {
+        sb_page_free( sb, ( sb_page * )sb_ptrq_pop_back( &sb->pages ) );
+        sb->spill_page = MIN( sb->spill_page, sb->first_page + sb->pages.count );
+    }
+
+    // Find the new newest logical line; pops are rare so drop all wrapping.
+    sb->wrap_gen++;
+    sb->tail_line = sb->end_line;
+    sb->tail_open = 0;
+    if ( sb->end_line > sb->first_line )
+    {
+        sb->tail_open = !!( sb_line_flags( sb, sb->end_line - 1 ) & SB_LINE_WRAPPED );
+        sb->tail_line = sb_logical_start( sb, sb->end_line - 1 );
+    }
+
+    return 1;
+}
+
+void scrollback_get_range( scrollback *sb, uint64_t *first, uint64_t *end )
+{
+    *first = sb->first_line;
+    *end = sb->end_line;
+}
+
+int scrollback_get_line( scrollback *sb, uint64_t line, int cols, VTermScreenCell *cells )
+{
+    sb_line_ref *ref;
+
+    if ( line < sb->first_line || line >= sb->end_line )
+        return 0;
+
+    ref = sb_line_ref_get( sb, line );
+    sb_decode_line( sb_block_data( sb, sb_block_get( sb, ref->block ) ) + ref->offset, cols, cells );
+    return 1;
+}
+
+void scrollback_set_width( scrollback *sb, int cols )
+{
+    if ( sb->width != cols )
+    {
+        sb->width = MAX( 1, cols );
+        sb->wrap_gen++;
+    }
+}
+
+void scrollback_pos_end( scrollback *sb, scrollback_pos *pos )
+{
+    pos->line = sb->end_line;
+    pos->row = 0;
+}
+
+int scrollback_pos_move( scrollback *sb, scrollback_pos *pos, int delta )
+{
+    int n;
+    int moved = 0;
+
+    // History may have been dropped since pos was set.
+    if ( pos->line < sb->first_line )
+    {
+        pos->line = sb->first_line;
+        pos->row = 0;
+    }
+    else if ( pos->line > sb->end_line )
+    {
+        scrollback_pos_end( sb, pos );
+    }
+    else if ( pos->line < sb->end_line )
+    {
+        pos->line = sb_logical_start( sb, pos->line );
+        pos->row = MIN( pos->row, sb_wrap_get( sb, pos->line )->nrows - 1 );
+    }
+
+    while ( delta < 0 )
+    {
+        if ( !pos->row )
+        {
+            if ( pos->line <= sb->first_line )
+                break;
+
+            pos->line = sb_logical_start( sb, pos->line - 1 );
+            pos->row = sb_wrap_get( sb, pos->line )->nrows;
+        }
+
+        n = MIN( pos->row, -delta );
+        pos->row -= n;
+        delta += n;
+        moved -= n;
+    }
+
+    while ( delta > 0 && pos->line < sb->end_line )
+    {
+        sb_wrap *wrap = sb_wrap_get( sb, pos->line );
+        int left = wrap->nrows - pos->row;
+
+        if ( delta < left )
+        {
+            pos->row += delta;
+            moved += delta;
+            break;
+        }
+
+        pos->line += wrap->nlines;
+        pos->row = 0;
+        delta -= left;
+        moved += left;
+    }
+
+    return moved;
+}
+
+int scrollback_get_row( scrollback *sb, const scrollback_pos *pos, VTermScreenCell *cells )
+{
+    int col;
+    size_t n;
+    sb_wrap *wrap;
+
+    if ( pos->line < sb->first_line || pos->line >= sb->end_line )
+        return 0;
+
+    wrap = sb_wrap_get( sb, sb_logical_start( sb, pos->line ) );
+    if ( pos->row >= wrap->nrows )
+        return 0;
+
+    n = wrap->rows[ pos->row + 1 ] - wrap->rows[ pos->row ];
+    memcpy( cells, wrap->cells + wrap->rows[ pos->row ], n * sizeof( VTermScreenCell ) );
+
+    for ( col = n; col < sb->width; col++ )
+        cells[ col ] = wrap->fill;
+    return 1;
+}
+
+int scrollback_search( scrollback *sb, search *s, uint64_t *line, int backward )
+{
+    const uint32_t *trigrams;
+    size_t ntrigrams = search_get_trigrams( s, &trigrams );
+    uint64_t l = *line;
+
+    if ( backward )
+        l = MIN( l, sb->end_line );
+    else if ( l < sb->first_line )
+        l = sb->first_line;
+    else
+        l++;
+
+    for ( ;; )
+    {
+        size_t len;
+        size_t start;
+        size_t end;
+        sb_line_ref *ref;
+        sb_block *block;
+
+        if ( backward )
+        {
+            if ( l <= sb->first_line )
+                return 0;
+            l--;
+        }
+        else if ( l >= sb->end_line )
+        {
+            return 0;
+        }
+
+        ref = sb_line_ref_get( sb, l );
+        block = sb_block_get( sb, ref->block );
+
+        if ( !sb_block_may_match( block, trigrams, ntrigrams ) )
+        {
+            // Skip the rest of this block.
+            if ( backward )
+            {
+                l = MAX( block->first_line, sb->first_line );
+            }
+            else
+            {
+                size_t i = ( uint32_t )( ref->block - ( uint32_t )sb->first_block );
+
+                l = ( i + 1 < sb->blocks.count ) ?
+                        ( ( sb_block * )sb_ptrq_get( &sb->blocks, i + 1 ) )->first_line : sb->end_line;
+            }
+            continue;
+        }
+
+        len = sb_line_text( sb, sb_block_data( sb, block ) + ref->offset );
+        if ( search_match( s, sb->text, len, 0, &start, &end ) )
+        {
+            *line = l;
+            return 1;
+        }
+
+        if ( !backward )
+            l++;
+    }
+}
+
+void scrollback_get_stats( scrollback *sb, scrollback_stats *stats )
+{
+    size_t i;
+
+    stats->lines = sb->end_line - sb->first_line;
+    stats->blocks = sb->blocks.count;
+    stats->bytes = sb->bytes;
+    stats->spilled_bytes = sb->spilled_bytes;
+    stats->raw_bytes = sb->raw_bytes;
+    stats->comp_bytes = sb->comp_bytes;
+    stats->decodes = sb->decodes;
+    stats->decode_ns = sb->decode_ns;
+    stats->line_bytes = 0;
+
+    for ( i = 0; i < sb->blocks.count; i++ )
+        stats->line_bytes += ( ( sb_block * )sb_ptrq_get( &sb->blocks, i ) )->used;
+}
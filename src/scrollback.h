@@ -0,0 +1,99 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _SCROLLBACK_H_
+#define _SCROLLBACK_H_
+
+// Lines that scroll off the top of the screen. Lines are trimmed of trailing
+// blanks and stored as style runs plus UTF-8 text in a chunked arena, which
+// gets compressed as it fills, so a stored line costs less than its text.
+typedef struct scrollback scrollback;
+
+struct search; // search.h
+
+#define SCROLLBACK_WRAPPED 0x1 // Line was soft wrapped: it continues on the next line.
+
+// A row of history wrapped to the current width.
+typedef struct scrollback_pos
+{
+    uint64_t line; // First stored line of the logical (unwrapped) line.
+    int row;       // Row within the logical line.
+} scrollback_pos;
+
+typedef struct scrollback_stats
+{
+    uint64_t lines;       // Lines currently stored.
+    size_t blocks;        // Arena blocks allocated.
+    size_t bytes;         // RAM used by arena blocks and line index.
+    size_t spilled_bytes; // Bytes of history in the spill file.
+    size_t line_bytes;    // Bytes of encoded line records.
+    size_t raw_bytes;     // Compressed blocks' size before compression.
+    size_t comp_bytes;    // Compressed blocks' size.
+    uint64_t decodes;     // Blocks decompressed to read lines.
+    uint64_t decode_ns;   // Time spent decompressing.
+} scrollback_stats;
+
+// max_lines and max_bytes limit how much history is kept; 0 means no limit.
+scrollback *scrollback_create( size_t max_lines, size_t max_bytes );
+void scrollback_free( scrollback *sb );
+
+// Move history older than the newest ram_bytes to an unlinked, memory mapped
+// file in dir (created if needed). Returns 0 on success.
+int scrollback_set_spill( scrollback *sb, const char *dir, size_t ram_bytes );
+
+// Guess the flags for a row leaving the screen. libvterm doesn't report soft
+// wraps, so a row with text in its last column is taken to continue on the
+// next one; a blank or space there is a hard line break.
+int scrollback_row_flags( int cols, const VTermScreenCell *cells );
+// Store a row of cells. flags are SCROLLBACK_WRAPPED. O(1).
+void scrollback_push( scrollback *sb, int cols, const VTermScreenCell *cells, int flags );
+// Remove the newest line and decode it into cols cells. Returns 0 if empty. O(1).
+int scrollback_pop( scrollback *sb, int cols, VTermScreenCell *cells );
+
+// Lines are numbered from creation: [ first, end ) are currently stored.
+void scrollback_get_range( scrollback *sb, uint64_t *first, uint64_t *end );
+// Decode a stored line into cols cells. Returns 0 if line isn't stored.
+int scrollback_get_line( scrollback *sb, uint64_t line, int cols, VTermScreenCell *cells );
+
+// Find the nearest line before (backward) or after *line whose text matches.
+// Blocks that can't contain the query's trigrams are skipped without being
+// decoded. Returns 1 and sets *line on a match.
+int scrollback_search( scrollback *sb, struct search *s, uint64_t *line, int backward );
+
+// Set the width rows are wrapped to. O(1): logical lines are rewrapped as
+// they are read, and the wrapping of recently read lines is cached.
+void scrollback_set_width( scrollback *sb, int cols );
+// Position one past the newest row.
+void scrollback_pos_end( scrollback *sb, scrollback_pos *pos );
+// Move pos by delta rows, negative towards older rows. Returns rows moved.
+int scrollback_pos_move( scrollback *sb, scrollback_pos *pos, int delta );
+// Get the row at pos as width cells. Returns 0 if pos isn't stored.
+int scrollback_get_row( scrollback *sb, const scrollback_pos *pos, VTermScreenCell *cells );
+
+void scrollback_get_stats( scrollback *sb, scrollback_stats *stats );
+
+#endif // _SCROLLBACK_H_
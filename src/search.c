@@ -0,0 +1,360 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <regex.h>
+
+#include "search.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define SEARCH_MAX_RUN 256
+
+struct search
+{
+    char *pattern;
+    size_t patlen;
+    int flags;
+
+    char *folded; // ASCII lower cased pattern for SEARCH_ICASE substrings.
+    regex_t regex;
+
+    char *buf; // Scratch copy of text: NUL terminated and / or folded.
+    size_t buf_size;
+
+    uint32_t *trigrams;
+    size_t ntrigrams;
+    size_t trigrams_size;
+};
+
+static uint8_t search_fold( uint8_t c )
+{
+    return ( c >= 'A' && c <= 'Z' ) ? c + ( 'a' - 'A' ) : c;
+}
+
+uint32_t search_trigram( const uint8_t *text )
+{
+    uint32_t key = ( search_fold( text[ 0 ] ) << 16 ) |
+                   ( search_fold( text[ 1 ] ) << 8 ) |
+                   search_fold( text[ 2 ] );
+
+    return key * 2654435761u;
+}
+
+// Add trigrams for a literal run which every match has to contain.
+static void search_add_literal( search *s, const char *lit, size_t len )
+{
+    size_t i;
+
+    for ( i = 0; i + 3 <= len; i++ )
+    {
+        const uint8_t *text = ( const uint8_t * )lit + i;
+
+        // We only fold ASCII case, so can't say anything about other bytes.
+        if ( ( s->flags & SEARCH_ICASE ) && ( ( text[ 0 ] | text[ 1 ] | text[ 2 ] ) & 0x80 ) )
+            continue;
+
+        if ( s->ntrigrams == s->trigrams_size )
+        {
+            s->trigrams_size = s->trigrams_size ? s->trigrams_size * 2 : 16;
+            s->trigrams = ( uint32_t * )realloc( s->trigrams, s->trigrams_size * sizeof( uint32_t ) );
+            if ( !s->trigrams )
+                FATAL_ERROR( realloc );
+        }
+
+        s->trigrams[ s->ntrigrams++ ] = search_trigram( text );
+    }
+}
+
+// Returns pointer just past the bracket expression starting at p.
+static const char *search_skip_bracket( const char *p )
+{
+    p++;
+    if ( *p == '^' )
+        p++;
+    if ( *p == ']' )
+        p++;
+    while ( *p && *p != ']' )
+    {
+        // Skip [:class:], [=equiv=] and [.coll.] which can contain ']'.
+        if ( *p == '[' && ( p[ 1 ] == ':' || p[ 1 ] == '=' || p[ 1 ] == '.' ) )
+        {
+            const char *close = strchr( p + 2, p[ 1 ] );
+
+            if ( close && close[ 1 ] == ']' )
+            {
+                p = close + 2;
+                continue;
+            }
+        }
+        p++;
+    }
+    return *p ? p + 1 : p;
+}
+
+// Pull literal runs out of an extended regex which any match must contain.
+// Anything under parentheses or alternation is skipped; we only need a subset
+// of the required text to prefilter.
+static void search_regex_literals( search *s )
+{
+    int depth = 0;
+    size_t len = 0;
+    char run[ SEARCH_MAX_RUN ];
+    const char *p;
+
+    // Any top level alternation means no single literal is required.
+    for ( p = s->pattern; *p; p++ )
+    {
+        if ( *p == '\\' && p[ 1 ] )
+            p++;
+        else if ( *p == '[' )
+            p = search_skip_bracket( p ) - 1;
+        else if ( *p == '|' )
+            return;
+    }
+
+    p = s->pattern;
+    while ( *p )
+    {
+        char c = *p++;
+
+        switch ( c )
+        {
+        case '\\':
+            if ( !*p )
+                break;
+            c = *p++;
+            if ( isalnum( ( unsigned char )c ) )
+            {
+                // Class escapes like \w or back references.
+                search_add_literal( s, run, len );
+                len = 0;
+                continue;
+            }
+            break;
+
+        case '*':
+        case '?':
+        case '{':
+            // Previous char is optional.
+            while ( len && ( run[ len - 1 ] & 0xc0 ) == 0x80 )
+                len--;
+            if ( len )
+                len--;
+            search_add_literal( s, run, len );
+            len = 0;
+
+            if ( c == '{' )
+            {
+                while ( *p && *p != '}' )
+                    p++;
+                if ( *p )
+                    p++;
+            }
+            continue;
+
+        case '[':
+            p = search_skip_bracket( p - 1 );
+            search_add_literal( s, run, len );
+            len = 0;
+            continue;
+
+        case '(':
+            depth++;
+            search_add_literal( s, run, len );
+            len = 0;
+            continue;
+
+        case ')':
+            depth--;
+            continue;
+
+        case '+':
+        case '.':
+        case '^':
+        case '$':
+            search_add_literal( s, run, len );
+            len = 0;
+            continue;
+        }
+
+        if ( depth )
+            continue;
+
+        if ( len == sizeof( run ) )
+        {
+            // Keep the tail around in case a quantifier follows.
+            search_add_literal( s, run, len - 8 );
+            memmove( run, run + len - 8, 8 );
+            len = 8;
+        }
+        run[ len++ ] = c;
+    }
+
+    search_add_literal( s, run, len );
+}
+
+search *search_create( const char *pattern, int flags )
+{
+    size_t i;
+    search *s;
+
+    if ( !pattern || !pattern[ 0 ] )
+        return NULL;
+
+    s = ( search * )calloc( 1, sizeof( *s ) );
+    if ( !s )
+        FATAL_ERROR( calloc );
+
+    s->pattern = strdup( pattern );
+    s->patlen = strlen( pattern );
+    s->flags = flags;
+
+    if ( flags & SEARCH_REGEX )
+    {
+        int ret = regcomp( &s->regex, pattern, REG_EXTENDED | ( ( flags & SEARCH_ICASE ) ? REG_ICASE : 0 ) );
+
+        if ( ret )
+        {
+            char err[ 128 ];
+
+            regerror( ret, &s->regex, err, sizeof( err ) );
+            clog_info( CLOG( 0 ), "regcomp( %s ) failed: %s", pattern, err );
+
+            free( s->pattern );
+            free( s );
+            return NULL;
+        }
+
+        search_regex_literals( s );
+    }
+    else
+    {
+        if ( flags & SEARCH_ICASE )
+        {
+            s->folded = strdup( pattern );
+            for ( i = 0; i < s->patlen; i++ )
+                s->folded[ i ] = search_fold( s->folded[ i ] );
+        }
+
+        search_add_literal( s, pattern, s->patlen );
+    }
+
+    return s;
+}
+
+void search_free( search *s )
+{
+    if ( s )
+    {
+        if ( s->flags & SEARCH_REGEX )
+            regfree( &s->regex );
+
+        free( s->pattern );
+        free( s->folded );
+        free( s->buf );
+        free( s->trigrams );
+        free( s );
+    }
+}
+
+const char *search_get_pattern( search *s )
+{
+    return s->pattern;
+}
+
+int search_get_flags( search *s )
+{
+    return s->flags;
+}
+
+int search_match( search *s, const char *text, size_t len, size_t from, size_t *start, size_t *end )
+{
+    if ( from > len )
+        return 0;
+
+    if ( len + 1 > s->buf_size )
+    {
+        s->buf_size = MAX( len + 1, s->buf_size * 2 );
+        s->buf = ( char * )realloc( s->buf, s->buf_size );
+        if ( !s->buf )
+            FATAL_ERROR( realloc );
+    }
+
+    if ( s->flags & SEARCH_REGEX )
+    {
+        regmatch_t match;
+
+        memcpy( s->buf, text, len );
+        s->buf[ len ] = 0;
+
+        if ( regexec( &s->regex, s->buf + from, 1, &match, from ? REG_NOTBOL : 0 ) )
+            return 0;
+
+        *start = from + match.rm_so;
+        *end = from + match.rm_eo;
+        return 1;
+    }
+    else
+    {
+        const char *found;
+
+        if ( s->flags & SEARCH_ICASE )
+        {
+            size_t i;
+
+            for ( i = from; i < len; i++ )
+                s->buf[ i ] = search_fold( text[ i ] );
+
+            found = ( const char * )memmem( s->buf + from, len - from, s->folded, s->patlen );
+            if ( !found )
+                return 0;
+
+            *start = found - s->buf;
+        }
+        else
+        {
+            found = ( const char * )memmem( text + from, len - from, s->pattern, s->patlen );
+            if ( !found )
+                return 0;
+
+            *start = found - text;
+        }
+
+        *end = *start + s->patlen;
+        return 1;
+    }
+}
+
+size_t search_get_trigrams( search *s, const uint32_t **trigrams )
+{
+    *trigrams = s->trigrams;
+    return s->ntrigrams;
+}
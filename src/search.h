@@ -0,0 +1,56 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+// Compiled substring or regex query, matched against UTF-8 line text.
+typedef struct search search;
+
+#define SEARCH_REGEX 0x1 // Pattern is a POSIX extended regex.
+#define SEARCH_ICASE 0x2 // Ignore case.
+
+// Returns NULL if pattern is empty or isn't a valid regex.
+search *search_create( const char *pattern, int flags );
+void search_free( search *s );
+
+const char *search_get_pattern( search *s );
+int search_get_flags( search *s );
+
+// Find the first match in text at or after byte offset from. Returns 1 and
+// sets [ *start, *end ) to the matched bytes if found.
+int search_match( search *s, const char *text, size_t len, size_t from, size_t *start, size_t *end );
+
+// Trigrams every match must contain, used to skip scrollback blocks which
+// can't match. Returns 0 when the query can't be prefiltered.
+size_t search_get_trigrams( search *s, const uint32_t **trigrams );
+
+// Hash for the three bytes starting at text. ASCII case is folded so the same
+// index serves case sensitive and insensitive queries.
+uint32_t search_trigram( const uint8_t *text );
+
+#endif // _SEARCH_H_
@@ -0,0 +1,383 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+
+#include "vterm.h"
+#include "scrollback.h"
+#include "termwin.h"
+#include "record.h"
+#include "session.h"
+#include "snapshot.h"
+#include "ipc.h"
+#include "server.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define SERVER_SESSION_MAX 32
+
+// Size of sessions before a client says how big it is.
+#define SERVER_ROWS 24
+#define SERVER_COLS 80
+
+typedef struct server
+{
+    int listen_fd;
+    const session_config *cfg;
+
+    session *sessions[ SERVER_SESSION_MAX ];
+    int session_count;
+    int cur; // Session the client is shown.
+    session_pool *pool; // Parses the others.
+
+    ipc_conn *client;
+    int rows; // Client size, 0 until it says hello.
+    int cols;
+    snapshot *sent; // Screen the client has. NULL sends it a whole snapshot.
+} server;
+
+static void server_status( server *srv )
+{
+    char text[ 64 ];
+
+    snprintf( text, sizeof( text ), "session %d of %d", srv->cur + 1, srv->session_count );
+    ipc_send( srv->client, IPC_STATUS, text, strlen( text ) );
+}
+
+// Show the client session index, from scratch.
+static void server_show( server *srv, int index )
+{
+    int rows, cols;
+    session *sess = srv->sessions[ index ];
+
+    srv->cur = index;
+    snapshot_free( srv->sent );
+    srv->sent = NULL;
+
+    vterm_get_size( session_get_vterm( sess ), &rows, &cols );
+    if ( rows != srv->rows || cols != srv->cols )
+        session_resize( sess, srv->rows, srv->cols );
+
+    server_status( srv );
+}
+
+static int server_open( server *srv, int rows, int cols )
+{
+    session *sess;
+
+    if ( srv->session_count >= SERVER_SESSION_MAX )
+        return -1;
+
+    sess = session_create( srv->cfg, rows, cols );
+    if ( !sess )
+        return -1;
+
+    srv->sessions[ srv->session_count++ ] = sess;
+    return 0;
+}
+
+static void server_close( server *srv, int index )
+{
+    session_free( srv->sessions[ index ] );
+
+    srv->session_count--;
+    memmove( &srv->sessions[ index ], &srv->sessions[ index + 1 ],
+             ( srv->session_count - index ) * sizeof( srv->sessions[ 0 ] ) );
+
+    if ( srv->cur >= index && srv->cur )
+        srv->cur--;
+    if ( srv->client && srv->rows && srv->session_count )
+        server_show( srv, srv->cur );
+}
+
+static void server_drop_client( server *srv, const char *why )
+{
+    if ( srv->client )
+    {
+        clog_info( CLOG( 0 ), "Client detached: %s", why );
+
+        ipc_conn_free( srv->client );
+        srv->client = NULL;
+        srv->rows = 0;
+        srv->cols = 0;
+
+        snapshot_free( srv->sent );
+        srv->sent = NULL;
+    }
+}
+
+// Tell the client why it's going and let it go. It gets what's queued only if
+// the socket takes it now.
+static void server_release_client( server *srv, const char *why )
+{
+    if ( srv->client )
+    {
+        ipc_send( srv->client, IPC_EXIT, why, strlen( why ) );
+        ipc_flush( srv->client );
+        server_drop_client( srv, why );
+    }
+}
+
+static void server_accept( server *srv )
+{
+    int fd = ipc_accept( srv->listen_fd );
+
+    if ( fd < 0 )
+        return;
+
+    // The newest client wins, like reattaching from another terminal.
+    server_release_client( srv, "attached from somewhere else" );
+
+    clog_info( CLOG( 0 ), "Client attached" );
+    srv->client = ipc_conn_create( fd );
+}
+
+static void server_handle_msg( server *srv, const ipc_msg *msg )
+{
+    uint16_t size[ 2 ];
+    int32_t delta;
+
+    switch ( msg->type )
+    {
+    case IPC_HELLO:
+    case IPC_RESIZE:
+        if ( msg->len != sizeof( size ) )
+            break;
+        memcpy( size, msg->data, sizeof( size ) );
+        srv->rows = MAX( size[ 0 ], 1 );
+        srv->cols = MAX( size[ 1 ], 1 );
+        server_show( srv, srv->cur );
+        break;
+
+    case IPC_INPUT:
+        if ( srv->rows )
+            session_write( srv->sessions[ srv->cur ], ( const char * )msg->data, msg->len );
+        break;
+
+    case IPC_NEW:
+        if ( !srv->rows )
+            break;
+        if ( server_open( srv, srv->rows, srv->cols ) )
+            ipc_send( srv->client, IPC_STATUS, "unable to start session", 23 );
+        else
+            server_show( srv, srv->session_count - 1 );
+        break;
+
+    case IPC_SELECT:
+        if ( !srv->rows || msg->len != sizeof( delta ) )
+            break;
+        memcpy( &delta, msg->data, sizeof( delta ) );
+        delta %= srv->session_count;
+        server_show( srv, ( srv->cur + delta + srv->session_count ) % srv->session_count );
+        break;
+
+    default:
+        clog_warn_limit( CLOG( 0 ), "Unknown client message %d", msg->type );
+        break;
+    }
+}
+
+static void server_read_client( server *srv )
+{
+    int ret;
+    ipc_msg msg;
+
+    if ( ipc_fill( srv->client ) )
+    {
+        // Whatever arrived before the close still counts.
+        while ( ipc_next( srv->client, &msg ) > 0 )
+            server_handle_msg( srv, &msg );
+        server_drop_client( srv, "connection closed" );
+        return;
+    }
+
+    while ( ( ret = ipc_next( srv->client, &msg ) ) > 0 )
+        server_handle_msg( srv, &msg );
+
+    if ( ret < 0 )
+        server_drop_client( srv, "bad message" );
+}
+
+// Bring the client's screen up to date. Only once it has taken everything
+// sent before, so a slow client gets fewer, bigger diffs rather than a
+// backlog.
+static void server_update_client( server *srv )
+{
+    int changed;
+    size_t len;
+    uint8_t *data;
+    snapshot *snap;
+    termwin_modes modes;
+    session *sess = srv->sessions[ srv->cur ];
+
+    if ( !srv->client || !srv->rows || ipc_pending( srv->client ) )
+        return;
+
+    changed = session_take_activity( sess );
+    if ( srv->sent && !changed )
+        return;
+
+    snap = snapshot_capture( session_get_vterm( sess ), NULL );
+    session_get_modes( sess, &modes );
+    snapshot_set_modes( snap, &modes );
+
+    if ( !srv->sent )
+    {
+        data = snapshot_encode( snap, &len );
+        ipc_send( srv->client, IPC_SNAPSHOT, data, len );
+    }
+    else
+    {
+        data = snapshot_diff( srv->sent, snap, &len );
+        if ( len )
+            ipc_send( srv->client, IPC_DIFF, data, len );
+    }
+    free( data );
+
+    snapshot_free( srv->sent );
+    srv->sent = snap;
+}
+
+static void server_loop( server *srv )
+{
+    while ( srv->session_count )
+    {
+        int i;
+        int ret;
+        fd_set fds;
+        fd_set wfds;
+        int maxfd = srv->listen_fd;
+        // Update the client every 20ms.
+        struct timeval timeout = { 0, 20000 };
+
+        FD_ZERO( &fds );
+        FD_ZERO( &wfds );
+        FD_SET( srv->listen_fd, &fds );
+        FD_SET( session_pool_get_fd( srv->pool ), &fds );
+        maxfd = MAX( maxfd, session_pool_get_fd( srv->pool ) );
+        for ( i = 0; i < srv->session_count; i++ )
+        {
+            int fd = session_get_fd( srv->sessions[ i ] );
+
+            if ( session_busy( srv->sessions[ i ] ) )
+                continue;
+
+            FD_SET( fd, &fds );
+            maxfd = MAX( maxfd, fd );
+        }
+        if ( srv->client )
+        {
+            int fd = ipc_conn_get_fd( srv->client );
+
+            FD_SET( fd, &fds );
+            if ( ipc_pending( srv->client ) )
+                FD_SET( fd, &wfds );
+            maxfd = MAX( maxfd, fd );
+        }
+
+        ret = select( maxfd + 1, &fds, &wfds, NULL, &timeout );
+        if ( ret == -1 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            FATAL_ERROR( select );
+        }
+
+        if ( FD_ISSET( session_pool_get_fd( srv->pool ), &fds ) )
+            session_pool_reap( srv->pool );
+
+        // The client's session is read here so it can be captured; the
+        // others go to the pool. Backwards so closing one doesn't move those
+        // still to check.
+        for ( i = srv->session_count - 1; i >= 0; i-- )
+        {
+            session *sess = srv->sessions[ i ];
+
+            if ( session_exited( sess ) )
+                server_close( srv, i );
+            else if ( !session_busy( sess ) && FD_ISSET( session_get_fd( sess ), &fds ) &&
+                      ( ( srv->client && i == srv->cur ) || session_pool_submit( srv->pool, sess ) ) &&
+                      session_read( sess ) )
+                server_close( srv, i );
+        }
+
+        // A child closes its pty before it can be waited for, so session_free
+        // often misses it. Catch up here or the zombies pile up.
+        while ( waitpid( -1, NULL, WNOHANG ) > 0 )
+            ;
+
+        if ( !srv->session_count )
+            break;
+
+        if ( srv->client && FD_ISSET( ipc_conn_get_fd( srv->client ), &fds ) )
+            server_read_client( srv );
+
+        if ( FD_ISSET( srv->listen_fd, &fds ) )
+            server_accept( srv );
+
+        if ( srv->client )
+        {
+            server_update_client( srv );
+            if ( ipc_flush( srv->client ) )
+                server_drop_client( srv, "write failed" );
+        }
+    }
+
+    server_release_client( srv, "all sessions exited" );
+}
+
+int server_run( int listen_fd, const session_config *cfg, int parse_threads )
+{
+    server srv;
+
+    memset( &srv, 0, sizeof( srv ) );
+    srv.listen_fd = listen_fd;
+    srv.cfg = cfg;
+    srv.pool = session_pool_create( parse_threads );
+
+    if ( server_open( &srv, SERVER_ROWS, SERVER_COLS ) )
+    {
+        session_pool_free( srv.pool );
+        return -1;
+    }
+
+    server_loop( &srv );
+
+    while ( srv.session_count )
+        session_free( srv.sessions[ --srv.session_count ] );
+    session_pool_free( srv.pool );
+    snapshot_free( srv.sent );
+    close( listen_fd );
+
+    clog_info( CLOG( 0 ), "Server done" );
+    return 0;
+}
@@ -0,0 +1,618 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "vterm.h"
+#include "pseudo.h"
+#include "ptypool.h"
+#include "search.h"
+#include "scrollback.h"
+#include "termwin.h"
+#include "record.h"
+#include "session.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+struct session
+{
+    VTerm *vt;
+    scrollback *sb;
+    int master;
+    pid_t pid;
+
+    termwin *twin;        // Set while attached.
+    termwin_modes modes;  // Kept up to date while detached too.
+    int activity;         // Output while detached.
+    record *rec;
+
+    // Parsing on a session_pool worker. Everything but the pty fd and the
+    // flags here belongs to the worker until busy is cleared.
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int busy;
+    int exited;            // The worker's read found the child gone.
+    struct session *next;  // Pool queue.
+};
+
+// Most a worker parses for one session before letting others have a turn.
+#define SESSION_TASK_BYTES ( 256 * 1024 )
+
+struct session_pool
+{
+    pthread_t *threads;
+    int thread_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    session *head; // Queue of sessions with output to parse.
+    session *tail;
+    int stop;
+
+    int wake[ 2 ]; // Pipe written when a worker finishes a session.
+};
+
+int session_busy( session *sess )
+{
+    return __atomic_load_n( &sess->busy, __ATOMIC_ACQUIRE );
+}
+
+int session_exited( session *sess )
+{
+    return !session_busy( sess ) && sess->exited;
+}
+
+void session_wait( session *sess )
+{
+    if ( session_busy( sess ) )
+    {
+        pthread_mutex_lock( &sess->lock );
+        while ( sess->busy )
+            pthread_cond_wait( &sess->idle, &sess->lock );
+        pthread_mutex_unlock( &sess->lock );
+    }
+}
+
+static int session_damage_callback( VTermRect rect, void *user )
+{
+    session *sess = ( session * )user;
+
+    return termwin_damage_callback( rect, sess->twin );
+}
+
+static int session_movecursor_callback( VTermPos pos, VTermPos oldpos, int visible, void *user )
+{
+    session *sess = ( session * )user;
+
+    return termwin_movecursor_callback( pos, oldpos, visible, sess->twin );
+}
+
+static int session_settermprop_callback( VTermProp prop, VTermValue *val, void *user )
+{
+    session *sess = ( session * )user;
+
+    switch ( prop )
+    {
+    case VTERM_PROP_CURSORVISIBLE:
+        sess->modes.cursor_visible = !!val->boolean;
+        break;
+    case VTERM_PROP_ALTSCREEN:
+        sess->modes.altscreen = !!val->boolean;
+        break;
+    case VTERM_PROP_MOUSE:
+        sess->modes.mouse = val->number;
+        break;
+    case VTERM_PROP_REVERSE:
+        sess->modes.reverse = !!val->boolean;
+        break;
+    default:
+        break;
+    }
+
+    return sess->twin ? termwin_settermprop_callback( prop, val, sess->twin ) : 1;
+}
+
+static int session_bell_callback( void *user )
+{
+    session *sess = ( session * )user;
+
+    return termwin_bell_callback( sess->twin );
+}
+
+static int session_sb_pushline_callback( int cols, const VTermScreenCell *cells, void *user )
+{
+    session *sess = ( session * )user;
+
+    if ( !sess->sb )
+        return 0;
+
+    scrollback_push( sess->sb, cols, cells, scrollback_row_flags( cols, cells ) );
+    return 1;
+}
+
+static int session_sb_popline_callback( int cols, VTermScreenCell *cells, void *user )
+{
+    session *sess = ( session * )user;
+
+    return sess->sb ? scrollback_pop( sess->sb, cols, cells ) : 0;
+}
+
+// Attached sessions draw into their termwin.
+static const VTermScreenCallbacks g_session_cbs =
+    {
+      session_damage_callback,      // damage
+      NULL,                         // moverect
+      session_movecursor_callback,  // movecursor
+      session_settermprop_callback, // settermprop
+      session_bell_callback,        // bell
+      NULL,                         // resize
+      session_sb_pushline_callback, // sb_pushline
+      session_sb_popline_callback   // sb_popline
+    };
+
+// Detached sessions only parse. Without damage or movecursor callbacks
+// libvterm doesn't report either, and the cursor and cells are read back
+// from vterm once when attached.
+static const VTermScreenCallbacks g_session_hidden_cbs =
+    {
+      NULL,                         // damage
+      NULL,                         // moverect
+      NULL,                         // movecursor
+      session_settermprop_callback, // settermprop
+      NULL,                         // bell
+      NULL,                         // resize
+      session_sb_pushline_callback, // sb_pushline
+      session_sb_popline_callback   // sb_popline
+    };
+
+// Our environment with TERM set to term, or without it if term is NULL.
+// Returns a malloc'd array; only the TERM string is new.
+static char **session_env( const char *term, char **term_var )
+{
+    size_t i, count = 0;
+    char **env;
+
+    while ( environ[ count ] )
+        count++;
+
+    env = ( char ** )malloc( ( count + 2 ) * sizeof( char * ) );
+    if ( !env )
+        FATAL_ERROR( malloc );
+
+    *term_var = NULL;
+    if ( term && asprintf( term_var, "TERM=%s", term ) < 0 )
+        FATAL_ERROR( asprintf );
+
+    count = 0;
+    if ( *term_var )
+        env[ count++ ] = *term_var;
+    for ( i = 0; environ[ i ]; i++ )
+    {
+        if ( strncmp( environ[ i ], "TERM=", 5 ) )
+            env[ count++ ] = environ[ i ];
+    }
+    env[ count ] = NULL;
+
+    return env;
+}
+
+session *session_create( const session_config *cfg, int rows, int cols )
+{
+    session *sess;
+    pty_pair pair;
+    char **env;
+    char *term_var;
+    const struct winsize size = { rows, cols, 0, 0 };
+    VTermScreen *vts;
+    const VTermColor default_color = { 0, 0, 0 };
+    uint64_t start = get_time_ns();
+
+    sess = ( session * )calloc( 1, sizeof( *sess ) );
+    if ( !sess )
+        FATAL_ERROR( calloc );
+
+    if ( cfg->ptys ? pty_pool_take( cfg->ptys, &pair )
+                   : pty_open( &pair.master, &pair.slave, pair.slavename, sizeof( pair.slavename ), cfg->termios, NULL ) )
+    {
+        clog_error( CLOG( 0 ), "pty_open failed: %d", errno );
+        free( sess );
+        return NULL;
+    }
+
+    sess->master = pair.master;
+    if ( ioctl( sess->master, TIOCSWINSZ, &size ) != 0 )
+        FATAL_ERROR( ioctl( TIOCSWINSZ ) );
+
+    // posix_spawn doesn't copy our page tables like fork, which matters
+    // once scrollback and other sessions have made us big.
+    env = session_env( cfg->env_term, &term_var );
+    sess->pid = pty_spawn( &sess->master, pair.slave, pair.slavename, cfg->argv[ 0 ],
+                           ( char *const * )cfg->argv, env );
+    free( term_var );
+    free( env );
+
+    if ( sess->pid < 0 )
+    {
+        clog_error( CLOG( 0 ), "pty_spawn %s failed: %d", cfg->argv[ 0 ], errno );
+        free( sess );
+        return NULL;
+    }
+
+    clog_info( CLOG( 0 ), "pty_spawn child:%d slavename:%s in %.1f us", sess->pid, pair.slavename,
+               ( get_time_ns() - start ) / 1000.0 );
+
+    if ( fcntl( sess->master, F_SETFL, fcntl( sess->master, F_GETFL ) | O_NONBLOCK ) < 0 )
+        FATAL_ERROR( fcntl );
+
+    sess->vt = vterm_new( rows, cols );
+    vterm_set_utf8( sess->vt, 1 );
+    vterm_state_set_default_colors( vterm_obtain_state( sess->vt ), &default_color, &default_color );
+
+    if ( cfg->scrollback_lines )
+    {
+        size_t max_lines = ( cfg->scrollback_lines == SIZE_MAX ) ? 0 : cfg->scrollback_lines;
+
+        sess->sb = scrollback_create( max_lines, cfg->scrollback_bytes );
+        scrollback_set_width( sess->sb, cols );
+        if ( cfg->scrollback_dir )
+            scrollback_set_spill( sess->sb, cfg->scrollback_dir, cfg->scrollback_spill_ram );
+    }
+
+    sess->modes.cursor_visible = 1;
+
+    pthread_mutex_init( &sess->lock, NULL );
+    pthread_cond_init( &sess->idle, NULL );
+
+    vts = vterm_obtain_screen( sess->vt );
+    vterm_screen_enable_altscreen( vts, 1 );
+    vterm_screen_reset( vts, 1 );
+    vterm_screen_set_callbacks( vts, &g_session_hidden_cbs, sess );
+
+    return sess;
+}
+
+void session_free( session *sess )
+{
+    if ( sess )
+    {
+        session_wait( sess );
+        pthread_mutex_destroy( &sess->lock );
+        pthread_cond_destroy( &sess->idle );
+
+        close( sess->master );
+
+        // Exited children are reaped here, others by init after we're gone.
+        if ( waitpid( sess->pid, NULL, WNOHANG ) < 0 )
+            clog_debug( CLOG( 0 ), "waitpid %d failed: %d", sess->pid, errno );
+
+        vterm_free( sess->vt );
+
+        if ( sess->sb )
+        {
+            scrollback_stats stats;
+
+            scrollback_get_stats( sess->sb, &stats );
+            clog_info( CLOG( 0 ), "scrollback %d: %" PRIu64 " lines, %zu blocks, %zu bytes (%zu bytes of lines, %zu spilled)",
+                       sess->pid, stats.lines, stats.blocks, stats.bytes, stats.line_bytes, stats.spilled_bytes );
+            if ( stats.comp_bytes )
+            {
+                clog_info( CLOG( 0 ), "scrollback compression: %zu -> %zu bytes (%.2fx), %" PRIu64 " decodes, %.1f us per decode",
+                           stats.raw_bytes, stats.comp_bytes, ( double )stats.raw_bytes / stats.comp_bytes, stats.decodes,
+                           stats.decodes ? stats.decode_ns / 1000.0 / stats.decodes : 0.0 );
+            }
+
+            scrollback_free( sess->sb );
+        }
+
+        free( sess );
+    }
+}
+
+VTerm *session_get_vterm( session *sess )
+{
+    session_wait( sess );
+    return sess->vt;
+}
+
+scrollback *session_get_scrollback( session *sess )
+{
+    session_wait( sess );
+    return sess->sb;
+}
+
+int session_get_fd( session *sess )
+{
+    return sess->master;
+}
+
+pid_t session_get_pid( session *sess )
+{
+    return sess->pid;
+}
+
+void session_get_modes( session *sess, termwin_modes *modes )
+{
+    session_wait( sess );
+    *modes = sess->modes;
+}
+
+void session_attach( session *sess, termwin *twin )
+{
+    VTermPos pos;
+
+    session_wait( sess );
+
+    termwin_scroll_end( twin );
+    termwin_setvterm( twin, sess->vt );
+    termwin_setscrollback( twin, sess->sb );
+    termwin_set_modes( twin, &sess->modes );
+
+    vterm_state_get_cursorpos( vterm_obtain_state( sess->vt ), &pos );
+    termwin_movecursor_callback( pos, pos, sess->modes.cursor_visible, twin );
+
+    // The one full paint; damage is only collected from here on.
+    termwin_redraw( twin );
+
+    sess->twin = twin;
+    __atomic_store_n( &sess->activity, 0, __ATOMIC_RELAXED );
+    vterm_screen_set_callbacks( vterm_obtain_screen( sess->vt ), &g_session_cbs, sess );
+}
+
+void session_detach( session *sess )
+{
+    if ( sess->twin )
+    {
+        termwin_scroll_end( sess->twin );
+        sess->twin = NULL;
+        vterm_screen_set_callbacks( vterm_obtain_screen( sess->vt ), &g_session_hidden_cbs, sess );
+    }
+}
+
+int session_take_activity( session *sess )
+{
+    // Workers set it while parsing.
+    return __atomic_exchange_n( &sess->activity, 0, __ATOMIC_RELAXED );
+}
+void session_set_record( session *sess, record *rec )
+{
+    session_wait( sess );
+    sess->rec = rec;
+}
+
+// Parse up to limit bytes of output. Returns -1 when the child has exited.
+static int session_read_some( session *sess, size_t limit )
+{
+    char buf[ 8192 ];
+    size_t total = 0;
+
+    while ( total < limit )
+    {
+        ssize_t bytes_read = TEMP_FAILURE_RETRY( read( sess->master, buf, sizeof( buf ) ) );
+
+        // Check if master pty was closed.
+        if ( !bytes_read )
+            return -1;
+
+        if ( bytes_read < 0 )
+        {
+            // EAGAIN: no data available.
+            // EIO: last slave fd closed.
+            if ( errno == EAGAIN )
+                return 0;
+            else if ( errno == EIO )
+                return -1;
+            else
+                FATAL_ERROR( read );
+        }
+
+        if ( sess->rec )
+            record_output( sess->rec, buf, bytes_read );
+
+        if ( !sess->twin )
+            __atomic_store_n( &sess->activity, 1, __ATOMIC_RELAXED );
+
+        vterm_input_write( sess->vt, buf, bytes_read );
+        total += bytes_read;
+    }
+
+    return 0;
+}
+
+int session_read( session *sess )
+{
+    return session_read_some( sess, SIZE_MAX );
+}
+
+void session_write( session *sess, const char *buf, size_t len )
+{
+    ssize_t bytes_write = TEMP_FAILURE_RETRY( write( sess->master, buf, len ) );
+
+    if ( bytes_write != ( ssize_t )len )
+        FATAL_ERROR( write );
+
+    if ( sess->rec )
+        record_input( sess->rec, buf, len );
+}
+
+void session_resize( session *sess, int rows, int cols )
+{
+    const struct winsize size = { rows, cols, 0, 0 };
+
+    session_wait( sess );
+
+    if ( ioctl( sess->master, TIOCSWINSZ, &size ) != 0 )
+        FATAL_ERROR( ioctl( TIOCSWINSZ ) );
+
+    vterm_set_size( sess->vt, rows, cols );
+
+    // History gets rewrapped lazily as it's viewed.
+    if ( sess->sb )
+        scrollback_set_width( sess->sb, cols );
+
+    if ( sess->rec )
+        record_resize( sess->rec, rows, cols );
+}
+
+static void *session_pool_thread( void *arg )
+{
+    session_pool *pool = ( session_pool * )arg;
+
+    for ( ;; )
+    {
+        int ret;
+        session *sess;
+
+        pthread_mutex_lock( &pool->lock );
+        while ( !pool->head && !pool->stop )
+            pthread_cond_wait( &pool->work, &pool->lock );
+        if ( !pool->head )
+        {
+            pthread_mutex_unlock( &pool->lock );
+            return NULL;
+        }
+
+        sess = pool->head;
+        pool->head = sess->next;
+        if ( !pool->head )
+            pool->tail = NULL;
+        pthread_mutex_unlock( &pool->lock );
+
+        ret = session_read_some( sess, SESSION_TASK_BYTES );
+
+        pthread_mutex_lock( &sess->lock );
+        sess->exited = ( ret < 0 );
+        __atomic_store_n( &sess->busy, 0, __ATOMIC_RELEASE );
+        pthread_cond_broadcast( &sess->idle );
+        pthread_mutex_unlock( &sess->lock );
+
+        // A full pipe already has the main loop's attention.
+        if ( write( pool->wake[ 1 ], "", 1 ) < 0 && errno != EAGAIN )
+            FATAL_ERROR( write );
+    }
+}
+
+session_pool *session_pool_create( int threads )
+{
+    int i;
+    session_pool *pool;
+
+    if ( threads <= 0 )
+        threads = MAX( 1, ( int )sysconf( _SC_NPROCESSORS_ONLN ) );
+
+    pool = ( session_pool * )calloc( 1, sizeof( *pool ) );
+    if ( !pool )
+        FATAL_ERROR( calloc );
+    pool->threads = ( pthread_t * )calloc( threads, sizeof( pthread_t ) );
+    if ( !pool->threads )
+        FATAL_ERROR( calloc );
+
+    pthread_mutex_init( &pool->lock, NULL );
+    pthread_cond_init( &pool->work, NULL );
+
+    if ( pipe2( pool->wake, O_NONBLOCK | O_CLOEXEC ) )
+        FATAL_ERROR( pipe2 );
+
+    for ( i = 0; i < threads; i++ )
+    {
+        if ( pthread_create( &pool->threads[ i ], NULL, session_pool_thread, pool ) )
+            FATAL_ERROR( pthread_create );
+    }
+    pool->thread_count = threads;
+
+    clog_info( CLOG( 0 ), "Parsing detached sessions on %d threads", threads );
+    return pool;
+}
+
+void session_pool_free( session_pool *pool )
+{
+    if ( pool )
+    {
+        int i;
+
+        // Workers finish what's queued before they go.
+        pthread_mutex_lock( &pool->lock );
+        pool->stop = 1;
+        pthread_cond_broadcast( &pool->work );
+        pthread_mutex_unlock( &pool->lock );
+
+        for ( i = 0; i < pool->thread_count; i++ )
+            pthread_join( pool->threads[ i ], NULL );
+
+        close( pool->wake[ 0 ] );
+        close( pool->wake[ 1 ] );
+        pthread_mutex_destroy( &pool->lock );
+        pthread_cond_destroy( &pool->work );
+        free( pool->threads );
+        free( pool );
+    }
+}
+
+int session_pool_get_fd( session_pool *pool )
+{
+    return pool->wake[ 0 ];
+}
+
+int session_pool_submit( session_pool *pool, session *sess )
+{
+    // Attached sessions draw and recording ones feed the recorder's single
+    // producer queue, both from the main thread.
+    if ( sess->twin || sess->rec )
+        return -1;
+    if ( session_busy( sess ) )
+        return 0;
+
+    pthread_mutex_lock( &sess->lock );
+    sess->busy = 1;
+    pthread_mutex_unlock( &sess->lock );
+
+    sess->next = NULL;
+
+    pthread_mutex_lock( &pool->lock );
+    if ( pool->tail )
+        pool->tail->next = sess;
+    else
+        pool->head = sess;
+    pool->tail = sess;
+    pthread_cond_signal( &pool->work );
+    pthread_mutex_unlock( &pool->lock );
+    return 0;
+}
+
+void session_pool_reap( session_pool *pool )
+{
+    char buf[ 256 ];
+
+    while ( read( pool->wake[ 0 ], buf, sizeof( buf ) ) > 0 )
+        ;
+}
@@ -0,0 +1,104 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+// A program running in a pseudo terminal with its own vterm and scrollback.
+// One session at a time is attached to the termwin and drawn; the others
+// keep parsing their output so they're current when switched to, but get no
+// damage or cursor callbacks until they're attached and painted in full.
+typedef struct session session;
+
+typedef struct session_config
+{
+    const char *const *argv;        // Program to run.
+    const char *env_term;           // TERM for it, NULL to unset.
+    const struct termios *termios;  // Initial pty settings.
+    size_t scrollback_lines;        // 0: no scrollback, SIZE_MAX: unlimited.
+    size_t scrollback_bytes;        // 0: no limit.
+    const char *scrollback_dir;     // Spill old scrollback here if set.
+    size_t scrollback_spill_ram;    // RAM kept when spilling.
+    struct pty_pool *ptys;          // Ready ptys, NULL to open one each time.
+} session_config;
+
+// Start cfg->argv in a new pty. Returns NULL on failure.
+session *session_create( const session_config *cfg, int rows, int cols );
+// Close the pty and reap the child if it has exited.
+void session_free( session *sess );
+
+VTerm *session_get_vterm( session *sess );
+scrollback *session_get_scrollback( session *sess );
+int session_get_fd( session *sess );
+pid_t session_get_pid( session *sess );
+// Modes set by the program, kept whether or not it's attached.
+void session_get_modes( session *sess, termwin_modes *modes );
+
+// Draw sess in twin with one full paint. Only one session should be attached
+// to a termwin at a time.
+void session_attach( session *sess, termwin *twin );
+void session_detach( session *sess );
+
+// Returns 1 if output arrived while detached, and clears it.
+int session_take_activity( session *sess );
+
+// Record output, input and resizes to rec. NULL stops.
+void session_set_record( session *sess, record *rec );
+
+// Parse everything the child has written. Returns -1 when it has exited.
+int session_read( session *sess );
+// Send bytes to the child.
+void session_write( session *sess, const char *buf, size_t len );
+void session_resize( session *sess, int rows, int cols );
+
+// Threads parsing detached sessions' output, so many busy sessions can use
+// more than one core. Sessions are queued when their pty has output and one
+// worker at a time parses a session, keeping its output in order. While a
+// session is busy, every session_ call except session_write and these waits
+// for its worker first.
+typedef struct session_pool session_pool;
+
+// threads 0: one per core.
+session_pool *session_pool_create( int threads );
+// Finishes queued work first. Free sessions before their pool.
+void session_pool_free( session_pool *pool );
+
+// Readable when a worker has finished a session; session_pool_reap clears it.
+int session_pool_get_fd( session_pool *pool );
+void session_pool_reap( session_pool *pool );
+
+// Queue sess to be parsed. Returns -1 if it's attached or recording, which
+// session_read handles on the main thread.
+int session_pool_submit( session_pool *pool, session *sess );
+
+// A worker has sess; leave its pty out of select until it's done.
+int session_busy( session *sess );
+// A worker found the child gone.
+int session_exited( session *sess );
+void session_wait( session *sess );
+
+#endif // _SESSION_H_
@@ -0,0 +1,712 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "vterm.h"
+#include "scrollback.h"
+#include "termwin.h"
+#include "termcolors.h"
+#include "snapshot.h"
+#include "lz.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+/*
+    Encoded layout, little endian:
+
+        char magic[ 8 ]         "CVTSNAP\1"
+        uint16_t rows, cols
+        uint16_t cursor_row, cursor_col
+        uint8_t flags           SNAP_CURSOR_VISIBLE, ...
+        uint8_t mouse
+        uint8_t default_fg[ 3 ], default_bg[ 3 ]
+        uint32_t colors_len     termcolors_save tables
+        uint32_t cells_len      cells before compression
+        uint32_t stored_len     cells as stored, LZ compressed if smaller
+        uint8_t colors[ colors_len ]
+        uint8_t cells[ stored_len ]
+
+    Each cell is a pen byte (SNAP_PEN_*), fg and bg rgb, and its chars as
+    varints of char + 1 ending with 0. The right half of a wide char isn't
+    stored.
+*/
+
+#define SNAP_MAGIC "CVTSNAP\1"
+#define SNAP_HEADER_SIZE 36
+
+#define SNAP_CURSOR_VISIBLE 0x1
+#define SNAP_ALTSCREEN 0x2
+#define SNAP_REVERSE 0x4
+
+#define SNAP_PEN_BOLD 0x01
+#define SNAP_PEN_UNDERLINE_SHIFT 1 // 2 bits
+#define SNAP_PEN_ITALIC 0x08
+#define SNAP_PEN_BLINK 0x10
+#define SNAP_PEN_REVERSE 0x20
+#define SNAP_PEN_STRIKE 0x40
+#define SNAP_PEN_WIDE 0x80
+
+// Pen byte and colors.
+#define SNAP_PEN_SIZE 7
+
+struct snapshot
+{
+    int rows;
+    int cols;
+    VTermPos cursor;
+    termwin_modes modes;
+    VTermColor default_fg;
+    VTermColor default_bg;
+    VTermScreenCell *cells; // rows * cols
+
+    uint8_t *colors; // termcolors_save tables.
+    size_t colors_len;
+};
+
+typedef struct snap_buf
+{
+    uint8_t *data;
+    size_t len;
+    size_t size;
+} snap_buf;
+
+static void snap_put( snap_buf *buf, const void *data, size_t len )
+{
+    if ( buf->len + len > buf->size )
+    {
+        buf->size = MAX( buf->len + len, MAX( 4096, buf->size * 2 ) );
+        buf->data = ( uint8_t * )realloc( buf->data, buf->size );
+        if ( !buf->data )
+            FATAL_ERROR( realloc );
+    }
+
+    memcpy( buf->data + buf->len, data, len );
+    buf->len += len;
+}
+
+static void snap_printf( snap_buf *buf, const char *fmt, ... ) ATTRIBUTE_PRINTF( 2, 3 );
+static void snap_printf( snap_buf *buf, const char *fmt, ... )
+{
+    int len;
+    va_list ap;
+    char str[ 128 ];
+
+    va_start( ap, fmt );
+    len = vsnprintf( str, sizeof( str ), fmt, ap );
+    va_end( ap );
+
+    snap_put( buf, str, MIN( ( size_t )len, sizeof( str ) - 1 ) );
+}
+
+static void snap_put_varint( snap_buf *buf, uint32_t v )
+{
+    uint8_t b;
+
+    while ( v >= 0x80 )
+    {
+        b = ( uint8_t )( v | 0x80 );
+        snap_put( buf, &b, 1 );
+        v >>= 7;
+    }
+    b = ( uint8_t )v;
+    snap_put( buf, &b, 1 );
+}
+
+// Returns 0 if the varint runs past end.
+static int snap_get_varint( const uint8_t **p, const uint8_t *end, uint32_t *v )
+{
+    int shift = 0;
+
+    *v = 0;
+    while ( *p < end && shift < 32 )
+    {
+        uint8_t b = *( *p )++;
+
+        *v |= ( uint32_t )( b & 0x7f ) << shift;
+        if ( !( b & 0x80 ) )
+            return 1;
+        shift += 7;
+    }
+    return 0;
+}
+
+static int snap_is_continuation( const VTermScreenCell *cell )
+{
+    return cell->chars[ 0 ] == ( uint32_t )-1;
+}
+
+// Pen byte and colors of cell.
+static void snap_pen( const VTermScreenCell *cell, uint8_t pen[ SNAP_PEN_SIZE ] )
+{
+    pen[ 0 ] = ( cell->attrs.bold ? SNAP_PEN_BOLD : 0 ) |
+               ( ( cell->attrs.underline & 3 ) << SNAP_PEN_UNDERLINE_SHIFT ) |
+               ( cell->attrs.italic ? SNAP_PEN_ITALIC : 0 ) |
+               ( cell->attrs.blink ? SNAP_PEN_BLINK : 0 ) |
+               ( cell->attrs.reverse ? SNAP_PEN_REVERSE : 0 ) |
+               ( cell->attrs.strike ? SNAP_PEN_STRIKE : 0 ) |
+               ( ( cell->width > 1 ) ? SNAP_PEN_WIDE : 0 );
+    pen[ 1 ] = cell->fg.red;
+    pen[ 2 ] = cell->fg.green;
+    pen[ 3 ] = cell->fg.blue;
+    pen[ 4 ] = cell->bg.red;
+    pen[ 5 ] = cell->bg.green;
+    pen[ 6 ] = cell->bg.blue;
+}
+
+snapshot *snapshot_capture( VTerm *vt, termwin *twin )
+{
+    int row, col;
+    snapshot *snap;
+    VTermState *state = vterm_obtain_state( vt );
+    VTermScreen *vts = vterm_obtain_screen( vt );
+
+    snap = ( snapshot * )calloc( 1, sizeof( *snap ) );
+    if ( !snap )
+        FATAL_ERROR( calloc );
+
+    vterm_get_size( vt, &snap->rows, &snap->cols );
+    vterm_state_get_cursorpos( state, &snap->cursor );
+    vterm_state_get_default_colors( state, &snap->default_fg, &snap->default_bg );
+
+    snap->cells = ( VTermScreenCell * )calloc( ( size_t )snap->rows * snap->cols, sizeof( VTermScreenCell ) );
+    if ( !snap->cells )
+        FATAL_ERROR( calloc );
+
+    for ( row = 0; row < snap->rows; row++ )
+    {
+        for ( col = 0; col < snap->cols; col++ )
+        {
+            VTermPos pos = { row, col };
+
+            vterm_screen_get_cell( vts, pos, &snap->cells[ row * snap->cols + col ] );
+        }
+    }
+
+    snap->modes.cursor_visible = 1;
+    if ( twin )
+    {
+        termwin_get_modes( twin, &snap->modes );
+        if ( termwin_get_colors( twin ) )
+            snap->colors = termcolors_save( termwin_get_colors( twin ), &snap->colors_len );
+    }
+
+    return snap;
+}
+
+void snapshot_free( snapshot *snap )
+{
+    if ( snap )
+    {
+        free( snap->cells );
+        free( snap->colors );
+        free( snap );
+    }
+}
+
+void snapshot_get_size( const snapshot *snap, int *rows, int *cols )
+{
+    *rows = snap->rows;
+    *cols = snap->cols;
+}
+
+void snapshot_set_modes( snapshot *snap, const termwin_modes *modes )
+{
+    snap->modes = *modes;
+}
+
+uint8_t *snapshot_encode( const snapshot *snap, size_t *len )
+{
+    int i, k;
+    uint32_t u32;
+    uint16_t u16[ 4 ];
+    size_t stored_len;
+    uint8_t *stored;
+    snap_buf cells = { NULL, 0, 0 };
+    snap_buf out = { NULL, 0, 0 };
+    uint8_t flags = ( snap->modes.cursor_visible ? SNAP_CURSOR_VISIBLE : 0 ) |
+                    ( snap->modes.altscreen ? SNAP_ALTSCREEN : 0 ) |
+                    ( snap->modes.reverse ? SNAP_REVERSE : 0 );
+    uint8_t colors[ 8 ] = { flags, ( uint8_t )snap->modes.mouse,
+                            snap->default_fg.red, snap->default_fg.green, snap->default_fg.blue,
+                            snap->default_bg.red, snap->default_bg.green, snap->default_bg.blue };
+
+    for ( i = 0; i < snap->rows * snap->cols; i++ )
+    {
+        uint8_t pen[ SNAP_PEN_SIZE ];
+        const VTermScreenCell *cell = &snap->cells[ i ];
+
+        // Continuation of the wide char before it.
+        if ( snap_is_continuation( cell ) && i % snap->cols )
+            continue;
+
+        snap_pen( cell, pen );
+        snap_put( &cells, pen, sizeof( pen ) );
+
+        for ( k = 0; k < VTERM_MAX_CHARS_PER_CELL && cell->chars[ k ] && !snap_is_continuation( cell ); k++ )
+            snap_put_varint( &cells, MIN( cell->chars[ k ], 0x10ffff ) + 1 );
+        snap_put_varint( &cells, 0 );
+    }
+
+    stored = ( uint8_t * )malloc( cells.len );
+    if ( !stored )
+        FATAL_ERROR( malloc );
+
+    stored_len = lz_compress( cells.data, cells.len, stored, cells.len );
+    if ( !stored_len )
+    {
+        memcpy( stored, cells.data, cells.len );
+        stored_len = cells.len;
+    }
+
+    snap_put( &out, SNAP_MAGIC, 8 );
+    u16[ 0 ] = snap->rows;
+    u16[ 1 ] = snap->cols;
+    u16[ 2 ] = snap->cursor.row;
+    u16[ 3 ] = snap->cursor.col;
+    snap_put( &out, u16, sizeof( u16 ) );
+    snap_put( &out, colors, sizeof( colors ) );
+    u32 = snap->colors_len;
+    snap_put( &out, &u32, 4 );
+    u32 = cells.len;
+    snap_put( &out, &u32, 4 );
+    u32 = stored_len;
+    snap_put( &out, &u32, 4 );
+    snap_put( &out, snap->colors, snap->colors_len );
+    snap_put( &out, stored, stored_len );
+
+    free( stored );
+    free( cells.data );
+
+    *len = out.len;
+    return out.data;
+}
+
+// Decode cells data into snap. Returns 0 if it's corrupt.
+static int snap_decode_cells( snapshot *snap, const uint8_t *p, const uint8_t *end )
+{
+    int i, k;
+
+    for ( i = 0; i < snap->rows * snap->cols; i++ )
+    {
+        uint32_t c;
+        VTermScreenCell *cell = &snap->cells[ i ];
+
+        if ( end - p < SNAP_PEN_SIZE )
+            return 0;
+
+        cell->attrs.bold = !!( p[ 0 ] & SNAP_PEN_BOLD );
+        cell->attrs.underline = ( p[ 0 ] >> SNAP_PEN_UNDERLINE_SHIFT ) & 3;
+        cell->attrs.italic = !!( p[ 0 ] & SNAP_PEN_ITALIC );
+        cell->attrs.blink = !!( p[ 0 ] & SNAP_PEN_BLINK );
+        cell->attrs.reverse = !!( p[ 0 ] & SNAP_PEN_REVERSE );
+        cell->attrs.strike = !!( p[ 0 ] & SNAP_PEN_STRIKE );
+        cell->width = ( p[ 0 ] & SNAP_PEN_WIDE ) ? 2 : 1;
+        cell->fg.red = p[ 1 ];
+        cell->fg.green = p[ 2 ];
+        cell->fg.blue = p[ 3 ];
+        cell->bg.red = p[ 4 ];
+        cell->bg.green = p[ 5 ];
+        cell->bg.blue = p[ 6 ];
+        p += SNAP_PEN_SIZE;
+
+        for ( k = 0;; k++ )
+        {
+            if ( !snap_get_varint( &p, end, &c ) )
+                return 0;
+            if ( !c )
+                break;
+            if ( k < VTERM_MAX_CHARS_PER_CELL )
+                cell->chars[ k ] = c - 1;
+        }
+
+        if ( cell->width > 1 && ( i + 1 ) % snap->cols )
+        {
+            VTermScreenCell *next = &snap->cells[ ++i ];
+
+            *next = *cell;
+            memset( next->chars, 0, sizeof( next->chars ) );
+            next->chars[ 0 ] = ( uint32_t )-1;
+            next->width = 1;
+        }
+    }
+
+    return p == end;
+}
+
+snapshot *snapshot_decode( const uint8_t *data, size_t len )
+{
+    snapshot *snap;
+    uint16_t u16[ 4 ];
+    uint32_t colors_len, cells_len, stored_len;
+    uint8_t *cells = NULL;
+    const uint8_t *p = data + SNAP_HEADER_SIZE;
+
+    if ( len < SNAP_HEADER_SIZE || memcmp( data, SNAP_MAGIC, 8 ) )
+        return NULL;
+
+    memcpy( u16, data + 8, sizeof( u16 ) );
+    memcpy( &colors_len, data + 24, 4 );
+    memcpy( &cells_len, data + 28, 4 );
+    memcpy( &stored_len, data + 32, 4 );
+
+    if ( !u16[ 0 ] || !u16[ 1 ] || colors_len > len - SNAP_HEADER_SIZE ||
+         stored_len > len - SNAP_HEADER_SIZE - colors_len || stored_len > cells_len )
+        return NULL;
+
+    // Each stored cell takes a pen and at least the terminating 0, and at
+    // most every other cell (the right half of a wide char) isn't stored.
+    if ( cells_len < ( ( ( uint64_t )u16[ 0 ] * u16[ 1 ] + 1 ) / 2 ) * ( SNAP_PEN_SIZE + 1 ) )
+        return NULL;
+
+    // Sizes come from the data, so a failed allocation means a bad file.
+    snap = ( snapshot * )calloc( 1, sizeof( *snap ) );
+    if ( !snap )
+        return NULL;
+
+    snap->rows = u16[ 0 ];
+    snap->cols = u16[ 1 ];
+    snap->cursor.row = MIN( u16[ 2 ], snap->rows - 1 );
+    snap->cursor.col = MIN( u16[ 3 ], snap->cols - 1 );
+    snap->modes.cursor_visible = !!( data[ 16 ] & SNAP_CURSOR_VISIBLE );
+    snap->modes.altscreen = !!( data[ 16 ] & SNAP_ALTSCREEN );
+    snap->modes.reverse = !!( data[ 16 ] & SNAP_REVERSE );
+    snap->modes.mouse = data[ 17 ];
+    snap->default_fg.red = data[ 18 ];
+    snap->default_fg.green = data[ 19 ];
+    snap->default_fg.blue = data[ 20 ];
+    snap->default_bg.red = data[ 21 ];
+    snap->default_bg.green = data[ 22 ];
+    snap->default_bg.blue = data[ 23 ];
+
+    snap->cells = ( VTermScreenCell * )calloc( ( size_t )snap->rows * snap->cols, sizeof( VTermScreenCell ) );
+    if ( !snap->cells )
+    {
+        snapshot_free( snap );
+        return NULL;
+    }
+
+    if ( colors_len )
+    {
+        snap->colors = ( uint8_t * )malloc( colors_len );
+        if ( !snap->colors )
+        {
+            snapshot_free( snap );
+            return NULL;
+        }
+        memcpy( snap->colors, p, colors_len );
+        snap->colors_len = colors_len;
+    }
+    p += colors_len;
+
+    if ( stored_len < cells_len )
+    {
+        cells = ( uint8_t * )malloc( cells_len );
+        if ( !cells || lz_decompress( p, stored_len, cells, cells_len ) != cells_len )
+        {
+            free( cells );
+            snapshot_free( snap );
+            return NULL;
+        }
+        p = cells;
+    }
+
+    if ( !snap_decode_cells( snap, p, p + cells_len ) )
+    {
+        free( cells );
+        snapshot_free( snap );
+        return NULL;
+    }
+
+    free( cells );
+    return snap;
+}
+
+int snapshot_save( const snapshot *snap, const char *path )
+{
+    int fd;
+    size_t len;
+    char tmp[ PATH_MAX ];
+    uint8_t *data = snapshot_encode( snap, &len );
+
+    // Write a temp file and rename it so a crash never leaves half a snapshot.
+    snprintf( tmp, sizeof( tmp ), "%s.tmp", path );
+    fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+    if ( fd < 0 )
+    {
+        clog_error( CLOG( 0 ), "Unable to open %s: %d", tmp, errno );
+        free( data );
+        return -1;
+    }
+
+    if ( TEMP_FAILURE_RETRY( write( fd, data, len ) ) != ( ssize_t )len || close( fd ) || rename( tmp, path ) )
+    {
+        clog_error( CLOG( 0 ), "Unable to write %s: %d", path, errno );
+        unlink( tmp );
+        free( data );
+        return -1;
+    }
+
+    clog_info( CLOG( 0 ), "Saved %dx%d snapshot to %s, %zu bytes", snap->rows, snap->cols, path, len );
+    free( data );
+    return 0;
+}
+
+snapshot *snapshot_load( const char *path )
+{
+    struct stat st;
+    uint8_t *data;
+    snapshot *snap = NULL;
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+
+    if ( fd < 0 )
+    {
+        clog_error( CLOG( 0 ), "Unable to open %s: %d", path, errno );
+        return NULL;
+    }
+
+    if ( !fstat( fd, &st ) && st.st_size > 0 && ( data = ( uint8_t * )malloc( st.st_size ) ) )
+    {
+        if ( TEMP_FAILURE_RETRY( read( fd, data, st.st_size ) ) == st.st_size )
+            snap = snapshot_decode( data, st.st_size );
+        free( data );
+    }
+    close( fd );
+
+    if ( !snap )
+        clog_error( CLOG( 0 ), "%s is not a valid snapshot", path );
+    return snap;
+}
+
+static void snap_put_sgr( snap_buf *buf, const snapshot *snap, const VTermScreenCell *cell )
+{
+    const VTermColor *fg = &cell->fg;
+    const VTermColor *bg = &cell->bg;
+
+    snap_put( buf, "\033[0", 3 );
+    if ( cell->attrs.bold )
+        snap_put( buf, ";1", 2 );
+    if ( cell->attrs.underline == 1 )
+        snap_put( buf, ";4", 2 );
+    else if ( cell->attrs.underline == 2 )
+        snap_put( buf, ";21", 3 );
+    if ( cell->attrs.italic )
+        snap_put( buf, ";3", 2 );
+    if ( cell->attrs.blink )
+        snap_put( buf, ";5", 2 );
+    if ( cell->attrs.reverse )
+        snap_put( buf, ";7", 2 );
+    if ( cell->attrs.strike )
+        snap_put( buf, ";9", 2 );
+
+    if ( fg->red != snap->default_fg.red || fg->green != snap->default_fg.green || fg->blue != snap->default_fg.blue )
+        snap_printf( buf, ";38;2;%u;%u;%u", fg->red, fg->green, fg->blue );
+    if ( bg->red != snap->default_bg.red || bg->green != snap->default_bg.green || bg->blue != snap->default_bg.blue )
+        snap_printf( buf, ";48;2;%u;%u;%u", bg->red, bg->green, bg->blue );
+
+    snap_put( buf, "m", 1 );
+}
+
+static int snap_cell_equal( const VTermScreenCell *a, const VTermScreenCell *b )
+{
+    int k;
+    uint8_t pen_a[ SNAP_PEN_SIZE ];
+    uint8_t pen_b[ SNAP_PEN_SIZE ];
+
+    snap_pen( a, pen_a );
+    snap_pen( b, pen_b );
+    if ( memcmp( pen_a, pen_b, sizeof( pen_a ) ) )
+        return 0;
+
+    for ( k = 0; k < VTERM_MAX_CHARS_PER_CELL; k++ )
+    {
+        if ( a->chars[ k ] != b->chars[ k ] )
+            return 0;
+        if ( !a->chars[ k ] )
+            break;
+    }
+    return 1;
+}
+
+// Draw snap's cells. With old, only cells which differ from it, otherwise
+// cells which aren't blank after a clear.
+static void snap_put_cells( snap_buf *buf, const snapshot *snap, const snapshot *old, int rows, int cols )
+{
+    int row, col;
+    uint8_t pen[ SNAP_PEN_SIZE ];
+    uint8_t blank[ SNAP_PEN_SIZE ];
+    uint8_t cur_pen[ SNAP_PEN_SIZE ];
+    VTermScreenCell blank_cell;
+
+    memset( &blank_cell, 0, sizeof( blank_cell ) );
+    blank_cell.fg = snap->default_fg;
+    blank_cell.bg = snap->default_bg;
+    blank_cell.width = 1;
+    snap_pen( &blank_cell, blank );
+    memcpy( cur_pen, blank, sizeof( cur_pen ) );
+
+    for ( row = 0; row < rows; row++ )
+    {
+        int at_col = -1; // Where the cursor is on this row, -1 if unknown.
+
+        for ( col = 0; col < cols; col++ )
+        {
+            int k;
+            uint8_t utf8[ 4 ];
+            const VTermScreenCell *cell = &snap->cells[ row * snap->cols + col ];
+            int width = ( cell->width > 1 ) ? 2 : 1;
+
+            if ( snap_is_continuation( cell ) )
+                continue;
+
+            // Wide char cut off by a narrower terminal.
+            if ( col + width > cols )
+                break;
+
+            if ( old )
+            {
+                // A wide char changing covers or uncovers the cell to its right.
+                if ( snap_cell_equal( cell, &old->cells[ row * old->cols + col ] ) &&
+                     ( width == 1 || snap_cell_equal( cell + 1, &old->cells[ row * old->cols + col + 1 ] ) ) )
+                    continue;
+            }
+
+            snap_pen( cell, pen );
+            pen[ 0 ] &= ~SNAP_PEN_WIDE;
+
+            // Blank cells are already there after the clear.
+            if ( !old && !cell->chars[ 0 ] && !memcmp( pen, blank, sizeof( pen ) ) )
+                continue;
+
+            if ( at_col != col )
+                snap_printf( buf, "\033[%d;%dH", row + 1, col + 1 );
+            if ( memcmp( pen, cur_pen, sizeof( pen ) ) )
+            {
+                snap_put_sgr( buf, snap, cell );
+                memcpy( cur_pen, pen, sizeof( pen ) );
+            }
+
+            if ( !cell->chars[ 0 ] )
+                snap_put( buf, " ", 1 );
+            for ( k = 0; k < VTERM_MAX_CHARS_PER_CELL && cell->chars[ k ]; k++ )
+                snap_put( buf, utf8, utf8_encode( utf8, cell->chars[ k ] ) );
+
+            // The last column leaves the cursor pending a wrap.
+            at_col = ( col + width < cols ) ? col + width : -1;
+        }
+    }
+
+    snap_put( buf, "\033[0m", 4 );
+}
+
+uint8_t *snapshot_escapes( const snapshot *snap, int rows, int cols, size_t *len )
+{
+    snap_buf buf = { NULL, 0, 0 };
+
+    rows = MIN( rows, snap->rows );
+    cols = MIN( cols, snap->cols );
+
+    if ( snap->modes.altscreen )
+        snap_put( &buf, "\033[?1049h", 8 );
+    snap_put( &buf, "\033[0m\033[H\033[2J", 11 );
+
+    snap_put_cells( &buf, snap, NULL, rows, cols );
+
+    if ( snap->modes.reverse )
+        snap_put( &buf, "\033[?5h", 5 );
+    if ( snap->modes.mouse )
+        snap_printf( &buf, "\033[?%dh", 999 + MIN( snap->modes.mouse, 3 ) );
+    snap_printf( &buf, "\033[%d;%dH", MIN( snap->cursor.row, rows - 1 ) + 1, MIN( snap->cursor.col, cols - 1 ) + 1 );
+    if ( !snap->modes.cursor_visible )
+        snap_put( &buf, "\033[?25l", 6 );
+
+    *len = buf.len;
+    return buf.data;
+}
+
+uint8_t *snapshot_diff( const snapshot *old, const snapshot *snap, size_t *len )
+{
+    snap_buf buf = { NULL, 0, 0 };
+
+    if ( !old || old->rows != snap->rows || old->cols != snap->cols ||
+         memcmp( &old->default_fg, &snap->default_fg, sizeof( VTermColor ) ) ||
+         memcmp( &old->default_bg, &snap->default_bg, sizeof( VTermColor ) ) )
+    {
+        return snapshot_escapes( snap, snap->rows, snap->cols, len );
+    }
+
+    snap_put_cells( &buf, snap, old, snap->rows, snap->cols );
+
+    if ( snap->modes.reverse != old->modes.reverse )
+        snap_printf( &buf, "\033[?5%c", snap->modes.reverse ? 'h' : 'l' );
+    if ( snap->modes.mouse != old->modes.mouse )
+    {
+        if ( old->modes.mouse )
+            snap_printf( &buf, "\033[?%dl", 999 + MIN( old->modes.mouse, 3 ) );
+        if ( snap->modes.mouse )
+            snap_printf( &buf, "\033[?%dh", 999 + MIN( snap->modes.mouse, 3 ) );
+    }
+
+    // Nothing moved: send nothing at all.
+    if ( buf.len == 4 && snap->cursor.row == old->cursor.row && snap->cursor.col == old->cursor.col &&
+         snap->modes.cursor_visible == old->modes.cursor_visible )
+    {
+        free( buf.data );
+        *len = 0;
+        return NULL;
+    }
+
+    snap_printf( &buf, "\033[%d;%dH", snap->cursor.row + 1, snap->cursor.col + 1 );
+    if ( snap->modes.cursor_visible != old->modes.cursor_visible )
+        snap_printf( &buf, "\033[?25%c", snap->modes.cursor_visible ? 'h' : 'l' );
+
+    *len = buf.len;
+    return buf.data;
+}
+
+void snapshot_restore( const snapshot *snap, VTerm *vt, termwin *twin )
+{
+    size_t len;
+    int rows, cols;
+    uint8_t *data;
+
+    if ( twin && snap->colors && termwin_get_colors( twin ) )
+    {
+        if ( termcolors_load( termwin_get_colors( twin ), snap->colors, snap->colors_len ) )
+            clog_warn( CLOG( 0 ), "Snapshot color tables are corrupt" );
+    }
+
+    vterm_get_size( vt, &rows, &cols );
+    data = snapshot_escapes( snap, rows, cols, &len );
+    vterm_input_write( vt, ( const char * )data, len );
+    free( data );
+}
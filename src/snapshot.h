@@ -0,0 +1,65 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+// Screen snapshots: every cell, the cursor, modes and termwin's color tables.
+// Restoring one into a fresh vterm gives back the same screen, so a new
+// process can pick up where an old one left off.
+typedef struct snapshot snapshot;
+
+// Capture vt's screen. twin adds modes and color tables and can be NULL.
+snapshot *snapshot_capture( VTerm *vt, termwin *twin );
+void snapshot_free( snapshot *snap );
+
+void snapshot_get_size( const snapshot *snap, int *rows, int *cols );
+// Modes for snapshots captured without a termwin.
+void snapshot_set_modes( snapshot *snap, const termwin_modes *modes );
+
+// Compact binary form, cells LZ compressed. Returns a malloc'd buffer.
+uint8_t *snapshot_encode( const snapshot *snap, size_t *len );
+// Returns NULL if data isn't a valid snapshot.
+snapshot *snapshot_decode( const uint8_t *data, size_t len );
+
+// Write / read a snapshot file. Returns 0 / NULL on failure.
+int snapshot_save( const snapshot *snap, const char *path );
+snapshot *snapshot_load( const char *path );
+
+// Escape sequences which draw the snapshot on a terminal rows x cols in
+// size, clipping if it's smaller. Returns a malloc'd buffer.
+uint8_t *snapshot_escapes( const snapshot *snap, int rows, int cols, size_t *len );
+
+// Escape sequences which turn a terminal showing old into snap: changed cells,
+// modes and the cursor. Returns NULL and 0 if nothing changed, and all of snap
+// if old is NULL or a different size. Returns a malloc'd buffer.
+uint8_t *snapshot_diff( const snapshot *old, const snapshot *snap, size_t *len );
+
+// Draw the snapshot into vt at its current size and load twin's color tables.
+void snapshot_restore( const snapshot *snap, VTerm *vt, termwin *twin );
+
+#endif // _SNAPSHOT_H_
@@ -0,0 +1,404 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <limits.h>
+
+#if defined( __APPLE__ )
+#include <ncurses.h>
+#else
+#include <ncursesw/curses.h>
+#endif
+
+#include "vterm.h"
+#include "termcolors.h"
+#include "clog.h"
+#include "cvterm_utils.h"
+
+#define MAX_ANSI_COLORS 256
+
+// Both lookup tables (color hash to color number, fg/bg to pair number) are
+// open addressing hashes which start small and double as entries are added,
+// so they only hold the colors and pairs a session actually uses.
+#define COLORMAP_EMPTY 0xffffffff
+#define COLORMAP_INITIAL_SIZE 64
+
+typedef struct colormap_entry
+{
+    uint32_t key;
+    int value;
+} colormap_entry;
+
+typedef struct colormap
+{
+    uint32_t count;
+    uint32_t mask;
+    colormap_entry *entries;
+} colormap;
+
+struct termcolors
+{
+    int refcount;
+    int numcolors;
+    int pairid_count;
+    colormap color_map; // vterm_color_hashid -> ncurses color id
+    colormap pair_map;  // ( fgid << 8 ) + bgid -> ncurses pair id
+    VTermColor ansi_colors[ MAX_ANSI_COLORS ];
+};
+
+static termcolors *g_termcolors = NULL;
+
+static void colormap_init( colormap *map, uint32_t size )
+{
+    map->count = 0;
+    map->mask = size - 1;
+    map->entries = ( colormap_entry * )malloc( size * sizeof( colormap_entry ) );
+    if ( !map->entries )
+        FATAL_ERROR( malloc );
+
+    memset( map->entries, 0xff, size * sizeof( colormap_entry ) );
+}
+
+static void colormap_free( colormap *map )
+{
+    free( map->entries );
+    map->entries = NULL;
+    map->count = 0;
+    map->mask = 0;
+}
+
+static uint32_t colormap_slot( const colormap *map, uint32_t key )
+{
+    uint32_t hash = key * 2654435761u;
+
+    return ( hash ^ ( hash >> 16 ) ) & map->mask;
+}
+
+// Returns entry for key, or the empty entry key should be inserted at.
+static colormap_entry *colormap_find( colormap *map, uint32_t key )
+{
+    uint32_t i = colormap_slot( map, key );
+
+    while ( map->entries[ i ].key != key && map->entries[ i ].key != COLORMAP_EMPTY )
+        i = ( i + 1 ) & map->mask;
+
+    return &map->entries[ i ];
+}
+
+static void colormap_insert( colormap *map, uint32_t key, int value )
+{
+    colormap_entry *entry;
+
+    // Keep load factor under 50% so probe sequences stay short.
+    if ( ( map->count + 1 ) * 2 > map->mask + 1 )
+    {
+        uint32_t i;
+        colormap old = *map;
+
+        colormap_init( map, ( old.mask + 1 ) * 2 );
+
+        for ( i = 0; i <= old.mask; i++ )
+        {
+            if ( old.entries[ i ].key != COLORMAP_EMPTY )
+                *colormap_find( map, old.entries[ i ].key ) = old.entries[ i ];
+        }
+        map->count = old.count;
+
+        colormap_free( &old );
+    }
+
+    entry = colormap_find( map, key );
+    if ( entry->key == COLORMAP_EMPTY )
+        map->count++;
+
+    entry->key = key;
+    entry->value = value;
+}
+
+static int vterm_color_equal( const VTermColor *a, const VTermColor *b )
+{
+    return ( a->red == b->red ) &&
+           ( a->green == b->green ) &&
+           ( a->blue == b->blue );
+}
+
+static int vterm_color_distance( const VTermColor *a, const VTermColor *b )
+{
+    int red = a->red - b->red;
+    int green = a->green - b->green;
+    int blue = a->blue - b->blue;
+
+    return red * red + green * green + blue * blue;
+}
+
+// Get key into color_map.
+static uint32_t vterm_color_hashid( const VTermColor *color )
+{
+    // We're using the high five bits for each color channel.
+    int hashid = ( ( color->red >> 3 ) << 10 ) |
+                 ( ( color->green >> 3 ) << 5 ) |
+                 ( color->blue >> 3 );
+
+    return hashid & 0x7fff;
+}
+
+static void termcolors_init_palette( termcolors *colors, VTerm *vt )
+{
+    int i;
+    int ret;
+    VTermState *state = vterm_obtain_state( vt );
+
+    colors->numcolors = sqrt_uint32( COLOR_PAIRS );
+    if ( colors->numcolors > COLORS )
+        colors->numcolors = COLORS;
+
+    clog_info( CLOG( 0 ), "COLORS:%d COLOR_PAIRS:%d numcolors:%d\n",
+               COLORS, COLOR_PAIRS, colors->numcolors );
+
+    if ( colors->numcolors > MAX_ANSI_COLORS )
+        colors->numcolors = MAX_ANSI_COLORS;
+
+    for ( i = 0; i < colors->numcolors; i++ )
+        vterm_state_get_palette_color( state, i, &colors->ansi_colors[ i ] );
+
+    if ( can_change_color() )
+    {
+        for ( i = 16; i < colors->numcolors; i++ )
+        {
+            short r = ( colors->ansi_colors[ i ].red * 1000 ) / 255;
+            short g = ( colors->ansi_colors[ i ].green * 1000 ) / 255;
+            short b = ( colors->ansi_colors[ i ].blue * 1000 ) / 255;
+
+            ret = init_color( i, r, g, b );
+            if ( ret == ERR )
+            {
+                clog_warn( CLOG( 0 ), "init_color( %d, %d, %d, %d ) failed: %d", i, r, g, b, errno );
+                break;
+            }
+        }
+    }
+
+    for ( i = 16; i < colors->numcolors; i++ )
+    {
+        short r, g, b;
+
+        NCURSES_CHECK( ret, color_content, i, &r, &g, &b );
+
+        colors->ansi_colors[ i ].red = r * 255 / 1000;
+        colors->ansi_colors[ i ].green = g * 255 / 1000;
+        colors->ansi_colors[ i ].blue = b * 255 / 1000;
+    }
+}
+
+termcolors *termcolors_acquire( VTerm *vt )
+{
+    termcolors *colors = g_termcolors;
+
+    if ( !colors )
+    {
+        colors = ( termcolors * )malloc( sizeof( *colors ) );
+        if ( !colors )
+            FATAL_ERROR( malloc );
+
+        colors->refcount = 0;
+        colors->numcolors = 0;
+        memset( colors->ansi_colors, 0, sizeof( colors->ansi_colors ) );
+
+        colormap_init( &colors->color_map, COLORMAP_INITIAL_SIZE );
+        colormap_init( &colors->pair_map, COLORMAP_INITIAL_SIZE );
+
+        // First pairid is set by ncurses.
+        colors->pairid_count = 1;
+        colormap_insert( &colors->pair_map, 0, 0 );
+
+        termcolors_init_palette( colors, vt );
+
+        g_termcolors = colors;
+    }
+
+    colors->refcount++;
+    return colors;
+}
+
+void termcolors_release( termcolors *colors )
+{
+    if ( colors && !--colors->refcount )
+    {
+        colormap_free( &colors->color_map );
+        colormap_free( &colors->pair_map );
+
+        if ( g_termcolors == colors )
+            g_termcolors = NULL;
+
+        free( colors );
+    }
+}
+
+int termcolors_get_colorid( termcolors *colors, const VTermColor *color )
+{
+    uint32_t hashid = vterm_color_hashid( color );
+    colormap_entry *entry = colormap_find( &colors->color_map, hashid );
+
+    if ( entry->key == COLORMAP_EMPTY )
+    {
+        int i;
+        int idx = 0;
+        int distance = INT_MAX;
+
+        for ( i = 0; i < colors->numcolors; i++ )
+        {
+            if ( vterm_color_equal( &colors->ansi_colors[ i ], color ) )
+            {
+                idx = i;
+                break;
+            }
+
+            int d = vterm_color_distance( &colors->ansi_colors[ i ], color );
+            if ( d < distance )
+            {
+                distance = d;
+                idx = i;
+            }
+        }
+
+        colormap_insert( &colors->color_map, hashid, idx );
+        return idx;
+    }
+
+    return entry->value;
+}
+
+int termcolors_get_pairid( termcolors *colors, int fgid, int bgid )
+{
+    uint32_t pairidx = ( fgid << 8 ) + bgid;
+    colormap_entry *entry = colormap_find( &colors->pair_map, pairidx );
+
+    if ( entry->key == COLORMAP_EMPTY )
+    {
+        int ret;
+        int pairid = colors->pairid_count;
+
+        NCURSES_CHECK( ret, init_pair, pairid, fgid, bgid );
+
+        colors->pairid_count++;
+        colormap_insert( &colors->pair_map, pairidx, pairid );
+        return pairid;
+    }
+
+    return entry->value;
+}
+
+uint8_t *termcolors_save( termcolors *colors, size_t *len )
+{
+    uint32_t i;
+    uint8_t *data, *p;
+    uint32_t npairs = colors->pairid_count - 1;
+    uint32_t *pairs = ( uint32_t * )calloc( npairs + 1, sizeof( uint32_t ) );
+
+    // u32 count, { u32 hashid, u32 colorid } ..., u32 count, u32 pairidx by pair id.
+    *len = 8 + colors->color_map.count * 8 + npairs * 4;
+    data = ( uint8_t * )malloc( *len );
+    if ( !data || !pairs )
+        FATAL_ERROR( malloc );
+
+    p = data;
+    memcpy( p, &colors->color_map.count, 4 );
+    p += 4;
+    for ( i = 0; i <= colors->color_map.mask; i++ )
+    {
+        const colormap_entry *entry = &colors->color_map.entries[ i ];
+
+        if ( entry->key != COLORMAP_EMPTY )
+        {
+            memcpy( p, &entry->key, 4 );
+            memcpy( p + 4, &entry->value, 4 );
+            p += 8;
+        }
+    }
+
+    for ( i = 0; i <= colors->pair_map.mask; i++ )
+    {
+        const colormap_entry *entry = &colors->pair_map.entries[ i ];
+
+        if ( entry->key != COLORMAP_EMPTY && entry->value > 0 && ( uint32_t )entry->value <= npairs )
+            pairs[ entry->value ] = entry->key;
+    }
+
+    memcpy( p, &npairs, 4 );
+    memcpy( p + 4, pairs + 1, npairs * 4 );
+
+    free( pairs );
+    return data;
+}
+
+int termcolors_load( termcolors *colors, const uint8_t *data, size_t len )
+{
+    uint32_t i, count;
+
+    if ( len < 4 )
+        return -1;
+
+    memcpy( &count, data, 4 );
+    if ( count > ( len - 4 ) / 8 )
+        return -1;
+
+    for ( i = 0; i < count; i++ )
+    {
+        uint32_t key;
+        int value;
+
+        memcpy( &key, data + 4 + i * 8, 4 );
+        memcpy( &value, data + 8 + i * 8, 4 );
+        if ( key != COLORMAP_EMPTY && value >= 0 && value < colors->numcolors )
+            colormap_insert( &colors->color_map, key, value );
+    }
+
+    data += 4 + count * 8;
+    len -= 4 + count * 8;
+    if ( len < 4 )
+        return -1;
+
+    memcpy( &count, data, 4 );
+    if ( count > ( len - 4 ) / 4 )
+        return -1;
+
+    for ( i = 0; i < count; i++ )
+    {
+        uint32_t pairidx;
+        int fgid, bgid;
+
+        memcpy( &pairidx, data + 4 + i * 4, 4 );
+        fgid = pairidx >> 8;
+        bgid = pairidx & 0xff;
+
+        if ( fgid < colors->numcolors && bgid < colors->numcolors )
+            termcolors_get_pairid( colors, fgid, bgid );
+    }
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2016, Michael Sartain <mikesart@fastmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ **************************************************************************/
+#ifndef _TERMCOLORS_H_
+#define _TERMCOLORS_H_
+
+// Color context shared by every termwin in the process. ncurses color and
+// pair ids are global to the screen, so all windows map VTermColors through
+// the same reference counted tables.
+typedef struct termcolors termcolors;
+
+// Get the shared color context. The first caller initializes the palette
+// from vt's state; later callers just add a reference.
+termcolors *termcolors_acquire( VTerm *vt );
+void termcolors_release( termcolors *colors );
+
+// Map a VTermColor to the closest ncurses color id.
+int termcolors_get_colorid( termcolors *colors, const VTermColor *color );
+// Get (allocating if needed) the ncurses pair id for a fg/bg color id pair.
+int termcolors_get_pairid( termcolors *colors, int fgid, int bgid );
+
+// Save the color and pair tables so a new process can skip rebuilding them.
+// Returns a malloc'd buffer.
+uint8_t *termcolors_save( termcolors *colors, size_t *len );
+// Load tables from termcolors_save. Pairs are allocated in the saved order,
+// so a fresh process gets the same pair ids. Returns 0 on success.
+int termcolors_load( termcolors *colors, const uint8_t *data, size_t len );
+
+#endif // _TERMCOLORS_H_
@@ -27,7 +27,6 @@
  **************************************************************************/
 #define _GNU_SOURCE
 #include <stdint.h>
-#include <limits.h>
 
 #if defined( __APPLE__ )
 #include <ncurses.h>
@@ -36,7 +35,10 @@
 #endif
 
 #include "vterm.h"
+#include "search.h"
+#include "scrollback.h"
 #include "termwin.h"
+#include "termcolors.h"
 #include "clog.h"
 #include "cvterm_utils.h"
 
@@ -50,82 +52,141 @@
     The colors 0 to 15 are the terminal palette colors.
 */
 
-#define NCURSES_CHECK( _ret, _func, ... )                            \
-    do                                                               \
-    {                                                                \
-        _ret = _func( __VA_ARGS__ );                                 \
-        if ( _ret == ERR )                                           \
-        {                                                            \
-            clog_error( CLOG( 0 ), "%s failed: %d", #_func, errno ); \
-            if ( is_debugger_attached() )                            \
-                __debugbreak();                                      \
-            exit( -1 );                                              \
-        }                                                            \
-    } while ( 0 )
-
 #define NCURSES_COLORED_CHTYPE( ch, attr, pair ) \
     ( ( ch ) | ( attr ) | COLOR_PAIR( pair ) )
 
-#define MAX_ANSI_COLORS 256
+// Blank cells around the window area, status line in the bottom margin.
+#define TERMWIN_MARGIN 5
+
+// termwins share one ncurses screen: the first initializes it and the last
+// one freed ends it.
+static int s_ncurses_refs = 0;
 
 struct termwin
 {
     VTerm *vt;
     WINDOW *win;
-    int numcolors;
+    termcolors *colors;
+    scrollback *sb;
     VTermRect damage_rect;
-    int pairid_count;
-    short pair_table[ MAX_ANSI_COLORS * MAX_ANSI_COLORS ];
-    VTermColor ansi_colors[ MAX_ANSI_COLORS ];
-    uint16_t vterm_color_hash[ 32768 ]; // 2^(5+5+5)
+
+    search *highlight;   // Matches on screen are drawn reversed.
+    char *rowtext;       // UTF-8 text of the row being matched.
+    int *rowcols;        // Column of each byte in rowtext.
+    uint8_t *rowmask;    // Cells of rowcells inside a match.
+    size_t rowtext_size;
+    int rowcols_size;
+
+    char *status;        // Line of text drawn below the window.
+    int status_dirty;
+
+    int focus;           // Has the cursor and the status line.
+    int border_dirty;    // Borders only change with geometry and focus.
+
+    // While scrolled back, view_pos is the history row at the top of the
+    // window and live output is parsed but not drawn.
+    int scrolled;
+    int scroll_stale; // Live screen changed under the view.
+    int view_live;    // View showed live screen rows when last drawn.
+    int view_dirty;
+    scrollback_pos view_pos;
+    VTermScreenCell *rowcells;
+
+    VTermPos cursor;
+    int cursor_visible;
+    int altscreen;
+    int reverse;
+    int mouse;
+
+    uint64_t frames; // termwin_refresh calls that updated the terminal.
+    uint64_t cells;  // Cells drawn.
 };
 
+static WINDOW *termwin_newwin( int y, int x, int rows, int cols )
+{
+    int ret;
+    WINDOW *win = newwin( rows, cols, y, x );
+
+    if ( !win )
+        FATAL_ERROR( newwin );
+
+    NCURSES_CHECK( ret, nodelay, win, true );
+    NCURSES_CHECK( ret, keypad, win, false );
+
+    // Let ncurses use insert / delete line when scrolling through history.
+    idlok( win, true );
+    return win;
+}
+
 termwin *termwin_init( const char *nc_term )
 {
     int ret;
     int maxx, maxy;
     WINDOW *win = NULL;
 
-    if ( nc_term && setenv( "TERM", nc_term, 1 ) )
-        FATAL_ERROR( setenv );
+    if ( !s_ncurses_refs )
+    {
+        if ( nc_term && setenv( "TERM", nc_term, 1 ) )
+            FATAL_ERROR( setenv );
 
-    initscr();
+        initscr();
 
-    if ( !has_colors() )
-    {
-        clog_error( CLOG( 0 ), "has_colors failed: %d", errno );
-        return NULL;
-    }
+        if ( !has_colors() )
+        {
+            clog_error( CLOG( 0 ), "has_colors failed: %d", errno );
+            return NULL;
+        }
+
+        NCURSES_CHECK( ret, start_color );
+        NCURSES_CHECK( ret, use_default_colors );
 
-    NCURSES_CHECK( ret, start_color );
-    NCURSES_CHECK( ret, use_default_colors );
+        NCURSES_CHECK( ret, raw );
+        NCURSES_CHECK( ret, noecho );
+        NCURSES_CHECK( ret, nonl );
 
-    NCURSES_CHECK( ret, raw );
-    NCURSES_CHECK( ret, noecho );
-    NCURSES_CHECK( ret, nonl );
+        NCURSES_CHECK( ret, nodelay, stdscr, true );
+        NCURSES_CHECK( ret, keypad, stdscr, false );
+
+        // Only the status line gets touched after this, so refreshing
+        // stdscr never covers the windows.
+        NCURSES_CHECK( ret, wnoutrefresh, stdscr );
+    }
+    s_ncurses_refs++;
 
     maxy = getmaxy( stdscr );
     maxx = getmaxx( stdscr );
-    win = newwin( maxy - 10, maxx - 10, 5, 5 );
-
-    NCURSES_CHECK( ret, nodelay, stdscr, true );
-    NCURSES_CHECK( ret, keypad, stdscr, false );
-    NCURSES_CHECK( ret, nodelay, win, true );
-    NCURSES_CHECK( ret, keypad, win, false );
+    win = termwin_newwin( TERMWIN_MARGIN, TERMWIN_MARGIN, maxy - 2 * TERMWIN_MARGIN, maxx - 2 * TERMWIN_MARGIN );
 
     termwin *twin = ( termwin * )malloc( sizeof( *twin ) );
     twin->win = win;
     twin->vt = NULL;
-    twin->numcolors = 0;
+    twin->colors = NULL;
+    twin->sb = NULL;
+    twin->highlight = NULL;
+    twin->rowtext = NULL;
+    twin->rowcols = NULL;
+    twin->rowmask = NULL;
+    twin->rowtext_size = 0;
+    twin->rowcols_size = 0;
+    twin->status = NULL;
+    twin->status_dirty = 0;
+    twin->focus = 1;
+    twin->border_dirty = 1;
+    twin->scrolled = 0;
+    twin->scroll_stale = 0;
+    twin->view_live = 0;
+    twin->view_dirty = 0;
+    twin->rowcells = NULL;
+    twin->cursor.row = 0;
+    twin->cursor.col = 0;
+    twin->cursor_visible = 1;
+    twin->altscreen = 0;
+    twin->reverse = 0;
+    twin->mouse = 0;
+    twin->frames = 0;
+    twin->cells = 0;
 
     memset( &twin->damage_rect, 0, sizeof( twin->damage_rect ) );
-    memset( twin->ansi_colors, 0, sizeof( twin->ansi_colors ) );
-    memset( twin->pair_table, 0xff, sizeof( twin->pair_table ) );
-    memset( twin->vterm_color_hash, 0xff, sizeof( twin->vterm_color_hash ) );
-
-    // First pairid is set by ncurses.
-    twin->pairid_count = 1;
-    twin->pair_table[ 0 ] = 0;
 
     return twin;
 }
@@ -140,147 +201,64 @@ void termwin_free( termwin *twin )
         twin->win = NULL;
         twin->vt = NULL;
 
-        NCURSES_CHECK( ret, endwin );
+        termcolors_release( twin->colors );
+        twin->colors = NULL;
 
+        if ( !--s_ncurses_refs )
+            NCURSES_CHECK( ret, endwin );
+
+        free( twin->rowtext );
+        free( twin->rowcols );
+        free( twin->rowmask );
+        free( twin->rowcells );
+        free( twin->status );
         free( twin );
     }
 }
 
-static int vterm_color_equal( const VTermColor *a, const VTermColor *b )
+void termwin_setvterm( termwin *twin, VTerm *vterm )
 {
-    return ( a->red == b->red ) &&
-           ( a->green == b->green ) &&
-           ( a->blue == b->blue );
-}
+    VTermState *state = vterm_obtain_state( vterm );
 
-static int vterm_color_distance( const VTermColor *a, const VTermColor *b )
-{
-    int red = a->red - b->red;
-    int green = a->green - b->green;
-    int blue = a->blue - b->blue;
+    twin->vt = vterm;
+
+    if ( !twin->colors )
+        twin->colors = termcolors_acquire( vterm );
 
-    return red * red + green * green + blue * blue;
+    const VTermColor default_color = { 0, 0, 0 };
+    vterm_state_set_default_colors( state, &default_color, &default_color );
 }
 
-// Get index into vterm_color_hash array.
-static int vterm_color_hashid( VTermColor *color )
+void termwin_setscrollback( termwin *twin, scrollback *sb )
 {
-    // We're using the high five bits for each color channel.
-    int hashid = ( ( color->red >> 3 ) << 10 ) |
-                 ( ( color->green >> 3 ) << 5 ) |
-                 ( color->blue >> 3 );
-
-    return hashid & 0x7fff;
+    twin->sb = sb;
 }
 
-static int get_ncurses_colorid( termwin *twin, VTermColor *color )
+static void termwin_damage_all( termwin *twin )
 {
-    int hashid = vterm_color_hashid( color );
-
-    if ( twin->vterm_color_hash[ hashid ] == 0xffff )
-    {
-        int i;
-        int idx = 0;
-        int distance = INT_MAX;
-
-        for ( i = 0; i < twin->numcolors; i++ )
-        {
-            if ( vterm_color_equal( &twin->ansi_colors[ i ], color ) )
-            {
-                idx = i;
-                break;
-            }
-
-            int d = vterm_color_distance( &twin->ansi_colors[ i ], color );
-            if ( d < distance )
-            {
-                distance = d;
-                idx = i;
-            }
-        }
-
-        twin->vterm_color_hash[ hashid ] = idx;
-    }
-
-    return twin->vterm_color_hash[ hashid ];
+    twin->damage_rect.start_row = 0;
+    twin->damage_rect.start_col = 0;
+    twin->damage_rect.end_row = getmaxy( stdscr );
+    twin->damage_rect.end_col = getmaxx( stdscr );
 }
 
-static int get_ncurses_pairid( termwin *twin, int fgid, int bgid )
+void termwin_set_highlight( termwin *twin, search *s )
 {
-    int pairidx = ( fgid << 8 ) + bgid;
-
-    if ( twin->pair_table[ pairidx ] == -1 )
+    if ( twin->highlight != s )
     {
-        int ret;
-
-        NCURSES_CHECK( ret, init_pair, twin->pairid_count, fgid, bgid );
-
-        twin->pair_table[ pairidx ] = twin->pairid_count++;
+        twin->highlight = s;
+        termwin_damage_all( twin );
     }
-
-    return twin->pair_table[ pairidx ];
 }
 
-void termwin_setvterm( termwin *twin, VTerm *vterm )
+void termwin_set_status( termwin *twin, const char *text )
 {
-    int i;
-    int ret;
-    int fgid, bgid;
-    VTermState *state = vterm_obtain_state( vterm );
-
-    twin->vt = vterm;
-
-    twin->numcolors = sqrt_uint32( COLOR_PAIRS );
-    if ( twin->numcolors > COLORS )
-        twin->numcolors = COLORS;
-
-    clog_info( CLOG( 0 ), "COLORS:%d COLOR_PAIRS:%d numcolors:%d\n",
-               COLORS, COLOR_PAIRS, twin->numcolors );
-
-    if ( twin->numcolors > MAX_ANSI_COLORS )
-        twin->numcolors = MAX_ANSI_COLORS;
-
-    for ( i = 0; i < twin->numcolors; i++ )
-        vterm_state_get_palette_color( state, i, &twin->ansi_colors[ i ] );
-
-    if ( can_change_color() )
-    {
-        for ( i = 16; i < twin->numcolors; i++ )
-        {
-            short r = ( twin->ansi_colors[ i ].red * 1000 ) / 255;
-            short g = ( twin->ansi_colors[ i ].green * 1000 ) / 255;
-            short b = ( twin->ansi_colors[ i ].blue * 1000 ) / 255;
-
-            ret = init_color( i, r, g, b );
-            if ( ret == ERR )
-            {
-                clog_warn( CLOG( 0 ), "init_color( %d, %d, %d, %d ) failed: %d", i, r, g, b, errno );
-                break;
-            }
-        }
-    }
-
-    for ( i = 16; i < twin->numcolors; i++ )
-    {
-        short r, g, b;
-
-        NCURSES_CHECK( ret, color_content, i, &r, &g, &b );
-
-        twin->ansi_colors[ i ].red = r * 255 / 1000;
-        twin->ansi_colors[ i ].green = g * 255 / 1000;
-        twin->ansi_colors[ i ].blue = b * 255 / 1000;
-    }
-
-    for ( bgid = 0; bgid < twin->numcolors; bgid++ )
+    if ( ( twin->status || text ) && ( !twin->status || !text || strcmp( twin->status, text ) ) )
     {
-        for ( fgid = 0; fgid < twin->numcolors; fgid++ )
-        {
-            get_ncurses_pairid( twin, fgid, bgid );
-        }
+        free( twin->status );
+        twin->status = text ? strdup( text ) : NULL;
+        twin->status_dirty = 1;
     }
-
-    const VTermColor default_color = { 0, 0, 0 };
-    vterm_state_set_default_colors( state, &default_color, &default_color );
 }
 
 int termwin_getch( termwin *twin )
@@ -296,7 +274,7 @@ int termwin_getch( termwin *twin )
             // If I resize the gnome-terminal over and over, the input buffer seems
             // to get filled with an endless supply of KEY_RESIZE events and we hang
             // here. Workaround this by discarding all our input and starting over.
-            clog_warn( CLOG( 0 ), "wgetch got 128 KEY_RESIZE events: calling flushinp()." );
+            clog_warn_limit( CLOG( 0 ), "wgetch got 128 KEY_RESIZE events: calling flushinp()." );
             flushinp();
             return -1;
         }
@@ -304,44 +282,42 @@ int termwin_getch( termwin *twin )
         ch = wgetch( twin->win );
     }
 
+    // With nodelay this is usually just the end of the input.
     if ( ch == ERR )
-        clog_warn( CLOG( 0 ), "wgetch failed: %d", errno );
+        clog_debug_limit( CLOG( 0 ), "wgetch failed: %d", errno );
 
     return ch;
 }
 
-static void termwin_drawcell( termwin *twin, VTermScreen *vts, int row, int col )
+static void termwin_drawcell( termwin *twin, int row, int col, const VTermScreenCell *cell, int highlight )
 {
     int ret;
     cchar_t cch;
     const wchar_t *wch;
-    VTermScreenCell cell;
-    VTermPos pos = { row, col };
     static const wchar_t s_blankchar[] = L" ";
 
-    vterm_screen_get_cell( vts, pos, &cell );
-
     attr_t attr = A_NORMAL;
-    if ( cell.attrs.bold )
+    if ( cell->attrs.bold )
         attr |= A_BOLD;
-    if ( cell.attrs.underline )
+    if ( cell->attrs.underline )
         attr |= A_UNDERLINE;
-    if ( cell.attrs.blink )
+    if ( cell->attrs.blink )
         attr |= A_BLINK;
-    if ( cell.attrs.reverse )
+    if ( cell->attrs.reverse ^ highlight )
         attr |= A_REVERSE;
 
-    int fgid = get_ncurses_colorid( twin, &cell.fg );
-    int bgid = get_ncurses_colorid( twin, &cell.bg );
-    int pairid = get_ncurses_pairid( twin, fgid, bgid );
+    int fgid = termcolors_get_colorid( twin->colors, &cell->fg );
+    int bgid = termcolors_get_colorid( twin->colors, &cell->bg );
+    int pairid = termcolors_get_pairid( twin->colors, fgid, bgid );
 
-    wch = cell.chars[ 0 ] ? ( wchar_t * )&cell.chars[ 0 ] : s_blankchar;
+    wch = ( cell->chars[ 0 ] && cell->chars[ 0 ] != ( uint32_t )-1 ) ? ( const wchar_t * )&cell->chars[ 0 ] : s_blankchar;
 
     NCURSES_CHECK( ret, setcchar, &cch, wch, attr, pairid, NULL );
 
     NCURSES_CHECK( ret, wmove, twin->win, row + 1, col + 1 );
 
     NCURSES_CHECK( ret, wadd_wch, twin->win, &cch );
+    twin->cells++;
 }
 
 int termwin_damage_callback( VTermRect rect, void *user )
@@ -365,8 +341,9 @@ int termwin_damage_callback( VTermRect rect, void *user )
 static void draw_border( termwin *twin, WINDOW *win )
 {
 #if 1
-    int attr = A_BOLD;
-    int pairid = get_ncurses_pairid( twin, COLOR_MAGENTA, 0 );
+    // Dim borders on the windows without focus.
+    int attr = twin->focus ? A_BOLD : A_NORMAL;
+    int pairid = termcolors_get_pairid( twin->colors, twin->focus ? COLOR_MAGENTA : COLOR_BLUE, 0 );
 
     wborder( win,
              NCURSES_COLORED_CHTYPE( ACS_VLINE, attr, pairid ),
@@ -425,12 +402,172 @@ static void draw_border( termwin *twin, WINDOW *win )
 #endif
 }
 
+static void termwin_grow_row( termwin *twin, int cols )
+{
+    if ( cols > twin->rowcols_size )
+    {
+        twin->rowcols_size = cols;
+        twin->rowcells = ( VTermScreenCell * )realloc( twin->rowcells, cols * sizeof( VTermScreenCell ) );
+        twin->rowmask = ( uint8_t * )realloc( twin->rowmask, cols );
+        if ( !twin->rowcells || !twin->rowmask )
+            FATAL_ERROR( realloc );
+    }
+    if ( ( size_t )cols * VTERM_MAX_CHARS_PER_CELL * 4 > twin->rowtext_size )
+    {
+        twin->rowtext_size = ( size_t )cols * VTERM_MAX_CHARS_PER_CELL * 4;
+        twin->rowtext = ( char * )realloc( twin->rowtext, twin->rowtext_size );
+        twin->rowcols = ( int * )realloc( twin->rowcols, twin->rowtext_size * sizeof( int ) );
+        if ( !twin->rowtext || !twin->rowcols )
+            FATAL_ERROR( realloc );
+    }
+}
+
+// Mark which of the cols cells in twin->rowcells are covered by highlight matches.
+static void termwin_match_row( termwin *twin, int cols )
+{
+    int col;
+    size_t len = 0;
+    size_t from = 0;
+    size_t start, end;
+    const VTermScreenCell *cells = twin->rowcells;
+
+    memset( twin->rowmask, 0, cols );
+
+    for ( col = 0; col < cols; col++ )
+    {
+        int i;
+        size_t n;
+
+        // Second half of a wide char.
+        if ( cells[ col ].chars[ 0 ] == ( uint32_t )-1 )
+            continue;
+
+        n = utf8_encode( ( uint8_t * )twin->rowtext + len, cells[ col ].chars[ 0 ] ? cells[ col ].chars[ 0 ] : ' ' );
+        for ( i = 1; i < VTERM_MAX_CHARS_PER_CELL && cells[ col ].chars[ i ]; i++ )
+            n += utf8_encode( ( uint8_t * )twin->rowtext + len + n, cells[ col ].chars[ i ] );
+
+        while ( n-- )
+            twin->rowcols[ len++ ] = col;
+    }
+
+    while ( search_match( twin->highlight, twin->rowtext, len, from, &start, &end ) )
+    {
+        size_t i;
+
+        for ( i = start; i < end; i++ )
+        {
+            col = twin->rowcols[ i ];
+            twin->rowmask[ col ] = 1;
+
+            // Cover the second half of wide chars too.
+            if ( col + 1 < cols && cells[ col + 1 ].chars[ 0 ] == ( uint32_t )-1 )
+                twin->rowmask[ col + 1 ] = 1;
+        }
+
+        // Empty regex matches still need to move along.
+        from = ( end > start ) ? end : start + 1;
+    }
+}
+
+// Draw cells [ startcol, endcol ) of twin->rowcells at row.
+static void termwin_drawrow( termwin *twin, int row, int startcol, int endcol )
+{
+    int col;
+
+    if ( twin->highlight )
+        termwin_match_row( twin, endcol );
+
+    for ( col = startcol; col < endcol; col++ )
+        termwin_drawcell( twin, row, col, &twin->rowcells[ col ], twin->highlight ? twin->rowmask[ col ] : 0 );
+}
+
+static void termwin_get_screen_row( termwin *twin, VTermScreen *vts, int row, int startcol, int endcol )
+{
+    int col;
+
+    for ( col = startcol; col < endcol; col++ )
+    {
+        VTermPos pos = { row, col };
+
+        // Window can be bigger than the screen when replaying a recording.
+        if ( !vterm_screen_get_cell( vts, pos, &twin->rowcells[ col ] ) )
+            memset( &twin->rowcells[ col ], 0, sizeof( twin->rowcells[ col ] ) );
+    }
+}
+
+// Draw viewport rows [ from, to ) while scrolled back: history rows from
+// view_pos down, then the top of the live screen.
+static void termwin_draw_view( termwin *twin, int from, int to )
+{
+    int row;
+    int cols = getmaxx( twin->win ) - 2;
+    scrollback_pos pos = twin->view_pos;
+    int hist_rows = scrollback_pos_move( twin->sb, &pos, from );
+    VTermScreen *vts = vterm_obtain_screen( twin->vt );
+
+    termwin_grow_row( twin, cols );
+    scrollback_set_width( twin->sb, cols );
+
+    for ( row = from; row < to; row++ )
+    {
+        if ( hist_rows == row && scrollback_get_row( twin->sb, &pos, twin->rowcells ) )
+        {
+            scrollback_pos_move( twin->sb, &pos, 1 );
+            hist_rows++;
+        }
+        else
+        {
+            termwin_get_screen_row( twin, vts, row - hist_rows, 0, cols );
+        }
+
+        termwin_drawrow( twin, row, 0, cols );
+    }
+
+    twin->view_dirty = 1;
+}
+
+// Rows at the bottom of the view showing the live screen, not history.
+static int termwin_view_live_rows( termwin *twin )
+{
+    int rows = getmaxy( twin->win ) - 2;
+    scrollback_pos pos = twin->view_pos;
+
+    return rows - scrollback_pos_move( twin->sb, &pos, rows );
+}
+
+static void termwin_draw_status( termwin *twin )
+{
+    int ret;
+    int y = getmaxy( stdscr ) - TERMWIN_MARGIN;
+    int x = TERMWIN_MARGIN;
+
+    if ( y >= getmaxy( stdscr ) )
+        return;
+
+    NCURSES_CHECK( ret, wmove, stdscr, y, x );
+    wclrtoeol( stdscr );
+    if ( twin->status )
+        mvwaddnstr( stdscr, y, x, twin->status, getmaxx( stdscr ) - x );
+
+    twin->status_dirty = 0;
+}
+
 static int termwin_draw( termwin *twin )
 {
+    int border = 0;
+
+    // Cells never touch the border, so it's only drawn when it changes.
+    if ( twin->border_dirty && !twin->scrolled )
+    {
+        draw_border( twin, twin->win );
+        twin->border_dirty = 0;
+        border = 1;
+    }
+
     if ( twin->damage_rect.end_col || twin->damage_rect.end_row )
     {
         int ret;
-        int row, col;
+        int row;
         int y = getcury( twin->win );
         int x = getcurx( twin->win );
         int maxy = getmaxy( twin->win ) - 2;
@@ -439,20 +576,29 @@ static int termwin_draw( termwin *twin )
         int endcol = MIN( maxx, twin->damage_rect.end_col );
         VTermScreen *vts = vterm_obtain_screen( twin->vt );
 
-        if ( ( twin->damage_rect.start_row == 0 ) ||
-             ( twin->damage_rect.start_col == 0 ) ||
-             ( endrow > maxy ) ||
-             ( endcol > maxx ) )
+        // Output is parsed but not drawn while looking at history. Only a
+        // view reaching into the live screen is out of date; as history
+        // grows, rows drawn from the live screen become history rows.
+        if ( twin->scrolled )
         {
-            draw_border( twin, twin->win );
+            if ( twin->view_live || termwin_view_live_rows( twin ) )
+                twin->scroll_stale = 1;
+            return border;
         }
 
+        // Matches can start or end outside the damage, so redo whole rows.
+        if ( twin->highlight )
+        {
+            twin->damage_rect.start_col = 0;
+            endcol = maxx;
+        }
+
+        termwin_grow_row( twin, maxx );
+
         for ( row = twin->damage_rect.start_row; row < endrow; row++ )
         {
-            for ( col = twin->damage_rect.start_col; col < endcol; col++ )
-            {
-                termwin_drawcell( twin, vts, row, col );
-            }
+            termwin_get_screen_row( twin, vts, row, twin->damage_rect.start_col, endcol );
+            termwin_drawrow( twin, row, twin->damage_rect.start_col, endcol );
         }
 
         NCURSES_CHECK( ret, wmove, twin->win, y, x );
@@ -462,21 +608,271 @@ static int termwin_draw( termwin *twin )
         return 1;
     }
 
-    return 0;
+    return border;
 }
 
 void termwin_refresh( termwin *twin )
 {
+    termwin_refresh_all( &twin, 1 );
+}
+
+void termwin_refresh_all( termwin **twins, int count )
+{
+    int i;
     int ret;
+    int status = 0;
+    int changed = 0;
+    termwin *focus = NULL;
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( twins[ i ]->focus )
+        {
+            focus = twins[ i ];
+            if ( focus->status_dirty )
+            {
+                termwin_draw_status( focus );
+                status = 1;
+            }
+        }
+    }
 
-    if ( termwin_draw( twin ) )
+    // The status line is on stdscr, under the windows.
+    if ( status )
     {
         NCURSES_CHECK( ret, wnoutrefresh, stdscr );
-        NCURSES_CHECK( ret, wnoutrefresh, twin->win );
+        changed = 1;
+    }
+
+    // Only windows which changed get copied to the screen.
+    for ( i = 0; i < count; i++ )
+    {
+        termwin *twin = twins[ i ];
+
+        if ( termwin_draw( twin ) || twin->view_dirty )
+        {
+            NCURSES_CHECK( ret, wnoutrefresh, twin->win );
+            twin->view_dirty = 0;
+            twin->frames++;
+            changed = 1;
+        }
+    }
+
+    if ( changed )
+    {
+        // Last window refreshed gets the cursor.
+        if ( focus )
+            NCURSES_CHECK( ret, wnoutrefresh, focus->win );
         NCURSES_CHECK( ret, doupdate );
     }
 }
 
+void termwin_get_modes( termwin *twin, termwin_modes *modes )
+{
+    modes->cursor_visible = twin->cursor_visible;
+    modes->altscreen = twin->altscreen;
+    modes->reverse = twin->reverse;
+    modes->mouse = twin->mouse;
+}
+
+void termwin_set_modes( termwin *twin, const termwin_modes *modes )
+{
+    twin->cursor_visible = modes->cursor_visible;
+    twin->altscreen = modes->altscreen;
+    twin->reverse = modes->reverse;
+    twin->mouse = modes->mouse;
+
+    if ( twin->focus && !twin->scrolled )
+        curs_set( twin->cursor_visible );
+}
+
+void termwin_redraw( termwin *twin )
+{
+    termwin_damage_all( twin );
+    twin->status_dirty = 1;
+    twin->border_dirty = 1;
+}
+
+void termwin_set_focus( termwin *twin, int focus )
+{
+    int ret;
+
+    if ( twin->focus == focus )
+        return;
+
+    twin->focus = focus;
+    twin->border_dirty = 1;
+    if ( focus )
+    {
+        twin->status_dirty = 1;
+        if ( !twin->scrolled )
+        {
+            NCURSES_CHECK( ret, wmove, twin->win, twin->cursor.row + 1, twin->cursor.col + 1 );
+            curs_set( twin->cursor_visible );
+        }
+    }
+}
+
+void termwin_get_area( termwin *twin, int *y, int *x, int *rows, int *cols )
+{
+    *y = TERMWIN_MARGIN;
+    *x = TERMWIN_MARGIN;
+    *rows = MAX( 4, getmaxy( stdscr ) - 2 * TERMWIN_MARGIN );
+    *cols = MAX( 4, getmaxx( stdscr ) - 2 * TERMWIN_MARGIN );
+}
+
+void termwin_set_geometry( termwin *twin, int y, int x, int rows, int cols )
+{
+    int ret;
+
+    rows = MAX( 3, rows );
+    cols = MAX( 3, cols );
+    if ( getbegy( twin->win ) == y && getbegx( twin->win ) == x &&
+         getmaxy( twin->win ) == rows && getmaxx( twin->win ) == cols )
+        return;
+
+    // A new window is simpler than moving one which may not fit on the way.
+    NCURSES_CHECK( ret, delwin, twin->win );
+    twin->win = termwin_newwin( y, x, rows, cols );
+
+    termwin_scroll_end( twin );
+    termwin_redraw( twin );
+}
+
+termcolors *termwin_get_colors( termwin *twin )
+{
+    return twin->colors;
+}
+
+void termwin_get_stats( termwin *twin, termwin_stats *stats )
+{
+    stats->frames = twin->frames;
+    stats->cells = twin->cells;
+}
+
+// View has scrolled down to the top of the live screen.
+static int termwin_view_is_live( termwin *twin )
+{
+    uint64_t first, end;
+
+    scrollback_get_range( twin->sb, &first, &end );
+    return twin->view_pos.line >= end;
+}
+
+void termwin_scroll_end( termwin *twin )
+{
+    int ret;
+
+    if ( !twin->scrolled )
+        return;
+
+    twin->scrolled = 0;
+    twin->scroll_stale = 0;
+    twin->view_live = 0;
+
+    // One repaint of the live screen, nothing from history.
+    NCURSES_CHECK( ret, wmove, twin->win, twin->cursor.row + 1, twin->cursor.col + 1 );
+    if ( twin->focus )
+        curs_set( twin->cursor_visible );
+    termwin_damage_all( twin );
+    twin->border_dirty = 1;
+}
+
+int termwin_scroll( termwin *twin, int delta )
+{
+    int moved;
+    int rows = getmaxy( twin->win ) - 2;
+
+    if ( !twin->sb || !delta || ( !twin->scrolled && delta > 0 ) )
+        return 0;
+
+    if ( !twin->scrolled )
+    {
+        // Start with the view right on the live screen.
+        scrollback_set_width( twin->sb, getmaxx( twin->win ) - 2 );
+        scrollback_pos_end( twin->sb, &twin->view_pos );
+        twin->scrolled = 1;
+        twin->scroll_stale = 0;
+        curs_set( 0 );
+    }
+
+    moved = scrollback_pos_move( twin->sb, &twin->view_pos, delta );
+    if ( !moved )
+    {
+        if ( termwin_view_is_live( twin ) )
+            termwin_scroll_end( twin );
+        return 0;
+    }
+
+    if ( termwin_view_is_live( twin ) )
+    {
+        // Back down to the live screen.
+        termwin_scroll_end( twin );
+    }
+    else if ( twin->scroll_stale || abs( moved ) >= rows )
+    {
+        termwin_draw_view( twin, 0, rows );
+        twin->scroll_stale = 0;
+    }
+    else
+    {
+        int ret;
+
+        // Shift what's on screen and only draw the rows scrolled in. With
+        // idlok ncurses turns this into terminal scroll / insert line ops.
+        NCURSES_CHECK( ret, wsetscrreg, twin->win, 1, rows );
+        scrollok( twin->win, TRUE );
+        NCURSES_CHECK( ret, wscrl, twin->win, moved );
+        scrollok( twin->win, FALSE );
+
+        if ( moved < 0 )
+            termwin_draw_view( twin, 0, -moved );
+        else
+            termwin_draw_view( twin, rows - moved, rows );
+
+        // Scrolled in lines are blank, border included.
+        draw_border( twin, twin->win );
+    }
+
+    if ( twin->scrolled )
+        twin->view_live = termwin_view_live_rows( twin ) > 0;
+    return moved;
+}
+
+void termwin_scroll_to( termwin *twin, uint64_t line, int row )
+{
+    if ( !twin->sb )
+        return;
+
+    twin->view_pos.line = line;
+    twin->view_pos.row = 0;
+
+    if ( !twin->scrolled )
+    {
+        twin->scrolled = 1;
+        curs_set( 0 );
+    }
+
+    scrollback_set_width( twin->sb, getmaxx( twin->win ) - 2 );
+    scrollback_pos_move( twin->sb, &twin->view_pos, -row );
+    if ( termwin_view_is_live( twin ) )
+    {
+        termwin_scroll_end( twin );
+        return;
+    }
+
+    termwin_draw_view( twin, 0, getmaxy( twin->win ) - 2 );
+    twin->scroll_stale = 0;
+    twin->view_live = termwin_view_live_rows( twin ) > 0;
+}
+
+int termwin_get_scroll( termwin *twin, uint64_t *line )
+{
+    if ( twin->scrolled )
+        *line = twin->view_pos.line;
+    return twin->scrolled;
+}
+
 int termwin_movecursor_callback( VTermPos pos, VTermPos oldpos, int visible, void *user )
 {
     int ret;
@@ -486,11 +882,13 @@ int termwin_movecursor_callback( VTermPos pos, VTermPos oldpos, int visible, voi
 
     if ( pos.row >= maxy || pos.col >= maxx )
     {
-        clog_warn( CLOG( 0 ), "bad pos: %d/%d %d/%d", pos.row, pos.col, maxy, maxx );
+        clog_warn_limit( CLOG( 0 ), "bad pos: %d/%d %d/%d", pos.row, pos.col, maxy, maxx );
         return 1;
     }
 
-    NCURSES_CHECK( ret, wmove, twin->win, pos.row + 1, pos.col + 1 );
+    twin->cursor = pos;
+    if ( !twin->scrolled )
+        NCURSES_CHECK( ret, wmove, twin->win, pos.row + 1, pos.col + 1 );
     return 1;
 }
 
@@ -504,24 +902,33 @@ int termwin_bell_callback( void *user )
 
 int termwin_settermprop_callback( VTermProp prop, VTermValue *val, void *user )
 {
+    termwin *twin = ( termwin * )user;
+
     switch ( prop )
     {
     case VTERM_PROP_CURSORVISIBLE:
-        clog_info( CLOG( 0 ), "VTERM_PROP_CURSORVISIBLE:%d", val->boolean );
-        curs_set( !!val->boolean );
+        clog_debug_limit( CLOG( 0 ), "VTERM_PROP_CURSORVISIBLE:%d", val->boolean );
+        twin->cursor_visible = !!val->boolean;
+        if ( twin->focus && !twin->scrolled )
+            curs_set( twin->cursor_visible );
         return 1;
     case VTERM_PROP_ALTSCREEN:
         clog_debug( CLOG( 0 ), "NYI PROP_ALTSCREEN NYI" );
+        twin->altscreen = !!val->boolean;
         return 1;
     case VTERM_PROP_TITLE:
         clog_debug( CLOG( 0 ), "NYI PROP_TITLE: %s", val->string );
         return 1;
     case VTERM_PROP_MOUSE:
         clog_debug( CLOG( 0 ), "NYI PROP_MOUSE:%d", val->number );
+        twin->mouse = val->number;
         return 1;
+    case VTERM_PROP_REVERSE:
+        clog_debug( CLOG( 0 ), "NYI PROP_REVERSE:%d", val->boolean );
+        twin->reverse = !!val->boolean;
+        return 0;
     case VTERM_PROP_CURSORBLINK:
     case VTERM_PROP_ICONNAME:
-    case VTERM_PROP_REVERSE:
     case VTERM_PROP_CURSORSHAPE:
     default:
         clog_debug( CLOG( 0 ), "NYI prop:%d", prop );
@@ -529,6 +936,24 @@ int termwin_settermprop_callback( VTermProp prop, VTermValue *val, void *user )
     }
 }
 
+int termwin_sb_pushline_callback( int cols, const VTermScreenCell *cells, void *user )
+{
+    termwin *twin = ( termwin * )user;
+
+    if ( !twin->sb )
+        return 0;
+
+    scrollback_push( twin->sb, cols, cells, scrollback_row_flags( cols, cells ) );
+    return 1;
+}
+
+int termwin_sb_popline_callback( int cols, VTermScreenCell *cells, void *user )
+{
+    termwin *twin = ( termwin * )user;
+
+    return twin->sb ? scrollback_pop( twin->sb, cols, cells ) : 0;
+}
+
 void termwin_getsize( termwin *twin, int *rows, int *cols )
 {
     *rows = getmaxy( twin->win ) - 2;
@@ -538,16 +963,11 @@ void termwin_getsize( termwin *twin, int *rows, int *cols )
 void termwin_resize( termwin *twin )
 {
     int ret;
-    int maxy = getmaxy( stdscr );
-    int maxx = getmaxx( stdscr );
-    int lines = MAX( 4, maxy - 10 );
-    int columns = MAX( 4, maxx - 10 );
+    int y, x, lines, columns;
 
+    termwin_get_area( twin, &y, &x, &lines, &columns );
     NCURSES_CHECK( ret, wresize, twin->win, lines, columns );
 
-    // Damage entire window.
-    twin->damage_rect.start_row = 0;
-    twin->damage_rect.start_col = 0;
-    twin->damage_rect.end_row = maxy;
-    twin->damage_rect.end_col = maxx;
+    termwin_scroll_end( twin );
+    termwin_redraw( twin );
 }
@@ -28,21 +28,77 @@
 #ifndef _TERMWIN_H_
 #define _TERMWIN_H_
 
+// A bordered ncurses window showing a vterm. Several can share the screen.
 typedef struct termwin termwin;
 
+struct search; // search.h
+
+typedef struct termwin_stats
+{
+    uint64_t frames; // Refreshes that updated the terminal.
+    uint64_t cells;  // Cells drawn.
+} termwin_stats;
+
+// Modes set by the program which aren't part of the screen cells.
+typedef struct termwin_modes
+{
+    int cursor_visible;
+    int altscreen;
+    int reverse; // DECSCNM
+    int mouse;   // VTERM_PROP_MOUSE_* value, 0 for off.
+} termwin_modes;
+
 termwin *termwin_init( const char *nc_term );
 void termwin_free( termwin *twin );
 
 void termwin_setvterm( termwin *twin, VTerm *term );
+void termwin_setscrollback( termwin *twin, scrollback *sb );
 int termwin_getch( termwin *twin );
 void termwin_refresh( termwin *twin );
+// Draw several windows, sharing the screen as panes, with one terminal
+// update. Windows without changes aren't touched.
+void termwin_refresh_all( termwin **twins, int count );
+// Fill the area inside the screen margins.
 void termwin_resize( termwin *twin );
 void termwin_getsize( termwin *twin, int *rows, int *cols );
 
+// Screen area inside the margins where windows go.
+void termwin_get_area( termwin *twin, int *y, int *x, int *rows, int *cols );
+// Place the window, border included, at y, x on the screen.
+void termwin_set_geometry( termwin *twin, int y, int x, int rows, int cols );
+// The focused window has the cursor and draws its status line. New windows
+// have focus.
+void termwin_set_focus( termwin *twin, int focus );
+void termwin_get_stats( termwin *twin, termwin_stats *stats );
+void termwin_get_modes( termwin *twin, termwin_modes *modes );
+// Switch to a vterm's modes, e.g. when attaching another session.
+void termwin_set_modes( termwin *twin, const termwin_modes *modes );
+// Draw the whole window again on the next refresh.
+void termwin_redraw( termwin *twin );
+// Color tables shared by all windows; see termcolors.h.
+struct termcolors *termwin_get_colors( termwin *twin );
+
+// Draw matches of s on screen in reverse video. NULL turns it off.
+void termwin_set_highlight( termwin *twin, struct search *s );
+// Show text on the line below the window. NULL clears it.
+void termwin_set_status( termwin *twin, const char *text );
+
+// Scroll the view back (negative) or forward through history. Only the rows
+// scrolled in get drawn. Returns rows moved; reaching the live screen ends it.
+int termwin_scroll( termwin *twin, int delta );
+// Show history with line at window row.
+void termwin_scroll_to( termwin *twin, uint64_t line, int row );
+// Go back to the live screen.
+void termwin_scroll_end( termwin *twin );
+// Returns 1 and the history line at the top of the window if scrolled back.
+int termwin_get_scroll( termwin *twin, uint64_t *line );
+
 // libvterm callbacks
 int termwin_damage_callback( VTermRect rect, void *user );
 int termwin_movecursor_callback( VTermPos pos, VTermPos oldpos, int visible, void *user );
 int termwin_bell_callback( void *user );
 int termwin_settermprop_callback( VTermProp prop, VTermValue *val, void *user );
+int termwin_sb_pushline_callback( int cols, const VTermScreenCell *cells, void *user );
+int termwin_sb_popline_callback( int cols, VTermScreenCell *cells, void *user );
 
 #endif // _TERMWIN_H_